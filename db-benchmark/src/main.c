@@ -0,0 +1,760 @@
+#include "../../process-server/include/db.h"
+#include "../../process-server/include/db_bloom.h"
+#include "../../process-server/include/db_cache.h"
+#include "../../process-server/include/db_snapshot.h"
+#include "../../process-server/include/manager.h"
+#include "../../process-server/include/rw_lock.h"
+#include "../../process-server/include/storage.h"
+#include "../../process-server/include/util.h"
+
+#include <ctype.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/** The command line flags. */
+#define OPTS_LIST "b:c:d:f:g:n:k:r:s:t"
+
+/** Usage message to print when bad user input. */
+#define USAGE_MESSAGE \
+    "usage: ./db-benchmark -d <database-name> [-b <storage>] [-c <cache-size>] [-f <filter-size>] [-g <batch-size>]" \
+    " [-n <operations>] [-k <keys>] [-r <snapshot-writes>] [-s <value-size>] [-t]\n" \
+    "\t-d <database-name>: The path to the database to benchmark; it is created if it does not exist.\n"\
+    "\t[-b <storage>]: The storage engine to benchmark, ndbm or log; every engine if not specified.\n"\
+    "\t[-c <cache-size>]: The size in bytes of the read cache in front of the engine; no cache if not specified.\n"\
+    "\t[-f <filter-size>]: The size in bytes of the Bloom filter in front of the engine; no filter if not specified.\n"\
+    "\t[-g <batch-size>]: The number of upserts in each batch of the batched-insert workload.\n"\
+    "\t[-n <operations>]: The number of operations in each workload.\n"\
+    "\t[-k <keys>]: The number of distinct keys in the overwrite-heavy and read-heavy workloads.\n"\
+    "\t[-r <snapshot-writes>]: Publish a snapshot before the read workloads, with a delta table for this many writes;"\
+    " no snapshot if not specified.\n"\
+    "\t[-s <value-size>]: The size of each value in bytes.\n"\
+    "\t[-t]: Trace the program execution.\n\n"
+
+#define DEFAULT_NUM_OPS 10000                     /** The default number of operations in each workload. */
+#define DEFAULT_NUM_KEYS 100                      /** The default number of keys in the overwrite and read workloads. */
+#define DEFAULT_VALUE_SIZE 512                    /** The default size of each value. */
+#define DEFAULT_BATCH_SIZE 64                     /** The default number of upserts in each batch of the batched workload. */
+#define BENCH_LOCK_NAME_PREFIX "/bench_2f6b08"    /** Benchmark database lock semaphore name prefix. */
+#define BENCH_SHM_NAME "/bench_shm_2f6b08"        /** Benchmark database shared state shared memory name. */
+#define BENCH_CACHE_SHM_NAME "/bench_shmc_2f6b08" /** Benchmark database read cache shared memory name. */
+#define BENCH_BLOOM_SHM_NAME "/bench_shmb_2f6b08" /** Benchmark database key Bloom filter shared memory name. */
+#define BENCH_SNAPSHOT_SHM_NAME "/bench_shms_2f6b08" /** Benchmark database snapshot delta table shared memory name. */
+#define BENCH_KEY_MAX_LEN 64                      /** The maximum length of a benchmark key. */
+#define NSEC_PER_SEC 1000000000.0                 /** Nanoseconds in a second. */
+#define USEC_PER_SEC 1000000.0                    /** Microseconds in a second. */
+
+/**
+ * The program state. Holds necessary global program information.
+ */
+struct program_state
+{
+    struct core_object          co;
+    struct state_object         so;
+    const struct storage_engine *storage; // NULL to benchmark every engine.
+    
+    char   *db_name;
+    char   *value;
+    size_t cache_size;
+    size_t bloom_size;
+    size_t snapshot_writes;
+    size_t batch_size;
+    size_t num_ops;
+    size_t num_keys;
+    size_t value_size;
+};
+
+/**
+ * The result of running a workload.
+ */
+struct workload_result
+{
+    size_t created;  // Upserts that created a key, or fetches that found one.
+    size_t replaced; // Upserts that replaced a value.
+    double seconds;
+};
+
+/**
+ * parse_args
+ * <p>
+ * Parse command line arguments and set up the program state.
+ * </p>
+ * @param argc the number of arguments
+ * @param argv the arguments
+ * @param ps the program state
+ * @return 0 on success, -1 and set err on failure
+ */
+static int parse_args(int argc, char **argv, struct program_state *ps);
+
+/**
+ * parse_size
+ * <p>
+ * Parse a positive size from a command line argument.
+ * </p>
+ * @param str the argument
+ * @param size the size to set
+ * @return 0 on success, -1 if the argument is not a positive number
+ */
+static int parse_size(const char *str, size_t *size);
+
+/**
+ * trace_reporter
+ * <p>
+ * Print out the file, function, and line.
+ * </p>
+ * @param file the file
+ * @param func the function
+ * @param line the line
+ */
+static void trace_reporter(const char *file, const char *func, size_t line);
+
+/**
+ * setup_program_state_variables
+ * <p>
+ * Setup the program state: the state the database functions of the server expect and the value to upsert.
+ * </p>
+ * @param ps the program state
+ * @param database_name_str the database name
+ * @return 0 on success, -1 and set err on failure
+ */
+static int setup_program_state_variables(struct program_state *ps, const char *database_name_str);
+
+/**
+ * destroy_program_state
+ * <p>
+ * Free memory allocated for the benchmark.
+ * </p>
+ * @param ps the program state
+ */
+static void destroy_program_state(struct program_state *ps);
+
+/**
+ * run_workload
+ * <p>
+ * Upsert num_ops values under keys cycling through key_space keys, timing the upserts.
+ * </p>
+ * @param ps the program state
+ * @param name the name of the workload, used in the keys
+ * @param key_space the number of distinct keys
+ * @param result the result to fill
+ * @return 0 on success, -1 and set err on failure
+ */
+static int run_workload(struct program_state *ps, const char *name, size_t key_space,
+                        struct workload_result *result);
+
+/**
+ * run_batch_workload
+ * <p>
+ * Upsert num_ops values under new keys in batches of batch_size, timing the batches.
+ * </p>
+ * @param ps the program state
+ * @param name the name of the workload, used in the keys
+ * @param result the result to fill
+ * @return 0 on success, -1 and set err on failure
+ */
+static int run_batch_workload(struct program_state *ps, const char *name, struct workload_result *result);
+
+/**
+ * run_read_workload
+ * <p>
+ * Fetch num_ops values under keys cycling through key_space keys, timing the fetches.
+ * </p>
+ * @param ps the program state
+ * @param name the name of the workload whose keys to fetch
+ * @param key_space the number of distinct keys
+ * @param result the result to fill
+ * @return 0 on success, -1 and set err on failure
+ */
+static int run_read_workload(struct program_state *ps, const char *name, size_t key_space,
+                             struct workload_result *result);
+
+/**
+ * print_workload_result
+ * <p>
+ * Print the result of a workload.
+ * </p>
+ * @param ps the program state
+ * @param name the name of the workload
+ * @param result the result
+ */
+static void print_workload_result(struct program_state *ps, const char *name, const struct workload_result *result);
+
+/**
+ * run_benchmark
+ * <p>
+ * Run the workloads on the storage engine to benchmark, or on every storage engine in turn.
+ * </p>
+ * @param ps the program state
+ * @return 0 on success, -1 and set err on failure
+ */
+static int run_benchmark(struct program_state *ps);
+
+/**
+ * run_engine_benchmark
+ * <p>
+ * Run the insert-heavy workload, in which every upsert creates a key, the batched-insert workload, in which the
+ * upserts creating keys are applied in batches as by the database writer process, the overwrite-heavy workload,
+ * in which every upsert replaces one of a few keys, the read-heavy workload, in which every operation fetches
+ * one of those keys, and the read-miss workload, in which every operation fetches a key that was never written,
+ * on a storage engine and print the results. With a snapshot, the read workloads read it, published after the writes.
+ * </p>
+ * @param ps the program state
+ * @param storage the storage engine
+ * @return 0 on success, -1 and set err on failure
+ */
+static int run_engine_benchmark(struct program_state *ps, const struct storage_engine *storage);
+
+/**
+ * run
+ * <p>
+ * Run the program.
+ * </p>
+ * @param ps the program state
+ * @param argc the argument count
+ * @param argv the argument vector
+ * @return 0 on success, 1 on failure
+ */
+static int run(struct program_state *ps, int argc, char **argv);
+
+int main(int argc, char **argv)
+{
+    int status;
+    struct program_state ps;
+    
+    status = run(&ps, argc, argv);
+    
+    destroy_program_state(&ps);
+    free_mem_manager(ps.co.mm);
+    
+    return status;
+}
+
+static int run(struct program_state *ps, int argc, char **argv)
+{
+    int status;
+    
+    memset(ps, 0, sizeof(struct program_state));
+    ps->co.mm      = init_mem_manager();
+    ps->num_ops    = DEFAULT_NUM_OPS;
+    ps->num_keys   = DEFAULT_NUM_KEYS;
+    ps->value_size = DEFAULT_VALUE_SIZE;
+    ps->batch_size = DEFAULT_BATCH_SIZE;
+    status = parse_args(argc, argv, ps);
+    
+    if (status == 0)
+    {
+        status = run_benchmark(ps);
+    }
+    
+    if (status == -1)
+    {
+        if (ps->co.err.error_number)
+        {
+            GET_ERROR(ps->co.err);
+        }
+        status = EXIT_FAILURE;
+    } else
+    {
+        status = EXIT_SUCCESS;
+    }
+    
+    return status;
+}
+
+static int parse_args(int argc, char **argv, struct program_state *ps)
+{
+    if (argc < 1)
+    {
+        (void) fprintf(stdout, USAGE_MESSAGE);
+        return -1;
+    }
+    
+    int        c;
+    const char *database_name_str;
+    
+    database_name_str = NULL;
+    
+    while ((c = getopt(argc, argv, OPTS_LIST)) != -1) // NOLINT(concurrency-mt-unsafe) : No threads here
+    {
+        switch (c)
+        {
+            case 'b':
+            {
+                ps->storage = get_storage_engine(optarg);
+                if (!ps->storage)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'c':
+            {
+                if (parse_size(optarg, &ps->cache_size) == -1)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'd':
+            {
+                database_name_str = optarg;
+                break;
+            }
+            case 'f':
+            {
+                if (parse_size(optarg, &ps->bloom_size) == -1)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'g':
+            {
+                if (parse_size(optarg, &ps->batch_size) == -1)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'n':
+            {
+                if (parse_size(optarg, &ps->num_ops) == -1)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'k':
+            {
+                if (parse_size(optarg, &ps->num_keys) == -1)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'r':
+            {
+                if (parse_size(optarg, &ps->snapshot_writes) == -1)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 's':
+            {
+                if (parse_size(optarg, &ps->value_size) == -1)
+                {
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 't':
+            {
+                ps->co.tracer = trace_reporter;
+                break;
+            }
+            case '?':
+            {
+                if (isprint(optopt))
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stderr, "Unknown option \'-%c\'.\n", optopt);
+                } else
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stderr, "Unknown option character \'\\x%x\'.\n", (unsigned int) optopt);
+                }
+                // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                (void) fprintf(stdout, USAGE_MESSAGE);
+                break;
+            }
+            default:;
+        }
+    }
+    
+    if (setup_program_state_variables(ps, database_name_str) == -1)
+    {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int parse_size(const char *str, size_t *size)
+{
+    char               *end;
+    unsigned long long parsed;
+    
+    errno  = 0;
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+    parsed = strtoull(str, &end, 10);
+    if (errno || *end != '\0' || parsed == 0)
+    {
+        errno = 0;
+        return -1;
+    }
+    *size = (size_t) parsed;
+    
+    return 0;
+}
+
+static void trace_reporter(const char *file, const char *func, size_t line)
+{
+    (void) fprintf(stdout, "TRACE: %s : %s : @ %zu\n", file, func, line);
+}
+
+static int setup_program_state_variables(struct program_state *ps, const char *database_name_str)
+{
+    PRINT_STACK_TRACE(ps->co.tracer);
+    
+    if (!database_name_str)
+    {
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stdout, USAGE_MESSAGE);
+        return -1;
+    }
+    
+    ps->db_name = mm_strdup(database_name_str, ps->co.mm);
+    ps->value   = mm_malloc(ps->value_size, ps->co.mm);
+    if (!(ps->db_name && ps->value))
+    {
+        SET_ERROR(ps->co.err);
+        return -1;
+    }
+    memset(ps->value, 'v', ps->value_size);
+    
+    // The database functions of the server keep their shards in the state.
+    ps->co.so = &ps->so;
+    
+    return 0;
+}
+
+static int run_benchmark(struct program_state *ps)
+{
+    PRINT_STACK_TRACE(ps->co.tracer);
+    
+    const struct storage_engine *const *engines;
+    
+    (void) fprintf(stdout, "%zu operations on %zu-byte values in %s\n", ps->num_ops, ps->value_size, ps->db_name);
+    
+    if (ps->storage)
+    {
+        return run_engine_benchmark(ps, ps->storage);
+    }
+    for (engines = get_storage_engines(); *engines; ++engines)
+    {
+        if (run_engine_benchmark(ps, *engines) == -1)
+        {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int run_engine_benchmark(struct program_state *ps, const struct storage_engine *storage)
+{
+    PRINT_STACK_TRACE(ps->co.tracer);
+    
+    struct workload_result result;
+    
+    ps->co.storage = storage;
+    if (open_db_shards(&ps->co, &ps->so, ps->db_name, 1, BENCH_LOCK_NAME_PREFIX, BENCH_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    // Each entry is made large enough for a benchmark key and value.
+    if (open_db_cache(&ps->co, &ps->so.db_cache, ps->cache_size, BENCH_KEY_MAX_LEN + ps->value_size, DB_CACHE_LRU,
+                      BENCH_CACHE_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    if (open_db_bloom(&ps->co, &ps->so.db_bloom, ps->bloom_size, BENCH_BLOOM_SHM_NAME) == -1
+        || fill_db_bloom(&ps->co, &ps->so) == -1)
+    {
+        return -1;
+    }
+    if (open_db_snapshot(&ps->co, &ps->so.db_snapshot, ps->snapshot_writes, BENCH_SNAPSHOT_SHM_NAME) == -1
+        || (ps->snapshot_writes && create_dir(SNAPSHOT_DIR) == -1))
+    {
+        SET_ERROR(ps->co.err);
+        return -1;
+    }
+    (void) fprintf(stdout, "%s:\n", storage->name);
+    
+    if (run_workload(ps, "insert", ps->num_ops, &result) == -1)
+    {
+        return -1;
+    }
+    print_workload_result(ps, "insert-heavy", &result);
+    
+    if (run_batch_workload(ps, "batch", &result) == -1)
+    {
+        return -1;
+    }
+    print_workload_result(ps, "batched-insert", &result);
+    
+    // Create the keys first so that every timed upsert is an overwrite.
+    if (run_workload(ps, "overwrite", ps->num_keys, &result) == -1)
+    {
+        return -1;
+    }
+    if (run_workload(ps, "overwrite", ps->num_keys, &result) == -1)
+    {
+        return -1;
+    }
+    print_workload_result(ps, "overwrite-heavy", &result);
+    
+    if (publish_db_snapshot(&ps->co, &ps->so) == -1)
+    {
+        return -1;
+    }
+    
+    if (run_read_workload(ps, "overwrite", ps->num_keys, &result) == -1)
+    {
+        return -1;
+    }
+    print_workload_result(ps, "read-heavy", &result);
+    
+    if (run_read_workload(ps, "missing", ps->num_keys, &result) == -1)
+    {
+        return -1;
+    }
+    print_workload_result(ps, "read-miss", &result);
+    
+    if (ps->cache_size)
+    {
+        print_db_cache_stats(&ps->so.db_cache);
+    }
+    if (ps->bloom_size)
+    {
+        print_db_bloom_stats(&ps->so.db_bloom);
+    }
+    if (ps->snapshot_writes)
+    {
+        print_db_snapshot_stats(&ps->so.db_snapshot);
+    }
+    close_db_cache(&ps->so.db_cache);
+    close_db_bloom(&ps->so.db_bloom);
+    unlink_db_snapshot(&ps->so.db_snapshot);
+    close_db_snapshot(&ps->so.db_snapshot);
+    close_db_shards(&ps->co, &ps->so);
+    unlink_db_shards(BENCH_LOCK_NAME_PREFIX, 1);
+    
+    return 0;
+}
+
+static int run_workload(struct program_state *ps, const char *name, size_t key_space,
+                        struct workload_result *result)
+{
+    PRINT_STACK_TRACE(ps->co.tracer);
+    
+    char            key_str[BENCH_KEY_MAX_LEN];
+    datum           key;
+    datum           value;
+    struct timespec start;
+    struct timespec end;
+    int             status;
+    
+    memset(result, 0, sizeof(struct workload_result));
+    value.dptr  = ps->value;
+    value.dsize = ps->value_size;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+    {
+        SET_ERROR(ps->co.err);
+        return -1;
+    }
+    for (size_t op = 0; op < ps->num_ops; ++op)
+    {
+        // The process ID keeps the keys of one run apart from those of earlier runs on the same database.
+        (void) snprintf(key_str, BENCH_KEY_MAX_LEN, "/%s/%d/%zu", name, (int) getpid(), op % key_space);
+        key.dptr  = key_str;
+        key.dsize = strlen(key_str) + 1;
+        
+        status = db_upsert(&ps->co, get_db_shard(&ps->so, &key), &key, &value);
+        if (status == -1)
+        {
+            return -1;
+        }
+        if (status == 1)
+        {
+            ++result->replaced;
+        } else
+        {
+            ++result->created;
+        }
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+    {
+        SET_ERROR(ps->co.err);
+        return -1;
+    }
+    
+    result->seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+    
+    return 0;
+}
+
+static int run_batch_workload(struct program_state *ps, const char *name, struct workload_result *result)
+{
+    PRINT_STACK_TRACE(ps->co.tracer);
+    
+    char            (*key_strs)[BENCH_KEY_MAX_LEN];
+    datum           *keys;
+    datum           *values;
+    int             *results;
+    struct timespec start;
+    struct timespec end;
+    size_t          num_items;
+    int             status;
+    
+    memset(result, 0, sizeof(struct workload_result));
+    key_strs = mm_malloc(ps->batch_size * BENCH_KEY_MAX_LEN, ps->co.mm);
+    keys     = mm_malloc(ps->batch_size * sizeof(datum), ps->co.mm);
+    values   = mm_malloc(ps->batch_size * sizeof(datum), ps->co.mm);
+    results  = mm_malloc(ps->batch_size * sizeof(int), ps->co.mm);
+    if (!(key_strs && keys && values && results))
+    {
+        SET_ERROR(ps->co.err);
+        mm_free(ps->co.mm, key_strs);
+        mm_free(ps->co.mm, keys);
+        mm_free(ps->co.mm, values);
+        mm_free(ps->co.mm, results);
+        return -1;
+    }
+    
+    status = 0;
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+    {
+        SET_ERROR(ps->co.err);
+        status = -1;
+    }
+    for (size_t op = 0; status == 0 && op < ps->num_ops; op += num_items)
+    {
+        // One shard, so the whole batch goes to it, as it would for the writer process with one shard.
+        num_items = (ps->num_ops - op < ps->batch_size) ? ps->num_ops - op : ps->batch_size;
+        for (size_t i = 0; i < num_items; ++i)
+        {
+            (void) snprintf(key_strs[i], BENCH_KEY_MAX_LEN, "/%s/%d/%zu", name, (int) getpid(), op + i);
+            keys[i].dptr    = key_strs[i];
+            keys[i].dsize   = (int) strlen(key_strs[i]) + 1;
+            values[i].dptr  = ps->value;
+            values[i].dsize = (int) ps->value_size;
+        }
+        
+        status = db_upsert_batch(&ps->co, &ps->so.db_shards[0], num_items, keys, values, results);
+        for (size_t i = 0; status == 0 && i < num_items; ++i)
+        {
+            if (results[i] == -1)
+            {
+                status = -1;
+            } else if (results[i] == 1)
+            {
+                ++result->replaced;
+            } else
+            {
+                ++result->created;
+            }
+        }
+    }
+    if (status == 0 && clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+    {
+        SET_ERROR(ps->co.err);
+        status = -1;
+    }
+    
+    mm_free(ps->co.mm, key_strs);
+    mm_free(ps->co.mm, keys);
+    mm_free(ps->co.mm, values);
+    mm_free(ps->co.mm, results);
+    if (status == -1)
+    {
+        return -1;
+    }
+    
+    result->seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+    
+    return 0;
+}
+
+static int run_read_workload(struct program_state *ps, const char *name, size_t key_space,
+                             struct workload_result *result)
+{
+    PRINT_STACK_TRACE(ps->co.tracer);
+    
+    char            key_str[BENCH_KEY_MAX_LEN];
+    datum           key;
+    uint8_t         *value;
+    size_t          value_size;
+    struct timespec start;
+    struct timespec end;
+    int             status;
+    
+    memset(result, 0, sizeof(struct workload_result));
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+    {
+        SET_ERROR(ps->co.err);
+        return -1;
+    }
+    for (size_t op = 0; op < ps->num_ops; ++op)
+    {
+        (void) snprintf(key_str, BENCH_KEY_MAX_LEN, "/%s/%d/%zu", name, (int) getpid(), op % key_space);
+        key.dptr  = key_str;
+        key.dsize = strlen(key_str) + 1;
+        
+        status = safe_dbm_fetch(&ps->co, get_db_shard(&ps->so, &key), &key, &value, &value_size);
+        if (status == -1)
+        {
+            return -1;
+        }
+        if (status == 0)
+        {
+            ++result->created;
+            mm_free(ps->co.mm, value);
+        }
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+    {
+        SET_ERROR(ps->co.err);
+        return -1;
+    }
+    
+    result->seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / NSEC_PER_SEC;
+    
+    return 0;
+}
+
+static void print_workload_result(struct program_state *ps, const char *name, const struct workload_result *result)
+{
+    PRINT_STACK_TRACE(ps->co.tracer);
+    
+    (void) fprintf(stdout, "%-16s %zu created or found, %zu replaced: %.3f s, %.1f us/op, %.0f ops/s\n", name,
+                   result->created, result->replaced, result->seconds,
+                   result->seconds * USEC_PER_SEC / (double) ps->num_ops, (double) ps->num_ops / result->seconds);
+}
+
+static void destroy_program_state(struct program_state *ps)
+{
+    if (ps->so.num_db_shards)
+    {
+        close_db_shards(&ps->co, &ps->so);
+        unlink_db_shards(BENCH_LOCK_NAME_PREFIX, 1);
+    }
+    close_db_cache(&ps->so.db_cache);
+    close_db_bloom(&ps->so.db_bloom);
+    close_db_snapshot(&ps->so.db_snapshot);
+    mm_free(ps->co.mm, ps->db_name);
+    mm_free(ps->co.mm, ps->value);
+}
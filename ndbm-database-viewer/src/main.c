@@ -1,3 +1,4 @@
+#include "../../process-server/include/db_record.h"
 #include "../../process-server/include/error_handlers.h"
 #include "../../process-server/include/manager.h"
 
@@ -5,27 +6,40 @@
 #include <getopt.h>
 #include <ndbm.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 /** The command line flags. */
-#define OPTS_LIST "d:s:t"
+#define OPTS_LIST "c:d:ms:t"
 
 /** Usage message to print when bad user input. */
 #define USAGE_MESSAGE \
-    "usage: ./ndbm-database-viewer -d <database-name> [-s <semaphore-name>] [-t]\n" \
+    "usage: ./ndbm-database-viewer -d <database-name> [-m] [-s <semaphore-name>] [-t]\n" \
+    "       ./ndbm-database-viewer -c <server-pid> [-t]\n" \
+    "\t-c <server-pid>: Ask the running server to compact its database online.\n"\
     "\t-d <database-name>: The path to the database to view.\n"\
+    "\t[-m]: Migrate records in the legacy format to the binary record format.\n"\
     "\t[-s <semaphore-name>]: The database semaphore name.\n"\
     "\t[-t]: Trace the program execution.\n\n"
 
 #define DB_FLAGS (O_RDWR | O_CREAT)          /** Flags for opening db. */
 #define DB_FILE_MODE (S_IRUSR | S_IWUSR)     /** File mode for opening db. */
 
+#define PRINT_TIME_LEN 64                            /** Length of the buffer for a printed modification time. */
+#define PRINT_TIME_FORMAT "%a, %d %b %Y %H:%M:%S %Z" /** Format in which to print modification times. */
+
+#define MIGRATE_INITIAL_KEYS 64 /** Number of keys for which to make room before migrating. */
+
 /** The format in which to print database entries. */
-#define PRINT_FORMAT "{ key: \"%s\", value: \"%s %s\" }\n"
+#define PRINT_FORMAT "{ key: \"%s\", modified: \"%s\", type: \"%s\", encoding: \"%s\", size: %zu, %s: \"%.*s\" }\n"
+
+/** The format in which to print the metadata records of database entries. */
+#define PRINT_META_FORMAT "{ metadata of: \"%s\", modified: \"%s\", type: \"%s\", encoding: \"%s\", size: %llu, etag: \"%s\" }\n"
 
-/** Function call to print a database entry. */
-#define PRINT_ENTRY(key, value) (void) fprintf(stdout, PRINT_FORMAT, (char *) (key).dptr, (char *) (value).dptr, ((char *) (value).dptr + strlen((char *) (value).dptr) + 1))
+/** The format in which to print database entries that cannot be decoded. */
+#define PRINT_MALFORMED_FORMAT "{ key: \"%s\", malformed: %d bytes }\n"
 
 /**
  * The program state. Holds necessary global program information.
@@ -40,6 +54,8 @@ struct program_state
     sem_t *db_sem;
     char  *db_sem_name;
     char  *db_name;
+    bool  migrate;
+    pid_t compact_pid; // 0 unless the server is to be asked to compact its database.
 };
 
 /**
@@ -97,6 +113,52 @@ static void destroy_program_state(struct program_state *ps);
  */
 static int scan_database(struct program_state *ps);
 
+/**
+ * print_entry
+ * <p>
+ * Decode a database entry and print it. A value kept in the blob store is printed as the digest of its blob, and
+ * the metadata record of a value is printed as the metadata.
+ * </p>
+ * @param key the key
+ * @param value the value
+ */
+static void print_entry(datum key, datum value);
+
+/**
+ * migrate_database
+ * <p>
+ * Rewrite the records of the database in the legacy "timestamp\0body\0" format in the binary record format, and
+ * store the metadata record of each.
+ * </p>
+ * @param ps the program state
+ * @return 0 on success, -1 and set err on failure
+ */
+static int migrate_database(struct program_state *ps);
+
+/**
+ * request_compaction
+ * <p>
+ * Ask the server to compact its database, by sending SIGUSR1 to it. The server rebuilds its database in the
+ * background while it goes on serving requests.
+ * </p>
+ * @param ps the program state
+ * @return 0 on success, -1 and set err on failure
+ */
+static int request_compaction(struct program_state *ps);
+
+/**
+ * store_meta
+ * <p>
+ * Store the metadata record of a value encoded in the binary record format.
+ * </p>
+ * @param ps the program state
+ * @param db the database
+ * @param key the key of the value
+ * @param value the value
+ * @return 0 on success, -1 and set err on failure
+ */
+static int store_meta(struct program_state *ps, DBM *db, datum key, datum value);
+
 /**
  * print_db_error
  * <p>
@@ -139,9 +201,19 @@ static int run(struct program_state *ps, int argc, char **argv)
     ps->mm = init_mem_manager();
     status = parse_args(argc, argv, ps);
     
-    if (status == 0)
+    if (status == 0 && ps->compact_pid)
     {
-        status = scan_database(ps);
+        status = request_compaction(ps);
+    } else
+    {
+        if (status == 0 && ps->migrate)
+        {
+            status = migrate_database(ps);
+        }
+        if (status == 0)
+        {
+            status = scan_database(ps);
+        }
     }
     
     if (status == -1)
@@ -170,6 +242,8 @@ static int parse_args(int argc, char **argv, struct program_state *ps)
     int        c;
     const char *database_name_str;
     const char *semaphore_name_str;
+    char       *end;
+    long       pid;
     
     database_name_str  = NULL;
     semaphore_name_str = NULL;
@@ -178,11 +252,31 @@ static int parse_args(int argc, char **argv, struct program_state *ps)
     {
         switch (c)
         {
+            case 'c':
+            {
+                // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+                pid = strtol(optarg, &end, 10);
+                if (*end != '\0' || pid <= 0)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stderr, "Invalid server pid \'%s\'.\n", optarg);
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                ps->compact_pid = (pid_t) pid;
+                break;
+            }
             case 'd':
             {
                 database_name_str = optarg;
                 break;
             }
+            case 'm':
+            {
+                ps->migrate = true;
+                break;
+            }
             case 's':
             {
                 semaphore_name_str = optarg;
@@ -249,6 +343,10 @@ static int setup_program_state_variables(struct program_state *ps, const char *d
     
     if (!database_name_str)
     {
+        if (ps->compact_pid)
+        {
+            return 0;
+        }
         // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
         (void) fprintf(stdout, USAGE_MESSAGE);
         return -1;
@@ -286,8 +384,7 @@ static int scan_database(struct program_state *ps)
         SET_ERROR(ps->err);
         return -1;
     }
-    key   = dbm_firstkey(db);
-    value = dbm_fetch(db, key);
+    key = dbm_firstkey(db);
     if (!key.dptr && dbm_error(db))
     {
         print_db_error(db);
@@ -295,15 +392,15 @@ static int scan_database(struct program_state *ps)
     
     if (key.dptr)
     {
+        value = dbm_fetch(db, key);
         // NOLINTNEXTLINE(concurrency-mt-unsafe): No threads here
-        PRINT_ENTRY(key, value);
+        print_entry(key, value);
         ++count;
     }
     // Compare the display name to the name in the db
     while (key.dptr)
     {
-        key   = dbm_nextkey(db);
-        value = dbm_fetch(db, key);
+        key = dbm_nextkey(db);
         if (!key.dptr && dbm_error(db))
         {
             print_db_error(db);
@@ -311,8 +408,9 @@ static int scan_database(struct program_state *ps)
         }
         if (key.dptr)
         {
+            value = dbm_fetch(db, key);
             // NOLINTNEXTLINE(concurrency-mt-unsafe): No threads here
-            PRINT_ENTRY(key, value);
+            print_entry(key, value);
             ++count;
         }
     }
@@ -331,14 +429,222 @@ static int scan_database(struct program_state *ps)
     return 0;
 }
 
+static void print_entry(datum key, datum value)
+{
+    struct db_record record;
+    struct db_meta   meta;
+    struct tm        tm;
+    char             modified[PRINT_TIME_LEN];
+    
+    if (is_db_meta_key(key.dptr, (size_t) key.dsize))
+    {
+        if (decode_db_meta((uint8_t *) value.dptr, (size_t) value.dsize, &meta) == -1)
+        {
+            (void) fprintf(stdout, PRINT_MALFORMED_FORMAT, (char *) key.dptr + 1, value.dsize);
+            return;
+        }
+        modified[0] = '\0';
+        if (localtime_r(&meta.mtime, &tm))
+        {
+            (void) strftime(modified, PRINT_TIME_LEN, PRINT_TIME_FORMAT, &tm);
+        }
+        (void) fprintf(stdout, PRINT_META_FORMAT, (char *) key.dptr + 1, modified,
+                       (meta.content_type) ? meta.content_type : "",
+                       (meta.content_encoding) ? meta.content_encoding : "",
+                       (unsigned long long) meta.value_size, meta.etag);
+        return;
+    }
+    
+    if (decode_db_record((uint8_t *) value.dptr, (size_t) value.dsize, &record) == -1)
+    {
+        (void) fprintf(stdout, PRINT_MALFORMED_FORMAT, (char *) key.dptr, value.dsize);
+        return;
+    }
+    
+    modified[0] = '\0';
+    if (localtime_r(&record.mtime, &tm))
+    {
+        (void) strftime(modified, PRINT_TIME_LEN, PRINT_TIME_FORMAT, &tm);
+    }
+    
+    (void) fprintf(stdout, PRINT_FORMAT, (char *) key.dptr, modified,
+                   (record.content_type) ? record.content_type : "",
+                   (record.content_encoding) ? record.content_encoding : "",
+                   record.body_size, (record.flags & DB_RECORD_BLOB) ? "blob" : "value", (int) record.body_size,
+                   (const char *) record.body);
+}
+
+static int migrate_database(struct program_state *ps)
+{
+    PRINT_STACK_TRACE(ps->tracer);
+    DBM              *db;
+    datum            key;
+    datum            value;
+    datum            *keys;
+    size_t           num_keys;
+    size_t           max_keys;
+    struct db_record record;
+    uint8_t          *buffer;
+    size_t           migrated;
+    
+    num_keys = 0;
+    max_keys = MIGRATE_INITIAL_KEYS;
+    migrated = 0;
+    
+    keys = mm_malloc(max_keys * sizeof(datum), ps->mm);
+    if (!keys)
+    {
+        SET_ERROR(ps->err);
+        return -1;
+    }
+    
+    if (ps->db_sem && sem_wait(ps->db_sem) == -1)
+    {
+        SET_ERROR(ps->err);
+        return -1;
+    }
+    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
+    db = dbm_open(ps->db_name, DB_FLAGS, DB_FILE_MODE);
+    if (db == (DBM *) 0)
+    {
+        SET_ERROR(ps->err);
+        return -1;
+    }
+    
+    // The keys are copied first, as storing while iterating may reorder the database.
+    for (key = dbm_firstkey(db); key.dptr; key = dbm_nextkey(db))
+    {
+        if (num_keys == max_keys)
+        {
+            max_keys *= 2;
+            keys = mm_realloc(keys, max_keys * sizeof(datum), ps->mm);
+            if (!keys)
+            {
+                SET_ERROR(ps->err);
+                dbm_close(db);
+                return -1;
+            }
+        }
+        keys[num_keys].dsize = key.dsize;
+        keys[num_keys].dptr  = mm_malloc((size_t) key.dsize, ps->mm);
+        if (!keys[num_keys].dptr)
+        {
+            SET_ERROR(ps->err);
+            dbm_close(db);
+            return -1;
+        }
+        memcpy(keys[num_keys].dptr, key.dptr, (size_t) key.dsize);
+        ++num_keys;
+    }
+    
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+        value = dbm_fetch(db, keys[k]);
+        if (!value.dptr || decode_db_record((uint8_t *) value.dptr, (size_t) value.dsize, &record) == -1
+            || !(record.flags & DB_RECORD_LEGACY))
+        {
+            continue;
+        }
+        
+        record.flags = DB_RECORD_CHECKSUM;
+        buffer       = mm_malloc(db_record_size(&record), ps->mm);
+        if (!buffer)
+        {
+            SET_ERROR(ps->err);
+            dbm_close(db);
+            return -1;
+        }
+        encode_db_record(&record, buffer);
+        value.dptr  = buffer;
+        value.dsize = (int) db_record_size(&record);
+        if (dbm_store(db, keys[k], value, DBM_REPLACE) == -1)
+        {
+            print_db_error(db);
+        } else if (store_meta(ps, db, keys[k], value) == 0)
+        {
+            ++migrated;
+        }
+        mm_free(ps->mm, buffer);
+    }
+    
+    dbm_close(db);
+    // NOLINTEND(concurrency-mt-unsafe) : Protected
+    if (ps->db_sem)
+    {
+        sem_post(ps->db_sem);
+    }
+    
+    (void) fprintf(stdout, "Migrated %zu of %zu records to the binary record format.\n", migrated, num_keys);
+    
+    return 0;
+}
+
 void destroy_program_state(struct program_state *ps)
 {
     mm_free(ps->mm, ps->db_name);
-    sem_close(ps->db_sem);
-    sem_unlink(ps->db_sem_name);
+    if (ps->db_sem)
+    {
+        sem_close(ps->db_sem);
+        sem_unlink(ps->db_sem_name);
+    }
     mm_free(ps->mm, ps->db_sem_name);
 }
 
+static int request_compaction(struct program_state *ps)
+{
+    PRINT_STACK_TRACE(ps->tracer);
+    
+    if (kill(ps->compact_pid, SIGUSR1) == -1)
+    {
+        SET_ERROR(ps->err);
+        return -1;
+    }
+    (void) fprintf(stdout, "Asked the server with pid %d to compact its database.\n", (int) ps->compact_pid);
+    
+    return 0;
+}
+
+static int store_meta(struct program_state *ps, DBM *db, datum key, datum value)
+{
+    PRINT_STACK_TRACE(ps->tracer);
+    struct db_record record;
+    struct db_meta   meta;
+    datum            meta_key;
+    datum            meta_value;
+    int              ret_val;
+    
+    // Legacy records were never in the blob store, so the size of the value is the size of the body.
+    if (decode_db_record((uint8_t *) value.dptr, (size_t) value.dsize, &record) == -1)
+    {
+        return -1;
+    }
+    make_db_meta(&record, record.body_size, &meta);
+    
+    meta_key.dptr    = mm_malloc((size_t) key.dsize + 1, ps->mm);
+    meta_value.dsize = (int) db_meta_size(&meta);
+    meta_value.dptr  = mm_malloc((size_t) meta_value.dsize, ps->mm);
+    if (!(meta_key.dptr && meta_value.dptr))
+    {
+        SET_ERROR(ps->err);
+        mm_free(ps->mm, meta_key.dptr);
+        mm_free(ps->mm, meta_value.dptr);
+        return -1;
+    }
+    meta_key.dsize = (int) make_db_meta_key(key.dptr, (size_t) key.dsize, meta_key.dptr);
+    encode_db_meta(&meta, (uint8_t *) meta_value.dptr);
+    
+    ret_val = 0;
+    if (dbm_store(db, meta_key, meta_value, DBM_REPLACE) == -1) // NOLINT(concurrency-mt-unsafe) : Protected
+    {
+        print_db_error(db);
+        ret_val = -1;
+    }
+    mm_free(ps->mm, meta_key.dptr);
+    mm_free(ps->mm, meta_value.dptr);
+    
+    return ret_val;
+}
+
 void print_db_error(DBM *db)
 {
     int err_code;
@@ -0,0 +1,76 @@
+#ifndef HTTP_SERVER_COMPRESS_H
+#define HTTP_SERVER_COMPRESS_H
+
+#include "objects.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * Content codings which may be applied to a Response entity body.
+ */
+enum content_coding
+{
+    CODING_IDENTITY = 0,
+    CODING_GZIP,
+    CODING_DEFLATE
+};
+
+/**
+ * negotiate_content_coding
+ * <p>
+ * Choose the content coding for a Response from the Accept-Encoding header of a request. The coding with the
+ * highest quality value is chosen; gzip is preferred over deflate when they are equal.
+ * </p>
+ * @param req the request
+ * @return the content coding, CODING_IDENTITY if the request does not accept gzip or deflate
+ */
+enum content_coding negotiate_content_coding(struct http_request *req);
+
+/**
+ * content_coding_name
+ * <p>
+ * Get the name of a content coding as it appears in a Content-Encoding header.
+ * </p>
+ * @param coding the content coding
+ * @return the name, or NULL for CODING_IDENTITY
+ */
+const char *content_coding_name(enum content_coding coding);
+
+/**
+ * is_compressible
+ * <p>
+ * Check whether an entity is worth compressing: it must be at least COMPRESSION_MIN_SIZE bytes and its content
+ * type must not already be compressed.
+ * </p>
+ * @param content_type the content type of the entity
+ * @param size the size of the entity
+ * @return true if the entity should be compressed, false otherwise
+ */
+bool is_compressible(const char *content_type, size_t size);
+
+/**
+ * get_compressed_variant
+ * <p>
+ * Get a compressed variant of an entity. A precompressed .gz sibling of the entity file is used if present and
+ * up to date. Otherwise, the variant cached in CACHE_DIR under the digest of cache_key is used, and the entity is
+ * compressed into the cache only if that variant is missing or older than the entity, so each version of an
+ * entity is compressed at most once across all worker processes.
+ * </p>
+ * @param co the core object
+ * @param coding the content coding
+ * @param cache_key the key of the variant in the cache, beginning with '/'
+ * @param sibling_path the path of the entity file, or NULL if the entity is not a file
+ * @param last_modified the time at which the entity was last modified
+ * @param fd the file holding the entity, or 0
+ * @param data the entity if not in a file
+ * @param size the size of the entity
+ * @param entity_body the entity body to fill with the variant
+ * @return 0 if entity_body holds the variant, 1 if the variant is no smaller than the entity and the entity
+ * should be sent as is, -1 and set err on failure
+ */
+int get_compressed_variant(struct core_object *co, enum content_coding coding, const char *cache_key,
+                           const char *sibling_path, time_t last_modified, int fd, const char *data, size_t size,
+                           struct http_entity_body *entity_body);
+
+#endif //HTTP_SERVER_COMPRESS_H
@@ -3,33 +3,289 @@
 
 #include "objects.h"
 
+#include <time.h>
+
+/**
+ * open_db_shards
+ * <p>
+ * Set up the database shards: map the state they share between processes, open their locks, and create their
+ * databases if they do not exist. With one shard, its database is named db_name; otherwise shard i is named
+ * db_name_i. The shards must be opened before the processes using them are forked.
+ * </p>
+ * @param co the core object
+ * @param so the state object in which to set up the shards
+ * @param db_name the name of the database
+ * @param num_shards the number of shards, at most MAX_DB_SHARDS
+ * @param lock_name_prefix the prefix of the shard lock semaphore names
+ * @param shm_name the name of the shared memory object for the shared state
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_shards(struct core_object *co, struct state_object *so, const char *db_name, size_t num_shards,
+                   const char *lock_name_prefix, const char *shm_name);
+
+/**
+ * close_db_shards
+ * <p>
+ * Close the database handles and the locks of the database shards of this process and unmap their shared state.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ */
+void close_db_shards(struct core_object *co, struct state_object *so);
+
+/**
+ * unlink_db_shards
+ * <p>
+ * Unlink the lock semaphores of the database shards.
+ * </p>
+ * @param lock_name_prefix the prefix of the shard lock semaphore names
+ * @param num_shards the number of shards
+ */
+void unlink_db_shards(const char *lock_name_prefix, size_t num_shards);
+
+/**
+ * hash_db_key
+ * <p>
+ * Hash a database key.
+ * </p>
+ * @param key the key
+ * @return the hash
+ */
+uint32_t hash_db_key(const datum *key);
+
+/**
+ * hash_db_key_64
+ * <p>
+ * Hash a database key into 64 bits, with FNV-1a and then the MurmurHash3 finalizer so that every bit is well mixed.
+ * </p>
+ * @param key the key
+ * @return the hash
+ */
+uint64_t hash_db_key_64(const datum *key);
+
+/**
+ * get_db_shard
+ * <p>
+ * Get the database shard holding a key.
+ * </p>
+ * @param so the state object
+ * @param key the key
+ * @return the shard
+ */
+struct db_shard *get_db_shard(struct state_object *so, const datum *key);
+
 /**
  * db_upsert
  * <p>
- * Upsert into the database.
+ * Upsert into a database shard, updating the item in the read cache if it is cached.
  * </p>
  * @param co the core object
- * @param db_name the name of the database into which to upsert
- * @param sem the semaphore for the database
+ * @param shard the shard into which to upsert, locked for writing during the upsert
  * @param key the key to upsert
  * @param value the value to upsert
  * @return 0 on success and no overwrite, 1 on success and overwrite, -1 and set err on failure
  */
-int db_upsert(struct core_object *co, const char *db_name, sem_t *sem, datum *key, datum *value);
+int db_upsert(struct core_object *co, struct db_shard *shard, datum *key, datum *value);
+
+/**
+ * db_upsert_batch
+ * <p>
+ * Upsert a batch of items into a database shard under one acquisition of the shard lock, committing them to the
+ * storage engine once at the end of the batch. The keys are added to the Bloom filter, and the metadata record of
+ * each value is stored beside it. Each upsert is appended to the change log. An item whose metadata record cannot
+ * be stored, or whose upsert cannot be logged, counts as failed.
+ * </p>
+ * @param co the core object
+ * @param shard the shard into which to upsert, locked for writing during the batch
+ * @param num_items the number of items
+ * @param keys the keys to upsert
+ * @param values the values to upsert
+ * @param results set for each item to 0 if inserted, 1 if replaced, -1 if the upsert failed
+ * @return 0 on success, -1 and set err if the shard could not be locked
+ */
+int db_upsert_batch(struct core_object *co, struct db_shard *shard, size_t num_items, datum *keys, datum *values,
+                    int *results);
 
 /**
  * safe_dbm_fetch
  * <p>
- * Safely fetch an item from a database.
+ * Safely fetch an item from a database shard. The read cache is tried first, without taking the shard lock; an
+ * item fetched from the shard is added to the cache. A key the Bloom filter rules out is not found without
+ * touching the shard.
  * </p>
  * @param co the core object
- * @param db_name the name of the db from which to fetch
- * @param sem the db semaphore
+ * @param shard the shard from which to fetch, locked for reading during the fetch
  * @param key the key of the item to fetch
  * @param serial_buffer the buffer into which to copy the fetched item
+ * @param serial_buffer_size set to the size of the fetched item
  * @return 0 if successful and copy occurs, 1 if item not found, -1 and set err on failure
  */
-int safe_dbm_fetch(struct core_object *co, const char *db_name, sem_t *sem, datum *key, uint8_t **serial_buffer);
+int safe_dbm_fetch(struct core_object *co, struct db_shard *shard, datum *key, uint8_t **serial_buffer,
+                   size_t *serial_buffer_size);
+
+/**
+ * db_fetch_batch
+ * <p>
+ * Fetch a batch of items from a database shard as safe_dbm_fetch does, under at most one acquisition of the shard
+ * lock: the lock is taken for the first item that must be read from the shard, and held for the rest of the batch.
+ * </p>
+ * @param co the core object
+ * @param shard the shard from which to fetch
+ * @param num_items the number of items
+ * @param keys the keys of the items to fetch
+ * @param serial_buffers set for each item fetched to a buffer holding it
+ * @param serial_buffer_sizes set for each item fetched to its size
+ * @param results set for each item to 0 if fetched, 1 if not found, -1 if the fetch failed
+ * @return 0 on success, -1 and set err if the shard could not be locked, in which case no buffer is set
+ */
+int db_fetch_batch(struct core_object *co, struct db_shard *shard, size_t num_items, datum *keys,
+                   uint8_t **serial_buffers, size_t *serial_buffer_sizes, int *results);
+
+/**
+ * db_expire_batch
+ * <p>
+ * Remove the items of a batch that have expired from a database shard, with their metadata records, under one
+ * acquisition of the shard lock, committing the removals to the storage engine once at the end of the batch. An
+ * item is removed only if its metadata record, read under the lock, has an expiry time no later than now.
+ * </p>
+ * @param co the core object
+ * @param shard the shard from which to remove, locked for writing during the batch
+ * @param num_items the number of items
+ * @param keys the keys of the items
+ * @param now the current time
+ * @param results set for each item to 0 if removed, 1 if not expired or not found, -1 if the removal failed
+ * @return 0 on success, -1 and set err if the shard could not be locked
+ */
+int db_expire_batch(struct core_object *co, struct db_shard *shard, size_t num_items, datum *keys, time_t now,
+                    int *results);
+
+/**
+ * db_remove
+ * <p>
+ * Remove an item from a database shard, with its metadata record, and append the removal to the change log.
+ * </p>
+ * @param co the core object
+ * @param shard the shard from which to remove, locked for writing during the removal
+ * @param key the key of the item
+ * @return 0 if removed, 1 if not found, -1 and set err on failure
+ */
+int db_remove(struct core_object *co, struct db_shard *shard, datum *key);
+
+/**
+ * db_fetch_meta
+ * <p>
+ * Fetch the metadata record of an item from a database shard, as safe_dbm_fetch does, without reading the value
+ * of the item. The metadata record is stored beside the item by db_upsert_batch; legacy items have none.
+ * </p>
+ * @param co the core object
+ * @param shard the shard holding the item
+ * @param key the key of the item
+ * @param serial_buffer the buffer into which to copy the metadata record
+ * @param serial_buffer_size set to the size of the metadata record
+ * @return 0 if successful and copy occurs, 1 if the item has no metadata record, -1 and set err on failure
+ */
+int db_fetch_meta(struct core_object *co, struct db_shard *shard, const datum *key, uint8_t **serial_buffer,
+                  size_t *serial_buffer_size);
+
+/**
+ * db_iterate
+ * <p>
+ * Call visit with every key in a database shard and its value, in no particular order. The key and value are valid
+ * only until visit returns. visit returns 0 to go on, 1 to stop, or -1 and sets err on failure.
+ * </p>
+ * @param co the core object
+ * @param shard the shard to iterate, locked for reading during the iteration
+ * @param visit the function to call with each key and value
+ * @param arg the argument to pass to visit
+ * @return 0 on success, -1 and set err on failure
+ */
+int db_iterate(struct core_object *co, struct db_shard *shard,
+               int (*visit)(struct core_object *co, datum *key, datum *value, void *arg), void *arg);
+
+/**
+ * db_maintain
+ * <p>
+ * Run the background maintenance of the storage engine, such as compaction, on a database shard. The engine
+ * takes the shard lock as it needs it.
+ * </p>
+ * @param co the core object
+ * @param shard the shard to maintain
+ * @return 0 on success, -1 and set err on failure
+ */
+int db_maintain(struct core_object *co, struct db_shard *shard);
+
+/**
+ * db_compact
+ * <p>
+ * Rebuild a database shard from its live records and switch every process over to the rebuilt shard, without
+ * blocking reads while the records are copied. The engine takes the shard lock as it needs it.
+ * </p>
+ * @param co the core object
+ * @param shard the shard to compact
+ * @return 0 if compacted or the engine cannot compact, 1 if the shard was written too often during the copy and
+ *         should be tried again later, -1 and set err on failure
+ */
+int db_compact(struct core_object *co, struct db_shard *shard);
+
+/**
+ * invalidate_db_handles
+ * <p>
+ * Make every process reopen its handle on a database shard before its next access to the shard. Used when the
+ * shard has been written or replaced through another handle. The shard lock must be held for writing.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ */
+void invalidate_db_handles(struct core_object *co, struct db_shard *shard);
+
+/**
+ * close_db_handle
+ * <p>
+ * Close the handle of this process on a database shard if it is open.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ */
+void close_db_handle(struct core_object *co, struct db_shard *shard);
+
+/**
+ * encode_db_value
+ * <p>
+ * Encode a value to be stored under a key as a database record, stamped with the current time and checksummed. A
+ * value too large for a database page beside its key goes to the blob store, and the record holds its digest.
+ * </p>
+ * @param co the core object
+ * @param key the key under which the value is to be stored
+ * @param body the value
+ * @param body_size the size of the value
+ * @param content_type the content type of the value, or NULL if not given
+ * @param content_encoding the content coding of the value, or NULL if it is not encoded
+ * @param expires the time after which the value has expired, or 0 if it never expires
+ * @param buffer set to a buffer holding the record, allocated with the memory manager
+ * @param buffer_size set to the size of the record
+ * @return 0 on success, -1 and set err on failure
+ */
+int encode_db_value(struct core_object *co, const datum *key, const uint8_t *body, size_t body_size,
+                    const char *content_type, const char *content_encoding, time_t expires, uint8_t **buffer,
+                    size_t *buffer_size);
+
+/**
+ * encode_db_blob_value
+ * <p>
+ * Encode a value already in the blob store as a database record holding its digest, stamped with the current time
+ * and checksummed.
+ * </p>
+ * @param co the core object
+ * @param digest the digest of the blob holding the value, in hexadecimal
+ * @param content_type the content type of the value, or NULL if not given
+ * @param content_encoding the content coding of the value, or NULL if it is not encoded
+ * @param expires the time after which the value has expired, or 0 if it never expires
+ * @param buffer set to a buffer holding the record, allocated with the memory manager
+ * @param buffer_size set to the size of the record
+ * @return 0 on success, -1 and set err on failure
+ */
+int encode_db_blob_value(struct core_object *co, const char *digest, const char *content_type,
+                         const char *content_encoding, time_t expires, uint8_t **buffer, size_t *buffer_size);
 
 /**
  * copy_dptr_to_buffer
@@ -43,21 +299,6 @@ int safe_dbm_fetch(struct core_object *co, const char *db_name, sem_t *sem, datu
  */
 int copy_dptr_to_buffer(struct core_object *co, uint8_t **buffer, datum *value);
 
-/**
- * write_to_dir
- * <p>
- * Save the file information in data_buffer to the directory path specified by save_dir under
- * the name file_name.
- * </p>
- * @param save_dir the directory to which the file will be saved
- * @param file_name the name of the file
- * @param data_buffer the file information
- * @param data_buf_size the size of the file
- * @return 0 on success, -1 on failure.
- */
-int write_to_dir(struct core_object *co, char *save_dir, const char *file_name, const char *data_buffer,
-                 size_t data_buf_size);
-
 /**
  * print_db_error
  * <p>
@@ -0,0 +1,57 @@
+#ifndef HTTP_SERVER_DB_BATCH_H
+#define HTTP_SERVER_DB_BATCH_H
+
+#include "objects.h"
+
+#include <time.h>
+
+/**
+ * db_multi_get_response_innards
+ * <p>
+ * Answer a database multi-get: read every key listed in a request body, one per line, and send the values as the
+ * parts of a multipart/mixed entity body, in the order the keys are listed. The keys are grouped by shard, and the
+ * keys of each shard are read under one acquisition of its lock. Each part names its key in a Content-Location
+ * header; a key not in the database gets an empty part with a Status header of 404. A list that repeats a key is
+ * answered with 400, and one whose parts add up to more than MAX_DB_MULTI_GET_SIZE with 413.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param keys the request body listing the keys
+ * @param keys_size the size of the request body
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @param entity_body pointer to the entity body for the response
+ * @return 0 on success, -1 and set err on failure
+ */
+int db_multi_get_response_innards(struct core_object *co, struct state_object *so, const char *keys,
+                                  size_t keys_size, size_t *status, struct http_header ***headers,
+                                  struct http_entity_body *entity_body);
+
+/**
+ * db_batch_upsert_response_innards
+ * <p>
+ * Answer a database batch upsert: parse the records of the request body one after another as they are read from
+ * the client connection, and upsert them in batches of up to DB_BATCH_UPSERT_SIZE records of a shard under one
+ * acquisition of its lock. Each record is a header line "<key size> <value size>[ <content type>]", followed by the
+ * key, the value and an optional line feed. The body is read through a window of bounded size, and a value too large
+ * for it is moved into the blob store as it arrives, so that no part of the process grows with the size of the body.
+ * Every record is stored with the expiry time of the request. The entity body must have been accepted.
+ * The entity body reports how many records were created, replaced and failed, then the outcome of each record in
+ * the order they were applied. A malformed record ends the batch; the records before it are applied, and the
+ * response is 400, or 413 if the body grew past the maximum size of an entity body.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param request the request, whose entity body holds the records
+ * @param records_size the size of the entity body, if it is not chunked
+ * @param expires the time after which the values have expired, or 0 if they never expire
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @param entity_body pointer to the entity body for the response
+ * @return 0 on success, -1 and set err on failure
+ */
+int db_batch_upsert_response_innards(struct core_object *co, struct state_object *so, struct http_request *request,
+                                     size_t records_size, time_t expires, size_t *status,
+                                     struct http_header ***headers, struct http_entity_body *entity_body);
+
+#endif //HTTP_SERVER_DB_BATCH_H
@@ -0,0 +1,79 @@
+#ifndef HTTP_SERVER_DB_BLOB_H
+#define HTTP_SERVER_DB_BLOB_H
+
+#include "objects.h"
+#include "sha256.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * store_db_blob
+ * <p>
+ * Store a value too large for a database page in the blob store, under the SHA-256 digest of its contents. A value
+ * already in the store is not written again, but its blob is touched, so that it is not collected before the record
+ * referring to it is written. The blob is written to a temporary file and renamed into place, so
+ * that readers never see part of it.
+ * </p>
+ * @param co the core object
+ * @param data the value
+ * @param size the size of the value
+ * @param digest set to the digest of the value, in hexadecimal
+ * @return 0 on success, -1 and set err on failure
+ */
+int store_db_blob(struct core_object *co, const uint8_t *data, size_t size, char digest[SHA256_HEX_LEN + 1]);
+
+/**
+ * store_db_blob_file
+ * <p>
+ * Move a file, written whole, into the blob store under the SHA-256 digest of its contents. If the store already
+ * holds the value, the file is removed instead and the blob is touched, as store_db_blob does. The file must be on
+ * the file system of the blob store.
+ * </p>
+ * @param co the core object
+ * @param file_path the path of the file
+ * @param digest the digest of the contents of the file, in hexadecimal
+ * @return 0 if the file was moved into the store, 1 if the store already held it, -1 and set err on failure
+ */
+int store_db_blob_file(struct core_object *co, const char *file_path, const char *digest);
+
+/**
+ * open_db_blob
+ * <p>
+ * Open a blob of the blob store for reading.
+ * </p>
+ * @param co the core object
+ * @param digest the digest of the blob, in hexadecimal
+ * @param fd set to the file descriptor of the blob
+ * @param size set to the size of the blob
+ * @return 0 on success, 1 if the blob is not in the store, -1 and set err on failure
+ */
+int open_db_blob(struct core_object *co, const char *digest, int *fd, size_t *size);
+
+/**
+ * get_db_blob_path
+ * <p>
+ * Get the path of a blob, relative to the working directory: BLOB_DIR, the first characters of the digest, then
+ * the digest.
+ * </p>
+ * @param digest the digest of the blob, in hexadecimal
+ * @param path the buffer into which to write the path
+ */
+void get_db_blob_path(const char *digest, char path[BUFSIZ]);
+
+/**
+ * collect_db_blobs
+ * <p>
+ * Remove the blobs of the blob store that are not in a list of live digests and were last stored before a time.
+ * Blobs stored since may be referred to by records not yet written, so they are kept whether listed or not.
+ * </p>
+ * @param co the core object
+ * @param live the live digests, SHA256_HEX_LEN characters each one after another; sorted in place
+ * @param num_live the number of live digests
+ * @param before the time before which an unlisted blob must have been stored to be removed
+ * @param removed set to the number of blobs removed
+ * @return 0 on success, -1 and set err on failure
+ */
+int collect_db_blobs(struct core_object *co, char *live, size_t num_live, time_t before, size_t *removed);
+
+#endif //HTTP_SERVER_DB_BLOB_H
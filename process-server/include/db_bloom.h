@@ -0,0 +1,84 @@
+#ifndef HTTP_SERVER_DB_BLOOM_H
+#define HTTP_SERVER_DB_BLOOM_H
+
+#include "objects.h"
+
+#include <stdbool.h>
+
+/**
+ * open_db_bloom
+ * <p>
+ * Map the database key Bloom filter in memory shared between processes, with all of its bits clear. A size of 0
+ * leaves the filter disabled. The filter must be opened, and filled, before the processes using it are forked.
+ * </p>
+ * @param co the core object
+ * @param bloom the filter to open
+ * @param size the size of the filter in bytes
+ * @param shm_name the name of the shared memory object for the filter
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_bloom(struct core_object *co, struct db_bloom *bloom, size_t size, const char *shm_name);
+
+/**
+ * fill_db_bloom
+ * <p>
+ * Add every key in the database shards to the database key Bloom filter. The shards are iterated through the
+ * handles of this process, which are closed afterwards so that no forked process inherits them.
+ * </p>
+ * @param co the core object
+ * @param so the state object holding the shards and the filter
+ * @return 0 on success, -1 and set err on failure
+ */
+int fill_db_bloom(struct core_object *co, struct state_object *so);
+
+/**
+ * close_db_bloom
+ * <p>
+ * Unmap the database key Bloom filter of this process.
+ * </p>
+ * @param bloom the filter
+ */
+void close_db_bloom(struct db_bloom *bloom);
+
+/**
+ * db_bloom_add
+ * <p>
+ * Add a key to the database key Bloom filter. The key must be added before it is written to the database, so that
+ * no read finds the value in the database while the filter still rules the key out.
+ * </p>
+ * @param bloom the filter
+ * @param key the key
+ */
+void db_bloom_add(struct db_bloom *bloom, const datum *key);
+
+/**
+ * db_bloom_may_contain
+ * <p>
+ * Check whether a key may be in the database. A key for which this is false is certainly not in the database.
+ * Always true if the filter is disabled.
+ * </p>
+ * @param bloom the filter
+ * @param key the key
+ * @return false if the key is certainly not in the database, otherwise true
+ */
+bool db_bloom_may_contain(struct db_bloom *bloom, const datum *key);
+
+/**
+ * db_bloom_false_positive
+ * <p>
+ * Count a key the database key Bloom filter let through that was not in the database.
+ * </p>
+ * @param bloom the filter
+ */
+void db_bloom_false_positive(struct db_bloom *bloom);
+
+/**
+ * print_db_bloom_stats
+ * <p>
+ * Print the configuration of the database key Bloom filter, how full it is, and how many reads it answered.
+ * </p>
+ * @param bloom the filter
+ */
+void print_db_bloom_stats(struct db_bloom *bloom);
+
+#endif //HTTP_SERVER_DB_BLOOM_H
@@ -0,0 +1,84 @@
+#ifndef HTTP_SERVER_DB_CACHE_H
+#define HTTP_SERVER_DB_CACHE_H
+
+#include "objects.h"
+
+/**
+ * open_db_cache
+ * <p>
+ * Map the database read cache in memory shared between processes. The cache holds about size bytes of entries,
+ * each holding a key and value of at most entry_size bytes together. A size of 0 leaves the cache disabled. The
+ * cache must be opened before the processes using it are forked.
+ * </p>
+ * @param co the core object
+ * @param cache the cache to open
+ * @param size the size of the cache in bytes
+ * @param entry_size the largest key and value an entry holds
+ * @param policy the eviction policy
+ * @param shm_name the name of the shared memory object for the cache
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_cache(struct core_object *co, struct db_cache *cache, size_t size, size_t entry_size,
+                  enum db_cache_policy policy, const char *shm_name);
+
+/**
+ * close_db_cache
+ * <p>
+ * Unmap the database read cache of this process.
+ * </p>
+ * @param cache the cache
+ */
+void close_db_cache(struct db_cache *cache);
+
+/**
+ * db_cache_fetch
+ * <p>
+ * Fetch the value of a key from the database read cache without taking a lock.
+ * </p>
+ * @param co the core object
+ * @param cache the cache
+ * @param key the key
+ * @param serial_buffer the buffer into which to copy the value
+ * @param serial_buffer_size set to the size of the value
+ * @return 0 if found and copied, 1 if not found, -1 and set err on failure
+ */
+int db_cache_fetch(struct core_object *co, struct db_cache *cache, const datum *key, uint8_t **serial_buffer,
+                   size_t *serial_buffer_size);
+
+/**
+ * db_cache_fill
+ * <p>
+ * Add a value fetched from the database to the database read cache, evicting another entry of its set if the
+ * set is full. The key is not added if it does not fit in an entry or if another process is writing the entry
+ * it would take. The shard lock of the key must be held for reading, so that the value cannot be replaced in the
+ * database before it is in the cache.
+ * </p>
+ * @param cache the cache
+ * @param key the key
+ * @param value the value
+ */
+void db_cache_fill(struct db_cache *cache, const datum *key, const datum *value);
+
+/**
+ * db_cache_update
+ * <p>
+ * Replace the cached value of a key that has been written to the database, bumping the version of its entry.
+ * If the new value does not fit in the entry, or the key has been removed from the database, the entry is dropped
+ * instead. Keys that are not cached are left out of the cache. The shard lock of the key must be held for writing.
+ * </p>
+ * @param cache the cache
+ * @param key the key
+ * @param value the new value, or NULL if the key has been removed
+ */
+void db_cache_update(struct db_cache *cache, const datum *key, const datum *value);
+
+/**
+ * print_db_cache_stats
+ * <p>
+ * Print the configuration of the database read cache and how many reads it served.
+ * </p>
+ * @param cache the cache
+ */
+void print_db_cache_stats(struct db_cache *cache);
+
+#endif //HTTP_SERVER_DB_CACHE_H
@@ -0,0 +1,171 @@
+#ifndef HTTP_SERVER_DB_CHANGELOG_H
+#define HTTP_SERVER_DB_CHANGELOG_H
+
+#include "objects.h"
+
+#include <time.h>
+
+#define DB_CHANGE_UPSERT 1     /** A change setting the value of a key. */
+#define DB_CHANGE_REMOVE 2     /** A change removing a key; no value follows. */
+#define DB_CHANGE_BLOB 3       /** Sent only: a blob, keyed by its digest, that the next upsert refers to. */
+#define DB_CHANGE_HEARTBEAT 4  /** Sent only: nothing changed, sent so that an idle replica knows it is caught up. */
+
+/**
+ * The header of a change in the change log. The key and then the value follow the header. The checksum covers the
+ * key and the value, so a change torn by a crash is detected and cut off when the log is next opened.
+ */
+struct db_change_header
+{
+    uint32_t type;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t checksum;
+    int64_t  time;      // When the change was made, in seconds since the epoch.
+};
+
+/**
+ * A change as sent to a replica: the change log offsets, then the change header, key and value. Both ends are on
+ * the same host, so the fields are sent in host byte order.
+ */
+struct db_change_frame
+{
+    uint64_t                offset; // The offset in the change log just past the change; the replica resumes here.
+    uint64_t                end;    // The size of the change log when the frame was sent.
+    struct db_change_header change;
+};
+
+/**
+ * A replica connected to the change log server.
+ */
+struct db_changelog_replica
+{
+    int      fd;                     // -1 if the slot is free.
+    uint8_t  start[sizeof(uint64_t)]; // The offset from which the replica asks to be sent changes, as it arrives.
+    size_t   start_size;
+    uint64_t offset;                 // The offset in the change log of the next change to send.
+    uint8_t  *out;                   // Frames waiting to be sent.
+    size_t   out_size;
+    size_t   out_sent;
+    size_t   out_capacity;
+    time_t   last_sent;
+};
+
+/**
+ * The change log server, run by the change log server process: the socket on which replicas connect, and the
+ * replicas connected.
+ */
+struct db_changelog_server
+{
+    int                         listen_fd;
+    const char                  *socket_path;
+    struct db_changelog_replica replicas[MAX_DB_REPLICAS];
+    uint8_t                     *change;          // The key and value of the change being read from the log.
+    size_t                      change_capacity;
+};
+
+/**
+ * open_db_changelog
+ * <p>
+ * Open the database change log for appending, creating it if it does not exist, and cut off any change torn by a
+ * crash at its end. If enabled is false the change log is left disabled, and changes are not logged. The change
+ * log must be opened before the processes appending to it are forked.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log to open
+ * @param path the path of the change log file
+ * @param shm_name the name of the shared memory object for the statistics of the change log
+ * @param enabled whether to log changes
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_changelog(struct core_object *co, struct db_changelog *changelog, const char *path, const char *shm_name,
+                      bool enabled);
+
+/**
+ * close_db_changelog
+ * <p>
+ * Close the database change log of this process.
+ * </p>
+ * @param changelog the change log
+ */
+void close_db_changelog(struct db_changelog *changelog);
+
+/**
+ * append_db_change
+ * <p>
+ * Append a change of a key to the database change log, in one write. The shard lock of the key must be held for
+ * writing, so that the changes of a key are logged in the order they were applied. A short write leaves a torn
+ * change in the log, which replicas cannot read past, so every append after it fails until the log is reopened and
+ * the torn change is cut off.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param type DB_CHANGE_UPSERT or DB_CHANGE_REMOVE
+ * @param key the key
+ * @param value the value upserted; NULL for a removal
+ * @return 0 on success, or if changes are not logged, -1 and set err on failure
+ */
+int append_db_change(struct core_object *co, struct db_changelog *changelog, uint32_t type, const datum *key,
+                     const datum *value);
+
+/**
+ * get_db_changelog_status
+ * <p>
+ * Get the size of the database change log and the number of replicas connected to it.
+ * </p>
+ * @param changelog the change log
+ * @param size pointer to the size of the change log
+ * @param num_replicas pointer to the number of replicas
+ * @return 0 on success, -1 and set errno on failure
+ */
+int get_db_changelog_status(struct db_changelog *changelog, uint64_t *size, size_t *num_replicas);
+
+/**
+ * open_db_changelog_server
+ * <p>
+ * Create the Unix socket on which replicas connect to be sent the database change log, replacing a socket left at
+ * the path by an earlier run.
+ * </p>
+ * @param co the core object
+ * @param server the server to open
+ * @param socket_path the path of the socket
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_changelog_server(struct core_object *co, struct db_changelog_server *server, const char *socket_path);
+
+/**
+ * serve_db_changelog
+ * <p>
+ * Run a round of the change log server: wait up to DB_CHANGELOG_POLL_MS for a replica to connect, ask for changes
+ * or take what was sent, then send each replica the changes appended since it was last sent any, without blocking.
+ * An upsert of a value held in the blob store is preceded by the blob. A replica with nothing to be sent is sent a
+ * heartbeat every DB_CHANGELOG_HEARTBEAT_INTERVAL seconds. A replica that hangs up or cannot be sent to is dropped.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param server the server
+ * @return 0 on success, -1 and set err on failure
+ */
+int serve_db_changelog(struct core_object *co, struct db_changelog *changelog, struct db_changelog_server *server);
+
+/**
+ * close_db_changelog_server
+ * <p>
+ * Disconnect the replicas, and close and unlink the socket of the change log server.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param server the server
+ */
+void close_db_changelog_server(struct core_object *co, struct db_changelog *changelog,
+                               struct db_changelog_server *server);
+
+/**
+ * print_db_changelog_stats
+ * <p>
+ * Print how many changes were appended to the database change log and how many bytes were sent to replicas.
+ * </p>
+ * @param changelog the change log
+ */
+void print_db_changelog_stats(struct db_changelog *changelog);
+
+#endif //HTTP_SERVER_DB_CHANGELOG_H
@@ -0,0 +1,85 @@
+#ifndef HTTP_SERVER_DB_EXPIRY_H
+#define HTTP_SERVER_DB_EXPIRY_H
+
+#include "objects.h"
+
+#include <time.h>
+
+/**
+ * A pass of the database expiry sweeper over the ordered key index, made in slices. Each slice checks the keys
+ * after the cursor until it has checked DB_EXPIRY_SLICE_KEYS keys or spent DB_EXPIRY_SLICE_MS, then removes the
+ * keys it found expired. A pass that collects blobs also keeps the digest of each blob a live key refers to, so that
+ * once the pass is done the blobs nothing refers to can be removed.
+ */
+struct db_expiry_sweep
+{
+    char            *cursor;           // The last key checked, from which the next slice goes on.
+    size_t          cursor_size;       // 0 before the first slice of the pass.
+    size_t          cursor_capacity;
+    char            *expired;          // The keys found expired by the slice, one after another.
+    size_t          expired_size;
+    size_t          expired_capacity;
+    size_t          expired_sizes[DB_EXPIRY_SLICE_KEYS];
+    size_t          num_expired;
+    time_t          now;               // The time against which the slice checks expiry.
+    struct timespec deadline;          // The monotonic time at which the slice stops checking keys.
+    size_t          checked;
+    size_t          removed;
+    bool            collect_blobs;     // The pass keeps the digests of live blobs; cleared if a record is unreadable.
+    char            *live_blobs;       // The digests of the blobs referred to, SHA256_HEX_LEN characters each.
+    size_t          num_live_blobs;
+    size_t          live_blobs_capacity;
+    time_t          started;           // The time the pass began.
+    size_t          collected;
+};
+
+/**
+ * open_db_expiry_sweep
+ * <p>
+ * Begin a pass of the database expiry sweeper from the first key.
+ * </p>
+ * @param co the core object
+ * @param sweep the pass to begin
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_expiry_sweep(struct core_object *co, struct db_expiry_sweep *sweep);
+
+/**
+ * sweep_db_expiry_slice
+ * <p>
+ * Run a slice of a pass of the database expiry sweeper. The keys are checked against their metadata records
+ * without taking a lock; the expired keys are then removed in a batch for each shard, each checked again under the
+ * shard write lock.
+ * </p>
+ * @param co the core object
+ * @param so the state object holding the shards and the ordered key index
+ * @param sweep the pass
+ * @return 0 if the pass is done, 1 if keys remain to be checked, -1 and set err on failure
+ */
+int sweep_db_expiry_slice(struct core_object *co, struct state_object *so, struct db_expiry_sweep *sweep);
+
+/**
+ * collect_db_expiry_blobs
+ * <p>
+ * Once a pass that collects blobs is done, remove the blobs of the blob store that no live key and no
+ * content-addressed file of the write directory refers to. Only blobs last stored DB_BLOB_COLLECT_GRACE seconds
+ * before the pass began are removed, so that a blob stored for a record written since, or still queued, is kept.
+ * Nothing is removed if the pass could not read every record.
+ * </p>
+ * @param co the core object
+ * @param sweep the pass, done
+ * @return 0 on success, -1 and set err on failure
+ */
+int collect_db_expiry_blobs(struct core_object *co, struct db_expiry_sweep *sweep);
+
+/**
+ * close_db_expiry_sweep
+ * <p>
+ * Free the buffers of a pass of the database expiry sweeper.
+ * </p>
+ * @param co the core object
+ * @param sweep the pass
+ */
+void close_db_expiry_sweep(struct core_object *co, struct db_expiry_sweep *sweep);
+
+#endif //HTTP_SERVER_DB_EXPIRY_H
@@ -0,0 +1,113 @@
+#ifndef HTTP_SERVER_DB_INDEX_H
+#define HTTP_SERVER_DB_INDEX_H
+
+#include "objects.h"
+
+#include <stdbool.h>
+
+/**
+ * open_db_index
+ * <p>
+ * Map the database ordered key index in memory shared between processes, holding no keys. A size of 0 leaves the
+ * index disabled. The index must be opened, and filled, before the processes using it are forked.
+ * </p>
+ * @param co the core object
+ * @param index the index to open
+ * @param size the size of the index in bytes
+ * @param shm_name the name of the shared memory object for the index
+ * @param sem_name the name of the semaphore held by writers
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_index(struct core_object *co, struct db_index *index, size_t size, const char *shm_name,
+                  const char *sem_name);
+
+/**
+ * fill_db_index
+ * <p>
+ * Insert every key in the database shards into the database ordered key index. The shards are iterated through
+ * the handles of this process, which are closed afterwards so that no forked process inherits them.
+ * </p>
+ * @param co the core object
+ * @param so the state object holding the shards and the index
+ * @return 0 on success, -1 and set err on failure
+ */
+int fill_db_index(struct core_object *co, struct state_object *so);
+
+/**
+ * close_db_index
+ * <p>
+ * Unmap the database ordered key index of this process and close its semaphore.
+ * </p>
+ * @param index the index
+ */
+void close_db_index(struct db_index *index);
+
+/**
+ * db_index_add
+ * <p>
+ * Insert a key into the database ordered key index if it is not there already. Metadata keys are not indexed. If
+ * the arena of the index is full, the key is dropped and the index is marked incomplete.
+ * </p>
+ * @param co the core object
+ * @param index the index
+ * @param key the key
+ * @return 0 on success, -1 and set err on failure
+ */
+int db_index_add(struct core_object *co, struct db_index *index, const datum *key);
+
+/**
+ * db_index_remove
+ * <p>
+ * Mark a key removed from the database as removed from the database ordered key index, so that listings pass over
+ * it. Its node keeps its room in the arena and is reused if the key is added again. The shard write lock of the
+ * key must be held.
+ * </p>
+ * @param index the index
+ * @param key the key
+ */
+void db_index_remove(struct db_index *index, const datum *key);
+
+/**
+ * db_index_complete
+ * <p>
+ * Check whether the database ordered key index holds every key in the database: it is enabled, and no key has been
+ * dropped for want of room.
+ * </p>
+ * @param index the index
+ * @return true if the index can be listed, otherwise false
+ */
+bool db_index_complete(struct db_index *index);
+
+/**
+ * db_index_list
+ * <p>
+ * Call visit, in order, with up to limit keys of the database ordered key index that begin with a prefix and sort
+ * after a cursor, without taking any lock. The key is valid until this process unmaps the index. visit returns 0
+ * to go on, 1 to stop, or -1 and sets err on failure.
+ * </p>
+ * @param co the core object
+ * @param index the index
+ * @param prefix the prefix of the keys to list
+ * @param prefix_size the size of the prefix
+ * @param cursor the key after which to list, or NULL to list from the first key with the prefix
+ * @param cursor_size the size of the cursor
+ * @param limit the most keys to list
+ * @param visit the function to call with each key
+ * @param arg the argument to pass to visit
+ * @return 0 if every key was listed, 1 if more keys follow the last listed or visit stopped the listing, -1 and set
+ * err on failure
+ */
+int db_index_list(struct core_object *co, struct db_index *index, const void *prefix, size_t prefix_size,
+                  const void *cursor, size_t cursor_size, size_t limit,
+                  int (*visit)(struct core_object *co, const datum *key, void *arg), void *arg);
+
+/**
+ * print_db_index_stats
+ * <p>
+ * Print how many keys the database ordered key index holds, how full its arena is, and how many listings it served.
+ * </p>
+ * @param index the index
+ */
+void print_db_index_stats(struct db_index *index);
+
+#endif //HTTP_SERVER_DB_INDEX_H
@@ -0,0 +1,196 @@
+#ifndef HTTP_SERVER_DB_RECORD_H
+#define HTTP_SERVER_DB_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DB_RECORD_MAGIC 0x00        /** First byte of a record; a legacy record starts with its timestamp text. */
+#define DB_RECORD_VERSION 1         /** Version of the record format written. */
+#define DB_RECORD_MAX_META_LEN 255  /** Longest content type or content coding a record holds, with its NUL. */
+#define DB_RECORD_MAX_ETAG_LEN 64   /** Longest entity tag of a value, without its quotes; a blob digest is the longest. */
+#define DB_META_KEY_PREFIX '\0'     /** First byte of the key of a metadata record, which no URI starts with. */
+
+#define DB_RECORD_CHECKSUM 0x01         /** Flag: the header holds the CRC-32 of the body. */
+#define DB_RECORD_CONTENT_TYPE 0x02     /** Flag: the record holds the content type of the body. */
+#define DB_RECORD_CONTENT_ENCODING 0x04 /** Flag: the record holds the content coding applied to the body. */
+#define DB_RECORD_BLOB 0x08             /** Flag: the body is the digest of the blob in BLOB_DIR holding the value. */
+#define DB_RECORD_META 0x10             /** Flag: the record is the metadata of a value; see struct db_meta. */
+#define DB_RECORD_EXPIRES 0x20          /** Flag: the record holds the time after which the value has expired. */
+#define DB_RECORD_LEGACY 0x80           /** Flag: the record was decoded from the legacy format. Never stored. */
+
+/**
+ * The fixed header at the start of each database value. Multibyte fields are in host byte order, as the databases
+ * are local to the machine. The header is followed by the content type and the content coding, each stored with
+ * its NUL if its flag is set, then by the expiry time as an int64_t if its flag is set, and then by the body.
+ */
+struct db_record_header
+{
+    uint8_t  magic;
+    uint8_t  version;
+    uint8_t  flags;
+    uint8_t  content_type_size;
+    uint8_t  content_encoding_size;
+    uint8_t  reserved[3];
+    int64_t  mtime;
+    uint32_t body_size;
+    uint32_t checksum;
+};
+
+/**
+ * A decoded database value. The strings and the body point into the value from which it was decoded.
+ */
+struct db_record
+{
+    time_t        mtime;
+    time_t        expires; // 0 if the value never expires.
+    uint8_t       flags;
+    const char    *content_type;
+    const char    *content_encoding;
+    const uint8_t *body;
+    size_t        body_size;
+    uint32_t      checksum; // Set if the DB_RECORD_CHECKSUM flag is.
+};
+
+/**
+ * The metadata of a database value, kept in a record of its own under the key of the value prefixed with
+ * DB_META_KEY_PREFIX, so that it can be read without reading the value. The metadata record holds the mtime, the
+ * expiry time, the content type and the content coding of the value in its header, and the size and entity tag of
+ * the value as its body.
+ */
+struct db_meta
+{
+    time_t     mtime;
+    time_t     expires; // 0 if the value never expires.
+    const char *content_type;
+    const char *content_encoding;
+    uint64_t   value_size;
+    char       etag[DB_RECORD_MAX_ETAG_LEN + 1]; // Empty if the value has no entity tag.
+};
+
+/**
+ * db_record_size
+ * <p>
+ * Get the size of the database value encoding a record.
+ * </p>
+ * @param record the record
+ * @return the size of the encoded record
+ */
+size_t db_record_size(const struct db_record *record);
+
+/**
+ * encode_db_record
+ * <p>
+ * Encode a record into a database value of db_record_size bytes. The content type and the content coding are
+ * stored if they are not NULL and are shorter than DB_RECORD_MAX_META_LEN, and the expiry time if it is not 0; the
+ * body checksum is stored if the DB_RECORD_CHECKSUM flag of the record is set. The DB_RECORD_BLOB flag is stored as set in the record.
+ * </p>
+ * @param record the record
+ * @param buffer the buffer into which to encode the record
+ */
+void encode_db_record(const struct db_record *record, uint8_t *buffer);
+
+/**
+ * decode_db_record
+ * <p>
+ * Decode a database value into a record without copying it. A value in the legacy "timestamp\0body\0" format is
+ * decoded too, and has the DB_RECORD_LEGACY flag set in the record.
+ * </p>
+ * @param value the value
+ * @param value_size the size of the value
+ * @param record the record to fill
+ * @return 0 on success, -1 if the value is malformed or its body does not match its checksum
+ */
+int decode_db_record(const uint8_t *value, size_t value_size, struct db_record *record);
+
+/**
+ * get_db_record_etag
+ * <p>
+ * Get the entity tag of the value of a record, without its quotes: the digest of its blob, or its size and body
+ * checksum. A record without a checksum, or whose blob digest is longer than DB_RECORD_MAX_ETAG_LEN, has no entity
+ * tag.
+ * </p>
+ * @param record the record
+ * @param etag the buffer into which to write the entity tag, empty if the record has none
+ */
+void get_db_record_etag(const struct db_record *record, char etag[DB_RECORD_MAX_ETAG_LEN + 1]);
+
+/**
+ * make_db_meta
+ * <p>
+ * Make the metadata of the value of a record. The strings of the metadata point into the record.
+ * </p>
+ * @param record the record
+ * @param value_size the size of the value, which for a record in the blob store is the size of the blob
+ * @param meta the metadata to fill
+ */
+void make_db_meta(const struct db_record *record, size_t value_size, struct db_meta *meta);
+
+/**
+ * db_meta_size
+ * <p>
+ * Get the size of the database value encoding the metadata of a value.
+ * </p>
+ * @param meta the metadata
+ * @return the size of the encoded metadata record
+ */
+size_t db_meta_size(const struct db_meta *meta);
+
+/**
+ * encode_db_meta
+ * <p>
+ * Encode the metadata of a value into a metadata record of db_meta_size bytes.
+ * </p>
+ * @param meta the metadata
+ * @param buffer the buffer into which to encode the metadata record
+ */
+void encode_db_meta(const struct db_meta *meta, uint8_t *buffer);
+
+/**
+ * decode_db_meta
+ * <p>
+ * Decode a metadata record. The strings of the metadata point into the record.
+ * </p>
+ * @param value the metadata record
+ * @param value_size the size of the metadata record
+ * @param meta the metadata to fill
+ * @return 0 on success, -1 if the record is malformed or is not a metadata record
+ */
+int decode_db_meta(const uint8_t *value, size_t value_size, struct db_meta *meta);
+
+/**
+ * make_db_meta_key
+ * <p>
+ * Make the key of the metadata record of a value from the key of the value.
+ * </p>
+ * @param key the key of the value
+ * @param key_size the size of the key of the value
+ * @param buffer the buffer into which to write the key of the metadata record, of key_size + 1 bytes
+ * @return the size of the key of the metadata record
+ */
+size_t make_db_meta_key(const void *key, size_t key_size, char *buffer);
+
+/**
+ * is_db_meta_key
+ * <p>
+ * Check whether a key is the key of a metadata record.
+ * </p>
+ * @param key the key
+ * @param key_size the size of the key
+ * @return true if the key is the key of a metadata record, otherwise false
+ */
+bool is_db_meta_key(const void *key, size_t key_size);
+
+/**
+ * is_db_expired
+ * <p>
+ * Check whether a value with an expiry time has expired.
+ * </p>
+ * @param expires the expiry time of the value, or 0 if it never expires
+ * @param now the current time
+ * @return true if the value has expired, otherwise false
+ */
+bool is_db_expired(time_t expires, time_t now);
+
+#endif //HTTP_SERVER_DB_RECORD_H
@@ -0,0 +1,97 @@
+#ifndef HTTP_SERVER_DB_REPLICA_H
+#define HTTP_SERVER_DB_REPLICA_H
+
+#include "objects.h"
+
+#define DB_REPLICATION_STATUS_SIZE 1024 /** Size of the buffer holding the replication status, the longest included. */
+
+/**
+ * The connection of the replicator process to the change log server of its primary.
+ */
+struct db_replica_stream
+{
+    int     fd;
+    uint8_t *change;          // The key and value of the frame being applied.
+    size_t  change_capacity;
+    size_t  unsaved;          // Changes applied since the offset applied was last saved.
+};
+
+/**
+ * open_db_replica
+ * <p>
+ * Map the replication status in memory shared between processes, resuming from the offset saved by an earlier run.
+ * If primary_socket is NULL the server is not a replica, and the status is left disabled. The status must be opened
+ * before the processes reading it are forked.
+ * </p>
+ * @param co the core object
+ * @param replica the replica state to open
+ * @param primary_socket the socket on which the primary serves its change log; NULL unless this server is a replica
+ * @param offset_path the file to which the offset applied is saved
+ * @param shm_name the name of the shared memory object for the status
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_replica(struct core_object *co, struct db_replica *replica, const char *primary_socket,
+                    const char *offset_path, const char *shm_name);
+
+/**
+ * close_db_replica
+ * <p>
+ * Unmap the replication status.
+ * </p>
+ * @param replica the replica state
+ */
+void close_db_replica(struct db_replica *replica);
+
+/**
+ * open_db_replica_stream
+ * <p>
+ * Connect to the change log server of the primary and ask for the changes after the offset applied.
+ * </p>
+ * @param co the core object
+ * @param replica the replica state
+ * @param stream the stream to open
+ * @return 0 if connected, 1 if the primary cannot be reached, -1 and set err on failure
+ */
+int open_db_replica_stream(struct core_object *co, struct db_replica *replica, struct db_replica_stream *stream);
+
+/**
+ * apply_db_replica_frame
+ * <p>
+ * Receive a frame from the primary and apply it: an upsert or removal is applied to the database, and a blob is
+ * stored in the blob store. Applying a change twice leaves the same database as applying it once, so the changes
+ * applied since the offset was last saved are safely applied again after a restart. The offset applied is saved
+ * every DB_REPLICA_SAVE_CHANGES changes and at every heartbeat.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param stream the stream
+ * @return 0 if a frame was applied, 1 if the stream was lost or interrupted, -1 and set err on failure
+ */
+int apply_db_replica_frame(struct core_object *co, struct state_object *so, struct db_replica_stream *stream);
+
+/**
+ * close_db_replica_stream
+ * <p>
+ * Save the offset applied and disconnect from the primary.
+ * </p>
+ * @param co the core object
+ * @param replica the replica state
+ * @param stream the stream
+ */
+void close_db_replica_stream(struct core_object *co, struct db_replica *replica, struct db_replica_stream *stream);
+
+/**
+ * format_db_replication_status
+ * <p>
+ * Describe the part this server plays in replication, one "name: value" line at a time. A replica reports how far
+ * behind its primary it is, in bytes of the change log and in seconds since the primary made the last change
+ * applied; a primary reports the size of its change log and the replicas connected.
+ * </p>
+ * @param so the state object
+ * @param buffer the buffer into which to write the status
+ * @param length the length of the status written
+ * @return 0 on success, -1 and set errno if the status does not fit the buffer
+ */
+int format_db_replication_status(struct state_object *so, char buffer[DB_REPLICATION_STATUS_SIZE], size_t *length);
+
+#endif //HTTP_SERVER_DB_REPLICA_H
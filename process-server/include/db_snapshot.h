@@ -0,0 +1,107 @@
+#ifndef HTTP_SERVER_DB_SNAPSHOT_H
+#define HTTP_SERVER_DB_SNAPSHOT_H
+
+#include "objects.h"
+
+#include <stdbool.h>
+
+#define DB_SNAPSHOT_MISS 2 /** Returned by db_snapshot_fetch for a key that must be read from the database shards. */
+
+/**
+ * open_db_snapshot
+ * <p>
+ * Map the delta table of the database snapshots in memory shared between processes, with no snapshot published.
+ * A number of writes of 0 leaves snapshots disabled. The delta table must be opened before the processes using it
+ * are forked.
+ * </p>
+ * @param co the core object
+ * @param snapshot the snapshot state to open
+ * @param writes the number of writes after which a new snapshot is published
+ * @param shm_name the name of the shared memory object for the delta table
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_snapshot(struct core_object *co, struct db_snapshot *snapshot, size_t writes, const char *shm_name);
+
+/**
+ * close_db_snapshot
+ * <p>
+ * Unmap the snapshot mapped by this process and the delta table.
+ * </p>
+ * @param snapshot the snapshot state
+ */
+void close_db_snapshot(struct db_snapshot *snapshot);
+
+/**
+ * unlink_db_snapshot
+ * <p>
+ * Remove the file of the latest published snapshot. Called by the parent once every other process has ended.
+ * </p>
+ * @param snapshot the snapshot state
+ */
+void unlink_db_snapshot(struct db_snapshot *snapshot);
+
+/**
+ * db_snapshot_mark
+ * <p>
+ * Record in the delta table that a key is being written, so that reads of it go to the database shards until a
+ * snapshot holding the write is published. The key must be marked under the shard write lock, before it is
+ * written to the database.
+ * </p>
+ * @param snapshot the snapshot state
+ * @param key the key
+ */
+void db_snapshot_mark(struct db_snapshot *snapshot, const datum *key);
+
+/**
+ * db_snapshot_fetch
+ * <p>
+ * Read a value from the latest published snapshot, without taking any lock, if the key has not been written since
+ * the snapshot was started. The latest snapshot is mapped first if this process has an older one mapped. The
+ * buffer is allocated with the memory manager.
+ * </p>
+ * @param co the core object
+ * @param snapshot the snapshot state
+ * @param key the key
+ * @param serial_buffer the buffer into which to copy the value
+ * @param serial_buffer_size the size of the value
+ * @return 0 if the value was copied, 1 if the key is not in the database, DB_SNAPSHOT_MISS if the key must be read
+ * from the database shards, -1 and set err on failure
+ */
+int db_snapshot_fetch(struct core_object *co, struct db_snapshot *snapshot, const datum *key, uint8_t **serial_buffer,
+                      size_t *serial_buffer_size);
+
+/**
+ * db_snapshot_due
+ * <p>
+ * Check whether a new snapshot should be published: if none has been, if the number of writes since the latest was
+ * started has been reached, if the delta table overflowed, or if any write is older than DB_SNAPSHOT_MAX_AGE.
+ * </p>
+ * @param snapshot the snapshot state
+ * @param writes the number of writes after which a new snapshot is published
+ * @return true if a snapshot should be published, otherwise false
+ */
+bool db_snapshot_due(struct db_snapshot *snapshot, size_t writes);
+
+/**
+ * publish_db_snapshot
+ * <p>
+ * Export every key and value in the database shards into a new snapshot file in SNAPSHOT_DIR, with a perfect-hash
+ * index over the keys, and publish it. Each shard is read under its read lock. The previous snapshot file is
+ * removed; processes that still map it keep reading it until they next map the latest.
+ * </p>
+ * @param co the core object
+ * @param so the state object holding the shards and the snapshot state
+ * @return 0 on success, -1 and set err on failure
+ */
+int publish_db_snapshot(struct core_object *co, struct state_object *so);
+
+/**
+ * print_db_snapshot_stats
+ * <p>
+ * Print the latest published snapshot, and how many reads it answered.
+ * </p>
+ * @param snapshot the snapshot state
+ */
+void print_db_snapshot_stats(struct db_snapshot *snapshot);
+
+#endif //HTTP_SERVER_DB_SNAPSHOT_H
@@ -0,0 +1,84 @@
+#ifndef HTTP_SERVER_DB_WRITE_QUEUE_H
+#define HTTP_SERVER_DB_WRITE_QUEUE_H
+
+#include "objects.h"
+
+#include <stdbool.h>
+
+#define DB_UPSERT_QUEUED 2 /** Returned for an upsert queued without waiting for it to be applied. */
+
+/**
+ * open_db_write_queue
+ * <p>
+ * Map the database write queue in memory shared between processes and open its semaphores. The queue holds size
+ * bytes of upserts. A size of 0 leaves the queue disabled, so that upserts are written by the workers themselves.
+ * The queue must be opened before the processes using it are forked.
+ * </p>
+ * @param co the core object
+ * @param queue the queue to open
+ * @param size the size of the queue in bytes
+ * @param sem_name_prefix the prefix of the queue semaphore names
+ * @param shm_name the name of the shared memory object for the queue
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_write_queue(struct core_object *co, struct db_write_queue *queue, size_t size,
+                        const char *sem_name_prefix, const char *shm_name);
+
+/**
+ * close_db_write_queue
+ * <p>
+ * Close the semaphores of the database write queue of this process and unmap the queue.
+ * </p>
+ * @param queue the queue
+ */
+void close_db_write_queue(struct db_write_queue *queue);
+
+/**
+ * unlink_db_write_queue
+ * <p>
+ * Unlink the semaphores of the database write queue.
+ * </p>
+ * @param sem_name_prefix the prefix of the queue semaphore names
+ */
+void unlink_db_write_queue(const char *sem_name_prefix);
+
+/**
+ * queue_db_upsert
+ * <p>
+ * Queue an upsert for the database writer process, waiting for room in the queue if it is full. If wait is true,
+ * wait until the writer has applied the upsert. An upsert too large for the queue, or made while the queue is
+ * disabled, is applied directly. Must be called from a worker process.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param key the key to upsert
+ * @param value the value to upsert
+ * @param wait whether to wait for the upsert to be applied
+ * @return DB_UPSERT_QUEUED if queued without waiting, 0 if applied and no overwrite, 1 if applied and overwrite,
+ * -1 and set err on failure
+ */
+int queue_db_upsert(struct core_object *co, struct state_object *so, datum *key, datum *value, bool wait);
+
+/**
+ * apply_db_write_queue
+ * <p>
+ * Wait for upserts to be queued, then apply every upsert in the queue, in one batch for each database shard, and
+ * wake the workers waiting on them. If the wait is interrupted by a signal, apply whatever is queued and return.
+ * Run by the database writer process.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+int apply_db_write_queue(struct core_object *co, struct state_object *so);
+
+/**
+ * print_db_write_queue_stats
+ * <p>
+ * Print the size of the database write queue and how many upserts it batched.
+ * </p>
+ * @param queue the queue
+ */
+void print_db_write_queue_stats(struct db_write_queue *queue);
+
+#endif //HTTP_SERVER_DB_WRITE_QUEUE_H
@@ -4,6 +4,6 @@
 #include "objects.h"
 
 int perform_method(struct core_object *co, struct state_object *so, struct http_request *request,
-        size_t *status, struct http_header ***headers, char **entity_body);
+        size_t *status, struct http_header ***headers, struct http_entity_body *entity_body);
 
 #endif //HTTP_SERVER_METHODS_H
@@ -2,11 +2,14 @@
 #define PROCESS_SERVER_OBJECTS_H
 
 #include "error_handlers.h"
+#include "rw_lock.h"
 
 #include <semaphore.h>
 #include <poll.h>
 #include <netinet/in.h>
 #include <ndbm.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #define HTTP_VERSION "HTTP/1.0" /** HTTP Version 1.0 */
 
@@ -40,6 +43,23 @@
 #define H_USER_AGENT "user-agent"
 #define H_WWW_AUTHENTICATE "www-authenticate"
 
+/**
+ * HTTP 1.1 headers
+ */
+#define H_ACCEPT_ENCODING "accept-encoding"
+#define H_ACCEPT_RANGES "accept-ranges"
+#define H_CONTENT_LOCATION "content-location"
+#define H_CONTENT_RANGE "content-range"
+#define H_ETAG "etag"
+#define H_EXPECT "expect"
+#define H_IF_RANGE "if-range"
+#define H_RANGE "range"
+#define H_TRANSFER_ENCODING "transfer-encoding"
+#define H_VARY "vary"
+
+#define EXPECT_CONTINUE "100-continue" /** The expectation of a client waiting to be asked for its entity body. */
+#define CHUNKED "chunked"                /** The transfer coding of an entity body sent in chunks of given sizes. */
+
 /**
  * HTTP 1.0 syntax
  */
@@ -61,6 +81,13 @@
  * Misc
  */
 #define TEXT_HTML_CONTENT_TYPE "text/html"
+#define TEXT_PLAIN_CONTENT_TYPE "text/plain"                                /** Content type of a database listing. */
+#define MULTIPART_BYTERANGES_CONTENT_TYPE "multipart/byteranges; boundary=" /** Content type of a multi-range response. */
+#define BYTERANGES_BOUNDARY "BYTERANGES_2f6b08"                             /** Boundary between parts of a multi-range response. */
+#define MULTIPART_MIXED_CONTENT_TYPE "multipart/mixed; boundary="           /** Content type of a database multi-get response. */
+#define MULTI_GET_BOUNDARY "MULTIGET_2f6b08"                                /** Boundary between parts of a database multi-get response. */
+#define BYTES_RANGE_UNIT "bytes"                                            /** The only range unit supported. */
+#define COMPRESSION_MIN_SIZE 1024                                           /** Entities smaller than this are not compressed. */
 
 #define NUM_CHILD_PROCESSES 8             /** The number of worker processes to be spawned to handle network requests. */
 #define CONNECTION_QUEUE 100              /** The number of connections that can be queued on the listening socket. */
@@ -73,14 +100,90 @@
 #define PIPE_WRITE_SEM_NAME "/pw_2f6b08"      /** Pipe write semaphore name. */
 #define DOMAIN_READ_SEM_NAME "/dr_2f6b08"     /** Domain socket read semaphore name. */
 #define DOMAIN_WRITE_SEM_NAME "/dw_2f6b08"    /** Domain socket write semaphore name. */
-#define DB_WRITE_SEM_NAME "/db_2f6b08"        /** Database socket write semaphore name. */
+#define DB_LOCK_NAME_PREFIX "/db_2f6b08"      /** Database shard reader/writer lock semaphore name prefix. */
+#define DB_SHM_NAME "/shm_2f6b08"             /** Database shared state shared memory name. */
+#define DB_CACHE_SHM_NAME "/shmc_2f6b08"      /** Database read cache shared memory name. */
+#define DB_BLOOM_SHM_NAME "/shmb_2f6b08"      /** Database key Bloom filter shared memory name. */
+#define DB_SNAPSHOT_SHM_NAME "/shms_2f6b08"   /** Database snapshot delta table shared memory name. */
+#define DB_INDEX_SHM_NAME "/shmi_2f6b08"      /** Database ordered key index shared memory name. */
+#define DB_INDEX_SEM_NAME "/dbi_2f6b08"       /** Database ordered key index writer semaphore name. */
+#define DB_WRITE_QUEUE_SEM_PREFIX "/dbwq_2f6b08" /** Database write queue semaphore name prefix. */
+#define DB_WRITE_QUEUE_SHM_NAME "/shmq_2f6b08"   /** Database write queue shared memory name. */
+#define DB_CHANGELOG_SHM_NAME "/shml_2f6b08"     /** Database change log statistics shared memory name. */
+#define DB_REPLICA_SHM_NAME "/shmr_2f6b08"       /** Database replication status shared memory name. */
+#define UPLOAD_FLUSHER_SEM_PREFIX "/upf_2f6b08"  /** Upload flusher semaphore name prefix. */
+#define UPLOAD_FLUSHER_SHM_NAME "/shmu_2f6b08"   /** Upload flusher shared memory name. */
 
 #define DB_NAME "db_http_2f6b08"              /** Database file name. */
 #define WRITE_DIR "dir_http_2f6b08"           /** Directory name. */
+#define CACHE_DIR "cache_http_2f6b08"         /** Compressed variant cache directory name. */
+#define BLOB_DIR "blob_http_2f6b08"           /** Database blob store directory name. */
+#define SNAPSHOT_DIR "snapshot_http_2f6b08"   /** Database snapshot directory name. */
+#define CHANGELOG_NAME "changes_http_2f6b08"  /** Database change log file name. */
+#define REPLICA_OFFSET_NAME "replica_http_2f6b08" /** File holding how far into the change log of its primary a replica has applied. */
 
 #define DB_FLAGS O_RDWR | O_CREAT             /** Flags for opening db. */
 #define DB_FILE_MODE S_IRUSR | S_IWUSR        /** File mode for opening db. */
 
+#define DEFAULT_DB_SHARDS 1                   /** The default number of database shards; one keeps the database in DB_NAME. */
+#define MAX_DB_SHARDS 64                      /** The maximum number of database shards. */
+#define DB_SHARD_NAME_SIZE 64                 /** Size of the buffers holding the name of a database shard and its lock. */
+
+#define DEFAULT_DB_CACHE_SIZE (8 * 1024 * 1024) /** The default size in bytes of the database read cache; 0 disables it. */
+#define DEFAULT_DB_CACHE_ENTRY_SIZE 4096        /** The default size in bytes of the largest key and value the read cache holds. */
+#define MAX_DB_CACHE_ENTRY_SIZE (1024 * 1024)   /** The maximum size in bytes of the largest key and value the read cache holds. */
+#define DB_CACHE_WAYS 8                         /** The number of entries in each set of the read cache, among which one is evicted. */
+
+#define DEFAULT_DB_BLOOM_SIZE (1024 * 1024)     /** The default size in bytes of the database key Bloom filter; 0 disables it. */
+#define DB_BLOOM_HASHES 7                       /** The number of bits of the Bloom filter set for each key. */
+
+#define DEFAULT_DB_SNAPSHOT_WRITES 0            /** The default number of writes after which a database snapshot is published; 0 disables snapshots. */
+#define MAX_DB_SNAPSHOT_WRITES (1024 * 1024)    /** The maximum number of writes after which a database snapshot is published. */
+#define DB_SNAPSHOT_INTERVAL 1                  /** Seconds between checks of whether a database snapshot is due. */
+#define DB_SNAPSHOT_MAX_AGE 30                  /** Seconds after which a database snapshot missing any write is republished. */
+
+#define DEFAULT_DB_INDEX_SIZE (64 * 1024 * 1024) /** The default size in bytes of the database ordered key index; 0 disables it. */
+#define DB_INDEX_MAX_HEIGHT 24                   /** The most levels of the skiplist of the ordered key index. */
+#define DEFAULT_DB_LIST_LIMIT 100                /** The default number of keys in a page of a database listing. */
+#define MAX_DB_LIST_LIMIT 10000                  /** The most keys in a page of a database listing. */
+
+#define DEFAULT_DB_WRITE_QUEUE_SIZE 0           /** The default size in bytes of the database write queue; 0 writes without queueing. */
+#define MIN_DB_WRITE_QUEUE_SIZE 4096            /** The minimum size in bytes of the database write queue. */
+
+#define DB_MULTI_GET_PATH "/_db/multi-get"      /** A database POST to this path reads the keys listed in its body, one per line. */
+#define MAX_DB_MULTI_GET_KEYS 1024              /** The most keys read by one database multi-get. */
+#define MAX_DB_MULTI_GET_SIZE (64 * 1024 * 1024) /** The most bytes of parts in the response to one database multi-get. */
+#define DB_BATCH_UPSERT_PATH "/_db/batch"       /** A database POST to this path upserts the records in its body. */
+#define DB_BATCH_UPSERT_SIZE 256                /** The most records of a batch upsert applied to a shard under one lock. */
+
+#define MAX_DB_TTL (10 * 365 * 24 * 60 * 60)    /** The longest TTL header, in seconds, with which a database value is stored. */
+#define DB_EXPIRY_INTERVAL 1                    /** Seconds between passes of the database expiry sweeper. */
+#define DB_EXPIRY_SLICE_KEYS 256                /** The most keys the expiry sweeper checks in one slice. */
+#define DB_EXPIRY_SLICE_MS 5                    /** The most milliseconds the expiry sweeper spends checking keys in one slice. */
+#define DB_EXPIRY_PAUSE_MS 20                   /** Milliseconds the expiry sweeper pauses between slices. */
+#define DB_BLOB_COLLECT_INTERVAL 3600           /** Seconds between collections of the blobs no value or file refers to. */
+#define DB_BLOB_COLLECT_GRACE 3600              /** Seconds after it was last stored that a blob may be collected. */
+
+#define MAX_DB_REPLICAS 8                       /** The most replicas to which the change log is served at once. */
+#define DB_CHANGELOG_POLL_MS 50                 /** Milliseconds the change log server waits between checks for new changes. */
+#define DB_CHANGELOG_HEARTBEAT_INTERVAL 1       /** Seconds after which an idle replica is sent a heartbeat. */
+#define DB_REPLICA_RETRY_INTERVAL 1             /** Seconds a replica waits before connecting to its primary again. */
+#define DB_REPLICA_TIMEOUT 5                    /** Seconds without a frame from its primary after which a replica reconnects. */
+#define DB_REPLICA_SAVE_CHANGES 1024            /** Changes a replica applies between saves of the offset applied. */
+#define DB_REPLICATION_PATH "/_db/replication"  /** A database GET of this path reports the replication status. */
+
+#define DB_MAX_INLINE_ITEM_SIZE 1000            /** The largest key and value stored in a database page; NDBM pages hold 1 KiB. Larger values go to BLOB_DIR. */
+
+#define DEFAULT_UPLOAD_GROUP_MS 10              /** The default milliseconds the first upload of a group waits for others before the group is synced. */
+#define MAX_UPLOAD_GROUP_MS 1000                /** The most milliseconds the first upload of a group waits for others before the group is synced. */
+#define DEFAULT_UPLOAD_GROUP_WRITES NUM_CHILD_PROCESSES /** The default number of uploads waiting at which a group is synced at once; each worker waits on one. */
+#define UPLOAD_GROUP_POLL_MS 1                  /** Milliseconds the upload flusher sleeps between checks of whether a group is full. */
+
+#define DEFAULT_MAX_ENTITY_BODY_SIZE 1073741824 /** The default largest request entity body accepted, in bytes. */
+
+#define MAX_AUX_PROCESSES 7                   /** The maximum number of auxiliary processes spawned beside the worker processes. */
+#define STORAGE_MAINTENANCE_INTERVAL 5        /** Seconds between runs of storage engine maintenance. */
+
 #define FOR_EACH_CHILD_c_IN_CHILD_PIDS for (size_t c = 0; c < NUM_CHILD_PROCESSES; ++c) /** For each loop macro for looping over child processes. */
 #define FOR_EACH_SOCKET_POLLFD_p_IN_POLLFDS for (size_t p = 2; p < POLLFDS_SIZE; ++p)   /** For each loop macro for looping over socket pollfds. */
 
@@ -92,6 +195,8 @@ enum StatusCodes
     ACCEPTED_202,
     NULL_203,
     NO_CONTENT_204,
+    NULL_205,
+    PARTIAL_CONTENT_206,
     MOVED_PERMANENTLY_301     = 301,
     MOVED_TEMPORARILY_302,
     NULL_303,
@@ -101,12 +206,31 @@ enum StatusCodes
     NULL_402,
     FORBIDDEN_403,
     NOT_FOUND_404,
+    LENGTH_REQUIRED_411       = 411,
+    REQUEST_ENTITY_TOO_LARGE_413 = 413,
+    REQUESTED_RANGE_NOT_SATISFIABLE_416 = 416,
+    EXPECTATION_FAILED_417,
     INTERNAL_SERVER_ERROR_500 = 500,
     NOT_IMPLEMENTED_501,
     BAD_GATEWAY_502,
     SERVICE_UNAVAILABLE_503
 };
 
+/** Which entry of a full read cache set is evicted to make room for another. */
+enum db_cache_policy
+{
+    DB_CACHE_LRU, // The least recently read or written.
+    DB_CACHE_FIFO // The least recently filled.
+};
+
+/** How an uploaded file is made durable before the upload is acknowledged. */
+enum upload_durability
+{
+    UPLOAD_DURABILITY_NONE,    // Left to the operating system to write back.
+    UPLOAD_DURABILITY_REQUEST, // Synced by the worker, file and directory, before it responds.
+    UPLOAD_DURABILITY_GROUP    // Synced by the upload flusher, with every other upload waiting, in one sync.
+};
+
 /**
  * core_object
  * <p>
@@ -120,27 +244,206 @@ struct core_object
 {
     TRACER_FUNCTION_AS(tracer);
     
-    struct error_saver    err;
-    struct memory_manager *mm;
-    struct sockaddr_in    listen_addr;
+    struct error_saver          err;
+    struct memory_manager       *mm;
+    struct sockaddr_in          listen_addr;
+    const struct storage_engine *storage;
+    size_t                      num_db_shards;
+    size_t                      db_cache_size;
+    size_t                      db_cache_entry_size;
+    enum db_cache_policy        db_cache_policy;
+    size_t                      db_bloom_size;
+    size_t                      db_snapshot_writes;
+    size_t                      db_index_size;
+    size_t                      db_write_queue_size;
+    const char                  *db_changelog_socket; // NULL if database changes are not logged.
+    const char                  *db_primary_socket;   // NULL unless this server is a replica.
+    enum upload_durability      upload_durability;
+    size_t                      upload_group_ms;
+    size_t                      upload_group_writes;
+    bool                        upload_addressed;     // Set if uploaded files are stored under their digests.
+    size_t                      max_entity_body_size; // 0 if request entity bodies are not limited.
     
     struct state_object *so;
 };
 
+/**
+ * A database handle kept open by a process between requests. The state is owned by the storage engine.
+ */
+struct db_handle
+{
+    void     *state;     // NULL if the database is not open.
+    uint64_t generation; // The database generation at which the database was opened.
+};
+
+/**
+ * Database state shared by all processes, one for each database shard.
+ */
+struct db_shared
+{
+    uint64_t             generation; // Read under the shard read lock, written under the write lock.
+    uint64_t             version;    // Bumped by every write; read under the read lock, written under the write lock.
+    struct rw_lock_state lock;
+};
+
+/**
+ * A database shard: one database file, holding the keys that hash to it, with its own lock.
+ */
+struct db_shard
+{
+    char             name[DB_SHARD_NAME_SIZE];
+    struct rw_lock   lock;
+    struct db_shared *shared;
+    struct db_handle handle;
+    bool             compact_pending; // Set in the storage maintenance process until a requested compaction is done.
+};
+
+/**
+ * The database read cache: a set-associative cache of database values by key, in memory shared by all processes.
+ * Reads take no lock; each entry carries a version that is odd while the entry is being written, and a read that
+ * sees the version change retries from the database.
+ */
+struct db_cache
+{
+    struct db_cache_shared *shared;     // NULL if the cache is disabled.
+    size_t                 map_size;
+    size_t                 num_sets;
+    size_t                 slot_size;   // Bytes from one entry to the next.
+    size_t                 entry_size;  // The largest key and value an entry holds.
+    enum db_cache_policy   policy;
+};
+
+/**
+ * The database key Bloom filter: a bit array in memory shared by all processes, in which every key in the database
+ * sets DB_BLOOM_HASHES bits. A key with any of its bits clear is certainly not in the database, so the read is
+ * answered without taking the shard lock. Bits are only ever set, so keys are never removed.
+ */
+struct db_bloom
+{
+    struct db_bloom_shared *shared;   // NULL if the filter is disabled.
+    size_t                 map_size;
+    size_t                 num_bits;
+};
+
+/**
+ * The database snapshots: immutable files holding every key and value in the database with a perfect-hash index,
+ * published by the snapshot publisher process and mapped by every process that reads. Reads of the latest snapshot
+ * take no lock. Keys written since it was started are marked in a delta table in memory shared by all processes,
+ * and only those are read from the shards.
+ */
+struct db_snapshot
+{
+    struct db_snapshot_shared *shared;     // NULL if snapshots are disabled.
+    size_t                    map_size;
+    size_t                    num_slots;   // Entries of the delta table; a power of two.
+    uint8_t                   *data;       // The snapshot mapped by this process; NULL if none is.
+    size_t                    data_size;
+    uint64_t                  generation;  // The generation of the mapped snapshot.
+};
+
+/**
+ * The database ordered key index: a skiplist of every key in the database, in an arena in memory shared by all
+ * processes, so that the keys under a prefix are listed in order without scanning the database. Readers take no
+ * lock; writers insert one at a time under a semaphore, linking each node only once it is complete. Nodes are
+ * never freed, so a reader never follows a link into reused memory; the node of a removed key is flagged instead.
+ */
+struct db_index
+{
+    struct db_index_shared *shared;     // NULL if the index is disabled.
+    size_t                 map_size;
+    size_t                 arena_size;  // Bytes of the arena holding the nodes.
+    sem_t                  *mutex;      // Held by the process inserting a key.
+};
+
+/**
+ * The database write queue: a ring buffer of upserts in memory shared by all processes, filled by the workers
+ * and applied in batches by the database writer process.
+ */
+struct db_write_queue
+{
+    struct db_write_queue_shared *shared;  // NULL if upserts are not queued.
+    size_t                       map_size;
+    size_t                       capacity; // Bytes of records the ring buffer holds.
+    sem_t                        *mutex;   // Protects the ends of the ring buffer.
+    sem_t                        *items;   // Counts the records queued.
+    sem_t                        *space;   // Posted when records are applied, for workers waiting for room.
+    sem_t                        *done[NUM_CHILD_PROCESSES]; // Posted when an upsert waited on by a worker is applied.
+};
+
+/**
+ * The database change log: every upsert and removal of a key, appended to one file in the order each shard applied
+ * them, and served to replicas over a Unix socket by the change log server process.
+ */
+struct db_changelog
+{
+    struct db_changelog_shared *shared; // NULL if changes are not logged.
+    int                        fd;      // The change log, opened for appending before the processes are forked.
+};
+
+/**
+ * The state of a replica: how far it has applied the change log of its primary, in memory shared by all processes.
+ * It is written only by the replicator process, which applies the changes.
+ */
+struct db_replica
+{
+    struct db_replica_shared *shared;         // NULL unless this server is a replica.
+    const char               *primary_socket; // The socket on which the primary serves its change log.
+    const char               *offset_path;    // The file to which the offset applied is saved, to resume from.
+    bool                     waiting;         // Set in the replicator while it cannot reach the primary.
+};
+
+/**
+ * The upload flusher: workers publishing uploads under group commit wait on it, and it syncs the file system once
+ * for the whole group of uploads waiting.
+ */
+struct upload_flusher
+{
+    struct upload_flusher_shared *shared;  // NULL unless uploads are group committed.
+    int                          dir_fd;   // The write directory, through which its file system is synced.
+    sem_t                        *mutex;   // Protects the uploads waiting.
+    sem_t                        *pending; // Counts the uploads waiting to be synced.
+    sem_t                        *done[NUM_CHILD_PROCESSES]; // Posted when the group of a worker's upload is synced.
+};
+
+/**
+ * An auxiliary process, forked beside the worker processes to run a task periodically.
+ */
+struct aux_process
+{
+    const char   *name;
+    int          (*run_once)(struct core_object *co, struct state_object *so);
+    unsigned int interval; // Seconds to sleep between runs.
+    pid_t        pid;
+};
+
 /**
  * Contains information about the program state.
  */
 struct state_object
 {
-    pid_t                child_pids[NUM_CHILD_PROCESSES];
-    int                  domain_fds[2];
-    int                  c_to_p_pipe_fds[2];
-    sem_t                *domain_sems[2];
-    sem_t                *c_to_p_pipe_sem_write;
-    sem_t                *db_sem;
+    pid_t                 child_pids[NUM_CHILD_PROCESSES];
+    int                   domain_fds[2];
+    int                   c_to_p_pipe_fds[2];
+    sem_t                 *domain_sems[2];
+    sem_t                 *c_to_p_pipe_sem_write;
+    struct db_shard       db_shards[MAX_DB_SHARDS];
+    size_t                num_db_shards;
+    struct db_shared      *db_shared; // The shared state of every shard, in one mapping.
+    struct db_cache       db_cache;
+    struct db_bloom       db_bloom;
+    struct db_snapshot    db_snapshot;
+    struct db_index       db_index;
+    struct db_write_queue db_write_queue;
+    struct db_changelog   db_changelog;
+    struct db_replica     db_replica;
+    struct upload_flusher upload_flusher;
+    struct aux_process    aux_processes[MAX_AUX_PROCESSES];
+    size_t                num_aux_processes;
     
-    struct parent_struct *parent;
-    struct child_struct  *child;
+    struct parent_struct  *parent;
+    struct child_struct   *child;
+    size_t                child_index; // The index of this worker process in child_pids; set in workers.
+    struct aux_process    *aux; // The auxiliary process run by this process; NULL in the parent and workers.
 };
 
 /**
@@ -154,7 +457,8 @@ struct parent_struct
 };
 
 /**
- * Contains information about the child state.
+ * Contains information about the child state: the connection being served, cleared before each request. State
+ * kept by a worker between requests belongs in the state object.
  */
 struct child_struct
 {
@@ -197,6 +501,10 @@ struct http_request
     size_t num_extension_headers;
     struct http_header **extension_headers;
     char               *entity_body;
+    size_t             entity_body_size;
+    int                client_fd;          // The connection from which the request was read.
+    bool               entity_body_unread; // The entity body is left on client_fd, for the method to accept.
+    bool               entity_body_chunked; // The entity body is sent in chunks, its size unknown until it ends.
 };
 
 /**
@@ -209,6 +517,18 @@ struct http_status_line
     const char *reason_phrase;
 };
 
+/**
+ * HTTP Response entity body. The body is held in memory in data. If fd is not 0, the body is instead
+ * size bytes of the file fd starting at offset, which will be sent directly from the file.
+ */
+struct http_entity_body
+{
+    char   *data;
+    size_t size;
+    int    fd;
+    off_t  offset;
+};
+
 /**s
  * HTTP Response.
  */
@@ -216,7 +536,7 @@ struct http_response
 {
     struct http_status_line status_line;
     struct http_header **headers;
-    const char *entity_body;
+    const struct http_entity_body *entity_body;
 };
 
 #endif //PROCESS_SERVER_OBJECTS_H
@@ -17,7 +17,8 @@ struct state_object *setup_process_state(struct memory_manager *mm);
  * open_pipe_semaphores_domain_sockets_database
  * <p>
  * Open the domain socket and set up the semaphores for controlling access to the child-parent pipe,
- * the domain socket, and the log file.
+ * the domain socket, and the log file. Set up the database shards and the database read cache
+ * shared by all processes.
  * </p>
  * @param co the core object
  * @param so the state object
@@ -25,11 +26,27 @@ struct state_object *setup_process_state(struct memory_manager *mm);
  */
 int open_pipe_semaphores_domain_sockets_database(struct core_object *co, struct state_object *so);
 
+/**
+ * register_aux_process
+ * <p>
+ * Register an auxiliary process to be forked beside the child processes. The process runs a task, then sleeps for
+ * an interval, until it is signalled to end.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param name the name of the process, printed when it starts and ends
+ * @param run_once the task, which returns 0 on success, -1 and sets err on failure
+ * @param interval the seconds to sleep between runs of the task
+ * @return 0 on success, -1 and set errno on failure
+ */
+int register_aux_process(struct core_object *co, struct state_object *so, const char *name,
+                         int (*run_once)(struct core_object *, struct state_object *), unsigned int interval);
+
 /**
  * fork_child_processes
  * <p>
- * Fork the main process into the specified number of child processes. Save the child pids. Setup the parent in the
- * parent process and the children in the child processes.
+ * Fork the main process into the specified number of child processes and the registered auxiliary processes. Save
+ * the child pids. Setup the parent in the parent process and the children in the child processes.
  * </p>
  * @param co the core object
  * @param so the state object
@@ -62,6 +79,17 @@ void p_destroy_parent_state(struct core_object *co, struct state_object *so, str
  */
 void c_destroy_child_state(struct core_object *co, struct state_object *so, struct child_struct *child);
 
+/**
+ * a_destroy_aux_state
+ * <p>
+ * Perform actions necessary to close an auxiliary process: close the database handle, the database lock, and the
+ * shared database state.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ */
+void a_destroy_aux_state(struct core_object *co, struct state_object *so);
+
 /**
  * close_fd_report_undefined_error
  * <p>
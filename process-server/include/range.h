@@ -0,0 +1,85 @@
+#ifndef HTTP_SERVER_RANGE_H
+#define HTTP_SERVER_RANGE_H
+
+#include "objects.h"
+
+#include <time.h>
+
+#define MAX_BYTE_RANGES 16 /** The maximum number of ranges honoured in a Range header; more are ignored. */
+
+/**
+ * A range of bytes in an entity. Both first and last are inclusive.
+ */
+struct byte_range
+{
+    off_t first;
+    off_t last;
+};
+
+/**
+ * get_applicable_range
+ * <p>
+ * Get the Range header of a request if it applies to an entity last modified at last_modified. The Range header
+ * does not apply if an If-Range header is present and the entity has been modified since the If-Range date.
+ * </p>
+ * @param req the request
+ * @param last_modified the time at which the entity was last modified
+ * @return the Range header if present and applicable, NULL otherwise
+ */
+struct http_header *get_applicable_range(struct http_request *req, time_t last_modified);
+
+/**
+ * parse_range_header
+ * <p>
+ * Parse the value of a Range header into byte ranges of an entity of size entity_size. Suffix ranges ("-500")
+ * and open-ended ranges ("9500-") are resolved against the entity size and ranges are clipped to the entity.
+ * Ranges that overlap or touch are merged, as RFC 7233 allows, and the ranges are returned in the order of the
+ * entity, so that together they never hold more than the entity.
+ * </p>
+ * @param value the value of the Range header
+ * @param entity_size the size of the entity
+ * @param ranges the array into which to parse the satisfiable ranges
+ * @return the number of satisfiable ranges, 0 if no range is satisfiable, -1 if the header is malformed or
+ * has more than MAX_BYTE_RANGES ranges and should be ignored
+ */
+int parse_range_header(const char *value, off_t entity_size, struct byte_range ranges[MAX_BYTE_RANGES]);
+
+/**
+ * range_assemble_response_innards
+ * <p>
+ * Assemble the innards of a 206 Partial Content Response. The range source is the file fd if fd is not 0,
+ * otherwise the entity in data. A single range from a file is sent directly from the file; multiple ranges
+ * are assembled into a multipart/byteranges body.
+ * </p>
+ * @param co the core object
+ * @param ranges the satisfiable ranges
+ * @param num_ranges the number of ranges
+ * @param entity_size the size of the whole entity
+ * @param entity_type the content type of the entity
+ * @param fd the file holding the entity, or 0; it is closed with the entity body
+ * @param data the entity if not in a file
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @param entity_body pointer to the entity body for the response
+ * @return 0 on success, -1 and set err on failure
+ */
+int range_assemble_response_innards(struct core_object *co, const struct byte_range *ranges, size_t num_ranges,
+                                    off_t entity_size, const char *entity_type, int fd, const char *data,
+                                    size_t *status, struct http_header ***headers,
+                                    struct http_entity_body *entity_body);
+
+/**
+ * range_not_satisfiable_response_innards
+ * <p>
+ * Assemble the innards of a 416 Requested Range Not Satisfiable Response.
+ * </p>
+ * @param co the core object
+ * @param entity_size the size of the whole entity
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @return 0 on success, -1 and set err on failure
+ */
+int range_not_satisfiable_response_innards(struct core_object *co, off_t entity_size, size_t *status,
+                                           struct http_header ***headers);
+
+#endif //HTTP_SERVER_RANGE_H
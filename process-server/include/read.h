@@ -15,4 +15,34 @@
  */
 int read_request(int fd, struct http_request * req, struct core_object * co);
 
+/**
+ * accept_entity_body
+ * <p>
+ * Accepts the entity body that read_request left unread, once the method has validated the request. A client
+ * waiting for 100 Continue is sent it, then the entity body is read, unless the method streams it from the
+ * connection itself. A chunked entity body is decoded as it is read. A method that rejects a request answers it
+ * without accepting the entity body, so the body is never sent or read. errno is EMSGSIZE if a chunked entity body
+ * is larger than the maximum, and EBADMSG if its chunks are malformed.
+ * </p>
+ * @param req the request.
+ * @param streamed whether the method streams the entity body from the connection rather than having it read.
+ * @param co the core object.
+ * @return 0 on success, -1 on failure.
+ */
+int accept_entity_body(struct http_request * req, bool streamed, struct core_object * co);
+
+/**
+ * read_chunk_header
+ * <p>
+ * Reads the size line of the next chunk of a chunked entity body from a client connection, first reading the CRLF
+ * that ends the data of the chunk before. After the last chunk, of size 0, the trailer is read and ignored. errno is
+ * EBADMSG if the chunk is malformed, or if the size line or a trailer line is longer than CHUNK_LINE_MAX.
+ * </p>
+ * @param fd the client connection.
+ * @param first whether this is the first chunk of the entity body.
+ * @param size set to the size of the data of the chunk, which the caller reads next.
+ * @return 0 on success, -1 on failure.
+ */
+int read_chunk_header(int fd, bool first, size_t * size);
+
 #endif //HTTP_SERVER_READ_H
@@ -16,6 +16,6 @@
  * @return 0 on success, -1 and set err on failure
  */
 int assemble_send_response(struct core_object *co, int socket_fd,
-                           size_t status, struct http_header **headers, const char *entity_body);
+                           size_t status, struct http_header **headers, const struct http_entity_body *entity_body);
 
 #endif //HTTP_SERVER_RESPONSE_H
@@ -0,0 +1,113 @@
+#ifndef HTTP_SERVER_RW_LOCK_H
+#define HTTP_SERVER_RW_LOCK_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * The state of a reader/writer lock. Must be in memory shared by all processes using the lock.
+ */
+struct rw_lock_state
+{
+    unsigned int     readers;             // Protected by readers_mutex.
+    unsigned int     writers;             // Protected by writers_mutex; includes waiting writers.
+    _Atomic uint64_t read_acquisitions;
+    _Atomic uint64_t read_contentions;    // Read acquisitions that had to wait.
+    _Atomic uint64_t write_acquisitions;
+    _Atomic uint64_t write_contentions;   // Write acquisitions that had to wait.
+};
+
+/**
+ * A writer-preferring reader/writer lock shared between processes. Any number of readers may hold the lock at
+ * once; a writer holds it alone. Once a writer is waiting, new readers wait behind it, so writers do not starve.
+ */
+struct rw_lock
+{
+    sem_t                *read_try;      // Held by writers to keep new readers out.
+    sem_t                *resource;      // Held by a writer, or by the readers as a group.
+    sem_t                *readers_mutex;
+    sem_t                *writers_mutex;
+    struct rw_lock_state *state;
+};
+
+/**
+ * open_rw_lock
+ * <p>
+ * Open the named semaphores of a reader/writer lock, creating them if they do not exist. The semaphore names
+ * are name_prefix followed by a suffix for each semaphore. The shared state of the lock is initialized.
+ * </p>
+ * @param lock the lock to open
+ * @param name_prefix the prefix of the semaphore names, beginning with '/'
+ * @param state the shared state of the lock
+ * @return 0 on success, -1 and set errno on failure
+ */
+int open_rw_lock(struct rw_lock *lock, const char *name_prefix, struct rw_lock_state *state);
+
+/**
+ * close_rw_lock
+ * <p>
+ * Close the named semaphores of a reader/writer lock.
+ * </p>
+ * @param lock the lock to close
+ */
+void close_rw_lock(struct rw_lock *lock);
+
+/**
+ * unlink_rw_lock
+ * <p>
+ * Unlink the named semaphores of a reader/writer lock.
+ * </p>
+ * @param name_prefix the prefix of the semaphore names
+ */
+void unlink_rw_lock(const char *name_prefix);
+
+/**
+ * acquire_read_lock
+ * <p>
+ * Acquire a reader/writer lock for reading, waiting while a writer holds it or is waiting for it.
+ * </p>
+ * @param lock the lock
+ * @return 0 on success, -1 and set errno on failure
+ */
+int acquire_read_lock(struct rw_lock *lock);
+
+/**
+ * release_read_lock
+ * <p>
+ * Release a reader/writer lock held for reading.
+ * </p>
+ * @param lock the lock
+ */
+void release_read_lock(struct rw_lock *lock);
+
+/**
+ * acquire_write_lock
+ * <p>
+ * Acquire a reader/writer lock for writing, waiting until no other process holds it.
+ * </p>
+ * @param lock the lock
+ * @return 0 on success, -1 and set errno on failure
+ */
+int acquire_write_lock(struct rw_lock *lock);
+
+/**
+ * release_write_lock
+ * <p>
+ * Release a reader/writer lock held for writing.
+ * </p>
+ * @param lock the lock
+ */
+void release_write_lock(struct rw_lock *lock);
+
+/**
+ * print_rw_lock_stats
+ * <p>
+ * Print the number of acquisitions of a reader/writer lock and how many of them had to wait.
+ * </p>
+ * @param name the name of the lock to print
+ * @param lock the lock
+ */
+void print_rw_lock_stats(const char *name, struct rw_lock *lock);
+
+#endif //HTTP_SERVER_RW_LOCK_H
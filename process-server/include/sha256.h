@@ -0,0 +1,52 @@
+#ifndef HTTP_SERVER_SHA256_H
+#define HTTP_SERVER_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32                   /** Size of a SHA-256 digest in bytes. */
+#define SHA256_HEX_LEN (SHA256_DIGEST_SIZE * 2) /** Length of a SHA-256 digest in hexadecimal. */
+#define SHA256_BLOCK_SIZE 64                    /** Size of a block hashed at a time. */
+
+/**
+ * The state of a SHA-256 hash computed a piece at a time.
+ */
+struct sha256_context
+{
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t  block[SHA256_BLOCK_SIZE];
+    size_t   block_size;
+};
+
+/**
+ * sha256_init
+ * <p>
+ * Start a SHA-256 hash.
+ * </p>
+ * @param ctx the hash context
+ */
+void sha256_init(struct sha256_context *ctx);
+
+/**
+ * sha256_update
+ * <p>
+ * Add data to a SHA-256 hash.
+ * </p>
+ * @param ctx the hash context
+ * @param data the data
+ * @param size the size of the data
+ */
+void sha256_update(struct sha256_context *ctx, const void *data, size_t size);
+
+/**
+ * sha256_final_hex
+ * <p>
+ * Finish a SHA-256 hash and write its digest in lowercase hexadecimal, NUL terminated.
+ * </p>
+ * @param ctx the hash context
+ * @param hex the buffer into which to write the digest
+ */
+void sha256_final_hex(struct sha256_context *ctx, char hex[SHA256_HEX_LEN + 1]);
+
+#endif //HTTP_SERVER_SHA256_H
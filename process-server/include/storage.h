@@ -0,0 +1,100 @@
+#ifndef HTTP_SERVER_STORAGE_H
+#define HTTP_SERVER_STORAGE_H
+
+#include "objects.h"
+
+/**
+ * A storage engine behind the database functions. Each database shard is a database of the engine; each process
+ * keeps its own state for the engine on a shard in its handle on the shard. The database functions call fetch with
+ * the shard lock held for reading, and upsert, remove and commit with it held for writing.
+ */
+struct storage_engine
+{
+    const char *name;
+    
+    /**
+     * Create the database if it does not exist. Called by the parent before the child processes are forked.
+     * Returns 0 on success, -1 and sets errno on failure.
+     */
+    int (*create)(const char *db_name);
+    
+    /**
+     * Fetch the value of a key. The value points into memory of the engine, valid until the next call to the
+     * engine. Returns 0 if found, 1 if not found, -1 and sets err on failure.
+     */
+    int (*fetch)(struct core_object *co, struct db_shard *shard, datum *key, datum *value);
+    
+    /**
+     * Insert or replace the value of a key. Returns 0 if the key was inserted, 1 if it was replaced, -1 and sets
+     * err on failure.
+     */
+    int (*upsert)(struct core_object *co, struct db_shard *shard, datum *key, datum *value);
+    
+    /**
+     * Remove a key and its value. Returns 0 if the key was removed, 1 if it was not found, -1 and sets err on
+     * failure.
+     */
+    int (*remove)(struct core_object *co, struct db_shard *shard, datum *key);
+    
+    /**
+     * Make the upserts and removals of this process on a shard visible to the other processes. Called once after a
+     * batch of them, with the shard lock still held for writing. NULL if they are visible as soon as they return.
+     */
+    void (*commit)(struct core_object *co, struct db_shard *shard);
+    
+    /**
+     * Call visit with every key in a shard and its value, in no particular order. The key and value point into
+     * memory of the engine, valid until visit returns. visit returns 0 to go on, 1 to stop, or -1 and sets err on
+     * failure. Called with the shard lock held for reading. Returns 0 on success, -1 and sets err on failure.
+     */
+    int (*iterate)(struct core_object *co, struct db_shard *shard,
+                   int (*visit)(struct core_object *co, datum *key, datum *value, void *arg), void *arg);
+    
+    /**
+     * Close the handle of this process on a shard.
+     */
+    void (*close)(struct core_object *co, struct db_shard *shard);
+    
+    /**
+     * Do background maintenance, such as compaction, on a shard. Called periodically by the storage maintenance
+     * process without the shard lock held; the engine takes the lock as it needs it. NULL if the engine needs no
+     * maintenance. Returns 0 on success, -1 and sets err on failure.
+     */
+    int (*maintain)(struct core_object *co, struct db_shard *shard);
+
+    /**
+     * Rebuild a shard from its live records, dropping the space left by replaced and removed values, and switch
+     * every process over to the rebuilt shard. Called by the storage maintenance process when compaction is
+     * requested, without the shard lock held; reads are not blocked while the records are copied. NULL if the
+     * engine cannot compact. Returns 0 if the shard was compacted, 1 if it was written too often during the copy
+     * and should be tried again later, -1 and sets err on failure.
+     */
+    int (*compact)(struct core_object *co, struct db_shard *shard);
+};
+
+/** The NDBM storage engine. */
+extern const struct storage_engine ndbm_storage_engine;
+
+/** The log-structured storage engine: append-only segment files with an in-memory hash index. */
+extern const struct storage_engine log_storage_engine;
+
+/**
+ * get_storage_engine
+ * <p>
+ * Get a storage engine by name.
+ * </p>
+ * @param name the name of the engine
+ * @return the engine, or NULL if there is no engine with the name
+ */
+const struct storage_engine *get_storage_engine(const char *name);
+
+/**
+ * get_storage_engines
+ * <p>
+ * Get the list of all storage engines, terminated by NULL.
+ * </p>
+ * @return the list of storage engines
+ */
+const struct storage_engine *const *get_storage_engines(void);
+
+#endif //HTTP_SERVER_STORAGE_H
@@ -0,0 +1,184 @@
+#ifndef HTTP_SERVER_UPLOAD_H
+#define HTTP_SERVER_UPLOAD_H
+
+#include "objects.h"
+#include "sha256.h"
+
+#include <stdio.h>
+
+/**
+ * A file being uploaded to the write directory. The body is streamed into a temporary file beside the path of the
+ * file, then renamed into place whole, so that readers never see part of it. If uploads are content-addressed, the
+ * body is hashed as it streams in, the file is moved into the blob store under its digest, and a symbolic link to
+ * the blob is renamed into place instead. A database value is uploaded the same way, straight into the blob store.
+ */
+struct upload
+{
+    char                  path[BUFSIZ];
+    char                  temp_path[BUFSIZ];
+    int                   fd;        // The temporary file, which holds the body once published; -1 once closed.
+    size_t                size;      // The bytes received so far.
+    bool                  published;
+    bool                  hashed;    // The upload is content-addressed, or is a database value.
+    struct sha256_context sha;       // The hash of the bytes received, if the upload is hashed.
+    char                  digest[SHA256_HEX_LEN + 1]; // The digest, once a hashed upload is published.
+};
+
+/**
+ * open_upload
+ * <p>
+ * Start an upload of a file to the write directory under a URI, creating the directory of the file if need be.
+ * </p>
+ * @param co the core object
+ * @param upload the upload to open
+ * @param uri the URI of the file
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_upload(struct core_object *co, struct upload *upload, const char *uri);
+
+/**
+ * open_db_value_upload
+ * <p>
+ * Start an upload of a database value into a temporary file of the blob store, so that a value of any size is
+ * received without being held in memory.
+ * </p>
+ * @param co the core object
+ * @param upload the upload to open
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_db_value_upload(struct core_object *co, struct upload *upload);
+
+/**
+ * receive_upload
+ * <p>
+ * Move part of the body of an upload from the client connection into the temporary file, in chunks of bounded
+ * size, so that the memory of the process does not grow with the size of the body. A hashed upload is read through
+ * a buffer, to be hashed on its way to the file.
+ * </p>
+ * @param co the core object
+ * @param upload the upload
+ * @param socket_fd the client connection
+ * @param size the number of bytes to receive
+ * @return 0 on success, -1 and set err on failure
+ */
+int receive_upload(struct core_object *co, struct upload *upload, int socket_fd, size_t size);
+
+/**
+ * write_upload
+ * <p>
+ * Append part of the body of an upload that is already in memory to the temporary file, hashing it if the upload is
+ * hashed.
+ * </p>
+ * @param co the core object
+ * @param upload the upload
+ * @param data the bytes to append
+ * @param size the number of bytes to append
+ * @return 0 on success, -1 and set err on failure
+ */
+int write_upload(struct core_object *co, struct upload *upload, const void *data, size_t size);
+
+/**
+ * publish_upload
+ * <p>
+ * Rename the temporary file of an upload into place, or the link to its blob if uploads are content-addressed,
+ * replacing any file at its path in one step, and make it as
+ * durable as the durability of uploads asks before returning: not at all, synced by this process, or synced by the
+ * upload flusher with the rest of its group. Must be called from a worker process.
+ * </p>
+ * @param co the core object
+ * @param upload the upload
+ * @return 0 if the file was created, 1 if a file was replaced, -1 and set err on failure
+ */
+int publish_upload(struct core_object *co, struct upload *upload);
+
+/**
+ * publish_db_value_upload
+ * <p>
+ * Move the temporary file of a database value upload into the blob store under its digest. The file stays open, and
+ * holds the value.
+ * </p>
+ * @param co the core object
+ * @param upload the upload
+ * @return 0 on success, -1 and set err on failure
+ */
+int publish_db_value_upload(struct core_object *co, struct upload *upload);
+
+/**
+ * close_upload
+ * <p>
+ * Close the file of an upload, removing its temporary file if it was not published.
+ * </p>
+ * @param upload the upload
+ */
+void close_upload(struct upload *upload);
+
+/**
+ * get_upload_etag
+ * <p>
+ * Get the entity tag of a file of the write directory: the digest of its contents, if it was uploaded while
+ * uploads were content-addressed.
+ * </p>
+ * @param path the path of the file
+ * @param etag set to the digest of the file, in hexadecimal
+ * @return 0 if the file has an entity tag, 1 if it does not
+ */
+int get_upload_etag(const char *path, char etag[SHA256_HEX_LEN + 1]);
+
+/**
+ * open_upload_flusher
+ * <p>
+ * Map the state of the upload flusher in memory shared between processes and open its semaphores. If enabled is
+ * false the flusher is left disabled. The flusher must be opened before the processes using it are forked, and
+ * after the write directory is created.
+ * </p>
+ * @param co the core object
+ * @param flusher the flusher to open
+ * @param enabled whether uploads are group committed
+ * @param sem_name_prefix the prefix of the flusher semaphore names
+ * @param shm_name the name of the shared memory object for the flusher
+ * @return 0 on success, -1 and set err on failure
+ */
+int open_upload_flusher(struct core_object *co, struct upload_flusher *flusher, bool enabled,
+                        const char *sem_name_prefix, const char *shm_name);
+
+/**
+ * close_upload_flusher
+ * <p>
+ * Close the semaphores of the upload flusher of this process and unmap its state.
+ * </p>
+ * @param flusher the flusher
+ */
+void close_upload_flusher(struct upload_flusher *flusher);
+
+/**
+ * unlink_upload_flusher
+ * <p>
+ * Unlink the semaphores of the upload flusher.
+ * </p>
+ * @param sem_name_prefix the prefix of the flusher semaphore names
+ */
+void unlink_upload_flusher(const char *sem_name_prefix);
+
+/**
+ * flush_uploads
+ * <p>
+ * Wait for an upload to be published, let its group fill for up to upload_group_ms or until upload_group_writes
+ * uploads wait, then sync the file system once and wake every worker of the group. If the wait is interrupted by a
+ * signal, sync whatever uploads are waiting and return. Run by the upload flusher process.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+int flush_uploads(struct core_object *co, struct state_object *so);
+
+/**
+ * print_upload_flusher_stats
+ * <p>
+ * Print how many uploads the upload flusher synced, and in how many groups.
+ * </p>
+ * @param flusher the flusher
+ */
+void print_upload_flusher_stats(struct upload_flusher *flusher);
+
+#endif //HTTP_SERVER_UPLOAD_H
@@ -10,17 +10,32 @@
 
 #define HTTP_TIME_LEN 256 // TODO: too big, could be more precise
 
+#define TEMP_SUFFIX ".XXXXXX" // Suffix of a file being written before it is renamed into place, replaced by mkstemp.
+
 /**
  * write_fully
  * <p>
- * writes data fully to a file descriptor.
+ * writes data fully to a file descriptor, which may be a socket or a file.
  * </p>
  * @param fd file descriptor to write to.
  * @param data data to write.
  * @param size size of data.
  * @return 0 on success. On failure -1 and set errno.
  */
-int write_fully(int fd, void * data, size_t size);
+int write_fully(int fd, const void * data, size_t size);
+
+/**
+ * join_path
+ * <p>
+ * joins two strings into a path, failing rather than cutting the path short.
+ * </p>
+ * @param path buffer to write the path to.
+ * @param size size of the buffer.
+ * @param head the start of the path.
+ * @param tail the end of the path.
+ * @return 0 on success. On failure -1 and set errno to ENAMETOOLONG.
+ */
+int join_path(char *path, size_t size, const char *head, const char *tail);
 
 /**
  * read_fully
@@ -34,6 +49,32 @@ int write_fully(int fd, void * data, size_t size);
  */
 int read_fully(int fd, void * data, size_t size);
 
+/**
+ * sendfile_fully
+ * <p>
+ * Sends a region of a file fully to a socket without copying it through user space.
+ * </p>
+ * @param socket_fd the socket to send to.
+ * @param file_fd the file to send from.
+ * @param offset the offset in the file at which to start.
+ * @param size the number of bytes to send.
+ * @return 0 on success. On failure -1 and set errno.
+ */
+int sendfile_fully(int socket_fd, int file_fd, off_t offset, size_t size);
+
+/**
+ * splice_fully
+ * <p>
+ * Moves data fully from a socket to a file in chunks of bounded size. On Linux the data is spliced through a pipe
+ * without copying it through user space; elsewhere it is copied through a buffer.
+ * </p>
+ * @param socket_fd the socket to read from.
+ * @param file_fd the file to write to.
+ * @param size the number of bytes to move.
+ * @return 0 on success. On failure -1 and set errno; ECONNRESET if the socket closed first.
+ */
+int splice_fully(int socket_fd, int file_fd, size_t size);
+
 /**
  * litlittok
  * <p>
@@ -77,6 +118,16 @@ char * rl_litlittok(char * str, char * sep);
  */
 char * to_lower(char * s);
 
+/**
+ * get_content_type
+ * <p>
+ * Gets the content type of an entity from the extension of its URI. The default is text/html.
+ * </p>
+ * @param uri the URI of the entity.
+ * @return the content type.
+ */
+const char *get_content_type(const char *uri);
+
 /**
  * get_header
  * <p>
@@ -121,6 +172,16 @@ void destroy_http_header(struct http_header * header, struct core_object * co);
  */
 void free_all_headers(struct core_object *co, struct http_header **headers);
 
+/**
+ * free_entity_body
+ * <p>
+ * Free the memory of an entity body and close its file, if any, then zero the entity body.
+ * </p>
+ * @param co the core object
+ * @param entity_body the entity body
+ */
+void free_entity_body(struct core_object *co, struct http_entity_body *entity_body);
+
 /**
  * free_http_data
  * <p>
@@ -130,7 +191,7 @@ void free_all_headers(struct core_object *co, struct http_header **headers);
  * @param headers the header list
  * @param entity_body the entity body
  */
-void free_http_data(struct core_object *co, struct http_header **headers, char *entity_body);
+void free_http_data(struct core_object *co, struct http_header **headers, struct http_entity_body *entity_body);
 
 /**
  * strtosize_t
@@ -0,0 +1,405 @@
+#include "../include/compress.h"
+#include "../include/sha256.h"
+#include "../include/util.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ZLIB_CONST /** Make zlib input pointers const. */
+#include <zlib.h>
+
+// NOLINTBEGIN(modernize-macro-to-enum) : Macros are fine.
+#define COMPRESS_CHUNK_SIZE 16384  /** The number of bytes compressed at a time. */
+#define GZIP_WINDOW_BITS (15 + 16) /** zlib window bits for a gzip wrapper. */
+#define DEFLATE_WINDOW_BITS 15     /** zlib window bits for a zlib wrapper, which HTTP calls deflate. */
+#define DEFLATE_MEM_LEVEL 8        /** zlib default memory level. */
+#define QVALUE_MAX 1000            /** Quality value 1.000, in thousandths. */
+// NOLINTEND(modernize-macro-to-enum)
+
+#define GZIP_SUFFIX ".gz"          /** Suffix of gzip variants and precompressed siblings. */
+#define DEFLATE_SUFFIX ".zz"       /** Suffix of deflate variants. */
+
+/**
+ * Content types which are already compressed, by prefix.
+ */
+static const char *const compressed_content_types[] = {
+        "image/png", "image/jpeg", "image/gif", "image/webp", "video/", "audio/", "font/woff",
+        "application/zip", "application/gzip", "application/pdf", "application/octet-stream"
+};
+
+/**
+ * parse_qvalue
+ * <p>
+ * Parse the quality value of one element of an Accept-Encoding header, in thousandths.
+ * </p>
+ * @param params the parameters of the element, following the coding, or NULL
+ * @return the quality value, QVALUE_MAX if there is none
+ */
+static int parse_qvalue(const char *params);
+
+/**
+ * open_fresh_variant
+ * <p>
+ * Open a variant file if it exists and is fresh: modified after last_modified or, if not strictly_newer,
+ * at last_modified. Fill the entity body with the file.
+ * </p>
+ * @param path the path of the variant
+ * @param last_modified the time at which the entity was last modified
+ * @param strictly_newer whether a variant modified at last_modified is stale
+ * @param entity_body the entity body to fill
+ * @return 0 if the entity body was filled, 1 if the variant is missing or stale
+ */
+static int open_fresh_variant(const char *path, time_t last_modified, bool strictly_newer,
+                              struct http_entity_body *entity_body);
+
+/**
+ * compress_into_cache
+ * <p>
+ * Compress an entity into a temporary file beside cache_path, then rename it into place so that no reader
+ * ever sees a partial variant.
+ * </p>
+ * @param co the core object
+ * @param coding the content coding
+ * @param cache_path the path of the variant in the cache
+ * @param fd the file holding the entity, or 0
+ * @param data the entity if not in a file
+ * @param size the size of the entity
+ * @return 0 on success, -1 and set err on failure
+ */
+static int compress_into_cache(struct core_object *co, enum content_coding coding, const char *cache_path,
+                               int fd, const char *data, size_t size);
+
+/**
+ * deflate_to_fd
+ * <p>
+ * Compress an entity with zlib a chunk at a time and write the result to a file.
+ * </p>
+ * @param coding the content coding
+ * @param out_fd the file to which to write
+ * @param fd the file holding the entity, or 0
+ * @param data the entity if not in a file
+ * @param size the size of the entity
+ * @return 0 on success, -1 on failure
+ */
+static int deflate_to_fd(enum content_coding coding, int out_fd, int fd, const char *data, size_t size);
+
+enum content_coding negotiate_content_coding(struct http_request *req)
+{
+    struct http_header  *accept_encoding;
+    char                *codings;
+    char                *element;
+    char                *params;
+    char                *save;
+    int                 qvalues[3] = {0, -1, -1}; // Identity, gzip, deflate; -1 if not listed.
+    int                 wildcard;
+    enum content_coding chosen;
+    
+    accept_encoding = get_header(H_ACCEPT_ENCODING, req->extension_headers, req->num_extension_headers);
+    if (!accept_encoding)
+    {
+        return CODING_IDENTITY;
+    }
+    
+    codings = strdup(accept_encoding->value);
+    if (!codings)
+    {
+        return CODING_IDENTITY;
+    }
+    
+    // Format: 1#( codings [ ";" "q" "=" qvalue ] )
+    wildcard = -1;
+    for (element = strtok_r(codings, ",", &save); element; element = strtok_r(NULL, ",", &save))
+    {
+        params = strchr(element, ';');
+        if (params)
+        {
+            *params++ = '\0';
+        }
+        element = trim_whitespace(element);
+        
+        if (strcasecmp(element, "gzip") == 0 || strcasecmp(element, "x-gzip") == 0)
+        {
+            qvalues[CODING_GZIP] = parse_qvalue(params);
+        } else if (strcasecmp(element, "deflate") == 0)
+        {
+            qvalues[CODING_DEFLATE] = parse_qvalue(params);
+        } else if (strcmp(element, "*") == 0)
+        {
+            wildcard = parse_qvalue(params);
+        }
+    }
+    free(codings);
+    
+    // The wildcard covers any coding not listed explicitly.
+    for (size_t c = CODING_GZIP; c <= CODING_DEFLATE; ++c)
+    {
+        if (qvalues[c] == -1)
+        {
+            qvalues[c] = (wildcard == -1) ? 0 : wildcard;
+        }
+    }
+    
+    chosen = CODING_IDENTITY;
+    if (qvalues[CODING_GZIP] > 0 && qvalues[CODING_GZIP] >= qvalues[CODING_DEFLATE])
+    {
+        chosen = CODING_GZIP;
+    } else if (qvalues[CODING_DEFLATE] > 0)
+    {
+        chosen = CODING_DEFLATE;
+    }
+    
+    return chosen;
+}
+
+static int parse_qvalue(const char *params)
+{
+    const char *q;
+    int        qvalue;
+    int        scale;
+    
+    if (!params || !(q = strchr(params, '=')))
+    {
+        return QVALUE_MAX;
+    }
+    
+    // Format: ( "0" [ "." 0*3DIGIT ] ) | ( "1" [ "." 0*3("0") ] )
+    for (++q; isspace((unsigned char) *q); ++q);
+    if (*q != '0' && *q != '1')
+    {
+        return QVALUE_MAX;
+    }
+    qvalue = (*q++ - '0') * QVALUE_MAX;
+    if (*q == '.')
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Decimal places
+        for (++q, scale = QVALUE_MAX / 10; scale && isdigit((unsigned char) *q); ++q, scale /= 10)
+        {
+            qvalue += (*q - '0') * scale;
+        }
+    }
+    
+    return (qvalue > QVALUE_MAX) ? QVALUE_MAX : qvalue;
+}
+
+const char *content_coding_name(enum content_coding coding)
+{
+    switch (coding)
+    {
+        case CODING_GZIP:
+        {
+            return "gzip";
+        }
+        case CODING_DEFLATE:
+        {
+            return "deflate";
+        }
+        case CODING_IDENTITY:
+        default:
+        {
+            return NULL;
+        }
+    }
+}
+
+bool is_compressible(const char *content_type, size_t size)
+{
+    if (size < COMPRESSION_MIN_SIZE)
+    {
+        return false;
+    }
+    
+    for (size_t t = 0; t < sizeof(compressed_content_types) / sizeof(compressed_content_types[0]); ++t)
+    {
+        if (strncmp(content_type, compressed_content_types[t], strlen(compressed_content_types[t])) == 0)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+int get_compressed_variant(struct core_object *co, enum content_coding coding, const char *cache_key,
+                           const char *sibling_path, time_t last_modified, int fd, const char *data, size_t size,
+                           struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char                  variant_path[BUFSIZ];
+    const char            *suffix;
+    struct sha256_context sha;
+    char                  digest[SHA256_HEX_LEN + 1];
+    
+    suffix = (coding == CODING_GZIP) ? GZIP_SUFFIX : DEFLATE_SUFFIX;
+    
+    // A precompressed sibling, if present, is served as is. gzip -k gives it the mtime of the entity.
+    if (sibling_path && coding == CODING_GZIP && join_path(variant_path, BUFSIZ, sibling_path, GZIP_SUFFIX) == 0
+        && open_fresh_variant(variant_path, last_modified, false, entity_body) == 0)
+    {
+        return 0;
+    }
+    
+    // The variant is named by the digest of its key, so that no key, however long or full of "..", names a path
+    // outside CACHE_DIR.
+    sha256_init(&sha);
+    sha256_update(&sha, cache_key, strlen(cache_key));
+    sha256_final_hex(&sha, digest);
+    (void) snprintf(variant_path, BUFSIZ, "%s/%.2s/%s%s", CACHE_DIR, digest, digest, suffix);
+    // A cached variant compressed in the same second as the entity was modified may predate the modification.
+    if (open_fresh_variant(variant_path, last_modified, true, entity_body) == 1)
+    {
+        if (compress_into_cache(co, coding, variant_path, fd, data, size) == -1)
+        {
+            return -1;
+        }
+        if (open_fresh_variant(variant_path, last_modified, false, entity_body) == 1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+    }
+    
+    // An incompressible entity is still cached so that it is not compressed again, but it is not sent.
+    if (entity_body->size >= size)
+    {
+        free_entity_body(co, entity_body);
+        return 1;
+    }
+    
+    return 0;
+}
+
+static int open_fresh_variant(const char *path, time_t last_modified, bool strictly_newer,
+                              struct http_entity_body *entity_body)
+{
+    struct stat st;
+    int         fd;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 1;
+    }
+    
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || difftime(st.st_mtime, last_modified) < 0
+        || (strictly_newer && difftime(st.st_mtime, last_modified) <= 0))
+    {
+        close(fd);
+        return 1;
+    }
+    
+    entity_body->fd     = fd;
+    entity_body->offset = 0;
+    entity_body->size   = (size_t) st.st_size;
+    
+    return 0;
+}
+
+static int compress_into_cache(struct core_object *co, enum content_coding coding, const char *cache_path,
+                               int fd, const char *data, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char temp_path[BUFSIZ];
+    char *last_slash;
+    int  temp_fd;
+    
+    // Create the directories of the variant.
+    strlcpy(temp_path, cache_path, BUFSIZ);
+    last_slash = strrchr(temp_path, '/');
+    if (last_slash)
+    {
+        *last_slash = '\0';
+        if (create_dir(temp_path) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+    }
+    
+    if (join_path(temp_path, BUFSIZ, cache_path, TEMP_SUFFIX) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    temp_fd = mkstemp(temp_path);
+    if (temp_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if (deflate_to_fd(coding, temp_fd, fd, data, size) == -1 || rename(temp_path, cache_path) == -1)
+    {
+        SET_ERROR(co->err);
+        close(temp_fd);
+        unlink(temp_path);
+        return -1;
+    }
+    
+    close(temp_fd);
+    
+    return 0;
+}
+
+static int deflate_to_fd(enum content_coding coding, int out_fd, int fd, const char *data, size_t size)
+{
+    z_stream      zs;
+    unsigned char in[COMPRESS_CHUNK_SIZE];
+    unsigned char out[COMPRESS_CHUNK_SIZE];
+    size_t        consumed;
+    size_t        chunk_size;
+    int           flush;
+    int           status;
+    
+    memset(&zs, 0, sizeof(z_stream));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     (coding == CODING_GZIP) ? GZIP_WINDOW_BITS : DEFLATE_WINDOW_BITS,
+                     DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    consumed = 0;
+    do
+    {
+        chunk_size = (size - consumed < COMPRESS_CHUNK_SIZE) ? size - consumed : COMPRESS_CHUNK_SIZE;
+        if (fd)
+        {
+            if (pread(fd, in, chunk_size, (off_t) consumed) != (ssize_t) chunk_size)
+            {
+                deflateEnd(&zs);
+                return -1;
+            }
+            zs.next_in = in;
+        } else
+        {
+            zs.next_in = (const unsigned char *) data + consumed;
+        }
+        zs.avail_in = (uInt) chunk_size;
+        consumed += chunk_size;
+        flush = (consumed == size) ? Z_FINISH : Z_NO_FLUSH;
+        
+        // Drain the compressor into the file until it needs more input.
+        do
+        {
+            zs.next_out  = out;
+            zs.avail_out = COMPRESS_CHUNK_SIZE;
+            status = deflate(&zs, flush);
+            if (status == Z_STREAM_ERROR
+                || write_fully(out_fd, out, COMPRESS_CHUNK_SIZE - zs.avail_out) == -1)
+            {
+                deflateEnd(&zs);
+                return -1;
+            }
+        } while (zs.avail_out == 0);
+    } while (flush != Z_FINISH);
+    
+    deflateEnd(&zs);
+    
+    return 0;
+}
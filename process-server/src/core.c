@@ -1,18 +1,56 @@
 #include "../include/core.h"
 #include "../include/manager.h"
+#include "../include/storage.h"
 
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define OPTS_LIST "i:p:t"
-#define USAGE_MESSAGE                                                   \
-    "\nusage: ./http-server -i <ip address> [-p <port number>] [-t]\n"  \
-    "\t-i <ip address>, run the server at this ip address.\n"           \
-    "\t[-p <port number>], run the server at this port number;"         \
-    "\n\t\tif not specified, default port is 80.\n"                     \
+#define OPTS_LIST "ab:c:d:e:f:g:i:l:m:n:o:p:r:s:tu:w:x:"
+#define USAGE_MESSAGE                                                                                           \
+    "\nusage: ./http-server -i <ip address> [-p <port number>] [-s <storage>] [-n <shards>]"                    \
+    " [-c <cache size>] [-m <cache entry size>] [-e <cache policy>] [-b <filter size>] [-r <snapshot writes>]"  \
+    " [-o <index size>] [-w <write queue size>] [-l <change log socket>] [-f <primary socket>]"                 \
+    " [-d <durability>] [-g <group ms>] [-u <group writes>] [-a] [-x <max body size>] [-t]\n"                   \
+    "\t-i <ip address>, run the server at this ip address.\n"                                                   \
+    "\t[-p <port number>], run the server at this port number;"                                                 \
+    "\n\t\tif not specified, default port is 80.\n"                                                             \
+    "\t[-s <storage>], store the database with this storage engine, ndbm or log;"                               \
+    "\n\t\tif not specified, default storage engine is ndbm.\n"                                                 \
+    "\t[-n <shards>], split the database into this many shards, from 1 to 64;"                                  \
+    "\n\t\tif not specified, default is 1. Use the same number every run on a database.\n"                      \
+    "\t[-c <cache size>], cache database reads in this many bytes of shared memory, 0 to disable;"              \
+    "\n\t\tif not specified, default is 8388608.\n"                                                             \
+    "\t[-m <cache entry size>], cache keys and values of up to this many bytes together;"                       \
+    "\n\t\tif not specified, default is 4096.\n"                                                                \
+    "\t[-e <cache policy>], evict the least recently used (lru) or filled (fifo) cache entry;"                  \
+    "\n\t\tif not specified, default is lru.\n"                                                                 \
+    "\t[-b <filter size>], rule out missing keys with a Bloom filter of this many bytes, 0 to disable;"         \
+    "\n\t\tif not specified, default is 1048576.\n"                                                             \
+    "\t[-r <snapshot writes>], read from a database snapshot republished after this many writes, 0 to disable;" \
+    "\n\t\tif not specified, default is 0.\n"                                                                   \
+    "\t[-o <index size>], list database keys in order from an index of this many bytes, 0 to disable;"          \
+    "\n\t\tif not specified, default is 67108864.\n"                                                            \
+    "\t[-w <write queue size>], queue database writes in this many bytes for a writer process;"                 \
+    "\n\t\tif not specified, default is 0, which has the workers write themselves.\n"                           \
+    "\t[-l <change log socket>], log database changes and serve them to replicas on this Unix socket;"          \
+    "\n\t\tif not specified, changes are not logged.\n"                                                         \
+    "\t[-f <primary socket>], replicate the primary serving its change log on this socket, refusing writes;"    \
+    "\n\t\tif not specified, the server is not a replica.\n"                                                    \
+    "\t[-d <durability>], sync uploaded files before responding: none, request (each alone) or group;"          \
+    "\n\t\tif not specified, default is none.\n"                                                                \
+    "\t[-g <group ms>], with group durability, sync a group once its first upload has waited this long;"        \
+    "\n\t\tif not specified, default is 10.\n"                                                                  \
+    "\t[-u <group writes>], with group durability, sync a group when this many uploads wait, up to 8;"          \
+    "\n\t\tif not specified, default is 8.\n"                                                                   \
+    "\t[-a], optionally store each uploaded file once, under the SHA-256 digest of its contents,"               \
+    "\n\t\tlinked to from every URI it is uploaded to.\n"                                                       \
+    "\t[-x <max body size>], refuse request entity bodies larger than this many bytes, 0 to disable;"           \
+    "\n\t\tif not specified, default is 1073741824.\n"                                                          \
     "\t[-t], optionally trace the execution of the program.\n\n"
 
 /**
@@ -65,6 +103,31 @@ static int parse_ip_and_port(struct sockaddr_in *addr, const char *port_num_str,
  */
 static int validate_port(in_port_t *port_num, const char *port_num_str, TRACER_FUNCTION_AS(tracer));
 
+/**
+ * validate_num_db_shards
+ * <p>
+ * Validate a number of database shards. Store it in the core object if valid.
+ * </p>
+ * @param co the core object
+ * @param num_db_shards_str the number of shards argument
+ * @return 0 on success, -1 on failure
+ */
+static int validate_num_db_shards(struct core_object *co, const char *num_db_shards_str);
+
+/**
+ * validate_size
+ * <p>
+ * Validate a size in bytes within a range. Store it if valid.
+ * </p>
+ * @param co the core object
+ * @param size the size
+ * @param size_str the size argument
+ * @param min the smallest valid size
+ * @param max the largest valid size
+ * @return 0 on success, -1 on failure
+ */
+static int validate_size(struct core_object *co, size_t *size, const char *size_str, size_t min, size_t max);
+
 /**
  * validate_ip
  * <p>
@@ -106,26 +169,211 @@ static int parse_args(struct core_object *co, int argc, char **argv)
     
     port_num_str = NULL;
     ip_addr_str  = NULL;
+    co->storage              = get_storage_engines()[0];
+    co->num_db_shards        = DEFAULT_DB_SHARDS;
+    co->db_cache_size        = DEFAULT_DB_CACHE_SIZE;
+    co->db_cache_entry_size  = DEFAULT_DB_CACHE_ENTRY_SIZE;
+    co->db_cache_policy      = DB_CACHE_LRU;
+    co->db_bloom_size        = DEFAULT_DB_BLOOM_SIZE;
+    co->db_snapshot_writes   = DEFAULT_DB_SNAPSHOT_WRITES;
+    co->db_index_size        = DEFAULT_DB_INDEX_SIZE;
+    co->db_write_queue_size  = DEFAULT_DB_WRITE_QUEUE_SIZE;
+    co->upload_durability    = UPLOAD_DURABILITY_NONE;
+    co->upload_group_ms      = DEFAULT_UPLOAD_GROUP_MS;
+    co->upload_group_writes  = DEFAULT_UPLOAD_GROUP_WRITES;
+    co->upload_addressed     = false;
+    co->max_entity_body_size = DEFAULT_MAX_ENTITY_BODY_SIZE;
     
     while ((c = getopt(argc, argv, OPTS_LIST)) != -1) // NOLINT(concurrency-mt-unsafe) : No threads here
     {
         switch (c)
         {
+            case 'a':
+            {
+                co->upload_addressed = true;
+                break;
+            }
+            case 'b':
+            {
+                if (validate_size(co, &co->db_bloom_size, optarg, 0, SIZE_MAX) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'c':
+            {
+                if (validate_size(co, &co->db_cache_size, optarg, 0, SIZE_MAX) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'd':
+            {
+                if (strcmp(optarg, "none") == 0)
+                {
+                    co->upload_durability = UPLOAD_DURABILITY_NONE;
+                } else if (strcmp(optarg, "request") == 0)
+                {
+                    co->upload_durability = UPLOAD_DURABILITY_REQUEST;
+                } else if (strcmp(optarg, "group") == 0)
+                {
+                    co->upload_durability = UPLOAD_DURABILITY_GROUP;
+                } else
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stderr, "Unknown durability \'%s\'.\n", optarg);
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'e':
+            {
+                if (strcmp(optarg, "lru") == 0)
+                {
+                    co->db_cache_policy = DB_CACHE_LRU;
+                } else if (strcmp(optarg, "fifo") == 0)
+                {
+                    co->db_cache_policy = DB_CACHE_FIFO;
+                } else
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stderr, "Unknown cache policy \'%s\'.\n", optarg);
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'f':
+            {
+                co->db_primary_socket = optarg;
+                break;
+            }
+            case 'g':
+            {
+                if (validate_size(co, &co->upload_group_ms, optarg, 0, MAX_UPLOAD_GROUP_MS) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
             case 'i':
             {
                 ip_addr_str = optarg;
                 break;
             }
+            case 'l':
+            {
+                co->db_changelog_socket = optarg;
+                break;
+            }
+            case 'm':
+            {
+                if (validate_size(co, &co->db_cache_entry_size, optarg, 1, MAX_DB_CACHE_ENTRY_SIZE) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'n':
+            {
+                if (validate_num_db_shards(co, optarg) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'o':
+            {
+                if (validate_size(co, &co->db_index_size, optarg, 0, SIZE_MAX) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
             case 'p':
             {
                 port_num_str = optarg;
                 break;
             }
+            case 'r':
+            {
+                if (validate_size(co, &co->db_snapshot_writes, optarg, 0, MAX_DB_SNAPSHOT_WRITES) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 's':
+            {
+                co->storage = get_storage_engine(optarg);
+                if (!co->storage)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stderr, "Unknown storage engine \'%s\'.\n", optarg);
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
             case 't':
             {
                 co->tracer = trace_reporter;
                 break;
             }
+            case 'u':
+            {
+                if (validate_size(co, &co->upload_group_writes, optarg, 1, NUM_CHILD_PROCESSES) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
+            case 'w':
+            {
+                if (validate_size(co, &co->db_write_queue_size, optarg, 0, SIZE_MAX) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                if (co->db_write_queue_size && co->db_write_queue_size < MIN_DB_WRITE_QUEUE_SIZE)
+                {
+                    co->db_write_queue_size = MIN_DB_WRITE_QUEUE_SIZE;
+                }
+                break;
+            }
+            case 'x':
+            {
+                if (validate_size(co, &co->max_entity_body_size, optarg, 0, SIZE_MAX) == -1)
+                {
+                    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+                    (void) fprintf(stdout, USAGE_MESSAGE);
+                    return -1;
+                }
+                break;
+            }
             case '?':
             {
                 if (isprint(optopt))
@@ -216,6 +464,53 @@ static int validate_port(in_port_t *port_num, const char *port_num_str, TRACER_F
     return 0;
 }
 
+static int validate_num_db_shards(struct core_object *co, const char *num_db_shards_str)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char *end;
+    long parsed_num_db_shards;
+    
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+    parsed_num_db_shards = strtol(num_db_shards_str, &end, 10);
+    
+    if (*end != '\0' || parsed_num_db_shards < 1 || parsed_num_db_shards > MAX_DB_SHARDS)
+    {
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stderr, "%s is not a valid number of database shards\n", num_db_shards_str);
+        return -1;
+    }
+    
+    co->num_db_shards = (size_t) parsed_num_db_shards;
+    
+    return 0;
+}
+
+static int validate_size(struct core_object *co, size_t *size, const char *size_str, size_t min, size_t max)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char               *end;
+    unsigned long long parsed_size;
+    
+    errno = 0;
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+    parsed_size = strtoull(size_str, &end, 10);
+    
+    if (*size_str == '-' || end == size_str || *end != '\0' || errno == ERANGE || parsed_size < min
+        || parsed_size > max)
+    {
+        // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+        (void) fprintf(stderr, "%s is not a valid size\n", size_str);
+        errno = 0;
+        return -1;
+    }
+    
+    *size = (size_t) parsed_size;
+    
+    return 0;
+}
+
 static int validate_ip(struct sockaddr_in *addr, const char *ip_addr_str, TRACER_FUNCTION_AS(tracer))
 {
     PRINT_STACK_TRACE(tracer);
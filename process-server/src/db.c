@@ -1,96 +1,576 @@
 #include "../include/db.h"
+#include "../include/db_blob.h"
+#include "../include/db_bloom.h"
+#include "../include/db_cache.h"
+#include "../include/db_changelog.h"
+#include "../include/db_index.h"
+#include "../include/db_record.h"
+#include "../include/db_snapshot.h"
 #include "../include/manager.h"
+#include "../include/storage.h"
 #include "../include/util.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#define DB_FNV_OFFSET 2166136261U                  /** FNV-1a offset basis. */
+#define DB_FNV_PRIME 16777619U                     /** FNV-1a prime. */
+#define DB_FNV_64_OFFSET 14695981039346656037ULL   /** 64-bit FNV-1a offset basis. */
+#define DB_FNV_64_PRIME 1099511628211ULL           /** 64-bit FNV-1a prime. */
+#define DB_MIX_1 0xff51afd7ed558ccdULL             /** First multiplier of the MurmurHash3 finalizer. */
+#define DB_MIX_2 0xc4ceb9fe1a85ec53ULL             /** Second multiplier of the MurmurHash3 finalizer. */
+#define DB_MIX_SHIFT 33                            /** Shift of the MurmurHash3 finalizer. */
+#define DB_SHARD_HASH_SHIFT 16                     /** The key hash is shifted right by this before picking a shard. */
+
 /**
- * create_split_dir
+ * upsert_db_meta
  * <p>
- * For URIs that are long as, split the URI to create the directories necessary to store the file.
+ * Store the metadata record of a value just upserted into a database shard, beside it in the same shard. Values
+ * that are not records, such as legacy values, get no metadata record. The shard lock must be held for writing.
  * </p>
  * @param co the core object
- * @param new_dir_path the directory path
- * @param save_dir the save directory
+ * @param shard the shard
+ * @param key the key of the value
+ * @param value the value
  * @return 0 on success, -1 and set err on failure
  */
-static int create_split_dir(struct core_object *co, char *new_dir_path, const char *save_dir);
+static int upsert_db_meta(struct core_object *co, struct db_shard *shard, const datum *key, const datum *value);
+
+/**
+ * expire_db_item
+ * <p>
+ * Remove an item from a database shard, with its metadata record, if its metadata record says it has expired. The
+ * shard lock must be held for writing.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key of the item
+ * @param now the current time
+ * @return 0 if the item was removed, 1 if it has not expired or is not in the shard, -1 and set err on failure
+ */
+static int expire_db_item(struct core_object *co, struct db_shard *shard, datum *key, time_t now);
+
+/**
+ * remove_db_item
+ * <p>
+ * Remove an item from a database shard, with its metadata record. The removal is marked in the snapshot delta
+ * table, the item is dropped from the read cache and the ordered key index, and the removal is appended to the
+ * change log; the item stays in the Bloom filter, whose bits are never cleared. The shard lock must be held for
+ * writing.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key of the item
+ * @param meta_key the key of the metadata record of the item
+ * @return 0 if the item was removed, 1 if it is not in the shard, -1 and set err on failure
+ */
+static int remove_db_item(struct core_object *co, struct db_shard *shard, datum *key, datum *meta_key);
 
-int db_upsert(struct core_object *co, const char *db_name, sem_t *sem, datum *key, datum *value)
+int open_db_shards(struct core_object *co, struct state_object *so, const char *db_name, size_t num_shards,
+                   const char *lock_name_prefix, const char *shm_name)
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    int status;
-    int ret_val;
-    DBM *db;
+    int             shm_fd;
+    void            *shm;
+    struct db_shard *shard;
+    char            lock_name[DB_SHARD_NAME_SIZE];
     
-    if (sem_wait(sem) == -1)
+    if (num_shards == 0 || num_shards > MAX_DB_SHARDS)
     {
+        errno = EINVAL;
         SET_ERROR(co->err);
         return -1;
     }
-    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
-    db     = dbm_open(db_name, DB_FLAGS, DB_FILE_MODE);
-    if (db == (DBM *) 0)
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
     {
         SET_ERROR(co->err);
-        sem_post(sem);
         return -1;
     }
-    status = dbm_store(db, *key, *value, DBM_INSERT);
-    ret_val = status; // ret_val will be 1, 0, or -1
-    if (status == 1)
+    shm_unlink(shm_name);
+    
+    // The shared state is mapped for every possible shard, so that it is unmapped the same way however many opened.
+    if (ftruncate(shm_fd, (off_t) (MAX_DB_SHARDS * sizeof(struct db_shared))) == -1)
     {
-        status = dbm_store(db, *key, *value, DBM_REPLACE);
+        SET_ERROR(co->err);
+        close(shm_fd);
+        return -1;
     }
-    dbm_close(db);
-    // NOLINTEND(concurrency-mt-unsafe) : Protected
-    sem_post(sem);
     
-    if (status == -1) // If an error occurred in the insert or replace.
+    shm = mmap(NULL, MAX_DB_SHARDS * sizeof(struct db_shared), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
     {
-        print_db_error(db);
-        ret_val = -1;
+        SET_ERROR(co->err);
+        return -1;
+    }
+    so->db_shared     = (struct db_shared *) shm;
+    so->num_db_shards = 0;
+    
+    for (size_t s = 0; s < num_shards; ++s)
+    {
+        shard = &so->db_shards[s];
+        memset(shard, 0, sizeof(struct db_shard));
+        if (num_shards == 1)
+        {
+            (void) snprintf(shard->name, sizeof(shard->name), "%s", db_name);
+        } else
+        {
+            (void) snprintf(shard->name, sizeof(shard->name), "%s_%zu", db_name, s);
+        }
+        (void) snprintf(lock_name, sizeof(lock_name), "%s_%zu", lock_name_prefix, s);
+        shard->shared             = &so->db_shared[s];
+        shard->shared->generation = 0;
+        shard->shared->version    = 0;
+        
+        if (open_rw_lock(&shard->lock, lock_name, &shard->shared->lock) == -1)
+        {
+            SET_ERROR(co->err);
+            close_db_shards(co, so);
+            unlink_db_shards(lock_name_prefix, s);
+            return -1;
+        }
+        ++so->num_db_shards;
+        
+        // Create the database now so that readers, which may open it concurrently, never race to create it.
+        if (co->storage->create(shard->name) == -1)
+        {
+            SET_ERROR(co->err);
+            close_db_shards(co, so);
+            unlink_db_shards(lock_name_prefix, s + 1);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+void close_db_shards(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    for (size_t s = 0; s < so->num_db_shards; ++s)
+    {
+        close_db_handle(co, &so->db_shards[s]);
+        close_rw_lock(&so->db_shards[s].lock);
+    }
+    if (so->db_shared)
+    {
+        munmap(so->db_shared, MAX_DB_SHARDS * sizeof(struct db_shared));
+        so->db_shared = NULL;
+    }
+    so->num_db_shards = 0;
+}
+
+void unlink_db_shards(const char *lock_name_prefix, size_t num_shards)
+{
+    char lock_name[DB_SHARD_NAME_SIZE];
+    
+    for (size_t s = 0; s < num_shards; ++s)
+    {
+        (void) snprintf(lock_name, sizeof(lock_name), "%s_%zu", lock_name_prefix, s);
+        unlink_rw_lock(lock_name);
+    }
+}
+
+uint32_t hash_db_key(const datum *key)
+{
+    const uint8_t *bytes;
+    uint32_t      hash;
+    
+    // FNV-1a.
+    bytes = (const uint8_t *) key->dptr;
+    hash  = DB_FNV_OFFSET;
+    for (size_t i = 0; i < (size_t) key->dsize; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= DB_FNV_PRIME;
+    }
+    
+    return hash;
+}
+
+uint64_t hash_db_key_64(const datum *key)
+{
+    const uint8_t *bytes;
+    uint64_t      hash;
+    
+    bytes = (const uint8_t *) key->dptr;
+    hash  = DB_FNV_64_OFFSET;
+    for (size_t i = 0; i < (size_t) key->dsize; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= DB_FNV_64_PRIME;
+    }
+    
+    hash ^= hash >> DB_MIX_SHIFT;
+    hash *= DB_MIX_1;
+    hash ^= hash >> DB_MIX_SHIFT;
+    hash *= DB_MIX_2;
+    hash ^= hash >> DB_MIX_SHIFT;
+    
+    return hash;
+}
+
+struct db_shard *get_db_shard(struct state_object *so, const datum *key)
+{
+    // The high bits pick the shard, leaving the low bits to spread the keys of a shard within it.
+    return &so->db_shards[(hash_db_key(key) >> DB_SHARD_HASH_SHIFT) % so->num_db_shards];
+}
+
+int db_upsert(struct core_object *co, struct db_shard *shard, datum *key, datum *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int ret_val;
+    
+    if (db_upsert_batch(co, shard, 1, key, value, &ret_val) == -1)
+    {
+        return -1;
     }
     
     return ret_val;
 }
 
-int safe_dbm_fetch(struct core_object *co, const char *db_name, sem_t *sem, datum *key, uint8_t **serial_buffer)
+int db_upsert_batch(struct core_object *co, struct db_shard *shard, size_t num_items, datum *keys, datum *values,
+                    int *results)
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    int   ret_val;
-    DBM   *db;
+    if (acquire_write_lock(&shard->lock) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    for (size_t i = 0; i < num_items; ++i)
+    {
+        db_bloom_add(&co->so->db_bloom, &keys[i]);
+        db_snapshot_mark(&co->so->db_snapshot, &keys[i]);
+        results[i] = co->storage->upsert(co, shard, &keys[i], &values[i]);
+        if (results[i] != -1)
+        {
+            ++shard->shared->version;
+            db_cache_update(&co->so->db_cache, &keys[i], &values[i]);
+            
+            // The value is in storage whatever fails after, so its change is logged first; a change missing from
+            // the change log would never reach the replicas.
+            if (append_db_change(co, &co->so->db_changelog, DB_CHANGE_UPSERT, &keys[i], &values[i]) == -1)
+            {
+                results[i] = -1;
+            }
+            
+            // A key missing from the index would be left out of listings, so the write fails with it.
+            if (db_index_add(co, &co->so->db_index, &keys[i]) == -1)
+            {
+                results[i] = -1;
+            }
+            
+            // A value whose metadata record could not be written would be described by stale metadata.
+            if (upsert_db_meta(co, shard, &keys[i], &values[i]) == -1)
+            {
+                results[i] = -1;
+            }
+        }
+    }
+    if (co->storage->commit)
+    {
+        co->storage->commit(co, shard);
+    }
+    release_write_lock(&shard->lock);
+    
+    return 0;
+}
+
+int safe_dbm_fetch(struct core_object *co, struct db_shard *shard, datum *key, uint8_t **serial_buffer,
+                   size_t *serial_buffer_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int ret_val;
+    
+    if (db_fetch_batch(co, shard, 1, key, serial_buffer, serial_buffer_size, &ret_val) == -1)
+    {
+        return -1;
+    }
+    
+    return ret_val;
+}
+
+int db_fetch_batch(struct core_object *co, struct db_shard *shard, size_t num_items, datum *keys,
+                   uint8_t **serial_buffers, size_t *serial_buffer_sizes, int *results)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    bool  locked;
     datum value;
     
-    if (sem_wait(sem) == -1)
+    locked = false;
+    for (size_t i = 0; i < num_items; ++i)
+    {
+        results[i] = db_cache_fetch(co, &co->so->db_cache, &keys[i], &serial_buffers[i], &serial_buffer_sizes[i]);
+        if (results[i] != 1)
+        {
+            continue;
+        }
+        
+        // A key the filter rules out is certainly not in the shard, so the shard is not touched.
+        if (!db_bloom_may_contain(&co->so->db_bloom, &keys[i]))
+        {
+            continue;
+        }
+        
+        // A key not written since the latest snapshot was started is read from the snapshot, without taking the lock.
+        results[i] = db_snapshot_fetch(co, &co->so->db_snapshot, &keys[i], &serial_buffers[i],
+                                       &serial_buffer_sizes[i]);
+        if (results[i] != DB_SNAPSHOT_MISS)
+        {
+            continue;
+        }
+        
+        if (!locked)
+        {
+            if (acquire_read_lock(&shard->lock) == -1)
+            {
+                SET_ERROR(co->err);
+                for (size_t f = 0; f < i; ++f)
+                {
+                    if (results[f] == 0)
+                    {
+                        mm_free(co->mm, serial_buffers[f]);
+                    }
+                    results[f] = -1;
+                }
+                return -1;
+            }
+            locked = true;
+        }
+        results[i] = co->storage->fetch(co, shard, &keys[i], &value);
+        if (results[i] == 0)
+        {
+            results[i] = copy_dptr_to_buffer(co, &serial_buffers[i], &value);
+            serial_buffer_sizes[i] = (size_t) value.dsize;
+            db_cache_fill(&co->so->db_cache, &keys[i], &value);
+        } else if (results[i] == 1)
+        {
+            db_bloom_false_positive(&co->so->db_bloom);
+        }
+    }
+    if (locked)
+    {
+        release_read_lock(&shard->lock);
+    }
+    
+    return 0;
+}
+
+int db_expire_batch(struct core_object *co, struct db_shard *shard, size_t num_items, datum *keys, time_t now,
+                    int *results)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (acquire_write_lock(&shard->lock) == -1)
     {
         SET_ERROR(co->err);
         return -1;
     }
-    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
-    db = dbm_open(db_name, DB_FLAGS, DB_FILE_MODE);
-    if (db == (DBM *) 0)
+    for (size_t i = 0; i < num_items; ++i)
+    {
+        results[i] = expire_db_item(co, shard, &keys[i], now);
+    }
+    if (co->storage->commit)
+    {
+        co->storage->commit(co, shard);
+    }
+    release_write_lock(&shard->lock);
+    
+    return 0;
+}
+
+int db_remove(struct core_object *co, struct db_shard *shard, datum *key)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    datum meta_key;
+    int   ret_val;
+    
+    meta_key.dptr = mm_malloc((size_t) key->dsize + 1, co->mm);
+    if (!meta_key.dptr)
     {
         SET_ERROR(co->err);
-        sem_post(sem);
         return -1;
     }
-    value = dbm_fetch(db, (*key));
-    if (!value.dptr && dbm_error(db))
+    meta_key.dsize = (int) make_db_meta_key(key->dptr, (size_t) key->dsize, meta_key.dptr);
+    
+    if (acquire_write_lock(&shard->lock) == -1)
+    {
+        SET_ERROR(co->err);
+        mm_free(co->mm, meta_key.dptr);
+        return -1;
+    }
+    ret_val = remove_db_item(co, shard, key, &meta_key);
+    if (co->storage->commit)
+    {
+        co->storage->commit(co, shard);
+    }
+    release_write_lock(&shard->lock);
+    
+    mm_free(co->mm, meta_key.dptr);
+    
+    return ret_val;
+}
+
+int db_fetch_meta(struct core_object *co, struct db_shard *shard, const datum *key, uint8_t **serial_buffer,
+                  size_t *serial_buffer_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    datum meta_key;
+    int   ret_val;
+    
+    meta_key.dptr = mm_malloc((size_t) key->dsize + 1, co->mm);
+    if (!meta_key.dptr)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    meta_key.dsize = (int) make_db_meta_key(key->dptr, (size_t) key->dsize, meta_key.dptr);
+    
+    ret_val = safe_dbm_fetch(co, shard, &meta_key, serial_buffer, serial_buffer_size);
+    mm_free(co->mm, meta_key.dptr);
+    
+    return ret_val;
+}
+
+int db_iterate(struct core_object *co, struct db_shard *shard,
+               int (*visit)(struct core_object *co, datum *key, datum *value, void *arg), void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int ret_val;
+    
+    if (acquire_read_lock(&shard->lock) == -1)
     {
-        print_db_error(db);
+        SET_ERROR(co->err);
+        return -1;
     }
-    ret_val = copy_dptr_to_buffer(co, serial_buffer, &value);
-    dbm_close(db);
-    // NOLINTEND(concurrency-mt-unsafe) : Protected
-    sem_post(sem);
+    ret_val = co->storage->iterate(co, shard, visit, arg);
+    release_read_lock(&shard->lock);
     
     return ret_val;
 }
 
+int db_maintain(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (!co->storage->maintain)
+    {
+        return 0;
+    }
+    
+    return co->storage->maintain(co, shard);
+}
+
+int db_compact(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (!co->storage->compact)
+    {
+        return 0;
+    }
+    
+    return co->storage->compact(co, shard);
+}
+
+void invalidate_db_handles(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    ++shard->shared->generation;
+}
+
+void close_db_handle(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    co->storage->close(co, shard);
+}
+
+int encode_db_value(struct core_object *co, const datum *key, const uint8_t *body, size_t body_size,
+                    const char *content_type, const char *content_encoding, time_t expires, uint8_t **buffer,
+                    size_t *buffer_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_record record;
+    char             digest[SHA256_HEX_LEN + 1];
+    
+    record.mtime            = time(NULL);
+    record.expires          = expires;
+    record.flags            = DB_RECORD_CHECKSUM;
+    record.content_type     = content_type;
+    record.content_encoding = content_encoding;
+    record.body             = body;
+    record.body_size        = body_size;
+    
+    // A value too large for a database page goes to the blob store, and the record holds its digest.
+    if ((size_t) key->dsize + db_record_size(&record) > DB_MAX_INLINE_ITEM_SIZE)
+    {
+        if (store_db_blob(co, record.body, record.body_size, digest) == -1)
+        {
+            return -1;
+        }
+        return encode_db_blob_value(co, digest, content_type, content_encoding, expires, buffer, buffer_size);
+    }
+    
+    *buffer_size = db_record_size(&record);
+    *buffer      = mm_malloc(*buffer_size, co->mm);
+    if (!*buffer)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    encode_db_record(&record, *buffer);
+    
+    return 0;
+}
+
+int encode_db_blob_value(struct core_object *co, const char *digest, const char *content_type,
+                         const char *content_encoding, time_t expires, uint8_t **buffer, size_t *buffer_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_record record;
+    
+    record.mtime            = time(NULL);
+    record.expires          = expires;
+    record.flags            = DB_RECORD_CHECKSUM | DB_RECORD_BLOB;
+    record.content_type     = content_type;
+    record.content_encoding = content_encoding;
+    record.body             = (const uint8_t *) digest;
+    record.body_size        = SHA256_HEX_LEN;
+    
+    *buffer_size = db_record_size(&record);
+    *buffer      = mm_malloc(*buffer_size, co->mm);
+    if (!*buffer)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    encode_db_record(&record, *buffer);
+    
+    return 0;
+}
+
 int copy_dptr_to_buffer(struct core_object *co, uint8_t **buffer, datum *value)
 {
     PRINT_STACK_TRACE(co->tracer);
@@ -116,86 +596,131 @@ int copy_dptr_to_buffer(struct core_object *co, uint8_t **buffer, datum *value)
     return ret_val;
 }
 
-// NOLINTNEXTLINE(bugprone-easily-swappable-parameters)
-int write_to_dir(struct core_object *co, char *save_dir, const char *file_name, const char *data_buffer,
-                 size_t data_buf_size)
+static int upsert_db_meta(struct core_object *co, struct db_shard *shard, const datum *key, const datum *value)
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    char *save_file_name = NULL;
-    int  save_fd;
+    struct db_record record;
+    struct db_meta   meta;
+    char             digest[SHA256_HEX_LEN + 1];
+    size_t           value_size;
+    int              blob_fd;
+    datum            meta_key;
+    datum            meta_value;
+    int              ret_val;
     
-    if (set_string(&save_file_name, save_dir) == NULL)
+    if (is_db_meta_key(key->dptr, (size_t) key->dsize)
+        || decode_db_record((const uint8_t *) value->dptr, (size_t) value->dsize, &record) == -1
+        || (record.flags & (DB_RECORD_LEGACY | DB_RECORD_META)))
     {
-        SET_ERROR(co->err);
-        return -1;
+        return 0;
     }
-    if (append_string(&save_file_name, file_name) == NULL)
+    
+    // The record of a value in the blob store holds its digest, so the size of the value is the size of the blob.
+    value_size = record.body_size;
+    if ((record.flags & DB_RECORD_BLOB) && record.body_size == SHA256_HEX_LEN)
     {
-        SET_ERROR(co->err);
-        return -1;
+        memcpy(digest, record.body, SHA256_HEX_LEN);
+        digest[SHA256_HEX_LEN] = '\0';
+        if (open_db_blob(co, digest, &blob_fd, &value_size) != 0)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        close(blob_fd);
     }
+    make_db_meta(&record, value_size, &meta);
     
-    if (create_split_dir(co, save_file_name, save_dir) == -1)
+    meta_key.dptr    = mm_malloc((size_t) key->dsize + 1, co->mm);
+    meta_value.dsize = (int) db_meta_size(&meta);
+    meta_value.dptr  = mm_malloc((size_t) meta_value.dsize, co->mm);
+    if (!(meta_key.dptr && meta_value.dptr))
     {
         SET_ERROR(co->err);
+        mm_free(co->mm, meta_key.dptr);
+        mm_free(co->mm, meta_value.dptr);
         return -1;
     }
+    meta_key.dsize = (int) make_db_meta_key(key->dptr, (size_t) key->dsize, meta_key.dptr);
+    encode_db_meta(&meta, (uint8_t *) meta_value.dptr);
     
-    int ret_val;
-    
-    if (access(save_file_name, F_OK) == 0)
+    db_bloom_add(&co->so->db_bloom, &meta_key);
+    db_snapshot_mark(&co->so->db_snapshot, &meta_key);
+    ret_val = co->storage->upsert(co, shard, &meta_key, &meta_value);
+    if (ret_val != -1)
     {
-        ret_val = 1;
-    } else
-    {
-        ret_val = 0;
+        ++shard->shared->version;
+        db_cache_update(&co->so->db_cache, &meta_key, &meta_value);
     }
-    save_fd = open(save_file_name, O_CREAT | O_WRONLY | O_CLOEXEC | O_TRUNC, WR_DIR_FLAGS);
-    if (save_fd == -1)
+    
+    mm_free(co->mm, meta_key.dptr);
+    mm_free(co->mm, meta_value.dptr);
+    
+    return (ret_val == -1) ? -1 : 0;
+}
+
+static int expire_db_item(struct core_object *co, struct db_shard *shard, datum *key, time_t now)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    datum          meta_key;
+    datum          meta_value;
+    struct db_meta meta;
+    int            ret_val;
+    
+    meta_key.dptr = mm_malloc((size_t) key->dsize + 1, co->mm);
+    if (!meta_key.dptr)
     {
         SET_ERROR(co->err);
         return -1;
     }
+    meta_key.dsize = (int) make_db_meta_key(key->dptr, (size_t) key->dsize, meta_key.dptr);
     
-    if (write(save_fd, data_buffer, data_buf_size) == -1)
+    // The expiry is read again under the write lock, as the item may have been replaced since it was found expired.
+    ret_val = co->storage->fetch(co, shard, &meta_key, &meta_value);
+    if (ret_val != 0 || decode_db_meta((const uint8_t *) meta_value.dptr, (size_t) meta_value.dsize, &meta) == -1
+        || !is_db_expired(meta.expires, now))
     {
-        SET_ERROR(co->err);
-        return -1;
+        mm_free(co->mm, meta_key.dptr);
+        return (ret_val == -1) ? -1 : 1;
     }
     
-    close(save_fd);
-    free(save_file_name);
+    ret_val = remove_db_item(co, shard, key, &meta_key);
+    
+    mm_free(co->mm, meta_key.dptr);
     
     return ret_val;
 }
 
-static int create_split_dir(struct core_object *co, char *new_dir_path, const char *save_dir)
+static int remove_db_item(struct core_object *co, struct db_shard *shard, datum *key, datum *meta_key)
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    char *new_dir_path_temp;
+    int ret_val;
     
-    new_dir_path_temp = strdup(new_dir_path);
-    if (!new_dir_path_temp)
+    // Each removal bumps the version, as each upsert does, so that log states count the writes they replay.
+    db_snapshot_mark(&co->so->db_snapshot, key);
+    ret_val = co->storage->remove(co, shard, key);
+    if (ret_val == 0)
     {
-        SET_ERROR(co->err);
-        return -1;
+        ++shard->shared->version;
+        db_cache_update(&co->so->db_cache, key, NULL);
+        db_index_remove(&co->so->db_index, key);
     }
-    
-    for (size_t length = strlen(new_dir_path_temp); strcmp(new_dir_path_temp, save_dir) != 0 && length > 0; --length)
+    db_snapshot_mark(&co->so->db_snapshot, meta_key);
+    if (ret_val != -1 && co->storage->remove(co, shard, meta_key) == 0)
     {
-        if (*(new_dir_path_temp + length) == '/')
-        {
-            *(new_dir_path_temp + length + 1) = '\0';
-            create_dir(new_dir_path_temp);
-            break;
-        }
+        ++shard->shared->version;
+        db_cache_update(&co->so->db_cache, meta_key, NULL);
     }
     
-    free(new_dir_path_temp);
+    // A change missing from the change log would never reach the replicas.
+    if (ret_val == 0 && append_db_change(co, &co->so->db_changelog, DB_CHANGE_REMOVE, key, NULL) == -1)
+    {
+        ret_val = -1;
+    }
     
-    return 0;
+    return ret_val;
 }
 
 void print_db_error(DBM *db)
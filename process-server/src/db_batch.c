@@ -0,0 +1,1223 @@
+#include "../include/db.h"
+#include "../include/db_batch.h"
+#include "../include/db_blob.h"
+#include "../include/db_record.h"
+#include "../include/manager.h"
+#include "../include/read.h"
+#include "../include/upload.h"
+#include "../include/util.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DB_BATCH_FIELD_MAX_LEN 96  /** The maximum length of a Content-Type or Content-Length value of a response. */
+#define BATCH_BUFFER_SIZE 4096      /** Initial size of the buffers of a multi-get or batch upsert. */
+#define BATCH_WINDOW_SIZE 65536     /** Bytes of a batch upsert body read from the client at once. */
+#define BATCH_RECORD_MALFORMED 2    /** A record of a batch upsert is malformed, or the body ends inside it. */
+#define STATUS_HEADER "status"      /** Header of a multi-get part giving the status of its key. */
+
+/** Format of the header of one part of a multi-get body holding a value: key, type, coding line, tag and size. */
+#define MULTI_GET_PART_FORMAT \
+    "--" MULTI_GET_BOUNDARY CRLF_STR H_CONTENT_LOCATION COLON_SP_STR "%s" CRLF_STR \
+    STATUS_HEADER COLON_SP_STR "200" CRLF_STR H_CONTENT_TYPE COLON_SP_STR "%s" CRLF_STR "%s" \
+    H_ETAG COLON_SP_STR "\"%s\"" CRLF_STR H_CONTENT_LENGTH COLON_SP_STR "%zu" CRLF_STR CRLF_STR
+
+/** Format of the Content-Encoding line of a multi-get part holding an encoded value: coding. */
+#define MULTI_GET_CODING_FORMAT H_CONTENT_ENCODING COLON_SP_STR "%s" CRLF_STR
+
+/** Format of one part of a multi-get body for a key not in the database: key. */
+#define MULTI_GET_MISSING_PART_FORMAT \
+    "--" MULTI_GET_BOUNDARY CRLF_STR H_CONTENT_LOCATION COLON_SP_STR "%s" CRLF_STR \
+    STATUS_HEADER COLON_SP_STR "404" CRLF_STR H_CONTENT_LENGTH COLON_SP_STR "0" CRLF_STR CRLF_STR CRLF_STR
+
+/** Closing delimiter of a multi-get body. */
+#define MULTI_GET_END "--" MULTI_GET_BOUNDARY "--" CRLF_STR
+
+/**
+ * The keys of a database multi-get, sorted by shard so that the keys of each shard are read as one batch, and what
+ * was read for each. The arrays are carved out of one allocation.
+ */
+struct multi_get
+{
+    size_t  num_keys;
+    datum   *keys;
+    uint8_t **buffers;
+    size_t  *sizes;
+    size_t  *slots;   // The index in the sorted arrays of each key, in the order listed.
+    int     *results;
+};
+
+/**
+ * A response body being assembled.
+ */
+struct batch_body
+{
+    char   *data;
+    size_t size;
+    size_t capacity;
+};
+
+/**
+ * A record of a batch upsert, its key and value pointing into the window of the request body. A value too large for
+ * the window is left on the client connection, and its pointer is NULL.
+ */
+struct batch_record
+{
+    const char *key;
+    size_t     key_size;
+    const char *value;
+    size_t     value_size;
+};
+
+/**
+ * The request body of a batch upsert, read from the client connection into a window of bounded size and parsed as
+ * it arrives, so that the memory of the process does not grow with the size of the body. A chunked body is decoded
+ * on its way into the window.
+ */
+struct batch_stream
+{
+    int    fd;
+    bool   chunked;
+    bool   first_chunk;
+    bool   ended;     // The whole body has been read from the connection.
+    size_t unread;    // The bytes of the body, or of its current chunk if chunked, still on the connection.
+    size_t received;  // The bytes of a chunked body read so far.
+    char   *data;
+    size_t start;     // The offset in the window of the first byte not yet parsed.
+    size_t size;
+    size_t capacity;
+};
+
+/**
+ * The records of a database batch upsert waiting to be applied, up to DB_BATCH_UPSERT_SIZE for each shard, and
+ * the report of the records applied. The keys and values waiting for a shard are kept one after another in a
+ * buffer of the shard, so that the records cost no allocation of their own.
+ */
+struct batch_upsert
+{
+    struct batch_body *waiting;  // For each shard, each null-terminated key followed by its database record.
+    datum             *keys;     // DB_BATCH_UPSERT_SIZE for each shard; pointed into the buffer when flushed.
+    datum             *values;
+    size_t            num_waiting[MAX_DB_SHARDS];
+    size_t            created;
+    size_t            replaced;
+    size_t            failed;
+    struct batch_body key;       // The key of the record being parsed, null-terminated.
+    struct batch_body report;
+    struct batch_stream body;
+};
+
+/**
+ * split_keys
+ * <p>
+ * Split a list of keys, one per line, in place into null-terminated keys. Blank lines are skipped, and a carriage
+ * return ending a line is dropped.
+ * </p>
+ * @param list the list, null-terminated
+ * @param keys set to the start of each key, if not NULL
+ * @return the number of keys
+ */
+static size_t split_keys(char *list, char **keys);
+
+/**
+ * has_repeated_key
+ * <p>
+ * Check whether a list of keys holds a key more than once.
+ * </p>
+ * @param keys the keys
+ * @param num_keys the number of keys
+ * @param sorted room for num_keys keys, into which the keys are sorted
+ * @return true if a key is repeated, false otherwise
+ */
+static bool has_repeated_key(char **keys, size_t num_keys, char **sorted);
+
+/**
+ * compare_keys
+ * <p>
+ * Compare two null-terminated keys, for qsort.
+ * </p>
+ * @param a pointer to the first key
+ * @param b pointer to the second key
+ * @return less than, equal to or greater than 0 as the first key sorts before, with or after the second
+ */
+static int compare_keys(const void *a, const void *b);
+
+/**
+ * open_multi_get
+ * <p>
+ * Allocate the arrays of a multi-get, and sort its keys by shard.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param mg the multi-get
+ * @param keys the keys, in the order listed
+ * @param num_keys the number of keys
+ * @return 0 on success, -1 and set err on failure
+ */
+static int open_multi_get(struct core_object *co, struct state_object *so, struct multi_get *mg, char **keys,
+                          size_t num_keys);
+
+/**
+ * close_multi_get
+ * <p>
+ * Free the buffers read by a multi-get, and its arrays.
+ * </p>
+ * @param co the core object
+ * @param mg the multi-get
+ */
+static void close_multi_get(struct core_object *co, struct multi_get *mg);
+
+/**
+ * read_multi_get
+ * <p>
+ * Read the keys of a multi-get, one batch for each shard.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param mg the multi-get
+ * @return 0 on success, -1 and set err on failure
+ */
+static int read_multi_get(struct core_object *co, struct state_object *so, struct multi_get *mg);
+
+/**
+ * reserve_body
+ * <p>
+ * Grow a response body so that it has room for more bytes.
+ * </p>
+ * @param co the core object
+ * @param body the body
+ * @param size the number of bytes to make room for, beside the null byte written by snprintf
+ * @return 0 on success, -1 and set err on failure
+ */
+static int reserve_body(struct core_object *co, struct batch_body *body, size_t size);
+
+/**
+ * append_part
+ * <p>
+ * Append the part of a key to a multi-get body, reading the value from its blob if it is in the blob store. errno is
+ * EMSGSIZE if the part would take the body past MAX_DB_MULTI_GET_SIZE.
+ * </p>
+ * @param co the core object
+ * @param body the body
+ * @param key the key
+ * @param buffer the record read for the key
+ * @param size the size of the record
+ * @param result 0 if the key was read, 1 if it is not in the database
+ * @return 0 on success, -1 and set err on failure
+ */
+static int append_part(struct core_object *co, struct batch_body *body, const datum *key, const uint8_t *buffer,
+                       size_t size, int result);
+
+/**
+ * fill_stream
+ * <p>
+ * Read the request body of a batch upsert from the client connection until the window holds a number of bytes not
+ * yet parsed, or the body ends. The parsed bytes are dropped first to make room. errno is EMSGSIZE if a chunked body
+ * grows past the maximum size of an entity body, or EBADMSG if a chunk is malformed.
+ * </p>
+ * @param co the core object
+ * @param bs the request body
+ * @param size the number of bytes wanted, no more than the size of the window
+ * @return 0 on success, -1 and set err on failure
+ */
+static int fill_stream(struct core_object *co, struct batch_stream *bs, size_t size);
+
+/**
+ * parse_record
+ * <p>
+ * Parse the next record of a batch upsert from the request body, and move past it. A value too large for the window
+ * is left to be read by receive_value.
+ * </p>
+ * @param co the core object
+ * @param bs the request body
+ * @param record set to the record, its key and value pointing into the window until it is next filled
+ * @param content_type set to the content type of the record, or an empty string if it has none
+ * @return 0 if a record was parsed, 1 at the end of the body, BATCH_RECORD_MALFORMED if the record is malformed,
+ * -1 and set err on failure
+ */
+static int parse_record(struct core_object *co, struct batch_stream *bs, struct batch_record *record,
+                        char content_type[DB_BATCH_FIELD_MAX_LEN]);
+
+/**
+ * receive_value
+ * <p>
+ * Move a value too large for the window from the request body of a batch upsert into the blob store, a window at a
+ * time, and encode the database record pointing at it.
+ * </p>
+ * @param co the core object
+ * @param bs the request body
+ * @param value_size the size of the value
+ * @param content_type the content type of the value, or NULL if it has none
+ * @param expires the time after which the value has expired, or 0 if it never expires
+ * @param buffer set to the record, allocated with the memory manager
+ * @param buffer_size set to the size of the record
+ * @return 0 on success, BATCH_RECORD_MALFORMED if the body ends inside the value, -1 and set err on failure
+ */
+static int receive_value(struct core_object *co, struct batch_stream *bs, size_t value_size, const char *content_type,
+                         time_t expires, uint8_t **buffer, size_t *buffer_size);
+
+/**
+ * flush_batch
+ * <p>
+ * Upsert the records of a batch upsert waiting for a shard, report the outcome of each, and free them.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param bu the batch upsert
+ * @param shard the index of the shard
+ * @return 0 on success, -1 and set err on failure
+ */
+static int flush_batch(struct core_object *co, struct state_object *so, struct batch_upsert *bu, size_t shard);
+
+/**
+ * report_record
+ * <p>
+ * Count the outcome of a record of a batch upsert, and append it to the report.
+ * </p>
+ * @param co the core object
+ * @param bu the batch upsert
+ * @param key the key of the record
+ * @param key_size the size of the key, without a null byte
+ * @param result 0 if the record was created, 1 if it was replaced, -1 if it failed
+ * @return 0 on success, -1 and set err on failure
+ */
+static int report_record(struct core_object *co, struct batch_upsert *bu, const char *key, size_t key_size,
+                         int result);
+
+/**
+ * close_batch_upsert
+ * <p>
+ * Free the buffers and arrays of a batch upsert.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param bu the batch upsert
+ */
+static void close_batch_upsert(struct core_object *co, struct state_object *so, struct batch_upsert *bu);
+
+/**
+ * set_batch_headers
+ * <p>
+ * Set the headers of a multi-get or batch upsert response.
+ * </p>
+ * @param co the core object
+ * @param headers pointer to the header list for the response
+ * @param content_type the content type of the entity body
+ * @param content_length the size of the entity body
+ * @return 0 on success, -1 and set err on failure
+ */
+static int set_batch_headers(struct core_object *co, struct http_header ***headers, const char *content_type,
+                             size_t content_length);
+
+int db_multi_get_response_innards(struct core_object *co, struct state_object *so, const char *keys,
+                                  size_t keys_size, size_t *status, struct http_header ***headers,
+                                  struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char              *list;
+    char              **key_list;
+    size_t            num_keys;
+    struct multi_get  mg;
+    struct batch_body body;
+    size_t            slot;
+    char              content_type[DB_BATCH_FIELD_MAX_LEN];
+    int               saved_errno;
+    
+    list = mm_malloc(keys_size + 1, co->mm);
+    if (!list)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    memcpy(list, keys, keys_size);
+    list[keys_size] = '\0';
+    
+    num_keys = split_keys(list, NULL);
+    if (num_keys == 0 || num_keys > MAX_DB_MULTI_GET_KEYS)
+    {
+        mm_free(co->mm, list);
+        *status  = BAD_REQUEST_400;
+        *headers = NULL;
+        return 0;
+    }
+    
+    // Counting the keys split the list in place, so it is copied again to be split into the keys. The second half of
+    // the key list is room to sort them.
+    key_list = mm_malloc(2 * num_keys * sizeof(char *), co->mm);
+    if (!key_list)
+    {
+        SET_ERROR(co->err);
+        mm_free(co->mm, list);
+        return -1;
+    }
+    memcpy(list, keys, keys_size);
+    (void) split_keys(list, key_list);
+    
+    // A key listed twice would be read and sent twice, so that a short list could ask for a value many times over.
+    if (has_repeated_key(key_list, num_keys, key_list + num_keys))
+    {
+        mm_free(co->mm, key_list);
+        mm_free(co->mm, list);
+        *status  = BAD_REQUEST_400;
+        *headers = NULL;
+        return 0;
+    }
+    
+    if (open_multi_get(co, so, &mg, key_list, num_keys) == -1)
+    {
+        mm_free(co->mm, key_list);
+        mm_free(co->mm, list);
+        return -1;
+    }
+    mm_free(co->mm, key_list);
+    
+    if (read_multi_get(co, so, &mg) == -1)
+    {
+        close_multi_get(co, &mg);
+        mm_free(co->mm, list);
+        return -1;
+    }
+    
+    memset(&body, 0, sizeof(body));
+    body.capacity = BATCH_BUFFER_SIZE;
+    body.data     = mm_malloc(body.capacity, co->mm);
+    if (!body.data)
+    {
+        SET_ERROR(co->err);
+        close_multi_get(co, &mg);
+        mm_free(co->mm, list);
+        return -1;
+    }
+    
+    // The parts follow the order in which the keys were listed.
+    for (size_t k = 0; k < mg.num_keys; ++k)
+    {
+        slot = mg.slots[k];
+        if (append_part(co, &body, &mg.keys[slot], mg.buffers[slot], mg.sizes[slot], mg.results[slot]) == -1)
+        {
+            saved_errno = errno;
+            mm_free(co->mm, body.data);
+            close_multi_get(co, &mg);
+            mm_free(co->mm, list);
+            if (saved_errno == EMSGSIZE)
+            {
+                *status  = REQUEST_ENTITY_TOO_LARGE_413;
+                *headers = NULL;
+                return 0;
+            }
+            return -1;
+        }
+    }
+    close_multi_get(co, &mg);
+    mm_free(co->mm, list);
+    
+    if (reserve_body(co, &body, strlen(MULTI_GET_END)) == -1)
+    {
+        mm_free(co->mm, body.data);
+        return -1;
+    }
+    memcpy(body.data + body.size, MULTI_GET_END, strlen(MULTI_GET_END));
+    body.size += strlen(MULTI_GET_END);
+    
+    entity_body->data = body.data;
+    entity_body->size = body.size;
+    
+    (void) snprintf(content_type, DB_BATCH_FIELD_MAX_LEN, "%s%s", MULTIPART_MIXED_CONTENT_TYPE, MULTI_GET_BOUNDARY);
+    
+    *status = OK_200;
+    return set_batch_headers(co, headers, content_type, body.size);
+}
+
+int db_batch_upsert_response_innards(struct core_object *co, struct state_object *so, struct http_request *request,
+                                     size_t records_size, time_t expires, size_t *status,
+                                     struct http_header ***headers, struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct batch_upsert bu;
+    struct batch_record record;
+    struct batch_body   *waiting;
+    char                content_type[DB_BATCH_FIELD_MAX_LEN];
+    char                summary[DB_BATCH_FIELD_MAX_LEN];
+    size_t              summary_size;
+    size_t              shard;
+    size_t              slot;
+    uint8_t             *value_buffer;
+    size_t              value_buffer_size;
+    datum               key;
+    int                 res;
+    
+    memset(&bu, 0, sizeof(bu));
+    bu.waiting = mm_calloc(so->num_db_shards, sizeof(struct batch_body), co->mm);
+    bu.keys    = mm_malloc(so->num_db_shards * DB_BATCH_UPSERT_SIZE * sizeof(datum), co->mm);
+    bu.values  = mm_malloc(so->num_db_shards * DB_BATCH_UPSERT_SIZE * sizeof(datum), co->mm);
+    bu.key.capacity    = BATCH_BUFFER_SIZE;
+    bu.key.data        = mm_malloc(bu.key.capacity, co->mm);
+    bu.report.capacity = BATCH_BUFFER_SIZE;
+    bu.report.data     = mm_malloc(bu.report.capacity, co->mm);
+    bu.body.capacity   = BATCH_WINDOW_SIZE;
+    bu.body.data       = mm_malloc(bu.body.capacity, co->mm);
+    if (!(bu.waiting && bu.keys && bu.values && bu.key.data && bu.report.data && bu.body.data))
+    {
+        SET_ERROR(co->err);
+        close_batch_upsert(co, so, &bu);
+        return -1;
+    }
+    for (shard = 0; shard < so->num_db_shards; ++shard)
+    {
+        bu.waiting[shard].capacity = BATCH_BUFFER_SIZE;
+        bu.waiting[shard].data     = mm_malloc(BATCH_BUFFER_SIZE, co->mm);
+        if (!bu.waiting[shard].data)
+        {
+            SET_ERROR(co->err);
+            close_batch_upsert(co, so, &bu);
+            return -1;
+        }
+    }
+    bu.body.fd          = request->client_fd;
+    bu.body.chunked     = request->entity_body_chunked;
+    bu.body.first_chunk = true;
+    bu.body.unread      = (request->entity_body_chunked) ? 0 : records_size;
+    
+    // Each record is parsed and encoded as it arrives, and waits only until its shard has a full batch.
+    while ((res = parse_record(co, &bu.body, &record, content_type)) == 0)
+    {
+        // The key is not null-terminated in the request body, as it is everywhere else.
+        bu.key.size = 0;
+        if (reserve_body(co, &bu.key, record.key_size) == -1)
+        {
+            close_batch_upsert(co, so, &bu);
+            return -1;
+        }
+        memcpy(bu.key.data, record.key, record.key_size);
+        bu.key.data[record.key_size] = '\0';
+        key.dptr  = bu.key.data;
+        key.dsize = (int) record.key_size + 1;
+        
+        if (!record.value)
+        {
+            res = receive_value(co, &bu.body, record.value_size, (*content_type) ? content_type : NULL, expires,
+                                &value_buffer, &value_buffer_size);
+            if (res != 0)
+            {
+                break;
+            }
+        } else if (encode_db_value(co, &key, (const uint8_t *) record.value, record.value_size,
+                                   (*content_type) ? content_type : NULL, NULL, expires, &value_buffer,
+                                   &value_buffer_size) == -1)
+        {
+            if (report_record(co, &bu, bu.key.data, record.key_size, -1) == -1)
+            {
+                close_batch_upsert(co, so, &bu);
+                return -1;
+            }
+            continue;
+        }
+        
+        shard   = (size_t) (get_db_shard(so, &key) - so->db_shards);
+        waiting = &bu.waiting[shard];
+        if (reserve_body(co, waiting, record.key_size + 1 + value_buffer_size) == -1)
+        {
+            mm_free(co->mm, value_buffer);
+            close_batch_upsert(co, so, &bu);
+            return -1;
+        }
+        memcpy(waiting->data + waiting->size, key.dptr, (size_t) key.dsize);
+        memcpy(waiting->data + waiting->size + key.dsize, value_buffer, value_buffer_size);
+        waiting->size += record.key_size + 1 + value_buffer_size;
+        mm_free(co->mm, value_buffer);
+        
+        slot = shard * DB_BATCH_UPSERT_SIZE + bu.num_waiting[shard];
+        bu.keys[slot].dsize   = key.dsize;
+        bu.values[slot].dsize = (int) value_buffer_size;
+        
+        if (++bu.num_waiting[shard] == DB_BATCH_UPSERT_SIZE && flush_batch(co, so, &bu, shard) == -1)
+        {
+            close_batch_upsert(co, so, &bu);
+            return -1;
+        }
+    }
+    
+    // A body too large or wrongly chunked ends the batch as a malformed record does; any other failure is an error.
+    if (res == -1 && errno != EMSGSIZE && errno != EBADMSG)
+    {
+        close_batch_upsert(co, so, &bu);
+        return -1;
+    }
+    if (res == 1)
+    {
+        *status = OK_200;
+    } else
+    {
+        *status = (res == -1 && errno == EMSGSIZE) ? REQUEST_ENTITY_TOO_LARGE_413 : BAD_REQUEST_400;
+    }
+    
+    for (shard = 0; shard < so->num_db_shards; ++shard)
+    {
+        if (flush_batch(co, so, &bu, shard) == -1)
+        {
+            close_batch_upsert(co, so, &bu);
+            return -1;
+        }
+    }
+    
+    // The summary goes ahead of the outcome of each record.
+    summary_size = (size_t) snprintf(summary, DB_BATCH_FIELD_MAX_LEN, "created %zu replaced %zu failed %zu\n",
+                                     bu.created, bu.replaced, bu.failed);
+    if (reserve_body(co, &bu.report, summary_size) == -1)
+    {
+        close_batch_upsert(co, so, &bu);
+        return -1;
+    }
+    memmove(bu.report.data + summary_size, bu.report.data, bu.report.size);
+    memcpy(bu.report.data, summary, summary_size);
+    bu.report.size += summary_size;
+    
+    entity_body->data = bu.report.data;
+    entity_body->size = bu.report.size;
+    bu.report.data    = NULL;
+    close_batch_upsert(co, so, &bu);
+    
+    return set_batch_headers(co, headers, TEXT_PLAIN_CONTENT_TYPE, entity_body->size);
+}
+
+static size_t split_keys(char *list, char **keys)
+{
+    size_t num_keys;
+    char   *line;
+    char   *end;
+    size_t line_size;
+    
+    num_keys = 0;
+    for (line = list; *line; line = end + 1)
+    {
+        end = strchr(line, LF);
+        if (!end)
+        {
+            end = line + strlen(line) - 1; // The last line has no line feed; end points at its last byte.
+            line_size = strlen(line);
+        } else
+        {
+            line_size = (size_t) (end - line);
+            *end = '\0';
+        }
+        
+        if (line_size > 0 && line[line_size - 1] == CR)
+        {
+            line[--line_size] = '\0';
+        }
+        if (line_size == 0)
+        {
+            continue;
+        }
+        
+        if (keys)
+        {
+            keys[num_keys] = line;
+        }
+        ++num_keys;
+    }
+    
+    return num_keys;
+}
+
+static bool has_repeated_key(char **keys, size_t num_keys, char **sorted)
+{
+    memcpy(sorted, keys, num_keys * sizeof(char *));
+    qsort(sorted, num_keys, sizeof(char *), compare_keys);
+    for (size_t k = 1; k < num_keys; ++k)
+    {
+        if (strcmp(sorted[k - 1], sorted[k]) == 0)
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static int open_multi_get(struct core_object *co, struct state_object *so, struct multi_get *mg, char **keys,
+                          size_t num_keys)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    size_t shard_starts[MAX_DB_SHARDS + 1];
+    size_t shard;
+    datum  key;
+    void   *arrays;
+    
+    // The int results go last, so that every array is aligned for its type.
+    arrays = mm_malloc(num_keys * (sizeof(datum) + sizeof(uint8_t *) + sizeof(size_t) * 2 + sizeof(int)), co->mm);
+    if (!arrays)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    mg->num_keys = num_keys;
+    mg->keys     = (datum *) arrays;
+    mg->buffers  = (uint8_t **) (mg->keys + num_keys);
+    mg->sizes    = (size_t *) (mg->buffers + num_keys);
+    mg->slots    = mg->sizes + num_keys;
+    mg->results  = (int *) (mg->slots + num_keys);
+    
+    // Counting sort by shard: count the keys of each shard, then place each key after those of the shards before.
+    memset(shard_starts, 0, sizeof(shard_starts));
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+        key.dptr  = keys[k];
+        key.dsize = (int) strlen(keys[k]) + 1;
+        mg->slots[k] = (size_t) (get_db_shard(so, &key) - so->db_shards);
+        ++shard_starts[mg->slots[k] + 1];
+    }
+    for (size_t s = 0; s < so->num_db_shards; ++s)
+    {
+        shard_starts[s + 1] += shard_starts[s];
+    }
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+        shard = mg->slots[k];
+        mg->slots[k] = shard_starts[shard]++;
+        mg->keys[mg->slots[k]].dptr  = keys[k];
+        mg->keys[mg->slots[k]].dsize = (int) strlen(keys[k]) + 1;
+        mg->results[mg->slots[k]]    = 1;
+    }
+    
+    return 0;
+}
+
+static void close_multi_get(struct core_object *co, struct multi_get *mg)
+{
+    for (size_t k = 0; k < mg->num_keys; ++k)
+    {
+        if (mg->results[k] == 0)
+        {
+            mm_free(co->mm, mg->buffers[k]);
+        }
+    }
+    mm_free(co->mm, mg->keys);
+}
+
+static int read_multi_get(struct core_object *co, struct state_object *so, struct multi_get *mg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_shard *shard;
+    size_t          first;
+    size_t          last;
+    
+    for (first = 0; first < mg->num_keys; first = last)
+    {
+        shard = get_db_shard(so, &mg->keys[first]);
+        last  = first + 1;
+        while (last < mg->num_keys && get_db_shard(so, &mg->keys[last]) == shard)
+        {
+            ++last;
+        }
+        
+        if (db_fetch_batch(co, shard, last - first, mg->keys + first, mg->buffers + first, mg->sizes + first,
+                           mg->results + first) == -1)
+        {
+            return -1;
+        }
+        for (size_t k = first; k < last; ++k)
+        {
+            if (mg->results[k] == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+static int reserve_body(struct core_object *co, struct batch_body *body, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char   *data;
+    size_t capacity;
+    
+    if (body->size + size + 1 <= body->capacity)
+    {
+        return 0;
+    }
+    
+    capacity = body->capacity;
+    while (body->size + size + 1 > capacity)
+    {
+        capacity *= 2;
+    }
+    data = mm_realloc(body->data, capacity, co->mm);
+    if (!data)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    body->data     = data;
+    body->capacity = capacity;
+    
+    return 0;
+}
+
+static int append_part(struct core_object *co, struct batch_body *body, const datum *key, const uint8_t *buffer,
+                       size_t size, int result)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_record record;
+    const char       *content_type;
+    char             coding[DB_BATCH_FIELD_MAX_LEN];
+    char             etag[DB_RECORD_MAX_ETAG_LEN + 1];
+    char             digest[SHA256_HEX_LEN + 1];
+    size_t           value_size;
+    int              fd;
+    int              part_header_size;
+    
+    if (result == 1)
+    {
+        part_header_size = snprintf(NULL, 0, MULTI_GET_MISSING_PART_FORMAT, (const char *) key->dptr);
+        if ((size_t) part_header_size > MAX_DB_MULTI_GET_SIZE - body->size)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (reserve_body(co, body, (size_t) part_header_size) == -1)
+        {
+            return -1;
+        }
+        body->size += (size_t) snprintf(body->data + body->size, body->capacity - body->size,
+                                        MULTI_GET_MISSING_PART_FORMAT, (const char *) key->dptr);
+        return 0;
+    }
+    
+    if (decode_db_record(buffer, size, &record) == -1)
+    {
+        (void) fprintf(stderr, "malformed database record for %s\n", (const char *) key->dptr);
+        return -1;
+    }
+    
+    // An expired value is reported missing, as a GET of it would be.
+    if (is_db_expired(record.expires, time(NULL)))
+    {
+        return append_part(co, body, key, NULL, 0, 1);
+    }
+    content_type = (record.content_type) ? record.content_type : get_content_type(key->dptr);
+    get_db_record_etag(&record, etag);
+    coding[0] = '\0';
+    if (record.content_encoding)
+    {
+        (void) snprintf(coding, sizeof(coding), MULTI_GET_CODING_FORMAT, record.content_encoding);
+    }
+    
+    fd         = 0;
+    value_size = record.body_size;
+    if (record.flags & DB_RECORD_BLOB)
+    {
+        if (record.body_size != SHA256_HEX_LEN)
+        {
+            (void) fprintf(stderr, "malformed database blob record for %s\n", (const char *) key->dptr);
+            return -1;
+        }
+        memcpy(digest, record.body, SHA256_HEX_LEN);
+        digest[SHA256_HEX_LEN] = '\0';
+        if (open_db_blob(co, digest, &fd, &value_size) != 0)
+        {
+            (void) fprintf(stderr, "database blob %s for %s not readable\n", digest, (const char *) key->dptr);
+            return -1;
+        }
+    }
+    
+    // The content type and coding are in the record, which stays in its buffer until the part is appended.
+    part_header_size = snprintf(NULL, 0, MULTI_GET_PART_FORMAT, (const char *) key->dptr, content_type, coding,
+                                etag, value_size);
+    
+    // The values are held in the response body, so the parts may not add up to more than a bounded size.
+    if (value_size > MAX_DB_MULTI_GET_SIZE - body->size
+        || (size_t) part_header_size + CRLF_SIZE > MAX_DB_MULTI_GET_SIZE - body->size - value_size)
+    {
+        if (fd)
+        {
+            close(fd);
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (reserve_body(co, body, (size_t) part_header_size + value_size + CRLF_SIZE) == -1)
+    {
+        if (fd)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    body->size += (size_t) snprintf(body->data + body->size, body->capacity - body->size, MULTI_GET_PART_FORMAT,
+                                    (const char *) key->dptr, content_type, coding, etag, value_size);
+    
+    if (fd)
+    {
+        if (read_fully(fd, body->data + body->size, value_size) == -1)
+        {
+            SET_ERROR(co->err);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    } else
+    {
+        memcpy(body->data + body->size, record.body, value_size);
+    }
+    body->size += value_size;
+    memcpy(body->data + body->size, CRLF_STR, CRLF_SIZE);
+    body->size += CRLF_SIZE;
+    
+    return 0;
+}
+
+static int fill_stream(struct core_object *co, struct batch_stream *bs, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    size_t len;
+    
+    if (bs->size - bs->start >= size)
+    {
+        return 0;
+    }
+    
+    memmove(bs->data, bs->data + bs->start, bs->size - bs->start);
+    bs->size  -= bs->start;
+    bs->start  = 0;
+    
+    // As much of the body as fits is read, so that a window holds many small records.
+    while (bs->size < size && !bs->ended)
+    {
+        if (bs->unread == 0)
+        {
+            if (bs->chunked && read_chunk_header(bs->fd, bs->first_chunk, &bs->unread) == -1)
+            {
+                SET_ERROR(co->err);
+                return -1;
+            }
+            bs->first_chunk = false;
+            bs->ended       = bs->unread == 0;
+            if (co->max_entity_body_size && bs->unread > co->max_entity_body_size - bs->received)
+            {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            continue;
+        }
+        
+        len = (bs->unread < bs->capacity - bs->size) ? bs->unread : bs->capacity - bs->size;
+        if (read_fully(bs->fd, bs->data + bs->size, len) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        bs->size     += len;
+        bs->unread   -= len;
+        bs->received += len;
+    }
+    
+    return 0;
+}
+
+static int parse_record(struct core_object *co, struct batch_stream *bs, struct batch_record *record,
+                        char content_type[DB_BATCH_FIELD_MAX_LEN])
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    const char         *line;
+    const char         *end;
+    char               header[DB_BATCH_FIELD_MAX_LEN];
+    unsigned long long key_size;
+    unsigned long long value_size;
+    int                type_start;
+    size_t             header_size;
+    
+    // A line feed after the value of the previous record is skipped.
+    if (fill_stream(co, bs, DB_BATCH_FIELD_MAX_LEN + 1) == -1)
+    {
+        return -1;
+    }
+    if (bs->start < bs->size && bs->data[bs->start] == LF)
+    {
+        ++bs->start;
+    }
+    if (bs->start == bs->size)
+    {
+        return 1;
+    }
+    
+    line = bs->data + bs->start;
+    end  = memchr(line, LF, bs->size - bs->start);
+    if (!end || (size_t) (end - line) >= DB_BATCH_FIELD_MAX_LEN)
+    {
+        return BATCH_RECORD_MALFORMED;
+    }
+    header_size = (size_t) (end - line);
+    memcpy(header, line, header_size);
+    header[header_size] = '\0';
+    bs->start += header_size + 1;
+    if (header_size > 0 && header[header_size - 1] == CR)
+    {
+        header[--header_size] = '\0';
+    }
+    
+    // Format: key-size SP value-size [ SP content-type ]
+    type_start = -1;
+    if (sscanf(header, "%llu %llu %n", &key_size, &value_size, &type_start) < 2 || type_start == -1
+        || !isdigit((unsigned char) header[0]) || key_size == 0)
+    {
+        return BATCH_RECORD_MALFORMED;
+    }
+    (void) snprintf(content_type, DB_BATCH_FIELD_MAX_LEN, "%s", header + type_start);
+    
+    // The key is held whole in the window, and the value with it if both fit.
+    if (key_size > BATCH_WINDOW_SIZE || value_size > SIZE_MAX - key_size)
+    {
+        return BATCH_RECORD_MALFORMED;
+    }
+    if (fill_stream(co, bs, (key_size + value_size <= BATCH_WINDOW_SIZE) ? key_size + value_size : key_size) == -1)
+    {
+        return -1;
+    }
+    if (key_size > bs->size - bs->start)
+    {
+        return BATCH_RECORD_MALFORMED;
+    }
+    
+    record->key        = bs->data + bs->start;
+    record->key_size   = (size_t) key_size;
+    record->value      = NULL;
+    record->value_size = (size_t) value_size;
+    
+    // Keys are null-terminated everywhere else, so a key may not hold a null byte.
+    if (memchr(record->key, '\0', record->key_size))
+    {
+        return BATCH_RECORD_MALFORMED;
+    }
+    bs->start += key_size;
+    
+    if (key_size + value_size <= BATCH_WINDOW_SIZE)
+    {
+        if (value_size > bs->size - bs->start)
+        {
+            return BATCH_RECORD_MALFORMED;
+        }
+        record->value  = bs->data + bs->start;
+        bs->start     += value_size;
+    }
+    
+    return 0;
+}
+
+static int receive_value(struct core_object *co, struct batch_stream *bs, size_t value_size, const char *content_type,
+                         time_t expires, uint8_t **buffer, size_t *buffer_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct upload upload;
+    size_t        len;
+    
+    if (open_db_value_upload(co, &upload) == -1)
+    {
+        return -1;
+    }
+    
+    while (upload.size < value_size)
+    {
+        if (fill_stream(co, bs, 1) == -1)
+        {
+            close_upload(&upload);
+            return -1;
+        }
+        if (bs->start == bs->size)
+        {
+            close_upload(&upload);
+            return BATCH_RECORD_MALFORMED;
+        }
+        
+        len = (value_size - upload.size < bs->size - bs->start) ? value_size - upload.size : bs->size - bs->start;
+        if (write_upload(co, &upload, bs->data + bs->start, len) == -1)
+        {
+            close_upload(&upload);
+            return -1;
+        }
+        bs->start += len;
+    }
+    
+    if (publish_db_value_upload(co, &upload) == -1)
+    {
+        close_upload(&upload);
+        return -1;
+    }
+    close_upload(&upload);
+    
+    return encode_db_blob_value(co, upload.digest, content_type, NULL, expires, buffer, buffer_size);
+}
+
+static int flush_batch(struct core_object *co, struct state_object *so, struct batch_upsert *bu, size_t shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int    results[DB_BATCH_UPSERT_SIZE];
+    datum  *keys;
+    datum  *values;
+    size_t num_items;
+    char   *data;
+    int    ret_val;
+    
+    num_items = bu->num_waiting[shard];
+    if (num_items == 0)
+    {
+        return 0;
+    }
+    keys   = bu->keys + shard * DB_BATCH_UPSERT_SIZE;
+    values = bu->values + shard * DB_BATCH_UPSERT_SIZE;
+    
+    // The buffer no longer grows, so the keys and values can point into it.
+    data = bu->waiting[shard].data;
+    for (size_t i = 0; i < num_items; ++i)
+    {
+        keys[i].dptr   = data;
+        data          += keys[i].dsize;
+        values[i].dptr = data;
+        data          += values[i].dsize;
+    }
+    
+    if (db_upsert_batch(co, &so->db_shards[shard], num_items, keys, values, results) == -1)
+    {
+        return -1;
+    }
+    
+    ret_val = 0;
+    for (size_t i = 0; i < num_items && ret_val == 0; ++i)
+    {
+        ret_val = report_record(co, bu, keys[i].dptr, (size_t) keys[i].dsize - 1, results[i]);
+    }
+    bu->num_waiting[shard]  = 0;
+    bu->waiting[shard].size = 0;
+    
+    return ret_val;
+}
+
+static int report_record(struct core_object *co, struct batch_upsert *bu, const char *key, size_t key_size,
+                         int result)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    const char *outcome;
+    
+    switch (result)
+    {
+        case 0:
+        {
+            outcome = "created";
+            ++bu->created;
+            break;
+        }
+        case 1:
+        {
+            outcome = "replaced";
+            ++bu->replaced;
+            break;
+        }
+        default:
+        {
+            outcome = "failed";
+            ++bu->failed;
+        }
+    }
+    
+    if (reserve_body(co, &bu->report, strlen(outcome) + SP_SIZE + key_size + 1) == -1)
+    {
+        return -1;
+    }
+    bu->report.size += (size_t) snprintf(bu->report.data + bu->report.size, bu->report.capacity - bu->report.size,
+                                         "%s %.*s\n", outcome, (int) key_size, key);
+    
+    return 0;
+}
+
+static void close_batch_upsert(struct core_object *co, struct state_object *so, struct batch_upsert *bu)
+{
+    if (bu->waiting)
+    {
+        for (size_t shard = 0; shard < so->num_db_shards; ++shard)
+        {
+            if (bu->waiting[shard].data)
+            {
+                mm_free(co->mm, bu->waiting[shard].data);
+            }
+        }
+        mm_free(co->mm, bu->waiting);
+    }
+    if (bu->keys)
+    {
+        mm_free(co->mm, bu->keys);
+    }
+    if (bu->values)
+    {
+        mm_free(co->mm, bu->values);
+    }
+    if (bu->key.data)
+    {
+        mm_free(co->mm, bu->key.data);
+    }
+    if (bu->report.data)
+    {
+        mm_free(co->mm, bu->report.data);
+    }
+    if (bu->body.data)
+    {
+        mm_free(co->mm, bu->body.data);
+    }
+}
+
+static int set_batch_headers(struct core_object *co, struct http_header ***headers, const char *content_type,
+                             size_t content_length)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    const int num_headers = 2;
+    char      content_length_str[DB_BATCH_FIELD_MAX_LEN];
+    size_t    offset;
+    
+    (void) snprintf(content_length_str, DB_BATCH_FIELD_MAX_LEN, "%zu", content_length);
+    
+    *headers = mm_calloc(num_headers + 1, sizeof(struct http_header *), co->mm);
+    if (!*headers)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    offset = 0;
+    (*headers)[offset++] = set_header(co, H_CONTENT_TYPE, content_type);
+    (*headers)[offset++] = set_header(co, H_CONTENT_LENGTH, content_length_str);
+    (*headers)[offset]   = NULL;
+    
+    for (size_t h = 0; h < offset; ++h)
+    {
+        if (!(*headers)[h])
+        {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
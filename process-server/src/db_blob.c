@@ -0,0 +1,291 @@
+#include "../include/db_blob.h"
+#include "../include/util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOB_FANOUT_LEN 2          /** Digest characters naming the subdirectory of a blob, to keep directories small. */
+#define BLOB_COLLECT_SUFFIX ".gc"  /** Suffix of a blob moved aside to be collected, so that no writer reuses it. */
+
+/**
+ * create_blob_dir
+ * <p>
+ * Create the subdirectory of the blob store holding a blob, if it does not exist.
+ * </p>
+ * @param path the path of the blob
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int create_blob_dir(const char *path);
+
+/**
+ * touch_blob
+ * <p>
+ * Set the modification time of a blob to now, if it is in the store, so that a blob stored again counts as newly
+ * stored by collect_db_blobs.
+ * </p>
+ * @param path the path of the blob
+ * @return true if the blob is in the store, false otherwise
+ */
+static bool touch_blob(const char *path);
+
+/**
+ * collect_blob_dir
+ * <p>
+ * Remove the unlisted blobs stored before a time from one subdirectory of the blob store.
+ * </p>
+ * @param co the core object
+ * @param dir_path the path of the subdirectory
+ * @param live the live digests, sorted
+ * @param num_live the number of live digests
+ * @param before the time before which an unlisted blob must have been stored to be removed
+ * @param removed incremented for each blob removed
+ * @return 0 on success, -1 and set err on failure
+ */
+static int collect_blob_dir(struct core_object *co, const char *dir_path, const char *live, size_t num_live,
+                            time_t before, size_t *removed);
+
+/**
+ * compare_digests
+ * <p>
+ * Compare two digests of SHA256_HEX_LEN characters, for qsort and bsearch.
+ * </p>
+ * @param a the first digest
+ * @param b the second digest
+ * @return less than, equal to or greater than 0 as the first digest sorts before, with or after the second
+ */
+static int compare_digests(const void *a, const void *b);
+
+int store_db_blob(struct core_object *co, const uint8_t *data, size_t size, char digest[SHA256_HEX_LEN + 1])
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct sha256_context ctx;
+    char                  path[BUFSIZ];
+    char                  temp_path[BUFSIZ];
+    int                   temp_fd;
+    
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, size);
+    sha256_final_hex(&ctx, digest);
+    
+    // Blobs are only ever renamed into place whole, so a blob present holds this value.
+    get_db_blob_path(digest, path);
+    if (touch_blob(path))
+    {
+        return 0;
+    }
+    
+    if (create_blob_dir(path) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if (join_path(temp_path, sizeof(temp_path), path, TEMP_SUFFIX) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    temp_fd = mkstemp(temp_path);
+    if (temp_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if (write_fully(temp_fd, data, size) == -1 || rename(temp_path, path) == -1)
+    {
+        SET_ERROR(co->err);
+        close(temp_fd);
+        unlink(temp_path);
+        return -1;
+    }
+    
+    close(temp_fd);
+    
+    return 0;
+}
+
+int open_db_blob(struct core_object *co, const char *digest, int *fd, size_t *size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char        path[BUFSIZ];
+    struct stat st;
+    
+    get_db_blob_path(digest, path);
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return 1;
+        }
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (fstat(*fd, &st) == -1)
+    {
+        SET_ERROR(co->err);
+        close(*fd);
+        return -1;
+    }
+    *size = (size_t) st.st_size;
+    
+    return 0;
+}
+
+int store_db_blob_file(struct core_object *co, const char *file_path, const char *digest)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char path[BUFSIZ];
+    
+    // A blob present holds the same value, so the file is not needed.
+    get_db_blob_path(digest, path);
+    if (touch_blob(path))
+    {
+        unlink(file_path);
+        return 1;
+    }
+    
+    if (create_blob_dir(path) == -1 || rename(file_path, path) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    return 0;
+}
+
+void get_db_blob_path(const char *digest, char path[BUFSIZ])
+{
+    (void) snprintf(path, BUFSIZ, "%s/%.*s/%s", BLOB_DIR, BLOB_FANOUT_LEN, digest, digest);
+}
+
+static int create_blob_dir(const char *path)
+{
+    char dir_path[BUFSIZ];
+    
+    strlcpy(dir_path, path, BUFSIZ);
+    *strrchr(dir_path, '/') = '\0';
+    
+    return create_dir(dir_path);
+}
+
+int collect_db_blobs(struct core_object *co, char *live, size_t num_live, time_t before, size_t *removed)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char          dir_path[BUFSIZ];
+    DIR           *dir;
+    struct dirent *dirent;
+    int           ret_val;
+    
+    *removed = 0;
+    if (num_live > 0)
+    {
+        qsort(live, num_live, SHA256_HEX_LEN, compare_digests);
+    }
+    
+    dir = opendir(BLOB_DIR);
+    if (!dir)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    ret_val = 0;
+    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+    while (ret_val == 0 && (dirent = readdir(dir)))
+    {
+        if (strlen(dirent->d_name) != BLOB_FANOUT_LEN || *dirent->d_name == '.')
+        {
+            continue;
+        }
+        if (join_path(dir_path, sizeof(dir_path), BLOB_DIR "/", dirent->d_name) == -1)
+        {
+            SET_ERROR(co->err);
+            ret_val = -1;
+            break;
+        }
+        ret_val = collect_blob_dir(co, dir_path, live, num_live, before, removed);
+    }
+    closedir(dir);
+    
+    return ret_val;
+}
+
+static bool touch_blob(const char *path)
+{
+    return utimensat(AT_FDCWD, path, NULL, 0) == 0;
+}
+
+static int collect_blob_dir(struct core_object *co, const char *dir_path, const char *live, size_t num_live,
+                            time_t before, size_t *removed)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char          path[BUFSIZ];
+    char          doomed_path[BUFSIZ];
+    DIR           *dir;
+    struct dirent *dirent;
+    struct stat   st;
+    
+    dir = opendir(dir_path);
+    if (!dir)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+    while ((dirent = readdir(dir)))
+    {
+        // Only blobs are named by a whole digest; a temporary file being written has a suffix.
+        if (strlen(dirent->d_name) != SHA256_HEX_LEN
+            || strspn(dirent->d_name, "0123456789abcdef") != SHA256_HEX_LEN
+            || (num_live > 0 && bsearch(dirent->d_name, live, num_live, SHA256_HEX_LEN, compare_digests)))
+        {
+            continue;
+        }
+        get_db_blob_path(dirent->d_name, path);
+        if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_mtime >= before
+            || join_path(doomed_path, sizeof(doomed_path), path, BLOB_COLLECT_SUFFIX) == -1)
+        {
+            continue;
+        }
+        
+        // A writer may touch the blob to store it again while it is checked. Once it is moved aside, a writer
+        // stores it anew, and a touch made before the move shows in the blob moved aside, which is then put back.
+        if (rename(path, doomed_path) == -1)
+        {
+            continue;
+        }
+        if (lstat(doomed_path, &st) == 0 && st.st_mtime < before)
+        {
+            if (unlink(doomed_path) == 0)
+            {
+                ++*removed;
+            }
+        } else
+        {
+            (void) rename(doomed_path, path);
+        }
+    }
+    closedir(dir);
+    
+    return 0;
+}
+
+static int compare_digests(const void *a, const void *b)
+{
+    return memcmp(a, b, SHA256_HEX_LEN);
+}
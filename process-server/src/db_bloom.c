@@ -0,0 +1,244 @@
+#include "../include/db.h"
+#include "../include/db_bloom.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DB_BLOOM_WORD_BITS 64  /** Bits in each word of the filter. */
+#define DB_BLOOM_HALF_BITS 32  /** The hash is split into two halves of this many bits. */
+#define PERCENT 100            /** To print a fraction as a percentage. */
+
+/**
+ * The state of the Bloom filter shared by all processes. The words of the bit array follow.
+ */
+struct db_bloom_shared
+{
+    _Atomic uint64_t adds;
+    _Atomic uint64_t rejects;         // Reads answered by the filter alone.
+    _Atomic uint64_t false_positives; // Reads let through for keys not in the database.
+    _Atomic uint64_t words[];
+};
+
+/**
+ * get_bloom_bit
+ * <p>
+ * Get the index of a bit of a key, by double hashing: the bits of a key are h1 + i * h2 for i below
+ * DB_BLOOM_HASHES, where h1 and h2 are the halves of its hash.
+ * </p>
+ * @param bloom the filter
+ * @param hash the hash of the key
+ * @param i which bit of the key
+ * @return the index of the bit
+ */
+static size_t get_bloom_bit(const struct db_bloom *bloom, uint64_t hash, size_t i);
+
+/**
+ * fill_from_key
+ * <p>
+ * Add a key found by iterating a database shard to the Bloom filter.
+ * </p>
+ * @param co the core object
+ * @param key the key
+ * @param value the value, unused
+ * @param arg the filter
+ * @return 0, to go on iterating
+ */
+static int fill_from_key(struct core_object *co, datum *key, datum *value, void *arg);
+
+int open_db_bloom(struct core_object *co, struct db_bloom *bloom, size_t size, const char *shm_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int    shm_fd;
+    void   *shm;
+    size_t num_words;
+    
+    memset(bloom, 0, sizeof(struct db_bloom));
+    if (size == 0)
+    {
+        return 0;
+    }
+    
+    num_words = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    bloom->num_bits = num_words * DB_BLOOM_WORD_BITS;
+    bloom->map_size = sizeof(struct db_bloom_shared) + num_words * sizeof(uint64_t);
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    
+    // The new object is zero-filled, so every bit starts clear.
+    if (ftruncate(shm_fd, (off_t) bloom->map_size) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        return -1;
+    }
+    
+    shm = mmap(NULL, bloom->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    bloom->shared = (struct db_bloom_shared *) shm;
+    atomic_init(&bloom->shared->adds, 0);
+    atomic_init(&bloom->shared->rejects, 0);
+    atomic_init(&bloom->shared->false_positives, 0);
+    
+    return 0;
+}
+
+int fill_db_bloom(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int ret_val;
+    
+    if (!so->db_bloom.shared)
+    {
+        return 0;
+    }
+    
+    ret_val = 0;
+    for (size_t s = 0; s < so->num_db_shards && ret_val == 0; ++s)
+    {
+        ret_val = db_iterate(co, &so->db_shards[s], fill_from_key, &so->db_bloom);
+        close_db_handle(co, &so->db_shards[s]);
+    }
+    
+    return ret_val;
+}
+
+void close_db_bloom(struct db_bloom *bloom)
+{
+    if (bloom->shared)
+    {
+        munmap(bloom->shared, bloom->map_size);
+        bloom->shared = NULL;
+    }
+}
+
+void db_bloom_add(struct db_bloom *bloom, const datum *key)
+{
+    uint64_t hash;
+    size_t   bit;
+    
+    if (!bloom->shared)
+    {
+        return;
+    }
+    
+    hash = hash_db_key_64(key);
+    for (size_t i = 0; i < DB_BLOOM_HASHES; ++i)
+    {
+        bit = get_bloom_bit(bloom, hash, i);
+        atomic_fetch_or_explicit(&bloom->shared->words[bit / DB_BLOOM_WORD_BITS], 1ULL << (bit % DB_BLOOM_WORD_BITS),
+                                 memory_order_release);
+    }
+    atomic_fetch_add_explicit(&bloom->shared->adds, 1, memory_order_relaxed);
+}
+
+bool db_bloom_may_contain(struct db_bloom *bloom, const datum *key)
+{
+    uint64_t hash;
+    size_t   bit;
+    uint64_t word;
+    
+    if (!bloom->shared)
+    {
+        return true;
+    }
+    
+    hash = hash_db_key_64(key);
+    for (size_t i = 0; i < DB_BLOOM_HASHES; ++i)
+    {
+        bit  = get_bloom_bit(bloom, hash, i);
+        word = atomic_load_explicit(&bloom->shared->words[bit / DB_BLOOM_WORD_BITS], memory_order_acquire);
+        if (!(word & (1ULL << (bit % DB_BLOOM_WORD_BITS))))
+        {
+            atomic_fetch_add_explicit(&bloom->shared->rejects, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void db_bloom_false_positive(struct db_bloom *bloom)
+{
+    if (bloom->shared)
+    {
+        atomic_fetch_add_explicit(&bloom->shared->false_positives, 1, memory_order_relaxed);
+    }
+}
+
+void print_db_bloom_stats(struct db_bloom *bloom)
+{
+    size_t   bits_set;
+    uint64_t word;
+    double   fill;
+    double   false_positive_rate;
+    
+    if (!bloom->shared)
+    {
+        (void) fprintf(stdout, "database bloom filter: disabled\n");
+        return;
+    }
+    
+    bits_set = 0;
+    for (size_t w = 0; w < bloom->num_bits / DB_BLOOM_WORD_BITS; ++w)
+    {
+        for (word = atomic_load(&bloom->shared->words[w]); word; word &= word - 1)
+        {
+            ++bits_set;
+        }
+    }
+    
+    // A key not in the database gets through if all of its bits happen to be set.
+    fill                = (double) bits_set / (double) bloom->num_bits;
+    false_positive_rate = 1;
+    for (size_t i = 0; i < DB_BLOOM_HASHES; ++i)
+    {
+        false_positive_rate *= fill;
+    }
+    
+    (void) fprintf(stdout,
+                   "database bloom filter: %zu bits, %.1f%% set, %.4f%% expected false positives: %llu adds, "
+                   "%llu rejects, %llu false positives\n",
+                   bloom->num_bits, fill * PERCENT, false_positive_rate * PERCENT,
+                   (unsigned long long) atomic_load(&bloom->shared->adds),
+                   (unsigned long long) atomic_load(&bloom->shared->rejects),
+                   (unsigned long long) atomic_load(&bloom->shared->false_positives));
+}
+
+static size_t get_bloom_bit(const struct db_bloom *bloom, uint64_t hash, size_t i)
+{
+    uint64_t h1;
+    uint64_t h2;
+    
+    // h2 is odd, so that it never steps in place.
+    h1 = hash & UINT32_MAX;
+    h2 = (hash >> DB_BLOOM_HALF_BITS) | 1;
+    
+    return (size_t) ((h1 + i * h2) % bloom->num_bits);
+}
+
+static int fill_from_key(struct core_object *co, datum *key, datum *value, void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    (void) value;
+    db_bloom_add((struct db_bloom *) arg, key);
+    
+    return 0;
+}
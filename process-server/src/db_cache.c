@@ -0,0 +1,412 @@
+#include "../include/db.h"
+#include "../include/db_cache.h"
+#include "../include/manager.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DB_CACHE_LINE_SIZE 64                /** Entries start on a boundary of this many bytes so that none shares a cache line. */
+#define NANOSECONDS_PER_SECOND 1000000000ULL /** Nanoseconds in a second. */
+
+/**
+ * The state of the read cache shared by all processes. The entries follow, from DB_CACHE_SLOTS_OFFSET.
+ */
+struct db_cache_shared
+{
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t fills;
+    _Atomic uint64_t updates;
+    _Atomic uint64_t evictions;
+    _Atomic uint64_t oversized; // Values not cached, or dropped from the cache, because they did not fit.
+};
+
+/**
+ * An entry of the read cache. The key and then the value follow, in entry_size bytes.
+ */
+struct db_cache_slot
+{
+    _Atomic uint32_t version;   // Odd while the entry is being written.
+    uint32_t         hash;
+    _Atomic uint64_t last_used; // Monotonic time in nanoseconds of the last fill, or with LRU, of the last read.
+    uint32_t         key_size;  // 0 if the entry is empty.
+    uint32_t         value_size;
+};
+
+#define DB_CACHE_SLOTS_OFFSET \
+    ((sizeof(struct db_cache_shared) + DB_CACHE_LINE_SIZE - 1) / DB_CACHE_LINE_SIZE * DB_CACHE_LINE_SIZE) /** Offset of the first entry in the cache mapping. */
+
+// The mapping is page aligned, and every entry starts on a multiple of DB_CACHE_LINE_SIZE, so entries are aligned.
+_Static_assert(DB_CACHE_LINE_SIZE % _Alignof(struct db_cache_slot) == 0, "cache entries must be aligned");
+
+/**
+ * get_slot
+ * <p>
+ * Get an entry of the read cache.
+ * </p>
+ * @param cache the cache
+ * @param set the set of the entry
+ * @param way the index of the entry in its set
+ * @return the entry
+ */
+static struct db_cache_slot *get_slot(struct db_cache *cache, size_t set, size_t way);
+
+/**
+ * slot_holds_key
+ * <p>
+ * Check whether an entry of the read cache holds a key. The entry may be written concurrently, so the answer is
+ * only good if the version of the entry is unchanged afterwards.
+ * </p>
+ * @param slot the entry
+ * @param hash the hash of the key
+ * @param key the key
+ * @return true if the entry holds the key, otherwise false
+ */
+static bool slot_holds_key(struct db_cache_slot *slot, uint32_t hash, const datum *key);
+
+/**
+ * lock_slot
+ * <p>
+ * Start writing an entry of the read cache by making its version odd, if its version is still the one given.
+ * </p>
+ * @param slot the entry
+ * @param version the even version at which the entry was read
+ * @return true if the entry is now held for writing, false if another process changed it or is writing it
+ */
+static bool lock_slot(struct db_cache_slot *slot, uint32_t version);
+
+/**
+ * unlock_slot
+ * <p>
+ * Finish writing an entry of the read cache, giving it the next even version.
+ * </p>
+ * @param slot the entry
+ * @param version the version at which the entry was locked
+ */
+static void unlock_slot(struct db_cache_slot *slot, uint32_t version);
+
+/**
+ * monotonic_now
+ * <p>
+ * Get the monotonic time in nanoseconds.
+ * </p>
+ * @return the time
+ */
+static uint64_t monotonic_now(void);
+
+int open_db_cache(struct core_object *co, struct db_cache *cache, size_t size, size_t entry_size,
+                  enum db_cache_policy policy, const char *shm_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int  shm_fd;
+    void *shm;
+    
+    memset(cache, 0, sizeof(struct db_cache));
+    if (size == 0)
+    {
+        return 0;
+    }
+    
+    cache->entry_size = entry_size;
+    cache->policy     = policy;
+    cache->slot_size  = (sizeof(struct db_cache_slot) + entry_size + DB_CACHE_LINE_SIZE - 1) / DB_CACHE_LINE_SIZE
+                        * DB_CACHE_LINE_SIZE;
+    cache->num_sets   = size / (cache->slot_size * DB_CACHE_WAYS);
+    if (cache->num_sets == 0)
+    {
+        cache->num_sets = 1;
+    }
+    cache->map_size = DB_CACHE_SLOTS_OFFSET + cache->num_sets * DB_CACHE_WAYS * cache->slot_size;
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    
+    // The new object is zero-filled, so every entry starts empty at version 0.
+    if (ftruncate(shm_fd, (off_t) cache->map_size) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        return -1;
+    }
+    
+    shm = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    cache->shared = (struct db_cache_shared *) shm;
+    atomic_init(&cache->shared->hits, 0);
+    atomic_init(&cache->shared->misses, 0);
+    atomic_init(&cache->shared->fills, 0);
+    atomic_init(&cache->shared->updates, 0);
+    atomic_init(&cache->shared->evictions, 0);
+    atomic_init(&cache->shared->oversized, 0);
+    
+    return 0;
+}
+
+void close_db_cache(struct db_cache *cache)
+{
+    if (cache->shared)
+    {
+        munmap(cache->shared, cache->map_size);
+        cache->shared = NULL;
+    }
+}
+
+int db_cache_fetch(struct core_object *co, struct db_cache *cache, const datum *key, uint8_t **serial_buffer,
+                   size_t *serial_buffer_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint32_t             hash;
+    size_t               set;
+    struct db_cache_slot *slot;
+    uint32_t             version;
+    size_t               value_size;
+    
+    if (!cache->shared)
+    {
+        return 1;
+    }
+    if ((size_t) key->dsize > cache->entry_size)
+    {
+        atomic_fetch_add_explicit(&cache->shared->misses, 1, memory_order_relaxed);
+        return 1;
+    }
+    
+    hash = hash_db_key(key);
+    set  = hash % cache->num_sets;
+    for (size_t way = 0; way < DB_CACHE_WAYS; ++way)
+    {
+        slot    = get_slot(cache, set, way);
+        version = atomic_load_explicit(&slot->version, memory_order_acquire);
+        if ((version & 1) || !slot_holds_key(slot, hash, key))
+        {
+            continue;
+        }
+        
+        // A size torn by a concurrent write is caught by the version check, but must not overrun the entry first.
+        value_size = slot->value_size;
+        if (value_size > cache->entry_size - (size_t) key->dsize)
+        {
+            continue;
+        }
+        *serial_buffer = mm_malloc(value_size, co->mm);
+        if (!*serial_buffer)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        memcpy(*serial_buffer, (uint8_t *) (slot + 1) + key->dsize, value_size);
+        
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->version, memory_order_relaxed) != version)
+        {
+            mm_free(co->mm, *serial_buffer);
+            *serial_buffer = NULL;
+            continue;
+        }
+        
+        if (cache->policy == DB_CACHE_LRU)
+        {
+            atomic_store_explicit(&slot->last_used, monotonic_now(), memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&cache->shared->hits, 1, memory_order_relaxed);
+        *serial_buffer_size = value_size;
+        return 0;
+    }
+    
+    atomic_fetch_add_explicit(&cache->shared->misses, 1, memory_order_relaxed);
+    return 1;
+}
+
+void db_cache_fill(struct db_cache *cache, const datum *key, const datum *value)
+{
+    uint32_t             hash;
+    size_t               set;
+    struct db_cache_slot *slot;
+    struct db_cache_slot *victim;
+    uint32_t             version;
+    uint32_t             victim_version;
+    uint64_t             last_used;
+    uint64_t             victim_last_used;
+    bool                 evicted;
+    
+    if (!cache->shared)
+    {
+        return;
+    }
+    if ((size_t) key->dsize + (size_t) value->dsize > cache->entry_size)
+    {
+        atomic_fetch_add_explicit(&cache->shared->oversized, 1, memory_order_relaxed);
+        return;
+    }
+    
+    hash             = hash_db_key(key);
+    set              = hash % cache->num_sets;
+    victim           = NULL;
+    victim_version   = 0;
+    victim_last_used = UINT64_MAX;
+    for (size_t way = 0; way < DB_CACHE_WAYS; ++way)
+    {
+        slot    = get_slot(cache, set, way);
+        version = atomic_load_explicit(&slot->version, memory_order_acquire);
+        if (version & 1)
+        {
+            continue;
+        }
+        if (slot_holds_key(slot, hash, key))
+        {
+            return; // Another process filled it first.
+        }
+        
+        // Empty entries are taken before any is evicted.
+        last_used = (slot->key_size == 0) ? 0 : atomic_load_explicit(&slot->last_used, memory_order_relaxed);
+        if (last_used < victim_last_used)
+        {
+            victim           = slot;
+            victim_version   = version;
+            victim_last_used = last_used;
+        }
+    }
+    if (!victim || !lock_slot(victim, victim_version))
+    {
+        return;
+    }
+    
+    evicted = victim->key_size != 0;
+    victim->hash       = hash;
+    victim->key_size   = (uint32_t) key->dsize;
+    victim->value_size = (uint32_t) value->dsize;
+    memcpy(victim + 1, key->dptr, (size_t) key->dsize);
+    memcpy((uint8_t *) (victim + 1) + key->dsize, value->dptr, (size_t) value->dsize);
+    atomic_store_explicit(&victim->last_used, monotonic_now(), memory_order_relaxed);
+    unlock_slot(victim, victim_version);
+    
+    atomic_fetch_add_explicit(&cache->shared->fills, 1, memory_order_relaxed);
+    if (evicted)
+    {
+        atomic_fetch_add_explicit(&cache->shared->evictions, 1, memory_order_relaxed);
+    }
+}
+
+void db_cache_update(struct db_cache *cache, const datum *key, const datum *value)
+{
+    uint32_t             hash;
+    size_t               set;
+    struct db_cache_slot *slot;
+    uint32_t             version;
+    
+    if (!cache->shared || (size_t) key->dsize > cache->entry_size)
+    {
+        return;
+    }
+    
+    hash = hash_db_key(key);
+    set  = hash % cache->num_sets;
+    for (size_t way = 0; way < DB_CACHE_WAYS; ++way)
+    {
+        // With the shard lock held for writing, no other process can fill or update this key. An entry being
+        // written by another process is being filled with, or updated for, another key, so it will not hold this
+        // one afterwards and can be skipped.
+        slot    = get_slot(cache, set, way);
+        version = atomic_load_explicit(&slot->version, memory_order_acquire);
+        if ((version & 1) || !slot_holds_key(slot, hash, key) || !lock_slot(slot, version))
+        {
+            continue;
+        }
+        
+        if (value && (size_t) key->dsize + (size_t) value->dsize <= cache->entry_size)
+        {
+            slot->value_size = (uint32_t) value->dsize;
+            memcpy((uint8_t *) (slot + 1) + key->dsize, value->dptr, (size_t) value->dsize);
+            if (cache->policy == DB_CACHE_LRU)
+            {
+                atomic_store_explicit(&slot->last_used, monotonic_now(), memory_order_relaxed);
+            }
+            atomic_fetch_add_explicit(&cache->shared->updates, 1, memory_order_relaxed);
+        } else if (value)
+        {
+            slot->key_size = 0;
+            atomic_fetch_add_explicit(&cache->shared->oversized, 1, memory_order_relaxed);
+        } else
+        {
+            slot->key_size = 0;
+        }
+        unlock_slot(slot, version);
+    }
+}
+
+void print_db_cache_stats(struct db_cache *cache)
+{
+    if (!cache->shared)
+    {
+        (void) fprintf(stdout, "database cache: disabled\n");
+        return;
+    }
+    
+    (void) fprintf(stdout,
+                   "database cache: %zu entries of %zu bytes, %s: %llu hits, %llu misses, %llu fills, "
+                   "%llu updates, %llu evictions, %llu too large\n",
+                   cache->num_sets * DB_CACHE_WAYS, cache->entry_size,
+                   (cache->policy == DB_CACHE_LRU) ? "lru" : "fifo",
+                   (unsigned long long) atomic_load(&cache->shared->hits),
+                   (unsigned long long) atomic_load(&cache->shared->misses),
+                   (unsigned long long) atomic_load(&cache->shared->fills),
+                   (unsigned long long) atomic_load(&cache->shared->updates),
+                   (unsigned long long) atomic_load(&cache->shared->evictions),
+                   (unsigned long long) atomic_load(&cache->shared->oversized));
+}
+
+static struct db_cache_slot *get_slot(struct db_cache *cache, size_t set, size_t way)
+{
+    return (struct db_cache_slot *) (void *) ((uint8_t *) cache->shared + DB_CACHE_SLOTS_OFFSET
+                                              + (set * DB_CACHE_WAYS + way) * cache->slot_size);
+}
+
+static bool slot_holds_key(struct db_cache_slot *slot, uint32_t hash, const datum *key)
+{
+    return slot->hash == hash && slot->key_size == (uint32_t) key->dsize
+           && memcmp(slot + 1, key->dptr, (size_t) key->dsize) == 0;
+}
+
+static bool lock_slot(struct db_cache_slot *slot, uint32_t version)
+{
+    if (!atomic_compare_exchange_strong_explicit(&slot->version, &version, version + 1, memory_order_acquire,
+                                                 memory_order_relaxed))
+    {
+        return false;
+    }
+    atomic_thread_fence(memory_order_release);
+    
+    return true;
+}
+
+static void unlock_slot(struct db_cache_slot *slot, uint32_t version)
+{
+    atomic_store_explicit(&slot->version, version + 2, memory_order_release);
+}
+
+static uint64_t monotonic_now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (uint64_t) now.tv_sec * NANOSECONDS_PER_SECOND + (uint64_t) now.tv_nsec;
+}
@@ -0,0 +1,1003 @@
+#include "../include/db_blob.h"
+#include "../include/db_changelog.h"
+#include "../include/db_record.h"
+#include "../include/manager.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define DB_CHANGE_PARTS 3                  /** A change is written as its header, key, and value. */
+#define DB_CHANGELOG_BUFFER_SIZE 4096      /** Initial size of the buffers holding changes read and frames to send. */
+#define DB_CHANGELOG_SEND_SIZE (64 * 1024) /** Bytes of changes queued for a replica at a time, besides blobs. */
+#define DB_CHANGELOG_DISCARD_SIZE 64       /** Size of the buffer into which anything a replica sends late is read. */
+
+/**
+ * Statistics of the database change log, in memory shared by all processes.
+ */
+struct db_changelog_shared
+{
+    _Atomic uint64_t appended; // Changes appended.
+    _Atomic uint64_t sent;     // Bytes sent to replicas.
+    _Atomic uint32_t replicas; // Replicas connected.
+    _Atomic bool     torn;     // A short write left part of a change in the log; nothing is appended after it.
+};
+
+/**
+ * recover_changelog
+ * <p>
+ * Read through the change log, and cut off the first change that is not whole and intact and everything after it.
+ * </p>
+ * @param co the core object
+ * @param fd the change log
+ * @return 0 on success, -1 and set err on failure
+ */
+static int recover_changelog(struct core_object *co, int fd);
+
+/**
+ * pread_fully
+ * <p>
+ * Read a number of bytes from an offset in a file.
+ * </p>
+ * @param fd the file
+ * @param data the buffer into which to read
+ * @param size the number of bytes to read
+ * @param offset the offset from which to read
+ * @return 0 on success, 1 if the file ends first, -1 and set errno on failure
+ */
+static int pread_fully(int fd, void *data, size_t size, uint64_t offset);
+
+/**
+ * change_checksum
+ * <p>
+ * Get the CRC-32 of the key and value of a change.
+ * </p>
+ * @param key the key
+ * @param key_size the size of the key
+ * @param value the value
+ * @param value_size the size of the value
+ * @return the checksum
+ */
+static uint32_t change_checksum(const void *key, size_t key_size, const void *value, size_t value_size);
+
+/**
+ * reserve_buffer
+ * <p>
+ * Grow a buffer, by doubling, until it holds at least a number of bytes.
+ * </p>
+ * @param co the core object
+ * @param data the buffer
+ * @param capacity the size of the buffer
+ * @param size the number of bytes the buffer must hold
+ * @return 0 on success, -1 and set err on failure
+ */
+static int reserve_buffer(struct core_object *co, uint8_t **data, size_t *capacity, size_t size);
+
+/**
+ * accept_replica
+ * <p>
+ * Accept a replica connecting to the change log server into a free slot. A replica connecting while every slot is
+ * taken is disconnected.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param server the server
+ * @return 0 on success, -1 and set err on failure
+ */
+static int accept_replica(struct core_object *co, struct db_changelog *changelog, struct db_changelog_server *server);
+
+/**
+ * receive_from_replica
+ * <p>
+ * Read the offset from which a replica asks to be sent changes, as much as has arrived. Anything the replica sends
+ * after it is discarded. A replica that has hung up is dropped.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param replica the replica
+ */
+static void receive_from_replica(struct core_object *co, struct db_changelog *changelog,
+                                 struct db_changelog_replica *replica);
+
+/**
+ * fill_replica
+ * <p>
+ * Queue for a replica the changes after its offset, up to DB_CHANGELOG_SEND_SIZE bytes of them, stopping at a
+ * change still being appended. If there are none and the replica has been sent nothing for a while, queue a
+ * heartbeat.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param server the server
+ * @param replica the replica
+ * @param end the size of the change log
+ * @param now the current time
+ * @return 0 on success, 1 if the replica asked for changes from an offset within a change, -1 and set err on failure
+ */
+static int fill_replica(struct core_object *co, struct db_changelog *changelog, struct db_changelog_server *server,
+                        struct db_changelog_replica *replica, uint64_t end, time_t now);
+
+/**
+ * queue_blob
+ * <p>
+ * Queue for a replica the blob holding the value of the upsert it is sent next. A blob missing from the blob store
+ * is left out, with a warning.
+ * </p>
+ * @param co the core object
+ * @param replica the replica
+ * @param end the size of the change log
+ * @param digest the digest of the blob
+ * @return 0 on success, -1 and set err on failure
+ */
+static int queue_blob(struct core_object *co, struct db_changelog_replica *replica, uint64_t end,
+                      const char *digest);
+
+/**
+ * queue_frame
+ * <p>
+ * Queue a frame for a replica: its header, then the key and value.
+ * </p>
+ * @param co the core object
+ * @param replica the replica
+ * @param frame the header of the frame
+ * @param key the key; NULL if the size of the key is 0
+ * @param value the value; NULL if the size of the value is 0
+ * @return 0 on success, -1 and set err on failure
+ */
+static int queue_frame(struct core_object *co, struct db_changelog_replica *replica,
+                       const struct db_change_frame *frame, const void *key, const void *value);
+
+/**
+ * send_to_replica
+ * <p>
+ * Send a replica as much of its queued frames as it takes without blocking. A replica that cannot be sent to is
+ * dropped.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param replica the replica
+ */
+static void send_to_replica(struct core_object *co, struct db_changelog *changelog,
+                            struct db_changelog_replica *replica);
+
+/**
+ * drop_replica
+ * <p>
+ * Disconnect a replica and free its slot.
+ * </p>
+ * @param co the core object
+ * @param changelog the change log
+ * @param replica the replica
+ */
+static void drop_replica(struct core_object *co, struct db_changelog *changelog,
+                         struct db_changelog_replica *replica);
+
+int open_db_changelog(struct core_object *co, struct db_changelog *changelog, const char *path, const char *shm_name,
+                      bool enabled)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int  fd;
+    int  shm_fd;
+    void *shm;
+    
+    memset(changelog, 0, sizeof(struct db_changelog));
+    changelog->fd = -1;
+    if (!enabled)
+    {
+        return 0;
+    }
+    
+    // Every process appends to the change log through the one open file description made here.
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, DB_FILE_MODE);
+    if (fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (recover_changelog(co, fd) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        close(fd);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    if (ftruncate(shm_fd, (off_t) sizeof(struct db_changelog_shared)) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        close(fd);
+        return -1;
+    }
+    shm = mmap(NULL, sizeof(struct db_changelog_shared), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        close(fd);
+        return -1;
+    }
+    
+    changelog->shared = (struct db_changelog_shared *) shm;
+    changelog->fd     = fd;
+    atomic_init(&changelog->shared->appended, 0);
+    atomic_init(&changelog->shared->sent, 0);
+    atomic_init(&changelog->shared->replicas, 0);
+    atomic_init(&changelog->shared->torn, false);
+    
+    return 0;
+}
+
+void close_db_changelog(struct db_changelog *changelog)
+{
+    if (changelog->shared)
+    {
+        munmap(changelog->shared, sizeof(struct db_changelog_shared));
+        close(changelog->fd);
+        changelog->shared = NULL;
+        changelog->fd     = -1;
+    }
+}
+
+int append_db_change(struct core_object *co, struct db_changelog *changelog, uint32_t type, const datum *key,
+                     const datum *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_change_header header;
+    struct iovec            iov[DB_CHANGE_PARTS];
+    size_t                  change_size;
+    ssize_t                 written;
+    
+    if (!changelog->shared)
+    {
+        return 0;
+    }
+    
+    // A torn change is cut off only when the log is next opened, and replicas stop at it, so nothing may follow it.
+    if (atomic_load(&changelog->shared->torn))
+    {
+        errno = EIO;
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    header.type       = type;
+    header.key_size   = (uint32_t) key->dsize;
+    header.value_size = (value) ? (uint32_t) value->dsize : 0;
+    header.checksum   = change_checksum(key->dptr, header.key_size, (value) ? value->dptr : NULL,
+                                        header.value_size);
+    header.time       = (int64_t) time(NULL);
+    
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = key->dptr;
+    iov[1].iov_len  = header.key_size;
+    iov[2].iov_base = (value) ? value->dptr : NULL;
+    iov[2].iov_len  = header.value_size;
+    change_size = sizeof(header) + header.key_size + header.value_size;
+    
+    // One write appends the whole change, so changes appended by other processes are never interleaved with it.
+    written = writev(changelog->fd, iov, DB_CHANGE_PARTS);
+    if (written != (ssize_t) change_size)
+    {
+        // The log is shared by every process, so it cannot be cut back without losing changes appended since.
+        if (written != -1 && !atomic_exchange(&changelog->shared->torn, true))
+        {
+            (void) fprintf(stderr, "database change log torn by a short write; no more changes are logged\n");
+        }
+        if (written != -1)
+        {
+            errno = EIO;
+        }
+        SET_ERROR(co->err);
+        return -1;
+    }
+    atomic_fetch_add(&changelog->shared->appended, 1);
+    
+    return 0;
+}
+
+int get_db_changelog_status(struct db_changelog *changelog, uint64_t *size, size_t *num_replicas)
+{
+    struct stat st;
+    
+    *size         = 0;
+    *num_replicas = 0;
+    if (!changelog->shared)
+    {
+        return 0;
+    }
+    if (fstat(changelog->fd, &st) == -1)
+    {
+        return -1;
+    }
+    *size         = (uint64_t) st.st_size;
+    *num_replicas = atomic_load(&changelog->shared->replicas);
+    
+    return 0;
+}
+
+int open_db_changelog_server(struct core_object *co, struct db_changelog_server *server, const char *socket_path)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct sockaddr_un addr;
+    
+    memset(server, 0, sizeof(struct db_changelog_server));
+    server->listen_fd   = -1;
+    server->socket_path = socket_path;
+    for (size_t r = 0; r < MAX_DB_REPLICAS; ++r)
+    {
+        server->replicas[r].fd = -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        SET_ERROR(co->err);
+        return -1;
+    }
+    strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path));
+    
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    // A socket left at the path by an earlier run would make the bind fail.
+    unlink(socket_path);
+    if (bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(server->listen_fd, MAX_DB_REPLICAS) == -1)
+    {
+        SET_ERROR(co->err);
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        return -1;
+    }
+    
+    server->change_capacity = DB_CHANGELOG_BUFFER_SIZE;
+    server->change          = mm_malloc(server->change_capacity, co->mm);
+    if (!server->change)
+    {
+        SET_ERROR(co->err);
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        unlink(socket_path);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int serve_db_changelog(struct core_object *co, struct db_changelog *changelog, struct db_changelog_server *server)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct pollfd               pollfds[1 + MAX_DB_REPLICAS];
+    struct db_changelog_replica *replica;
+    struct stat                 st;
+    uint64_t                    end;
+    time_t                      now;
+    int                         timeout;
+    int                         res;
+    
+    if (fstat(changelog->fd, &st) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    end = (uint64_t) st.st_size;
+    
+    // A replica behind the log is filled again at once; otherwise the server waits for new changes or replicas.
+    timeout = DB_CHANGELOG_POLL_MS;
+    pollfds[0].fd      = server->listen_fd;
+    pollfds[0].events  = POLLIN;
+    pollfds[0].revents = 0;
+    for (size_t r = 0; r < MAX_DB_REPLICAS; ++r)
+    {
+        replica = &server->replicas[r];
+        pollfds[1 + r].fd      = replica->fd; // A free slot is -1, which poll ignores.
+        pollfds[1 + r].events  = (short) (POLLIN | ((replica->out_sent < replica->out_size) ? POLLOUT : 0));
+        pollfds[1 + r].revents = 0;
+        if (replica->fd != -1 && replica->start_size == sizeof(replica->start) && replica->offset != end
+            && replica->out_sent == replica->out_size)
+        {
+            timeout = 0;
+        }
+    }
+    
+    if (poll(pollfds, 1 + MAX_DB_REPLICAS, timeout) == -1)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if ((pollfds[0].revents & POLLIN) && accept_replica(co, changelog, server) == -1)
+    {
+        return -1;
+    }
+    for (size_t r = 0; r < MAX_DB_REPLICAS; ++r)
+    {
+        if (pollfds[1 + r].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            receive_from_replica(co, changelog, &server->replicas[r]);
+        }
+    }
+    
+    if (fstat(changelog->fd, &st) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    end = (uint64_t) st.st_size;
+    now = time(NULL);
+    for (size_t r = 0; r < MAX_DB_REPLICAS; ++r)
+    {
+        replica = &server->replicas[r];
+        if (replica->fd == -1 || replica->start_size < sizeof(replica->start))
+        {
+            continue;
+        }
+        if (replica->out_sent == replica->out_size)
+        {
+            res = fill_replica(co, changelog, server, replica, end, now);
+            if (res == -1)
+            {
+                return -1;
+            }
+            if (res == 1)
+            {
+                drop_replica(co, changelog, replica);
+                continue;
+            }
+        }
+        if (replica->out_sent < replica->out_size)
+        {
+            send_to_replica(co, changelog, replica);
+        }
+    }
+    
+    return 0;
+}
+
+void close_db_changelog_server(struct core_object *co, struct db_changelog *changelog,
+                               struct db_changelog_server *server)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    for (size_t r = 0; r < MAX_DB_REPLICAS; ++r)
+    {
+        if (server->replicas[r].fd != -1)
+        {
+            drop_replica(co, changelog, &server->replicas[r]);
+        }
+    }
+    if (server->listen_fd != -1)
+    {
+        close(server->listen_fd);
+        unlink(server->socket_path);
+        server->listen_fd = -1;
+    }
+    mm_free(co->mm, server->change);
+    server->change = NULL;
+}
+
+void print_db_changelog_stats(struct db_changelog *changelog)
+{
+    if (!changelog->shared)
+    {
+        (void) fprintf(stdout, "database change log: disabled\n");
+        return;
+    }
+    
+    (void) fprintf(stdout, "database change log: %llu changes appended, %llu bytes sent to replicas\n",
+                   (unsigned long long) atomic_load(&changelog->shared->appended),
+                   (unsigned long long) atomic_load(&changelog->shared->sent));
+}
+
+static int recover_changelog(struct core_object *co, int fd)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_change_header header;
+    struct stat             st;
+    uint64_t                size;
+    uint64_t                offset;
+    uint64_t                change_size;
+    uint8_t                 *change;
+    size_t                  change_capacity;
+    int                     res;
+    
+    if (fstat(fd, &st) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    size = (uint64_t) st.st_size;
+    
+    change_capacity = DB_CHANGELOG_BUFFER_SIZE;
+    change          = mm_malloc(change_capacity, co->mm);
+    if (!change)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    offset = 0;
+    res    = 0;
+    while (offset + sizeof(header) <= size)
+    {
+        res = pread_fully(fd, &header, sizeof(header), offset);
+        if (res != 0 || (header.type != DB_CHANGE_UPSERT && header.type != DB_CHANGE_REMOVE))
+        {
+            break;
+        }
+        change_size = sizeof(header) + (uint64_t) header.key_size + header.value_size;
+        if (offset + change_size > size)
+        {
+            break;
+        }
+        res = reserve_buffer(co, &change, &change_capacity, (size_t) header.key_size + header.value_size);
+        if (res == 0)
+        {
+            res = pread_fully(fd, change, (size_t) header.key_size + header.value_size, offset + sizeof(header));
+        }
+        if (res != 0 || change_checksum(change, header.key_size, change + header.key_size, header.value_size)
+                        != header.checksum)
+        {
+            break;
+        }
+        offset += change_size;
+    }
+    mm_free(co->mm, change);
+    if (res == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if (offset < size)
+    {
+        (void) fprintf(stderr, "Cut %llu bytes of a torn change off the end of the database change log.\n",
+                       (unsigned long long) (size - offset));
+        if (ftruncate(fd, (off_t) offset) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int pread_fully(int fd, void *data, size_t size, uint64_t offset)
+{
+    uint8_t *bytes;
+    size_t  done;
+    ssize_t res;
+    
+    bytes = (uint8_t *) data;
+    done  = 0;
+    while (done < size)
+    {
+        res = pread(fd, bytes + done, size - done, (off_t) (offset + done));
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (res == 0)
+        {
+            return 1;
+        }
+        done += (size_t) res;
+    }
+    
+    return 0;
+}
+
+static uint32_t change_checksum(const void *key, size_t key_size, const void *value, size_t value_size)
+{
+    uLong checksum;
+    
+    checksum = crc32(0L, Z_NULL, 0);
+    // zlib takes a NULL buffer as asking for the initial value, so empty parts are skipped.
+    if (key_size)
+    {
+        checksum = crc32(checksum, (const Bytef *) key, (uInt) key_size);
+    }
+    if (value_size)
+    {
+        checksum = crc32(checksum, (const Bytef *) value, (uInt) value_size);
+    }
+    
+    return (uint32_t) checksum;
+}
+
+static int reserve_buffer(struct core_object *co, uint8_t **data, size_t *capacity, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint8_t *grown;
+    size_t  grown_capacity;
+    
+    if (size <= *capacity)
+    {
+        return 0;
+    }
+    
+    grown_capacity = (*capacity) ? *capacity : DB_CHANGELOG_BUFFER_SIZE;
+    while (size > grown_capacity)
+    {
+        grown_capacity *= 2;
+    }
+    grown = (*data) ? mm_realloc(*data, grown_capacity, co->mm) : mm_malloc(grown_capacity, co->mm);
+    if (!grown)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    *data     = grown;
+    *capacity = grown_capacity;
+    
+    return 0;
+}
+
+static int accept_replica(struct core_object *co, struct db_changelog *changelog, struct db_changelog_server *server)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_changelog_replica *replica;
+    int                         fd;
+    
+    fd = accept(server->listen_fd, NULL, NULL);
+    if (fd == -1)
+    {
+        // The replica may have given up before it was accepted.
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR)
+        {
+            return 0;
+        }
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    replica = NULL;
+    for (size_t r = 0; r < MAX_DB_REPLICAS && !replica; ++r)
+    {
+        if (server->replicas[r].fd == -1)
+        {
+            replica = &server->replicas[r];
+        }
+    }
+    if (!replica)
+    {
+        (void) fprintf(stderr, "Turned away a replica; %d replicas are already connected.\n", MAX_DB_REPLICAS);
+        close(fd);
+        return 0;
+    }
+    
+    // The server sends to every replica from one process, so none may block it.
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        SET_ERROR(co->err);
+        close(fd);
+        return -1;
+    }
+    
+    memset(replica, 0, sizeof(struct db_changelog_replica));
+    replica->fd = fd;
+    atomic_fetch_add(&changelog->shared->replicas, 1);
+    
+    return 0;
+}
+
+static void receive_from_replica(struct core_object *co, struct db_changelog *changelog,
+                                 struct db_changelog_replica *replica)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint8_t discard[DB_CHANGELOG_DISCARD_SIZE];
+    ssize_t res;
+    
+    if (replica->start_size < sizeof(replica->start))
+    {
+        res = recv(replica->fd, replica->start + replica->start_size, sizeof(replica->start) - replica->start_size,
+                   MSG_DONTWAIT);
+    } else
+    {
+        res = recv(replica->fd, discard, sizeof(discard), MSG_DONTWAIT);
+    }
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (res <= 0)
+    {
+        drop_replica(co, changelog, replica);
+        return;
+    }
+    
+    if (replica->start_size < sizeof(replica->start))
+    {
+        replica->start_size += (size_t) res;
+        if (replica->start_size == sizeof(replica->start))
+        {
+            memcpy(&replica->offset, replica->start, sizeof(replica->offset));
+            (void) fprintf(stdout, "Replica connected to the database change log from offset %llu.\n",
+                           (unsigned long long) replica->offset);
+        }
+    }
+}
+
+static int fill_replica(struct core_object *co, struct db_changelog *changelog, struct db_changelog_server *server,
+                        struct db_changelog_replica *replica, uint64_t end, time_t now)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_change_header header;
+    struct db_change_frame  frame;
+    struct db_record        record;
+    char                    digest[SHA256_HEX_LEN + 1];
+    uint64_t                change_size;
+    int                     res;
+    
+    replica->out_size = 0;
+    replica->out_sent = 0;
+    
+    // A replica ahead of the log was following a log since replaced, so it is sent this one from the start.
+    if (replica->offset > end)
+    {
+        (void) fprintf(stderr, "Replica asked for changes from offset %llu of a change log of %llu bytes; "
+                               "sending it every change.\n",
+                       (unsigned long long) replica->offset, (unsigned long long) end);
+        replica->offset = 0;
+    }
+    
+    while (replica->offset + sizeof(header) <= end && replica->out_size < DB_CHANGELOG_SEND_SIZE)
+    {
+        res = pread_fully(changelog->fd, &header, sizeof(header), replica->offset);
+        if (res == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        if (res == 1)
+        {
+            break;
+        }
+        if (header.type != DB_CHANGE_UPSERT && header.type != DB_CHANGE_REMOVE)
+        {
+            (void) fprintf(stderr, "Replica asked for changes from offset %llu, which is not the start of one.\n",
+                           (unsigned long long) replica->offset);
+            return 1;
+        }
+        
+        // A change not yet whole is still being appended, and is sent in a later round.
+        change_size = sizeof(header) + (uint64_t) header.key_size + header.value_size;
+        if (replica->offset + change_size > end)
+        {
+            break;
+        }
+        if (reserve_buffer(co, &server->change, &server->change_capacity,
+                           (size_t) header.key_size + header.value_size) == -1)
+        {
+            return -1;
+        }
+        res = pread_fully(changelog->fd, server->change, (size_t) header.key_size + header.value_size,
+                          replica->offset + sizeof(header));
+        if (res == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        if (res == 1)
+        {
+            break;
+        }
+        
+        // The blob holding an upserted value is sent first, so that the replica has it before the record naming it.
+        if (header.type == DB_CHANGE_UPSERT
+            && decode_db_record(server->change + header.key_size, header.value_size, &record) == 0
+            && (record.flags & DB_RECORD_BLOB) && record.body_size == SHA256_HEX_LEN)
+        {
+            memcpy(digest, record.body, SHA256_HEX_LEN);
+            digest[SHA256_HEX_LEN] = '\0';
+            if (queue_blob(co, replica, end, digest) == -1)
+            {
+                return -1;
+            }
+        }
+        
+        replica->offset += change_size;
+        frame.offset = replica->offset;
+        frame.end    = end;
+        frame.change = header;
+        if (queue_frame(co, replica, &frame, server->change, server->change + header.key_size) == -1)
+        {
+            return -1;
+        }
+    }
+    
+    if (replica->out_size == 0 && difftime(now, replica->last_sent) >= DB_CHANGELOG_HEARTBEAT_INTERVAL)
+    {
+        memset(&frame, 0, sizeof(frame));
+        frame.offset      = replica->offset;
+        frame.end         = end;
+        frame.change.type = DB_CHANGE_HEARTBEAT;
+        frame.change.time = (int64_t) now;
+        if (queue_frame(co, replica, &frame, NULL, NULL) == -1)
+        {
+            return -1;
+        }
+    }
+    if (replica->out_size > 0)
+    {
+        replica->last_sent = now;
+    }
+    
+    return 0;
+}
+
+static int queue_blob(struct core_object *co, struct db_changelog_replica *replica, uint64_t end,
+                      const char *digest)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_change_frame frame;
+    uint8_t                *value;
+    int                    fd;
+    size_t                 size;
+    int                    res;
+    
+    res = open_db_blob(co, digest, &fd, &size);
+    if (res == -1)
+    {
+        return -1;
+    }
+    if (res == 1 || size > UINT32_MAX)
+    {
+        (void) fprintf(stderr, "database blob %s not sent to a replica\n", digest);
+        if (res == 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+    
+    // The blob is read straight into the queue, after the frame header and the digest.
+    memset(&frame, 0, sizeof(frame));
+    frame.offset            = replica->offset;
+    frame.end               = end;
+    frame.change.type       = DB_CHANGE_BLOB;
+    frame.change.key_size   = SHA256_HEX_LEN;
+    frame.change.value_size = (uint32_t) size;
+    frame.change.time       = (int64_t) time(NULL);
+    if (reserve_buffer(co, &replica->out, &replica->out_capacity,
+                       replica->out_size + sizeof(frame) + SHA256_HEX_LEN + size) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    value = replica->out + replica->out_size + sizeof(frame) + SHA256_HEX_LEN;
+    res   = pread_fully(fd, value, size, 0);
+    close(fd);
+    if (res != 0)
+    {
+        if (res == 1)
+        {
+            errno = EIO;
+        }
+        SET_ERROR(co->err);
+        return -1;
+    }
+    frame.change.checksum = change_checksum(digest, SHA256_HEX_LEN, value, size);
+    memcpy(replica->out + replica->out_size, &frame, sizeof(frame));
+    memcpy(replica->out + replica->out_size + sizeof(frame), digest, SHA256_HEX_LEN);
+    replica->out_size += sizeof(frame) + SHA256_HEX_LEN + size;
+    
+    return 0;
+}
+
+static int queue_frame(struct core_object *co, struct db_changelog_replica *replica,
+                       const struct db_change_frame *frame, const void *key, const void *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint8_t *out;
+    
+    if (reserve_buffer(co, &replica->out, &replica->out_capacity, replica->out_size + sizeof(struct db_change_frame)
+                                                                 + frame->change.key_size
+                                                                 + frame->change.value_size) == -1)
+    {
+        return -1;
+    }
+    
+    out = replica->out + replica->out_size;
+    memcpy(out, frame, sizeof(struct db_change_frame));
+    out += sizeof(struct db_change_frame);
+    if (frame->change.key_size)
+    {
+        memcpy(out, key, frame->change.key_size);
+        out += frame->change.key_size;
+    }
+    if (frame->change.value_size)
+    {
+        memcpy(out, value, frame->change.value_size);
+    }
+    replica->out_size += sizeof(struct db_change_frame) + frame->change.key_size + frame->change.value_size;
+    
+    return 0;
+}
+
+static void send_to_replica(struct core_object *co, struct db_changelog *changelog,
+                            struct db_changelog_replica *replica)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    ssize_t sent;
+    
+    sent = send(replica->fd, replica->out + replica->out_sent, replica->out_size - replica->out_sent,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            drop_replica(co, changelog, replica);
+        }
+        return;
+    }
+    
+    replica->out_sent += (size_t) sent;
+    atomic_fetch_add(&changelog->shared->sent, (uint64_t) sent);
+    if (replica->out_sent == replica->out_size)
+    {
+        replica->out_size = 0;
+        replica->out_sent = 0;
+    }
+}
+
+static void drop_replica(struct core_object *co, struct db_changelog *changelog,
+                         struct db_changelog_replica *replica)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (replica->start_size == sizeof(replica->start))
+    {
+        (void) fprintf(stdout, "Replica disconnected from the database change log at offset %llu.\n",
+                       (unsigned long long) replica->offset);
+    }
+    close(replica->fd);
+    mm_free(co->mm, replica->out);
+    memset(replica, 0, sizeof(struct db_changelog_replica));
+    replica->fd = -1;
+    atomic_fetch_sub(&changelog->shared->replicas, 1);
+}
@@ -0,0 +1,437 @@
+#include "../include/db.h"
+#include "../include/db_blob.h"
+#include "../include/db_expiry.h"
+#include "../include/db_index.h"
+#include "../include/db_record.h"
+#include "../include/manager.h"
+#include "../include/util.h"
+
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DB_EXPIRY_BUFFER_SIZE 256                 /** Initial size of the buffers holding the cursor and the expired keys. */
+#define NS_PER_MS 1000000L                        /** Nanoseconds in a millisecond. */
+#define NS_PER_S 1000000000L                      /** Nanoseconds in a second. */
+#define SLICE_NS (DB_EXPIRY_SLICE_MS * NS_PER_MS) /** Nanoseconds a slice may spend checking keys. */
+
+/**
+ * reserve_buffer
+ * <p>
+ * Grow a buffer, by doubling, until it holds at least a number of bytes.
+ * </p>
+ * @param co the core object
+ * @param data the buffer
+ * @param capacity the size of the buffer
+ * @param size the number of bytes the buffer must hold
+ * @return 0 on success, -1 and set err on failure
+ */
+static int reserve_buffer(struct core_object *co, char **data, size_t *capacity, size_t size);
+
+/**
+ * check_key
+ * <p>
+ * Check a key listed from the ordered key index against its metadata record, and keep it to be removed if it has
+ * expired. The key becomes the cursor of the pass.
+ * </p>
+ * @param co the core object
+ * @param key the key
+ * @param arg the pass
+ * @return 0 to go on, 1 once the slice has reached its deadline, -1 and set err on failure
+ */
+static int check_key(struct core_object *co, const datum *key, void *arg);
+
+/**
+ * mark_blob
+ * <p>
+ * Keep the digest of a blob referred to, so that the blob is not collected after the pass.
+ * </p>
+ * @param co the core object
+ * @param sweep the pass
+ * @param digest the digest of the blob, SHA256_HEX_LEN characters
+ * @return 0 on success, -1 and set err on failure
+ */
+static int mark_blob(struct core_object *co, struct db_expiry_sweep *sweep, const char *digest);
+
+/**
+ * mark_record_blob
+ * <p>
+ * Read the record of a key that has no readable metadata record, and keep the digest of its blob if it has one. If
+ * the record cannot be decoded, no blob is collected after the pass.
+ * </p>
+ * @param co the core object
+ * @param sweep the pass
+ * @param key the key
+ * @return 0 on success, -1 and set err on failure
+ */
+static int mark_record_blob(struct core_object *co, struct db_expiry_sweep *sweep, const datum *key);
+
+/**
+ * mark_upload_links
+ * <p>
+ * Keep the digests of the blobs that the content-addressed files under a directory of the write directory link to.
+ * </p>
+ * @param co the core object
+ * @param sweep the pass
+ * @param dir_path the path of the directory
+ * @return 0 on success, -1 and set err on failure
+ */
+static int mark_upload_links(struct core_object *co, struct db_expiry_sweep *sweep, const char *dir_path);
+
+/**
+ * past_deadline
+ * <p>
+ * Check whether the monotonic clock has reached a deadline.
+ * </p>
+ * @param deadline the deadline
+ * @return true if the deadline has been reached, otherwise false
+ */
+static bool past_deadline(const struct timespec *deadline);
+
+int open_db_expiry_sweep(struct core_object *co, struct db_expiry_sweep *sweep)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    memset(sweep, 0, sizeof(struct db_expiry_sweep));
+    sweep->started          = time(NULL);
+    sweep->cursor_capacity  = DB_EXPIRY_BUFFER_SIZE;
+    sweep->cursor           = mm_malloc(sweep->cursor_capacity, co->mm);
+    sweep->expired_capacity = DB_EXPIRY_BUFFER_SIZE;
+    sweep->expired          = mm_malloc(sweep->expired_capacity, co->mm);
+    if (!(sweep->cursor && sweep->expired))
+    {
+        SET_ERROR(co->err);
+        close_db_expiry_sweep(co, sweep);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int sweep_db_expiry_slice(struct core_object *co, struct state_object *so, struct db_expiry_sweep *sweep)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    datum           keys[DB_EXPIRY_SLICE_KEYS];
+    datum           batch[DB_EXPIRY_SLICE_KEYS];
+    int             results[DB_EXPIRY_SLICE_KEYS];
+    struct db_shard *shard;
+    size_t          offset;
+    size_t          num_items;
+    int             res;
+    
+    sweep->now          = time(NULL);
+    sweep->num_expired  = 0;
+    sweep->expired_size = 0;
+    if (clock_gettime(CLOCK_MONOTONIC, &sweep->deadline) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    // Carry into the seconds before adding, so the comparison does not rely on the sum not overflowing.
+    if (sweep->deadline.tv_nsec >= NS_PER_S - SLICE_NS)
+    {
+        sweep->deadline.tv_nsec -= NS_PER_S - SLICE_NS;
+        ++sweep->deadline.tv_sec;
+    } else
+    {
+        sweep->deadline.tv_nsec += SLICE_NS;
+    }
+    
+    // The slice lists every key after the cursor, so it takes no lock until it removes what it found.
+    res = db_index_list(co, &so->db_index, "", 0, (sweep->cursor_size) ? sweep->cursor : NULL, sweep->cursor_size,
+                        DB_EXPIRY_SLICE_KEYS, check_key, sweep);
+    if (res == -1)
+    {
+        return -1;
+    }
+    
+    offset = 0;
+    for (size_t k = 0; k < sweep->num_expired; ++k)
+    {
+        keys[k].dptr  = sweep->expired + offset;
+        keys[k].dsize = (int) sweep->expired_sizes[k];
+        offset += sweep->expired_sizes[k];
+    }
+    
+    // A removal that fails is left for the next pass to retry.
+    for (size_t s = 0; s < so->num_db_shards && sweep->num_expired > 0; ++s)
+    {
+        shard     = &so->db_shards[s];
+        num_items = 0;
+        for (size_t k = 0; k < sweep->num_expired; ++k)
+        {
+            if (get_db_shard(so, &keys[k]) == shard)
+            {
+                batch[num_items++] = keys[k];
+            }
+        }
+        if (num_items == 0)
+        {
+            continue;
+        }
+        if (db_expire_batch(co, shard, num_items, batch, sweep->now, results) == -1)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < num_items; ++i)
+        {
+            sweep->removed += (results[i] == 0) ? 1 : 0;
+        }
+    }
+    
+    return res;
+}
+
+void close_db_expiry_sweep(struct core_object *co, struct db_expiry_sweep *sweep)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    mm_free(co->mm, sweep->cursor);
+    mm_free(co->mm, sweep->expired);
+    if (sweep->live_blobs)
+    {
+        mm_free(co->mm, sweep->live_blobs);
+    }
+    sweep->cursor     = NULL;
+    sweep->expired    = NULL;
+    sweep->live_blobs = NULL;
+}
+
+int collect_db_expiry_blobs(struct core_object *co, struct db_expiry_sweep *sweep)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (!sweep->collect_blobs)
+    {
+        return 0;
+    }
+    if (mark_upload_links(co, sweep, WRITE_DIR) == -1)
+    {
+        return -1;
+    }
+    
+    return collect_db_blobs(co, sweep->live_blobs, sweep->num_live_blobs, sweep->started - DB_BLOB_COLLECT_GRACE,
+                            &sweep->collected);
+}
+
+static int reserve_buffer(struct core_object *co, char **data, size_t *capacity, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char   *grown;
+    size_t grown_capacity;
+    
+    if (size <= *capacity)
+    {
+        return 0;
+    }
+    
+    grown_capacity = *capacity;
+    while (size > grown_capacity)
+    {
+        grown_capacity *= 2;
+    }
+    grown = mm_realloc(*data, grown_capacity, co->mm);
+    if (!grown)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    *data     = grown;
+    *capacity = grown_capacity;
+    
+    return 0;
+}
+
+static int check_key(struct core_object *co, const datum *key, void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_expiry_sweep *sweep;
+    size_t                 key_size;
+    uint8_t                *data;
+    size_t                 data_size;
+    struct db_meta         meta;
+    int                    res;
+    
+    sweep    = (struct db_expiry_sweep *) arg;
+    key_size = (size_t) key->dsize;
+    if (reserve_buffer(co, &sweep->cursor, &sweep->cursor_capacity, key_size) == -1)
+    {
+        return -1;
+    }
+    memcpy(sweep->cursor, key->dptr, key_size);
+    sweep->cursor_size = key_size;
+    ++sweep->checked;
+    
+    // The expiry of a value is in its metadata record, which is read without reading the value. The entity tag
+    // kept there is the digest of the blob of a value in the blob store.
+    res = db_fetch_meta(co, get_db_shard(co->so, key), key, &data, &data_size);
+    if (res == -1)
+    {
+        return -1;
+    }
+    if (res == 0 && decode_db_meta(data, data_size, &meta) == 0)
+    {
+        if (is_db_expired(meta.expires, sweep->now))
+        {
+            if (reserve_buffer(co, &sweep->expired, &sweep->expired_capacity, sweep->expired_size + key_size) == -1)
+            {
+                mm_free(co->mm, data);
+                return -1;
+            }
+            memcpy(sweep->expired + sweep->expired_size, key->dptr, key_size);
+            sweep->expired_size += key_size;
+            sweep->expired_sizes[sweep->num_expired++] = key_size;
+        } else if (sweep->collect_blobs && strlen(meta.etag) == SHA256_HEX_LEN && mark_blob(co, sweep, meta.etag) == -1)
+        {
+            mm_free(co->mm, data);
+            return -1;
+        }
+        mm_free(co->mm, data);
+    } else
+    {
+        if (res == 0)
+        {
+            mm_free(co->mm, data);
+        }
+        if (sweep->collect_blobs && mark_record_blob(co, sweep, key) == -1)
+        {
+            return -1;
+        }
+    }
+    
+    return (past_deadline(&sweep->deadline)) ? 1 : 0;
+}
+
+static bool past_deadline(const struct timespec *deadline)
+{
+    struct timespec now;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    {
+        return true;
+    }
+    
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static int mark_blob(struct core_object *co, struct db_expiry_sweep *sweep, const char *digest)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (!sweep->live_blobs)
+    {
+        sweep->live_blobs_capacity = DB_EXPIRY_BUFFER_SIZE * SHA256_HEX_LEN;
+        sweep->live_blobs          = mm_malloc(sweep->live_blobs_capacity, co->mm);
+        if (!sweep->live_blobs)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+    }
+    if (reserve_buffer(co, &sweep->live_blobs, &sweep->live_blobs_capacity,
+                       (sweep->num_live_blobs + 1) * SHA256_HEX_LEN) == -1)
+    {
+        return -1;
+    }
+    memcpy(sweep->live_blobs + sweep->num_live_blobs * SHA256_HEX_LEN, digest, SHA256_HEX_LEN);
+    ++sweep->num_live_blobs;
+    
+    return 0;
+}
+
+static int mark_record_blob(struct core_object *co, struct db_expiry_sweep *sweep, const datum *key)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    datum            record_key;
+    uint8_t          *data;
+    size_t           data_size;
+    struct db_record record;
+    int              res;
+    
+    record_key = *key;
+    res        = safe_dbm_fetch(co, get_db_shard(co->so, key), &record_key, &data, &data_size);
+    if (res == -1)
+    {
+        return -1;
+    }
+    if (res == 1)
+    {
+        return 0;
+    }
+    
+    // A record that cannot be read may refer to any blob.
+    if (decode_db_record(data, data_size, &record) == -1)
+    {
+        sweep->collect_blobs = false;
+    } else if ((record.flags & DB_RECORD_BLOB) && record.body_size == SHA256_HEX_LEN
+               && mark_blob(co, sweep, (const char *) record.body) == -1)
+    {
+        mm_free(co->mm, data);
+        return -1;
+    }
+    mm_free(co->mm, data);
+    
+    return 0;
+}
+
+static int mark_upload_links(struct core_object *co, struct db_expiry_sweep *sweep, const char *dir_path)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char          path[BUFSIZ];
+    char          target[BUFSIZ];
+    DIR           *dir;
+    struct dirent *dirent;
+    struct stat   st;
+    ssize_t       target_size;
+    int           ret_val;
+    
+    dir = opendir(dir_path);
+    if (!dir)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    ret_val = 0;
+    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+    while (ret_val == 0 && (dirent = readdir(dir)))
+    {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (join_path(path, sizeof(path), dir_path, "/") == -1 || strlcat(path, dirent->d_name, BUFSIZ) >= BUFSIZ)
+        {
+            errno = ENAMETOOLONG;
+            SET_ERROR(co->err);
+            ret_val = -1;
+            break;
+        }
+        if (lstat(path, &st) == -1)
+        {
+            continue; // Removed since it was listed.
+        }
+        
+        if (S_ISDIR(st.st_mode))
+        {
+            ret_val = mark_upload_links(co, sweep, path);
+        } else if (S_ISLNK(st.st_mode))
+        {
+            // A content-addressed file links to its blob, which is named by its digest.
+            target_size = readlink(path, target, sizeof(target) - 1);
+            if (target_size >= SHA256_HEX_LEN)
+            {
+                ret_val = mark_blob(co, sweep, target + target_size - SHA256_HEX_LEN);
+            }
+        }
+    }
+    closedir(dir);
+    
+    return ret_val;
+}
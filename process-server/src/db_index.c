@@ -0,0 +1,535 @@
+#include "../include/db.h"
+#include "../include/db_index.h"
+#include "../include/db_record.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DB_INDEX_NODE_ALIGN 8      /** Nodes start on this boundary, for their links. Offset 0 is never a node. */
+#define DB_INDEX_LEVEL_MASK 3      /** A node rises a level for each pair of clear low bits of its key hash. */
+#define DB_INDEX_LEVEL_BITS 2      /** The number of key hash bits used to pick each level of a node. */
+#define PERCENT 100                /** To print a fraction as a percentage. */
+
+/**
+ * The state of the ordered key index shared by all processes. The arena holding the nodes follows.
+ */
+struct db_index_shared
+{
+    _Atomic uint64_t used;        // Bytes of the arena handed out; written under the semaphore.
+    _Atomic uint64_t num_keys;
+    _Atomic uint64_t dropped;     // Keys not inserted for want of room; the index is incomplete if any were.
+    _Atomic uint64_t lists;
+    _Atomic uint64_t head[DB_INDEX_MAX_HEIGHT];
+    _Alignas(DB_INDEX_NODE_ALIGN) uint8_t arena[];
+};
+
+/**
+ * A node of the skiplist, at an offset in the arena. The links of a node are the offsets of the next node at each
+ * of its levels, 0 at the end of the list; the key follows them. A node whose key has been removed from the
+ * database stays linked, flagged as removed, and is reused if the key is added again.
+ */
+struct db_index_node
+{
+    uint32_t         key_size;
+    uint32_t         height;
+    _Atomic uint32_t removed; // Written under the shard write lock of the key.
+    _Atomic uint64_t next[];
+};
+
+// The arena is aligned, and every node offset is rounded up to DB_INDEX_NODE_ALIGN, so nodes are aligned.
+_Static_assert(DB_INDEX_NODE_ALIGN % _Alignof(struct db_index_node) == 0, "index nodes must be aligned");
+
+/**
+ * get_node
+ * <p>
+ * Get the node at an offset in the arena.
+ * </p>
+ * @param index the index
+ * @param offset the offset of the node
+ * @return the node
+ */
+static struct db_index_node *get_node(const struct db_index *index, uint64_t offset);
+
+/**
+ * get_link
+ * <p>
+ * Get the link of a node at a level, or the head of the level if the offset is 0.
+ * </p>
+ * @param index the index
+ * @param offset the offset of the node, or 0 for the head
+ * @param level the level
+ * @return the link
+ */
+static _Atomic uint64_t *get_link(const struct db_index *index, uint64_t offset, size_t level);
+
+/**
+ * get_node_key
+ * <p>
+ * Get the key of a node, which follows its links.
+ * </p>
+ * @param node the node
+ * @return the key
+ */
+static uint8_t *get_node_key(struct db_index_node *node);
+
+/**
+ * get_node_height
+ * <p>
+ * Get the number of levels of the node of a key from its hash, so that each level holds about a quarter of the
+ * nodes of the level below. The height depends only on the key, so no random state is shared.
+ * </p>
+ * @param hash the hash of the key
+ * @return the number of levels, from 1 to DB_INDEX_MAX_HEIGHT
+ */
+static uint32_t get_node_height(uint64_t hash);
+
+/**
+ * compare_keys
+ * <p>
+ * Compare two keys byte by byte; a key sorts before any longer key it begins.
+ * </p>
+ * @param a the first key
+ * @param a_size the size of the first key
+ * @param b the second key
+ * @param b_size the size of the second key
+ * @return less than, equal to, or greater than 0 as a sorts before, with, or after b
+ */
+static int compare_keys(const void *a, size_t a_size, const void *b, size_t b_size);
+
+/**
+ * seek_db_index
+ * <p>
+ * Find the first node whose key sorts with or after a key, or only after it. Links are loaded with acquire order,
+ * so a node found is seen whole.
+ * </p>
+ * @param index the index
+ * @param key the key
+ * @param key_size the size of the key
+ * @param after whether to skip a node holding the key
+ * @param preds set to the offset of the last node before the node found at each level, 0 for the head; or NULL
+ * @return the offset of the node found, or 0 if every key sorts before
+ */
+static uint64_t seek_db_index(const struct db_index *index, const void *key, size_t key_size, bool after,
+                              uint64_t *preds);
+
+/**
+ * has_key
+ * <p>
+ * Check whether the node at an offset holds a key.
+ * </p>
+ * @param index the index
+ * @param offset the offset of the node, or 0
+ * @param key the key
+ * @return true if the node holds the key, otherwise false
+ */
+static bool has_key(const struct db_index *index, uint64_t offset, const datum *key);
+
+/**
+ * restore_node
+ * <p>
+ * Clear the removed flag of the node of a key added again to the database.
+ * </p>
+ * @param index the index
+ * @param offset the offset of the node
+ */
+static void restore_node(const struct db_index *index, uint64_t offset);
+
+/**
+ * fill_from_key
+ * <p>
+ * Insert a key found by iterating a database shard into the ordered key index.
+ * </p>
+ * @param co the core object
+ * @param key the key
+ * @param value the value, unused
+ * @param arg the index
+ * @return 0 to go on iterating, -1 and set err on failure
+ */
+static int fill_from_key(struct core_object *co, datum *key, datum *value, void *arg);
+
+int open_db_index(struct core_object *co, struct db_index *index, size_t size, const char *shm_name,
+                  const char *sem_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int  shm_fd;
+    void *shm;
+    
+    memset(index, 0, sizeof(struct db_index));
+    if (size == 0)
+    {
+        return 0;
+    }
+    
+    index->arena_size = size / DB_INDEX_NODE_ALIGN * DB_INDEX_NODE_ALIGN;
+    index->map_size   = sizeof(struct db_index_shared) + index->arena_size;
+    
+    // The semaphore is unlinked at once; the processes forked afterwards inherit it.
+    sem_unlink(sem_name);
+    index->mutex = sem_open(sem_name, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, 1);
+    if (index->mutex == SEM_FAILED)
+    {
+        SET_ERROR(co->err);
+        index->mutex = NULL;
+        return -1;
+    }
+    sem_unlink(sem_name);
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        close_db_index(index);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    
+    // The new object is zero-filled, so every level starts empty.
+    if (ftruncate(shm_fd, (off_t) index->map_size) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        close_db_index(index);
+        return -1;
+    }
+    
+    shm = mmap(NULL, index->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        close_db_index(index);
+        return -1;
+    }
+    index->shared = (struct db_index_shared *) shm;
+    atomic_init(&index->shared->used, DB_INDEX_NODE_ALIGN);
+    atomic_init(&index->shared->num_keys, 0);
+    atomic_init(&index->shared->dropped, 0);
+    atomic_init(&index->shared->lists, 0);
+    
+    return 0;
+}
+
+int fill_db_index(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int ret_val;
+    
+    if (!so->db_index.shared)
+    {
+        return 0;
+    }
+    
+    ret_val = 0;
+    for (size_t s = 0; s < so->num_db_shards && ret_val == 0; ++s)
+    {
+        ret_val = db_iterate(co, &so->db_shards[s], fill_from_key, &so->db_index);
+        close_db_handle(co, &so->db_shards[s]);
+    }
+    
+    return ret_val;
+}
+
+void close_db_index(struct db_index *index)
+{
+    if (index->shared)
+    {
+        munmap(index->shared, index->map_size);
+        index->shared = NULL;
+    }
+    if (index->mutex)
+    {
+        sem_close(index->mutex);
+        index->mutex = NULL;
+    }
+}
+
+int db_index_add(struct core_object *co, struct db_index *index, const datum *key)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint64_t             preds[DB_INDEX_MAX_HEIGHT];
+    uint64_t             offset;
+    uint64_t             node_size;
+    uint32_t             height;
+    struct db_index_node *node;
+    
+    if (!index->shared || is_db_meta_key(key->dptr, (size_t) key->dsize))
+    {
+        return 0;
+    }
+    
+    // Most writes replace a value, so the key is looked for before the semaphore is taken.
+    offset = seek_db_index(index, key->dptr, (size_t) key->dsize, false, NULL);
+    if (has_key(index, offset, key))
+    {
+        restore_node(index, offset);
+        return 0;
+    }
+    
+    if (sem_wait(index->mutex) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    offset = seek_db_index(index, key->dptr, (size_t) key->dsize, false, preds);
+    if (has_key(index, offset, key))
+    {
+        restore_node(index, offset);
+        sem_post(index->mutex);
+        return 0;
+    }
+    
+    height    = get_node_height(hash_db_key_64(key));
+    node_size = sizeof(struct db_index_node) + height * sizeof(uint64_t) + (size_t) key->dsize;
+    node_size = (node_size + DB_INDEX_NODE_ALIGN - 1) / DB_INDEX_NODE_ALIGN * DB_INDEX_NODE_ALIGN;
+    offset    = atomic_load_explicit(&index->shared->used, memory_order_relaxed);
+    if (offset + node_size > index->arena_size)
+    {
+        atomic_fetch_add_explicit(&index->shared->dropped, 1, memory_order_relaxed);
+        sem_post(index->mutex);
+        return 0;
+    }
+    atomic_store_explicit(&index->shared->used, offset + node_size, memory_order_relaxed);
+    
+    node = get_node(index, offset);
+    node->key_size = (uint32_t) key->dsize;
+    node->height   = height;
+    atomic_store_explicit(&node->removed, 0, memory_order_relaxed);
+    for (size_t level = 0; level < height; ++level)
+    {
+        atomic_store_explicit(&node->next[level],
+                              atomic_load_explicit(get_link(index, preds[level], level), memory_order_relaxed),
+                              memory_order_relaxed);
+    }
+    memcpy(get_node_key(node), key->dptr, (size_t) key->dsize);
+    
+    // The node is complete before it is linked, from the bottom level up, so a reader that finds it sees it whole.
+    for (size_t level = 0; level < height; ++level)
+    {
+        atomic_store_explicit(get_link(index, preds[level], level), offset, memory_order_release);
+    }
+    atomic_fetch_add_explicit(&index->shared->num_keys, 1, memory_order_relaxed);
+    
+    sem_post(index->mutex);
+    
+    return 0;
+}
+
+void db_index_remove(struct db_index *index, const datum *key)
+{
+    uint64_t             offset;
+    struct db_index_node *node;
+    
+    if (!index->shared || is_db_meta_key(key->dptr, (size_t) key->dsize))
+    {
+        return;
+    }
+    
+    offset = seek_db_index(index, key->dptr, (size_t) key->dsize, false, NULL);
+    if (!has_key(index, offset, key))
+    {
+        return;
+    }
+    node = get_node(index, offset);
+    if (atomic_exchange_explicit(&node->removed, 1, memory_order_release) == 0)
+    {
+        atomic_fetch_sub_explicit(&index->shared->num_keys, 1, memory_order_relaxed);
+    }
+}
+
+bool db_index_complete(struct db_index *index)
+{
+    return index->shared && atomic_load_explicit(&index->shared->dropped, memory_order_relaxed) == 0;
+}
+
+int db_index_list(struct core_object *co, struct db_index *index, const void *prefix, size_t prefix_size,
+                  const void *cursor, size_t cursor_size, size_t limit,
+                  int (*visit)(struct core_object *co, const datum *key, void *arg), void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint64_t             offset;
+    struct db_index_node *node;
+    datum                key;
+    size_t               count;
+    int                  ret_val;
+    
+    if (!index->shared)
+    {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&index->shared->lists, 1, memory_order_relaxed);
+    
+    // The keys with the prefix follow the prefix itself; a cursor among or past them skips ahead.
+    if (cursor && compare_keys(cursor, cursor_size, prefix, prefix_size) >= 0)
+    {
+        offset = seek_db_index(index, cursor, cursor_size, true, NULL);
+    } else
+    {
+        offset = seek_db_index(index, prefix, prefix_size, false, NULL);
+    }
+    
+    count = 0;
+    while (offset)
+    {
+        node = get_node(index, offset);
+        if (node->key_size < prefix_size || memcmp(get_node_key(node), prefix, prefix_size) != 0)
+        {
+            return 0;
+        }
+        
+        // Removed keys are passed over, so that a full page is only ever followed by a key that is listed.
+        if (!atomic_load_explicit(&node->removed, memory_order_acquire))
+        {
+            if (count == limit)
+            {
+                return 1;
+            }
+            key.dptr  = (char *) get_node_key(node);
+            key.dsize = (int) node->key_size;
+            ret_val   = visit(co, &key, arg);
+            if (ret_val != 0)
+            {
+                return ret_val;
+            }
+            ++count;
+        }
+        
+        offset = atomic_load_explicit(&node->next[0], memory_order_acquire);
+    }
+    
+    return 0;
+}
+
+void print_db_index_stats(struct db_index *index)
+{
+    uint64_t used;
+    
+    if (!index->shared)
+    {
+        (void) fprintf(stdout, "database index: disabled\n");
+        return;
+    }
+    
+    used = atomic_load(&index->shared->used);
+    (void) fprintf(stdout, "database index: %llu keys, %.1f%% of %zu bytes used: %llu listings, %llu keys dropped\n",
+                   (unsigned long long) atomic_load(&index->shared->num_keys),
+                   (double) used / (double) index->arena_size * PERCENT, index->arena_size,
+                   (unsigned long long) atomic_load(&index->shared->lists),
+                   (unsigned long long) atomic_load(&index->shared->dropped));
+}
+
+static struct db_index_node *get_node(const struct db_index *index, uint64_t offset)
+{
+    return (struct db_index_node *) (void *) (index->shared->arena + offset);
+}
+
+static _Atomic uint64_t *get_link(const struct db_index *index, uint64_t offset, size_t level)
+{
+    return (offset) ? &get_node(index, offset)->next[level] : &index->shared->head[level];
+}
+
+static uint8_t *get_node_key(struct db_index_node *node)
+{
+    return (uint8_t *) node + sizeof(struct db_index_node) + node->height * sizeof(uint64_t);
+}
+
+static uint32_t get_node_height(uint64_t hash)
+{
+    uint32_t height;
+    
+    for (height = 1; height < DB_INDEX_MAX_HEIGHT && (hash & DB_INDEX_LEVEL_MASK) == 0; ++height)
+    {
+        hash >>= DB_INDEX_LEVEL_BITS;
+    }
+    
+    return height;
+}
+
+static int compare_keys(const void *a, size_t a_size, const void *b, size_t b_size)
+{
+    int cmp;
+    
+    cmp = memcmp(a, b, (a_size < b_size) ? a_size : b_size);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    
+    return (a_size > b_size) - (a_size < b_size);
+}
+
+static uint64_t seek_db_index(const struct db_index *index, const void *key, size_t key_size, bool after,
+                              uint64_t *preds)
+{
+    uint64_t             pred;
+    uint64_t             next;
+    struct db_index_node *node;
+    int                  cmp;
+    
+    pred = 0;
+    next = 0;
+    for (size_t level = DB_INDEX_MAX_HEIGHT; level-- > 0;)
+    {
+        // Step along the level while the next node sorts before the key.
+        for (next = atomic_load_explicit(get_link(index, pred, level), memory_order_acquire); next;
+             next = atomic_load_explicit(get_link(index, pred, level), memory_order_acquire))
+        {
+            node = get_node(index, next);
+            cmp  = compare_keys(get_node_key(node), node->key_size, key, key_size);
+            if (cmp > 0 || (cmp == 0 && !after))
+            {
+                break;
+            }
+            pred = next;
+        }
+        if (preds)
+        {
+            preds[level] = pred;
+        }
+    }
+    
+    return next;
+}
+
+static bool has_key(const struct db_index *index, uint64_t offset, const datum *key)
+{
+    struct db_index_node *node;
+    
+    if (!offset)
+    {
+        return false;
+    }
+    node = get_node(index, offset);
+    
+    return node->key_size == (size_t) key->dsize && memcmp(get_node_key(node), key->dptr, node->key_size) == 0;
+}
+
+static void restore_node(const struct db_index *index, uint64_t offset)
+{
+    struct db_index_node *node;
+    
+    // The flag is read first, so that the many writes replacing a value do not write to the node.
+    node = get_node(index, offset);
+    if (atomic_load_explicit(&node->removed, memory_order_relaxed)
+        && atomic_exchange_explicit(&node->removed, 0, memory_order_release) == 1)
+    {
+        atomic_fetch_add_explicit(&index->shared->num_keys, 1, memory_order_relaxed);
+    }
+}
+
+static int fill_from_key(struct core_object *co, datum *key, datum *value, void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    (void) value;
+    
+    return db_index_add(co, (struct db_index *) arg, key);
+}
@@ -0,0 +1,369 @@
+#include "../include/db_record.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#define LEGACY_TIME_LEN 64                            /** Longest timestamp of a legacy record. */
+#define LEGACY_TIME_FORMAT "%a, %d %b %Y %H:%M:%S %Z" /** Format of the timestamp of a legacy record. */
+#define META_BODY_MAX_SIZE (sizeof(uint64_t) + DB_RECORD_MAX_ETAG_LEN) /** Largest body of a metadata record. */
+
+/**
+ * meta_size
+ * <p>
+ * Get the size stored for a content type or content coding, with its NUL, or 0 if it is absent or too long.
+ * </p>
+ * @param meta the content type or content coding, or NULL
+ * @return the size to store
+ */
+static size_t meta_size(const char *meta);
+
+/**
+ * body_checksum
+ * <p>
+ * Compute the CRC-32 of a record body.
+ * </p>
+ * @param body the body
+ * @param body_size the size of the body
+ * @return the checksum
+ */
+static uint32_t body_checksum(const uint8_t *body, size_t body_size);
+
+/**
+ * decode_meta
+ * <p>
+ * Decode a content type or content coding stored in a record, checking that it ends in its NUL.
+ * </p>
+ * @param cursor the position of the content type or content coding in the value, advanced past it
+ * @param end the end of the value
+ * @param size the stored size
+ * @param meta set to the content type or content coding
+ * @return 0 on success, -1 if malformed
+ */
+static int decode_meta(const uint8_t **cursor, const uint8_t *end, size_t size, const char **meta);
+
+/**
+ * decode_legacy_record
+ * <p>
+ * Decode a database value in the legacy "timestamp\0body\0" format.
+ * </p>
+ * @param value the value
+ * @param value_size the size of the value
+ * @param record the record to fill
+ * @return 0 on success, -1 if malformed
+ */
+static int decode_legacy_record(const uint8_t *value, size_t value_size, struct db_record *record);
+
+size_t db_record_size(const struct db_record *record)
+{
+    return sizeof(struct db_record_header) + meta_size(record->content_type) + meta_size(record->content_encoding)
+           + ((record->expires) ? sizeof(int64_t) : 0) + record->body_size;
+}
+
+void encode_db_record(const struct db_record *record, uint8_t *buffer)
+{
+    struct db_record_header header;
+    size_t                  content_type_size;
+    size_t                  content_encoding_size;
+    int64_t                 expires;
+    uint8_t                 *cursor;
+    
+    content_type_size     = meta_size(record->content_type);
+    content_encoding_size = meta_size(record->content_encoding);
+    
+    memset(&header, 0, sizeof(header));
+    header.magic                 = DB_RECORD_MAGIC;
+    header.version               = DB_RECORD_VERSION;
+    header.flags                 = record->flags & (DB_RECORD_CHECKSUM | DB_RECORD_BLOB | DB_RECORD_META);
+    header.content_type_size     = (uint8_t) content_type_size;
+    header.content_encoding_size = (uint8_t) content_encoding_size;
+    header.mtime                 = (int64_t) record->mtime;
+    header.body_size             = (uint32_t) record->body_size;
+    if (content_type_size)
+    {
+        header.flags |= DB_RECORD_CONTENT_TYPE;
+    }
+    if (content_encoding_size)
+    {
+        header.flags |= DB_RECORD_CONTENT_ENCODING;
+    }
+    if (record->expires)
+    {
+        header.flags |= DB_RECORD_EXPIRES;
+    }
+    if (header.flags & DB_RECORD_CHECKSUM)
+    {
+        header.checksum = body_checksum(record->body, record->body_size);
+    }
+    
+    // The content type and content coding may be NULL, which memcpy must not be given even for 0 bytes.
+    cursor = buffer;
+    memcpy(cursor, &header, sizeof(header));
+    cursor += sizeof(header);
+    if (content_type_size)
+    {
+        memcpy(cursor, record->content_type, content_type_size);
+        cursor += content_type_size;
+    }
+    if (content_encoding_size)
+    {
+        memcpy(cursor, record->content_encoding, content_encoding_size);
+        cursor += content_encoding_size;
+    }
+    if (record->expires)
+    {
+        expires = (int64_t) record->expires;
+        memcpy(cursor, &expires, sizeof(expires));
+        cursor += sizeof(expires);
+    }
+    memcpy(cursor, record->body, record->body_size);
+}
+
+int decode_db_record(const uint8_t *value, size_t value_size, struct db_record *record)
+{
+    struct db_record_header header;
+    const uint8_t           *cursor;
+    const uint8_t           *end;
+    int64_t                 expires;
+    
+    memset(record, 0, sizeof(struct db_record));
+    
+    if (value_size == 0)
+    {
+        return -1;
+    }
+    if (value[0] != DB_RECORD_MAGIC)
+    {
+        return decode_legacy_record(value, value_size, record);
+    }
+    if (value_size < sizeof(header))
+    {
+        return -1;
+    }
+    
+    memcpy(&header, value, sizeof(header));
+    if (header.version != DB_RECORD_VERSION)
+    {
+        return -1;
+    }
+    
+    cursor = value + sizeof(header);
+    end    = value + value_size;
+    if ((header.flags & DB_RECORD_CONTENT_TYPE)
+        && decode_meta(&cursor, end, header.content_type_size, &record->content_type) == -1)
+    {
+        return -1;
+    }
+    if ((header.flags & DB_RECORD_CONTENT_ENCODING)
+        && decode_meta(&cursor, end, header.content_encoding_size, &record->content_encoding) == -1)
+    {
+        return -1;
+    }
+    if (header.flags & DB_RECORD_EXPIRES)
+    {
+        if ((size_t) (end - cursor) < sizeof(expires))
+        {
+            return -1;
+        }
+        memcpy(&expires, cursor, sizeof(expires));
+        cursor += sizeof(expires);
+        record->expires = (time_t) expires;
+    }
+    if (header.body_size != (size_t) (end - cursor))
+    {
+        return -1;
+    }
+    if ((header.flags & DB_RECORD_CHECKSUM) && body_checksum(cursor, header.body_size) != header.checksum)
+    {
+        return -1;
+    }
+    
+    record->mtime     = (time_t) header.mtime;
+    record->flags     = header.flags;
+    record->body      = cursor;
+    record->body_size = header.body_size;
+    record->checksum  = header.checksum;
+    
+    return 0;
+}
+
+void get_db_record_etag(const struct db_record *record, char etag[DB_RECORD_MAX_ETAG_LEN + 1])
+{
+    if (record->flags & DB_RECORD_BLOB)
+    {
+        // A digest that does not fit is not cut short: a truncated tag could match another value.
+        if (record->body_size > DB_RECORD_MAX_ETAG_LEN)
+        {
+            etag[0] = '\0';
+            return;
+        }
+        
+        memcpy(etag, record->body, record->body_size);
+        etag[record->body_size] = '\0';
+    } else if (record->flags & DB_RECORD_CHECKSUM)
+    {
+        (void) snprintf(etag, DB_RECORD_MAX_ETAG_LEN + 1, "%zx-%08x", record->body_size,
+                        (unsigned int) record->checksum);
+    } else
+    {
+        etag[0] = '\0';
+    }
+}
+
+void make_db_meta(const struct db_record *record, size_t value_size, struct db_meta *meta)
+{
+    meta->mtime            = record->mtime;
+    meta->expires          = record->expires;
+    meta->content_type     = record->content_type;
+    meta->content_encoding = record->content_encoding;
+    meta->value_size       = value_size;
+    get_db_record_etag(record, meta->etag);
+}
+
+size_t db_meta_size(const struct db_meta *meta)
+{
+    struct db_record record;
+    
+    memset(&record, 0, sizeof(record));
+    record.expires          = meta->expires;
+    record.content_type     = meta->content_type;
+    record.content_encoding = meta->content_encoding;
+    record.body_size        = sizeof(uint64_t) + strlen(meta->etag);
+    
+    return db_record_size(&record);
+}
+
+void encode_db_meta(const struct db_meta *meta, uint8_t *buffer)
+{
+    struct db_record record;
+    uint8_t          body[META_BODY_MAX_SIZE];
+    size_t           etag_size;
+    
+    etag_size = strlen(meta->etag);
+    memcpy(body, &meta->value_size, sizeof(uint64_t));
+    memcpy(body + sizeof(uint64_t), meta->etag, etag_size);
+    
+    record.mtime            = meta->mtime;
+    record.expires          = meta->expires;
+    record.flags            = DB_RECORD_META | DB_RECORD_CHECKSUM;
+    record.content_type     = meta->content_type;
+    record.content_encoding = meta->content_encoding;
+    record.body             = body;
+    record.body_size        = sizeof(uint64_t) + etag_size;
+    encode_db_record(&record, buffer);
+}
+
+int decode_db_meta(const uint8_t *value, size_t value_size, struct db_meta *meta)
+{
+    struct db_record record;
+    size_t           etag_size;
+    
+    if (decode_db_record(value, value_size, &record) == -1 || !(record.flags & DB_RECORD_META)
+        || record.body_size < sizeof(uint64_t) || record.body_size > META_BODY_MAX_SIZE)
+    {
+        return -1;
+    }
+    
+    etag_size              = record.body_size - sizeof(uint64_t);
+    meta->mtime            = record.mtime;
+    meta->expires          = record.expires;
+    meta->content_type     = record.content_type;
+    meta->content_encoding = record.content_encoding;
+    memcpy(&meta->value_size, record.body, sizeof(uint64_t));
+    memcpy(meta->etag, record.body + sizeof(uint64_t), etag_size);
+    meta->etag[etag_size] = '\0';
+    
+    return 0;
+}
+
+size_t make_db_meta_key(const void *key, size_t key_size, char *buffer)
+{
+    buffer[0] = DB_META_KEY_PREFIX;
+    memcpy(buffer + 1, key, key_size);
+    
+    return key_size + 1;
+}
+
+bool is_db_meta_key(const void *key, size_t key_size)
+{
+    return key_size > 0 && *(const char *) key == DB_META_KEY_PREFIX;
+}
+
+bool is_db_expired(time_t expires, time_t now)
+{
+    return expires != 0 && expires <= now;
+}
+
+static size_t meta_size(const char *meta)
+{
+    size_t size;
+    
+    if (!meta)
+    {
+        return 0;
+    }
+    size = strlen(meta) + 1;
+    
+    return (size <= DB_RECORD_MAX_META_LEN) ? size : 0;
+}
+
+static uint32_t body_checksum(const uint8_t *body, size_t body_size)
+{
+    uLong checksum;
+    
+    checksum = crc32(0L, Z_NULL, 0);
+    checksum = crc32(checksum, body, (uInt) body_size);
+    
+    return (uint32_t) checksum;
+}
+
+static int decode_meta(const uint8_t **cursor, const uint8_t *end, size_t size, const char **meta)
+{
+    if (size == 0 || size > (size_t) (end - *cursor) || (*cursor)[size - 1] != '\0')
+    {
+        return -1;
+    }
+    *meta = (const char *) *cursor;
+    *cursor += size;
+    
+    return 0;
+}
+
+static int decode_legacy_record(const uint8_t *value, size_t value_size, struct db_record *record)
+{
+    const uint8_t *timestamp_end;
+    char          timestamp[LEGACY_TIME_LEN];
+    size_t        timestamp_size;
+    struct tm     tm;
+    
+    timestamp_end = memchr(value, '\0', value_size);
+    if (!timestamp_end)
+    {
+        return -1;
+    }
+    timestamp_size = (size_t) (timestamp_end - value) + 1;
+    if (timestamp_size > LEGACY_TIME_LEN)
+    {
+        return -1;
+    }
+    memcpy(timestamp, value, timestamp_size);
+    
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(timestamp, LEGACY_TIME_FORMAT, &tm) == NULL)
+    {
+        return -1;
+    }
+    tm.tm_isdst   = -1;
+    record->mtime = mktime(&tm);
+    if (record->mtime == -1)
+    {
+        return -1;
+    }
+    
+    // The body was stored as a string, so it ends at its first NUL.
+    record->flags     = DB_RECORD_LEGACY;
+    record->body      = value + timestamp_size;
+    record->body_size = strnlen((const char *) record->body, value_size - timestamp_size);
+    
+    return 0;
+}
@@ -0,0 +1,524 @@
+#include "../include/db.h"
+#include "../include/db_blob.h"
+#include "../include/db_changelog.h"
+#include "../include/db_replica.h"
+#include "../include/manager.h"
+#include "../include/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define DB_REPLICA_BUFFER_SIZE 4096     /** Initial size of the buffer holding the key and value of a frame. */
+#define DB_REPLICA_OFFSET_MAX_LEN 32    /** Size of the buffer holding the offset applied, as saved. */
+#define DB_REPLICA_TEMP_SUFFIX ".tmp"   /** Suffix of the file written before it replaces the saved offset. */
+#define DB_REPLICA_SOCKET_MAX_LEN ((int) sizeof(((struct sockaddr_un *) 0)->sun_path) - 1) /** Longest socket path. */
+
+/**
+ * The replication status of a replica, in memory shared by all processes. Written only by the replicator process.
+ */
+struct db_replica_shared
+{
+    _Atomic uint64_t applied;      // The offset in the change log of the primary up to which changes are applied.
+    _Atomic uint64_t primary_end;  // The size of the change log of the primary when it last sent a frame.
+    _Atomic int64_t  applied_time; // When the last change applied was made on the primary; 0 if none was.
+    _Atomic int64_t  contact_time; // When the primary last sent a frame; 0 if it never has.
+    _Atomic uint64_t num_applied;  // Changes applied since the server started.
+    _Atomic bool     connected;
+};
+
+/**
+ * load_offset
+ * <p>
+ * Read the offset applied saved by an earlier run.
+ * </p>
+ * @param offset_path the file to which the offset is saved
+ * @return the offset, or 0 if none was saved
+ */
+static uint64_t load_offset(const char *offset_path);
+
+/**
+ * save_offset
+ * <p>
+ * Save the offset applied, replacing the file holding the last one whole.
+ * </p>
+ * @param co the core object
+ * @param replica the replica state
+ * @return 0 on success, -1 and set err on failure
+ */
+static int save_offset(struct core_object *co, struct db_replica *replica);
+
+/**
+ * recv_fully
+ * <p>
+ * Receive a number of bytes from a socket.
+ * </p>
+ * @param fd the socket
+ * @param data the buffer into which to receive
+ * @param size the number of bytes to receive
+ * @return 0 on success, 1 if the socket was closed, timed out, failed or was interrupted first
+ */
+static int recv_fully(int fd, void *data, size_t size);
+
+/**
+ * apply_change
+ * <p>
+ * Apply an upsert or removal received from the primary to the database.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param type DB_CHANGE_UPSERT or DB_CHANGE_REMOVE
+ * @param key the key
+ * @param value the value upserted
+ * @return 0 on success, -1 and set err on failure
+ */
+static int apply_change(struct core_object *co, struct state_object *so, uint32_t type, datum *key, datum *value);
+
+int open_db_replica(struct core_object *co, struct db_replica *replica, const char *primary_socket,
+                    const char *offset_path, const char *shm_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int  shm_fd;
+    void *shm;
+    
+    memset(replica, 0, sizeof(struct db_replica));
+    if (!primary_socket)
+    {
+        return 0;
+    }
+    // The status reports the socket, so it is bounded here rather than only when the replicator connects.
+    if (strlen(primary_socket) > DB_REPLICA_SOCKET_MAX_LEN)
+    {
+        errno = ENAMETOOLONG;
+        SET_ERROR(co->err);
+        return -1;
+    }
+    replica->primary_socket = primary_socket;
+    replica->offset_path    = offset_path;
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    if (ftruncate(shm_fd, (off_t) sizeof(struct db_replica_shared)) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        return -1;
+    }
+    shm = mmap(NULL, sizeof(struct db_replica_shared), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    replica->shared = (struct db_replica_shared *) shm;
+    atomic_init(&replica->shared->applied, load_offset(offset_path));
+    atomic_init(&replica->shared->primary_end, atomic_load(&replica->shared->applied));
+    atomic_init(&replica->shared->applied_time, 0);
+    atomic_init(&replica->shared->contact_time, 0);
+    atomic_init(&replica->shared->num_applied, 0);
+    atomic_init(&replica->shared->connected, false);
+    
+    return 0;
+}
+
+void close_db_replica(struct db_replica *replica)
+{
+    if (replica->shared)
+    {
+        munmap(replica->shared, sizeof(struct db_replica_shared));
+        replica->shared = NULL;
+    }
+}
+
+int open_db_replica_stream(struct core_object *co, struct db_replica *replica, struct db_replica_stream *stream)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct sockaddr_un addr;
+    struct timeval     timeout;
+    uint64_t           offset;
+    
+    memset(stream, 0, sizeof(struct db_replica_stream));
+    stream->fd = -1;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(replica->primary_socket) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        SET_ERROR(co->err);
+        return -1;
+    }
+    strlcpy(addr.sun_path, replica->primary_socket, sizeof(addr.sun_path));
+    
+    stream->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stream->fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    // The primary sends a heartbeat every second it has nothing else to send, so silence means it is gone.
+    memset(&timeout, 0, sizeof(timeout));
+    timeout.tv_sec = DB_REPLICA_TIMEOUT;
+    if (setsockopt(stream->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
+    {
+        SET_ERROR(co->err);
+        close(stream->fd);
+        stream->fd = -1;
+        return -1;
+    }
+    
+    offset = atomic_load(&replica->shared->applied);
+    if (connect(stream->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || write_fully(stream->fd, &offset, sizeof(offset)) == -1)
+    {
+        if (!replica->waiting)
+        {
+            (void) fprintf(stderr, "Cannot reach the primary at %s: %s; retrying every %d seconds.\n",
+                           replica->primary_socket, strerror(errno), DB_REPLICA_RETRY_INTERVAL);
+            replica->waiting = true;
+        }
+        close(stream->fd);
+        stream->fd = -1;
+        return 1;
+    }
+    
+    stream->change_capacity = DB_REPLICA_BUFFER_SIZE;
+    stream->change          = mm_malloc(stream->change_capacity, co->mm);
+    if (!stream->change)
+    {
+        SET_ERROR(co->err);
+        close(stream->fd);
+        stream->fd = -1;
+        return -1;
+    }
+    
+    replica->waiting = false;
+    atomic_store(&replica->shared->connected, true);
+    (void) fprintf(stdout, "Replicating from the primary at %s from offset %llu.\n", replica->primary_socket,
+                   (unsigned long long) offset);
+    
+    return 0;
+}
+
+int apply_db_replica_frame(struct core_object *co, struct state_object *so, struct db_replica_stream *stream)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_replica      *replica;
+    struct db_change_frame frame;
+    size_t                 change_size;
+    uint8_t                *grown;
+    uLong                  checksum;
+    datum                  key;
+    datum                  value;
+    char                   digest[SHA256_HEX_LEN + 1];
+    
+    replica = &so->db_replica;
+    if (recv_fully(stream->fd, &frame, sizeof(frame)) == 1)
+    {
+        return 1;
+    }
+    
+    change_size = (size_t) frame.change.key_size + frame.change.value_size;
+    if (change_size > stream->change_capacity)
+    {
+        grown = mm_realloc(stream->change, change_size, co->mm);
+        if (!grown)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        stream->change          = grown;
+        stream->change_capacity = change_size;
+    }
+    if (change_size && recv_fully(stream->fd, stream->change, change_size) == 1)
+    {
+        return 1;
+    }
+    
+    // zlib takes a NULL buffer as asking for the initial value, so empty parts are skipped.
+    checksum = crc32(0L, Z_NULL, 0);
+    if (frame.change.key_size)
+    {
+        checksum = crc32(checksum, stream->change, frame.change.key_size);
+    }
+    if (frame.change.value_size)
+    {
+        checksum = crc32(checksum, stream->change + frame.change.key_size, frame.change.value_size);
+    }
+    if ((uint32_t) checksum != frame.change.checksum)
+    {
+        (void) fprintf(stderr, "Received a corrupt change from the primary at offset %llu; reconnecting.\n",
+                       (unsigned long long) frame.offset);
+        return 1;
+    }
+    
+    atomic_store(&replica->shared->contact_time, (int64_t) time(NULL));
+    atomic_store(&replica->shared->primary_end, frame.end);
+    
+    key.dptr    = stream->change;
+    key.dsize   = (int) frame.change.key_size;
+    value.dptr  = stream->change + frame.change.key_size;
+    value.dsize = (int) frame.change.value_size;
+    switch (frame.change.type)
+    {
+        case DB_CHANGE_UPSERT:
+        case DB_CHANGE_REMOVE:
+        {
+            if (apply_change(co, so, frame.change.type, &key, &value) == -1)
+            {
+                return -1;
+            }
+            atomic_store(&replica->shared->applied, frame.offset);
+            atomic_store(&replica->shared->applied_time, frame.change.time);
+            atomic_fetch_add(&replica->shared->num_applied, 1);
+            if (++stream->unsaved >= DB_REPLICA_SAVE_CHANGES)
+            {
+                stream->unsaved = 0;
+                return save_offset(co, replica);
+            }
+            break;
+        }
+        case DB_CHANGE_BLOB:
+        {
+            // The blob is stored under the digest of what was received, which must be the digest it was sent as.
+            if (store_db_blob(co, value.dptr, (size_t) value.dsize, digest) == -1)
+            {
+                return -1;
+            }
+            if (frame.change.key_size != SHA256_HEX_LEN || memcmp(digest, key.dptr, SHA256_HEX_LEN) != 0)
+            {
+                (void) fprintf(stderr, "Received a blob from the primary that does not match its digest.\n");
+            }
+            break;
+        }
+        case DB_CHANGE_HEARTBEAT:
+        {
+            // A heartbeat comes only once every change sent has been applied, so the offset is saved while idle.
+            if (stream->unsaved > 0)
+            {
+                stream->unsaved = 0;
+                return save_offset(co, replica);
+            }
+            break;
+        }
+        default:
+        {
+            (void) fprintf(stderr, "Received a change of unknown type %u from the primary; reconnecting.\n",
+                           frame.change.type);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+void close_db_replica_stream(struct core_object *co, struct db_replica *replica, struct db_replica_stream *stream)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (stream->fd == -1)
+    {
+        return;
+    }
+    
+    if (stream->unsaved > 0 && save_offset(co, replica) == -1)
+    {
+        (void) fprintf(stderr, "Could not save the offset applied from the primary: %s\n", strerror(errno));
+    }
+    close(stream->fd);
+    stream->fd = -1;
+    mm_free(co->mm, stream->change);
+    stream->change = NULL;
+    
+    atomic_store(&replica->shared->connected, false);
+    (void) fprintf(stdout, "Lost the primary at %s at offset %llu.\n", replica->primary_socket,
+                   (unsigned long long) atomic_load(&replica->shared->applied));
+}
+
+int format_db_replication_status(struct state_object *so, char buffer[DB_REPLICATION_STATUS_SIZE], size_t *length)
+{
+    struct db_replica_shared *shared;
+    uint64_t                 applied;
+    uint64_t                 primary_end;
+    int64_t                  applied_time;
+    int64_t                  contact_time;
+    int64_t                  now;
+    uint64_t                 changelog_size;
+    size_t                   num_replicas;
+    int                      len;
+    
+    now    = (int64_t) time(NULL);
+    shared = so->db_replica.shared;
+    if (shared)
+    {
+        applied      = atomic_load(&shared->applied);
+        primary_end  = atomic_load(&shared->primary_end);
+        applied_time = atomic_load(&shared->applied_time);
+        contact_time = atomic_load(&shared->contact_time);
+        
+        // A replica caught up with the last size it was sent is not behind, however long ago its last change was.
+        len = snprintf(buffer, DB_REPLICATION_STATUS_SIZE,
+                       "role: replica\nprimary: %.*s\nconnected: %s\napplied-offset: %llu\nprimary-offset: %llu\n"
+                       "lag-bytes: %llu\nlag-seconds: %lld\nchanges-applied: %llu\nlast-contact-seconds: %lld\n",
+                       DB_REPLICA_SOCKET_MAX_LEN, so->db_replica.primary_socket,
+                       (atomic_load(&shared->connected)) ? "true" : "false",
+                       (unsigned long long) applied, (unsigned long long) primary_end,
+                       (unsigned long long) ((primary_end > applied) ? primary_end - applied : 0),
+                       (long long) ((primary_end > applied && applied_time) ? now - applied_time : 0),
+                       (unsigned long long) atomic_load(&shared->num_applied),
+                       (long long) ((contact_time) ? now - contact_time : -1));
+    } else
+    {
+        len = snprintf(buffer, DB_REPLICATION_STATUS_SIZE, "role: %s\n",
+                       (so->db_changelog.shared) ? "primary" : "standalone");
+    }
+    if (len < 0 || len >= DB_REPLICATION_STATUS_SIZE)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    *length = (size_t) len;
+    
+    if (so->db_changelog.shared && get_db_changelog_status(&so->db_changelog, &changelog_size, &num_replicas) == 0)
+    {
+        len = snprintf(buffer + *length, DB_REPLICATION_STATUS_SIZE - *length, "changelog-size: %llu\nreplicas: %zu\n",
+                       (unsigned long long) changelog_size, num_replicas);
+        if (len < 0 || (size_t) len >= DB_REPLICATION_STATUS_SIZE - *length)
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+        *length += (size_t) len;
+    }
+    
+    return 0;
+}
+
+static uint64_t load_offset(const char *offset_path)
+{
+    char               text[DB_REPLICA_OFFSET_MAX_LEN];
+    int                fd;
+    ssize_t            len;
+    unsigned long long offset;
+    char               *end;
+    
+    fd = open(offset_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    len = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return 0;
+    }
+    text[len] = '\0';
+    
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+    offset = strtoull(text, &end, 10);
+    if (end == text || (*end != '\n' && *end != '\0'))
+    {
+        (void) fprintf(stderr, "Ignoring the malformed offset saved in %s.\n", offset_path);
+        return 0;
+    }
+    
+    return (uint64_t) offset;
+}
+
+static int save_offset(struct core_object *co, struct db_replica *replica)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char temp_path[BUFSIZ];
+    char text[DB_REPLICA_OFFSET_MAX_LEN];
+    int  len;
+    int  fd;
+    
+    (void) snprintf(temp_path, BUFSIZ, "%s%s", replica->offset_path, DB_REPLICA_TEMP_SUFFIX);
+    len = snprintf(text, sizeof(text), "%llu\n", (unsigned long long) atomic_load(&replica->shared->applied));
+    
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, DB_FILE_MODE);
+    if (fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (write_fully(fd, text, (size_t) len) == -1 || rename(temp_path, replica->offset_path) == -1)
+    {
+        SET_ERROR(co->err);
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+    close(fd);
+    
+    return 0;
+}
+
+static int recv_fully(int fd, void *data, size_t size)
+{
+    uint8_t *bytes;
+    size_t  done;
+    ssize_t res;
+    
+    bytes = (uint8_t *) data;
+    done  = 0;
+    while (done < size)
+    {
+        res = recv(fd, bytes + done, size - done, 0);
+        if (res == 0)
+        {
+            return 1;
+        }
+        if (res == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                (void) fprintf(stderr, "Heard nothing from the primary for %d seconds; reconnecting.\n",
+                               DB_REPLICA_TIMEOUT);
+            }
+            return 1;
+        }
+        done += (size_t) res;
+    }
+    
+    return 0;
+}
+
+static int apply_change(struct core_object *co, struct state_object *so, uint32_t type, datum *key, datum *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_shard *shard;
+    
+    shard = get_db_shard(so, key);
+    if (type == DB_CHANGE_UPSERT)
+    {
+        return (db_upsert(co, shard, key, value) == -1) ? -1 : 0;
+    }
+    
+    return (db_remove(co, shard, key) == -1) ? -1 : 0;
+}
@@ -0,0 +1,1035 @@
+#include "../include/db.h"
+#include "../include/db_snapshot.h"
+#include "../include/manager.h"
+#include "../include/util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DB_SNAPSHOT_MAGIC 0x313050534244504bULL /** Marks the start of a snapshot file. */
+#define DB_SNAPSHOT_FILE_PREFIX "snapshot_"      /** Prefix of the name of a snapshot file; its generation follows. */
+#define DB_SNAPSHOT_ALIGN 8                      /** Entries and tables of a snapshot start on a boundary of this. */
+#define DB_SNAPSHOT_INITIAL_SIZE 65536           /** Bytes first allocated for the image of a snapshot. */
+#define DB_SNAPSHOT_INITIAL_KEYS 1024            /** Keys first allocated for when building a snapshot. */
+#define DB_SNAPSHOT_BUCKET_KEYS 4                /** Average keys in each bucket of the perfect-hash index. */
+#define DB_SNAPSHOT_SLACK 4                      /** The index has one spare slot for every this many keys. */
+#define DB_SNAPSHOT_MAX_SEED 65536               /** Seeds tried for a bucket before the index is rebuilt larger. */
+#define DB_SNAPSHOT_MAX_BUILDS 8                 /** Attempts at building the index before the snapshot is skipped. */
+#define DB_SNAPSHOT_HALF_BITS 32                 /** The hash is split into two halves of this many bits. */
+#define DB_DELTA_FACTOR 4                        /** Delta table entries for each write between snapshots. */
+#define DB_DELTA_PROBES 16                       /** Delta table entries searched for a key, from the one it hashes to. */
+#define DB_DELTA_TAG_BITS 40                     /** Bits of a delta table entry holding the hash of its key. */
+#define DB_DELTA_TAG_SHIFT 24                    /** The hash is shifted right by this to get the tag of its key. */
+#define DB_DELTA_TAG_MASK ((1ULL << DB_DELTA_TAG_BITS) - 1)         /** Mask of the tag of a delta table entry. */
+#define DB_DELTA_EPOCH_MASK ((1ULL << (64 - DB_DELTA_TAG_BITS)) - 1) /** Mask of the epoch of a delta table entry. */
+
+/**
+ * The state of the snapshots shared by all processes. The entries of the delta table follow. Each entry holds the
+ * tag of a key written and the low bits of the epoch in which it was written; 0 if the entry is empty.
+ */
+struct db_snapshot_shared
+{
+    _Atomic uint64_t generation;      // Of the latest published snapshot; 0 before the first is published.
+    _Atomic uint64_t epoch;           // Bumped as each snapshot is started; writes are marked with it.
+    _Atomic uint64_t published_epoch; // The epoch in which the latest published snapshot was started.
+    _Atomic uint64_t overflow_epoch;  // One past the latest epoch in which a write found no room; 0 if none did.
+    _Atomic uint64_t writes;          // Writes marked since the latest snapshot was started.
+    _Atomic int64_t  started_at;      // Monotonic time in seconds at which the latest snapshot was started.
+    _Atomic uint64_t num_keys;        // Keys in the latest published snapshot.
+    _Atomic uint64_t hits;            // Reads answered by the snapshot.
+    _Atomic uint64_t deltas;          // Reads of keys written since the snapshot, sent to the shards.
+    _Atomic uint64_t overflows;       // Writes that found no room in the delta table.
+    _Atomic uint64_t slots[];
+};
+
+/**
+ * The header at the start of a snapshot file. The entries follow, then the seed of each bucket of the index as a
+ * uint32_t, then the offset of the entry in each slot of the index as a uint64_t, 0 if the slot is empty.
+ */
+struct db_snapshot_header
+{
+    uint64_t magic;
+    uint64_t epoch;        // The epoch in which the snapshot was started.
+    uint64_t num_keys;
+    uint64_t num_buckets;
+    uint64_t num_slots;
+    uint64_t seeds_offset;
+    uint64_t slots_offset;
+};
+
+/**
+ * An entry of a snapshot file. The key, then the value, follow.
+ */
+struct db_snapshot_entry
+{
+    uint32_t key_size;
+    uint32_t value_size;
+};
+
+// The image is allocated with malloc or mapped, and its tables start on a DB_SNAPSHOT_ALIGN boundary.
+_Static_assert(DB_SNAPSHOT_ALIGN % _Alignof(struct db_snapshot_header) == 0, "the header must be aligned");
+_Static_assert(DB_SNAPSHOT_ALIGN % _Alignof(uint64_t) == 0, "the index must be aligned");
+
+/**
+ * A snapshot being built: its image in memory, and the hash and offset of each entry.
+ */
+struct snapshot_builder
+{
+    uint8_t  *image;
+    size_t   size;
+    size_t   capacity;
+    uint64_t *hashes;
+    uint64_t *offsets;
+    size_t   num_keys;
+    size_t   max_keys;
+};
+
+/**
+ * A bucket of the perfect-hash index, while the index is being built.
+ */
+struct snapshot_bucket
+{
+    size_t bucket;
+    size_t first; // The index of the first key of the bucket in the keys sorted by bucket.
+    size_t size;
+};
+
+/**
+ * get_snapshot_path
+ * <p>
+ * Get the path of the snapshot file of a generation.
+ * </p>
+ * @param generation the generation
+ * @param path the buffer into which to write the path
+ */
+static void get_snapshot_path(uint64_t generation, char path[BUFSIZ]);
+
+/**
+ * get_snapshot_slot
+ * <p>
+ * Get the slot of the perfect-hash index in which a key lands with the seed of its bucket: h1 + seed * h2, where
+ * h1 and h2 are the halves of its hash.
+ * </p>
+ * @param hash the hash of the key
+ * @param seed the seed
+ * @param num_slots the number of slots
+ * @return the slot
+ */
+static size_t get_snapshot_slot(uint64_t hash, uint32_t seed, uint64_t num_slots);
+
+/**
+ * reserve_image
+ * <p>
+ * Make room for more bytes at the end of the image of a snapshot being built.
+ * </p>
+ * @param co the core object
+ * @param builder the snapshot being built
+ * @param size the number of bytes
+ * @return 0 on success, -1 and set err on failure
+ */
+static int reserve_image(struct core_object *co, struct snapshot_builder *builder, size_t size);
+
+/**
+ * add_to_snapshot
+ * <p>
+ * Append a key and value found by iterating a database shard to the snapshot being built.
+ * </p>
+ * @param co the core object
+ * @param key the key
+ * @param value the value
+ * @param arg the snapshot being built
+ * @return 0 to go on iterating, -1 and set err on failure
+ */
+static int add_to_snapshot(struct core_object *co, datum *key, datum *value, void *arg);
+
+/**
+ * build_snapshot_index
+ * <p>
+ * Append a perfect-hash index over the keys to the snapshot being built, by hash and displace: the keys are
+ * split into buckets, and for each bucket, largest first, a seed is found that lands all its keys in empty slots.
+ * </p>
+ * @param co the core object
+ * @param builder the snapshot being built
+ * @return 0 on success, 1 if no index could be built, -1 and set err on failure
+ */
+static int build_snapshot_index(struct core_object *co, struct snapshot_builder *builder);
+
+/**
+ * place_snapshot_buckets
+ * <p>
+ * Find a seed for every bucket of the perfect-hash index, with a number of slots.
+ * </p>
+ * @param builder the snapshot being built
+ * @param buckets the buckets, largest first
+ * @param num_buckets the number of buckets
+ * @param order the indexes of the keys, sorted by bucket
+ * @param seeds the seed of each bucket
+ * @param slots the slots, all empty
+ * @param num_slots the number of slots
+ * @return true if every bucket was placed, otherwise false
+ */
+static bool place_snapshot_buckets(const struct snapshot_builder *builder, const struct snapshot_bucket *buckets,
+                                   size_t num_buckets, const size_t *order, uint32_t *seeds, uint64_t *slots,
+                                   size_t num_slots);
+
+/**
+ * compare_bucket_sizes
+ * <p>
+ * Compare two buckets of the perfect-hash index so that the largest sorts first.
+ * </p>
+ * @param a the first bucket
+ * @param b the second bucket
+ * @return less than, equal to, or greater than 0 as a is larger than, the size of, or smaller than b
+ */
+static int compare_bucket_sizes(const void *a, const void *b);
+
+/**
+ * write_snapshot_file
+ * <p>
+ * Write the image of a snapshot to the file of its generation, whole: it is written beside it and renamed.
+ * </p>
+ * @param co the core object
+ * @param builder the snapshot
+ * @param generation the generation of the snapshot
+ * @return 0 on success, -1 and set err on failure
+ */
+static int write_snapshot_file(struct core_object *co, const struct snapshot_builder *builder, uint64_t generation);
+
+/**
+ * map_snapshot
+ * <p>
+ * Map the snapshot file of a generation in place of the snapshot this process has mapped.
+ * </p>
+ * @param co the core object
+ * @param snapshot the snapshot state
+ * @param generation the generation
+ * @return 0 on success, 1 if the file is gone or is not a snapshot, -1 and set err on failure
+ */
+static int map_snapshot(struct core_object *co, struct db_snapshot *snapshot, uint64_t generation);
+
+/**
+ * find_in_snapshot
+ * <p>
+ * Look a key up in the snapshot mapped by this process.
+ * </p>
+ * @param snapshot the snapshot state
+ * @param key the key
+ * @param hash the hash of the key
+ * @param value the value, pointing into the mapping, if found
+ * @return true if the key is in the snapshot, otherwise false
+ */
+static bool find_in_snapshot(const struct db_snapshot *snapshot, const datum *key, uint64_t hash, datum *value);
+
+/**
+ * is_in_delta
+ * <p>
+ * Check whether a key may have been written since a snapshot was started. Only the tag of the key is compared, so
+ * another key may be mistaken for it, which only sends the read to the shards.
+ * </p>
+ * @param snapshot the snapshot state
+ * @param hash the hash of the key
+ * @param epoch the epoch in which the snapshot was started
+ * @return true if the key may have been written since, otherwise false
+ */
+static bool is_in_delta(struct db_snapshot *snapshot, uint64_t hash, uint64_t epoch);
+
+/**
+ * get_delta_tag
+ * <p>
+ * Get the tag of a key in the delta table from its hash. It is never 0, so that an entry holding it is never empty.
+ * </p>
+ * @param hash the hash of the key
+ * @return the tag
+ */
+static uint64_t get_delta_tag(uint64_t hash);
+
+/**
+ * is_epoch_before
+ * <p>
+ * Check whether the low bits of an epoch in a delta table entry are of an epoch before another, modulo their range.
+ * </p>
+ * @param entry_epoch the low bits of the epoch of the entry
+ * @param epoch the other epoch
+ * @return true if the epoch of the entry is before the other, otherwise false
+ */
+static bool is_epoch_before(uint64_t entry_epoch, uint64_t epoch);
+
+/**
+ * get_monotonic_seconds
+ * <p>
+ * Get the monotonic time in seconds.
+ * </p>
+ * @return the time
+ */
+static int64_t get_monotonic_seconds(void);
+
+int open_db_snapshot(struct core_object *co, struct db_snapshot *snapshot, size_t writes, const char *shm_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int  shm_fd;
+    void *shm;
+    
+    memset(snapshot, 0, sizeof(struct db_snapshot));
+    if (writes == 0)
+    {
+        return 0;
+    }
+    
+    // Stale entries are reused, so the table only has to hold the writes made between two snapshots.
+    snapshot->num_slots = DB_DELTA_PROBES;
+    while (snapshot->num_slots < writes * DB_DELTA_FACTOR)
+    {
+        snapshot->num_slots <<= 1;
+    }
+    snapshot->map_size = sizeof(struct db_snapshot_shared) + snapshot->num_slots * sizeof(uint64_t);
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    
+    // The new object is zero-filled, so every entry starts empty.
+    if (ftruncate(shm_fd, (off_t) snapshot->map_size) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        return -1;
+    }
+    
+    shm = mmap(NULL, snapshot->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    snapshot->shared = (struct db_snapshot_shared *) shm;
+    atomic_init(&snapshot->shared->generation, 0);
+    atomic_init(&snapshot->shared->epoch, 0);
+    atomic_init(&snapshot->shared->published_epoch, 0);
+    atomic_init(&snapshot->shared->overflow_epoch, 0);
+    atomic_init(&snapshot->shared->writes, 0);
+    atomic_init(&snapshot->shared->started_at, get_monotonic_seconds());
+    atomic_init(&snapshot->shared->num_keys, 0);
+    atomic_init(&snapshot->shared->hits, 0);
+    atomic_init(&snapshot->shared->deltas, 0);
+    atomic_init(&snapshot->shared->overflows, 0);
+    
+    return 0;
+}
+
+void close_db_snapshot(struct db_snapshot *snapshot)
+{
+    if (snapshot->data)
+    {
+        munmap(snapshot->data, snapshot->data_size);
+        snapshot->data       = NULL;
+        snapshot->generation = 0;
+    }
+    if (snapshot->shared)
+    {
+        munmap(snapshot->shared, snapshot->map_size);
+        snapshot->shared = NULL;
+    }
+}
+
+void unlink_db_snapshot(struct db_snapshot *snapshot)
+{
+    char     path[BUFSIZ];
+    uint64_t generation;
+    
+    if (!snapshot->shared)
+    {
+        return;
+    }
+    
+    generation = atomic_load(&snapshot->shared->generation);
+    if (generation)
+    {
+        get_snapshot_path(generation, path);
+        unlink(path);
+    }
+}
+
+void db_snapshot_mark(struct db_snapshot *snapshot, const datum *key)
+{
+    _Atomic uint64_t *slot;
+    uint64_t         hash;
+    uint64_t         tag;
+    uint64_t         epoch;
+    uint64_t         published_epoch;
+    uint64_t         entry;
+    uint64_t         old;
+    uint64_t         overflow_epoch;
+    
+    if (!snapshot->shared)
+    {
+        return;
+    }
+    
+    hash            = hash_db_key_64(key);
+    tag             = get_delta_tag(hash);
+    epoch           = atomic_load(&snapshot->shared->epoch);
+    published_epoch = atomic_load(&snapshot->shared->published_epoch);
+    entry           = ((epoch & DB_DELTA_EPOCH_MASK) << DB_DELTA_TAG_BITS) | tag;
+    atomic_fetch_add_explicit(&snapshot->shared->writes, 1, memory_order_relaxed);
+    
+    // Marks of other keys, in other shards, race for entries; marks of the same key are serialized by its shard lock.
+    for (size_t p = 0; p < DB_DELTA_PROBES; ++p)
+    {
+        slot = &snapshot->shared->slots[(hash + p) & (snapshot->num_slots - 1)];
+        old  = atomic_load(slot);
+        
+        // An entry of the key is brought up to date. An empty entry, or one of a write held by the published
+        // snapshot, is taken.
+        while (old == 0 || (old & DB_DELTA_TAG_MASK) == tag || is_epoch_before(old >> DB_DELTA_TAG_BITS,
+                                                                                published_epoch))
+        {
+            if (atomic_compare_exchange_weak(slot, &old, entry))
+            {
+                return;
+            }
+        }
+    }
+    
+    // No room: every key is read from the shards until a snapshot started after this write is published.
+    atomic_fetch_add_explicit(&snapshot->shared->overflows, 1, memory_order_relaxed);
+    overflow_epoch = atomic_load(&snapshot->shared->overflow_epoch);
+    while (overflow_epoch < epoch + 1
+           && !atomic_compare_exchange_weak(&snapshot->shared->overflow_epoch, &overflow_epoch, epoch + 1))
+    {
+    }
+}
+
+int db_snapshot_fetch(struct core_object *co, struct db_snapshot *snapshot, const datum *key, uint8_t **serial_buffer,
+                      size_t *serial_buffer_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    const struct db_snapshot_header *header;
+    uint64_t                        generation;
+    uint64_t                        hash;
+    datum                           value;
+    bool                            found;
+    int                             ret_val;
+    
+    if (!snapshot->shared)
+    {
+        return DB_SNAPSHOT_MISS;
+    }
+    
+    generation = atomic_load(&snapshot->shared->generation);
+    if (generation == 0)
+    {
+        return DB_SNAPSHOT_MISS;
+    }
+    if (generation != snapshot->generation)
+    {
+        // The file is gone if a newer snapshot was published since the generation was read.
+        ret_val = map_snapshot(co, snapshot, generation);
+        if (ret_val != 0)
+        {
+            return (ret_val == -1) ? -1 : DB_SNAPSHOT_MISS;
+        }
+    }
+    header = (const struct db_snapshot_header *) (const void *) snapshot->data;
+    
+    hash = hash_db_key_64(key);
+    if (is_in_delta(snapshot, hash, header->epoch))
+    {
+        atomic_fetch_add_explicit(&snapshot->shared->deltas, 1, memory_order_relaxed);
+        return DB_SNAPSHOT_MISS;
+    }
+    found = find_in_snapshot(snapshot, key, hash, &value);
+    
+    // A snapshot published while the delta table was read lets writers reuse the entries of writes it holds, which
+    // this snapshot does not.
+    if (atomic_load(&snapshot->shared->generation) != generation)
+    {
+        return DB_SNAPSHOT_MISS;
+    }
+    atomic_fetch_add_explicit(&snapshot->shared->hits, 1, memory_order_relaxed);
+    
+    if (!found)
+    {
+        return 1;
+    }
+    *serial_buffer_size = (size_t) value.dsize;
+    
+    return copy_dptr_to_buffer(co, serial_buffer, &value);
+}
+
+bool db_snapshot_due(struct db_snapshot *snapshot, size_t writes)
+{
+    uint64_t pending;
+    
+    if (!snapshot->shared)
+    {
+        return false;
+    }
+    if (atomic_load(&snapshot->shared->generation) == 0)
+    {
+        return true;
+    }
+    if (atomic_load(&snapshot->shared->overflow_epoch) > atomic_load(&snapshot->shared->published_epoch))
+    {
+        return true;
+    }
+    
+    pending = atomic_load(&snapshot->shared->writes);
+    
+    return pending >= writes
+           || (pending && get_monotonic_seconds() - atomic_load(&snapshot->shared->started_at) >= DB_SNAPSHOT_MAX_AGE);
+}
+
+int publish_db_snapshot(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_snapshot        *snapshot;
+    struct snapshot_builder   builder;
+    struct db_snapshot_header *header;
+    uint64_t                  epoch;
+    uint64_t                  generation;
+    char                      path[BUFSIZ];
+    int                       ret_val;
+    
+    snapshot = &so->db_snapshot;
+    if (!snapshot->shared)
+    {
+        return 0;
+    }
+    
+    memset(&builder, 0, sizeof(struct snapshot_builder));
+    builder.capacity = DB_SNAPSHOT_INITIAL_SIZE;
+    builder.max_keys = DB_SNAPSHOT_INITIAL_KEYS;
+    builder.image    = mm_malloc(builder.capacity, co->mm);
+    builder.hashes   = mm_malloc(builder.max_keys * sizeof(uint64_t), co->mm);
+    builder.offsets  = mm_malloc(builder.max_keys * sizeof(uint64_t), co->mm);
+    if (!(builder.image && builder.hashes && builder.offsets))
+    {
+        SET_ERROR(co->err);
+        mm_free(co->mm, builder.image);
+        mm_free(co->mm, builder.hashes);
+        mm_free(co->mm, builder.offsets);
+        return -1;
+    }
+    builder.size = sizeof(struct db_snapshot_header);
+    
+    // Writes marked from here on are marked with the new epoch, so they are kept in the delta table whether or not
+    // the shards are read before they are made. Writes marked before are made under the shard write lock, so each
+    // is in the shard by the time the shard is read.
+    epoch = atomic_fetch_add(&snapshot->shared->epoch, 1) + 1;
+    atomic_store(&snapshot->shared->writes, 0);
+    atomic_store(&snapshot->shared->started_at, get_monotonic_seconds());
+    
+    ret_val = 0;
+    for (size_t s = 0; s < so->num_db_shards && ret_val == 0; ++s)
+    {
+        ret_val = db_iterate(co, &so->db_shards[s], add_to_snapshot, &builder);
+    }
+    if (ret_val == 0)
+    {
+        ret_val = build_snapshot_index(co, &builder);
+    }
+    
+    generation = atomic_load(&snapshot->shared->generation) + 1;
+    if (ret_val == 0)
+    {
+        header = (struct db_snapshot_header *) (void *) builder.image;
+        header->magic = DB_SNAPSHOT_MAGIC;
+        header->epoch = epoch;
+        ret_val = write_snapshot_file(co, &builder, generation);
+    }
+    if (ret_val == 0)
+    {
+        // The generation is published before the epoch, so that a writer reusing the entries of the epochs it
+        // holds finds readers of the previous snapshot already retrying.
+        atomic_store(&snapshot->shared->num_keys, builder.num_keys);
+        atomic_store(&snapshot->shared->generation, generation);
+        atomic_store(&snapshot->shared->published_epoch, epoch);
+        if (generation > 1)
+        {
+            get_snapshot_path(generation - 1, path);
+            unlink(path);
+        }
+    }
+    
+    mm_free(co->mm, builder.image);
+    mm_free(co->mm, builder.hashes);
+    mm_free(co->mm, builder.offsets);
+    
+    // A snapshot no index could be built for is skipped; the next is tried at the next check.
+    return (ret_val == -1) ? -1 : 0;
+}
+
+void print_db_snapshot_stats(struct db_snapshot *snapshot)
+{
+    if (!snapshot->shared)
+    {
+        (void) fprintf(stdout, "database snapshot: disabled\n");
+        return;
+    }
+    
+    (void) fprintf(stdout,
+                   "database snapshot: generation %llu, %llu keys, %zu delta entries: %llu hits, %llu delta reads, "
+                   "%llu overflows\n",
+                   (unsigned long long) atomic_load(&snapshot->shared->generation),
+                   (unsigned long long) atomic_load(&snapshot->shared->num_keys), snapshot->num_slots,
+                   (unsigned long long) atomic_load(&snapshot->shared->hits),
+                   (unsigned long long) atomic_load(&snapshot->shared->deltas),
+                   (unsigned long long) atomic_load(&snapshot->shared->overflows));
+}
+
+static void get_snapshot_path(uint64_t generation, char path[BUFSIZ])
+{
+    (void) snprintf(path, BUFSIZ, "%s/%s%llu", SNAPSHOT_DIR, DB_SNAPSHOT_FILE_PREFIX, (unsigned long long) generation);
+}
+
+static size_t get_snapshot_slot(uint64_t hash, uint32_t seed, uint64_t num_slots)
+{
+    uint64_t h1;
+    uint64_t h2;
+    
+    // h2 is odd, so that different seeds move a key.
+    h1 = hash & UINT32_MAX;
+    h2 = (hash >> DB_SNAPSHOT_HALF_BITS) | 1;
+    
+    return (size_t) ((h1 + seed * h2) % num_slots);
+}
+
+static int reserve_image(struct core_object *co, struct snapshot_builder *builder, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint8_t *image;
+    size_t  capacity;
+    
+    if (builder->size + size <= builder->capacity)
+    {
+        return 0;
+    }
+    
+    capacity = builder->capacity;
+    while (capacity < builder->size + size)
+    {
+        capacity *= 2;
+    }
+    image = mm_realloc(builder->image, capacity, co->mm);
+    if (!image)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    builder->image    = image;
+    builder->capacity = capacity;
+    
+    return 0;
+}
+
+static int add_to_snapshot(struct core_object *co, datum *key, datum *value, void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct snapshot_builder  *builder;
+    struct db_snapshot_entry entry;
+    size_t                   entry_size;
+    uint64_t                 *hashes;
+    uint64_t                 *offsets;
+    
+    builder = (struct snapshot_builder *) arg;
+    
+    if (builder->num_keys == builder->max_keys)
+    {
+        hashes  = mm_realloc(builder->hashes, builder->max_keys * 2 * sizeof(uint64_t), co->mm);
+        offsets = (hashes) ? mm_realloc(builder->offsets, builder->max_keys * 2 * sizeof(uint64_t), co->mm) : NULL;
+        if (!offsets)
+        {
+            SET_ERROR(co->err);
+            if (hashes)
+            {
+                builder->hashes = hashes;
+            }
+            return -1;
+        }
+        builder->hashes   = hashes;
+        builder->offsets  = offsets;
+        builder->max_keys *= 2;
+    }
+    
+    entry.key_size   = (uint32_t) key->dsize;
+    entry.value_size = (uint32_t) value->dsize;
+    entry_size       = sizeof(struct db_snapshot_entry) + entry.key_size + entry.value_size;
+    entry_size       = (entry_size + DB_SNAPSHOT_ALIGN - 1) / DB_SNAPSHOT_ALIGN * DB_SNAPSHOT_ALIGN;
+    if (reserve_image(co, builder, entry_size) == -1)
+    {
+        return -1;
+    }
+    
+    builder->hashes[builder->num_keys]  = hash_db_key_64(key);
+    builder->offsets[builder->num_keys] = builder->size;
+    ++builder->num_keys;
+    
+    memcpy(builder->image + builder->size, &entry, sizeof(struct db_snapshot_entry));
+    memcpy(builder->image + builder->size + sizeof(struct db_snapshot_entry), key->dptr, entry.key_size);
+    memcpy(builder->image + builder->size + sizeof(struct db_snapshot_entry) + entry.key_size, value->dptr,
+           entry.value_size);
+    builder->size += entry_size;
+    
+    return 0;
+}
+
+static int build_snapshot_index(struct core_object *co, struct snapshot_builder *builder)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_snapshot_header *header;
+    struct snapshot_bucket    *buckets;
+    size_t                    *order;
+    size_t                    *next;
+    uint32_t                  *seeds;
+    uint64_t                  *slots;
+    size_t                    num_buckets;
+    size_t                    num_slots;
+    size_t                    b;
+    bool                      placed;
+    int                       ret_val;
+    
+    num_buckets = builder->num_keys / DB_SNAPSHOT_BUCKET_KEYS + 1;
+    num_slots   = builder->num_keys + builder->num_keys / DB_SNAPSHOT_SLACK + 1;
+    
+    buckets = mm_calloc(num_buckets, sizeof(struct snapshot_bucket), co->mm);
+    next    = mm_calloc(num_buckets, sizeof(size_t), co->mm);
+    order   = mm_malloc((builder->num_keys + 1) * sizeof(size_t), co->mm);
+    seeds   = mm_malloc(num_buckets * sizeof(uint32_t), co->mm);
+    if (!(buckets && next && order && seeds))
+    {
+        SET_ERROR(co->err);
+        mm_free(co->mm, buckets);
+        mm_free(co->mm, next);
+        mm_free(co->mm, order);
+        mm_free(co->mm, seeds);
+        return -1;
+    }
+    
+    // Sort the keys by bucket, then the buckets by size.
+    for (size_t k = 0; k < builder->num_keys; ++k)
+    {
+        ++buckets[(builder->hashes[k] >> DB_SNAPSHOT_HALF_BITS) % num_buckets].size;
+    }
+    for (b = 0; b < num_buckets; ++b)
+    {
+        buckets[b].bucket = b;
+        buckets[b].first  = (b == 0) ? 0 : buckets[b - 1].first + buckets[b - 1].size;
+        next[b]           = buckets[b].first;
+    }
+    for (size_t k = 0; k < builder->num_keys; ++k)
+    {
+        b = (builder->hashes[k] >> DB_SNAPSHOT_HALF_BITS) % num_buckets;
+        order[next[b]++] = k;
+    }
+    qsort(buckets, num_buckets, sizeof(struct snapshot_bucket), compare_bucket_sizes);
+    
+    slots   = NULL;
+    placed  = false;
+    ret_val = 0;
+    for (size_t attempt = 0; attempt < DB_SNAPSHOT_MAX_BUILDS && !placed && ret_val == 0; ++attempt)
+    {
+        mm_free(co->mm, slots);
+        slots = mm_calloc(num_slots, sizeof(uint64_t), co->mm);
+        if (!slots)
+        {
+            SET_ERROR(co->err);
+            ret_val = -1;
+            break;
+        }
+        placed = place_snapshot_buckets(builder, buckets, num_buckets, order, seeds, slots, num_slots);
+        if (!placed)
+        {
+            num_slots += num_slots / DB_SNAPSHOT_SLACK + 1;
+        }
+    }
+    if (ret_val == 0 && !placed)
+    {
+        ret_val = 1;
+    }
+    
+    if (ret_val == 0)
+    {
+        builder->size = (builder->size + DB_SNAPSHOT_ALIGN - 1) / DB_SNAPSHOT_ALIGN * DB_SNAPSHOT_ALIGN;
+        ret_val = reserve_image(co, builder, num_buckets * sizeof(uint32_t) + DB_SNAPSHOT_ALIGN
+                                             + num_slots * sizeof(uint64_t));
+    }
+    if (ret_val == 0)
+    {
+        header = (struct db_snapshot_header *) (void *) builder->image;
+        header->num_keys     = builder->num_keys;
+        header->num_buckets  = num_buckets;
+        header->num_slots    = num_slots;
+        header->seeds_offset = builder->size;
+        memcpy(builder->image + builder->size, seeds, num_buckets * sizeof(uint32_t));
+        builder->size += num_buckets * sizeof(uint32_t);
+        builder->size = (builder->size + DB_SNAPSHOT_ALIGN - 1) / DB_SNAPSHOT_ALIGN * DB_SNAPSHOT_ALIGN;
+        header->slots_offset = builder->size;
+        memcpy(builder->image + builder->size, slots, num_slots * sizeof(uint64_t));
+        builder->size += num_slots * sizeof(uint64_t);
+    }
+    
+    mm_free(co->mm, buckets);
+    mm_free(co->mm, next);
+    mm_free(co->mm, order);
+    mm_free(co->mm, seeds);
+    mm_free(co->mm, slots);
+    
+    return ret_val;
+}
+
+static bool place_snapshot_buckets(const struct snapshot_builder *builder, const struct snapshot_bucket *buckets,
+                                   size_t num_buckets, const size_t *order, uint32_t *seeds, uint64_t *slots,
+                                   size_t num_slots)
+{
+    const struct snapshot_bucket *bucket;
+    size_t                       slot;
+    size_t                       k;
+    size_t                       i;
+    
+    memset(seeds, 0, num_buckets * sizeof(uint32_t));
+    for (size_t b = 0; b < num_buckets && buckets[b].size; ++b)
+    {
+        bucket = &buckets[b];
+        for (uint32_t seed = 0; seed <= DB_SNAPSHOT_MAX_SEED; ++seed)
+        {
+            // Take the slots of the keys one at a time, and give them back if one is taken.
+            for (i = 0; i < bucket->size; ++i)
+            {
+                k    = order[bucket->first + i];
+                slot = get_snapshot_slot(builder->hashes[k], seed, num_slots);
+                if (slots[slot])
+                {
+                    break;
+                }
+                slots[slot] = builder->offsets[k];
+            }
+            if (i == bucket->size)
+            {
+                seeds[bucket->bucket] = seed;
+                break;
+            }
+            while (i-- > 0)
+            {
+                slots[get_snapshot_slot(builder->hashes[order[bucket->first + i]], seed, num_slots)] = 0;
+            }
+            if (seed == DB_SNAPSHOT_MAX_SEED)
+            {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+static int compare_bucket_sizes(const void *a, const void *b)
+{
+    const struct snapshot_bucket *bucket_a;
+    const struct snapshot_bucket *bucket_b;
+    
+    bucket_a = (const struct snapshot_bucket *) a;
+    bucket_b = (const struct snapshot_bucket *) b;
+    
+    return (bucket_a->size < bucket_b->size) - (bucket_a->size > bucket_b->size);
+}
+
+static int write_snapshot_file(struct core_object *co, const struct snapshot_builder *builder, uint64_t generation)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char path[BUFSIZ];
+    char temp_path[BUFSIZ];
+    int  temp_fd;
+    
+    get_snapshot_path(generation, path);
+    if (join_path(temp_path, sizeof(temp_path), path, TEMP_SUFFIX) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    temp_fd = mkstemp(temp_path);
+    if (temp_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if (write_fully(temp_fd, builder->image, builder->size) == -1 || rename(temp_path, path) == -1)
+    {
+        SET_ERROR(co->err);
+        close(temp_fd);
+        unlink(temp_path);
+        return -1;
+    }
+    
+    close(temp_fd);
+    
+    return 0;
+}
+
+static int map_snapshot(struct core_object *co, struct db_snapshot *snapshot, uint64_t generation)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    const struct db_snapshot_header *header;
+    char                            path[BUFSIZ];
+    int                             fd;
+    struct stat                     st;
+    void                            *data;
+    size_t                          data_size;
+    
+    get_snapshot_path(generation, path);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return 1;
+        }
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        SET_ERROR(co->err);
+        close(fd);
+        return -1;
+    }
+    data_size = (size_t) st.st_size;
+    if (data_size < sizeof(struct db_snapshot_header))
+    {
+        close(fd);
+        return 1;
+    }
+    
+    data = mmap(NULL, data_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    header = (const struct db_snapshot_header *) data;
+    if (header->magic != DB_SNAPSHOT_MAGIC || header->num_buckets == 0 || header->num_slots == 0
+        || header->seeds_offset % DB_SNAPSHOT_ALIGN || header->slots_offset % DB_SNAPSHOT_ALIGN
+        || header->seeds_offset + header->num_buckets * sizeof(uint32_t) > data_size
+        || header->slots_offset + header->num_slots * sizeof(uint64_t) > data_size)
+    {
+        munmap(data, data_size);
+        return 1;
+    }
+    
+    if (snapshot->data)
+    {
+        munmap(snapshot->data, snapshot->data_size);
+    }
+    snapshot->data       = (uint8_t *) data;
+    snapshot->data_size  = data_size;
+    snapshot->generation = generation;
+    
+    return 0;
+}
+
+static bool find_in_snapshot(const struct db_snapshot *snapshot, const datum *key, uint64_t hash, datum *value)
+{
+    const struct db_snapshot_header *header;
+    const uint32_t                  *seeds;
+    const uint64_t                  *slots;
+    struct db_snapshot_entry        entry;
+    uint64_t                        offset;
+    
+    header = (const struct db_snapshot_header *) (const void *) snapshot->data;
+    seeds  = (const uint32_t *) (const void *) (snapshot->data + header->seeds_offset);
+    slots  = (const uint64_t *) (const void *) (snapshot->data + header->slots_offset);
+    
+    // The index is perfect over the keys of the snapshot, so any other key lands on some entry, or none, and the
+    // key of the entry must be compared.
+    offset = slots[get_snapshot_slot(hash, seeds[(hash >> DB_SNAPSHOT_HALF_BITS) % header->num_buckets],
+                                     header->num_slots)];
+    if (offset == 0 || offset + sizeof(struct db_snapshot_entry) > snapshot->data_size)
+    {
+        return false;
+    }
+    memcpy(&entry, snapshot->data + offset, sizeof(struct db_snapshot_entry));
+    if (offset + sizeof(struct db_snapshot_entry) + entry.key_size + entry.value_size > snapshot->data_size
+        || entry.key_size != (uint32_t) key->dsize
+        || memcmp(snapshot->data + offset + sizeof(struct db_snapshot_entry), key->dptr, entry.key_size) != 0)
+    {
+        return false;
+    }
+    
+    value->dptr  = (char *) (snapshot->data + offset + sizeof(struct db_snapshot_entry) + entry.key_size);
+    value->dsize = (int) entry.value_size;
+    
+    return true;
+}
+
+static bool is_in_delta(struct db_snapshot *snapshot, uint64_t hash, uint64_t epoch)
+{
+    uint64_t tag;
+    uint64_t entry;
+    
+    if (atomic_load(&snapshot->shared->overflow_epoch) > epoch)
+    {
+        return true;
+    }
+    
+    // Entries are never emptied, so the search ends at the first empty entry.
+    tag = get_delta_tag(hash);
+    for (size_t p = 0; p < DB_DELTA_PROBES; ++p)
+    {
+        entry = atomic_load(&snapshot->shared->slots[(hash + p) & (snapshot->num_slots - 1)]);
+        if (entry == 0)
+        {
+            return false;
+        }
+        if ((entry & DB_DELTA_TAG_MASK) == tag && !is_epoch_before(entry >> DB_DELTA_TAG_BITS, epoch))
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static uint64_t get_delta_tag(uint64_t hash)
+{
+    return ((hash >> DB_DELTA_TAG_SHIFT) & DB_DELTA_TAG_MASK) | 1;
+}
+
+static bool is_epoch_before(uint64_t entry_epoch, uint64_t epoch)
+{
+    uint64_t distance;
+    
+    distance = (epoch - entry_epoch) & DB_DELTA_EPOCH_MASK;
+    
+    return distance != 0 && distance <= DB_DELTA_EPOCH_MASK / 2;
+}
+
+static int64_t get_monotonic_seconds(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (int64_t) now.tv_sec;
+}
@@ -0,0 +1,511 @@
+#include "../include/db.h"
+#include "../include/db_write_queue.h"
+#include "../include/manager.h"
+#include "../include/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DB_WRITE_QUEUE_SEM_NAME_SIZE 32 /** Size of the buffer holding the name of a queue semaphore. */
+#define MUTEX_SEM_SUFFIX "_m"           /** Suffix of the queue mutex semaphore name. */
+#define ITEMS_SEM_SUFFIX "_i"           /** Suffix of the queued records semaphore name. */
+#define SPACE_SEM_SUFFIX "_s"           /** Suffix of the queue space semaphore name. */
+#define DONE_SEM_SUFFIX "_d"            /** Suffix, followed by the worker index, of a worker's applied semaphore name. */
+#define DB_WRITE_QUEUE_ALIGN 64         /** The ring buffer starts on a boundary of this many bytes. */
+
+/**
+ * The state of the write queue shared by all processes. The ring buffer follows, from DB_WRITE_QUEUE_RING_OFFSET.
+ * head and tail count bytes queued since the queue was opened; their remainder by the capacity is their position.
+ */
+struct db_write_queue_shared
+{
+    size_t           head;            // Start of the first record not yet applied; protected by mutex.
+    size_t           tail;            // End of the last record queued; protected by mutex.
+    unsigned int     waiting_workers; // Workers waiting on space; protected by mutex.
+    int              results[NUM_CHILD_PROCESSES]; // The result of the last applied upsert waited on by each worker.
+    _Atomic uint64_t upserts;
+    _Atomic uint64_t batches;
+    _Atomic uint64_t largest_batch;
+    _Atomic uint64_t full_waits;      // Upserts that waited for room in the queue.
+};
+
+/**
+ * A record in the ring buffer: the key and then the value follow, padded to the size of a record header. A record
+ * with a key size of 0 pads the ring buffer to its end, where the next record did not fit.
+ */
+struct db_write_record
+{
+    uint32_t key_size;
+    uint32_t value_size;
+    int32_t  waiter; // The index of the worker waiting on the upsert, or -1 if none is.
+    uint32_t shard;
+};
+
+#define DB_WRITE_QUEUE_RING_OFFSET \
+    ((sizeof(struct db_write_queue_shared) + DB_WRITE_QUEUE_ALIGN - 1) / DB_WRITE_QUEUE_ALIGN * DB_WRITE_QUEUE_ALIGN) /** Offset of the ring buffer in the queue mapping. */
+
+// The ring starts on a multiple of DB_WRITE_QUEUE_ALIGN, and its capacity and every record are multiples of the size
+// of a record header, so every record header is aligned.
+_Static_assert(DB_WRITE_QUEUE_ALIGN % _Alignof(struct db_write_record) == 0, "the ring must be aligned");
+_Static_assert(sizeof(struct db_write_record) % _Alignof(struct db_write_record) == 0, "records must be aligned");
+
+/**
+ * open_queue_sem
+ * <p>
+ * Open one named semaphore of the write queue with an initial value. A semaphore left by a server that did not
+ * shut down cleanly is replaced.
+ * </p>
+ * @param name_prefix the prefix of the semaphore name
+ * @param suffix the suffix of the semaphore name
+ * @param value the initial value
+ * @return the semaphore, or SEM_FAILED and set errno on failure
+ */
+static sem_t *open_queue_sem(const char *name_prefix, const char *suffix, unsigned int value);
+
+/**
+ * get_record
+ * <p>
+ * Get the record at a position in the ring buffer.
+ * </p>
+ * @param queue the queue
+ * @param offset the offset, counted since the queue was opened
+ * @return the record
+ */
+static struct db_write_record *get_record(struct db_write_queue *queue, size_t offset);
+
+/**
+ * record_size
+ * <p>
+ * Get the size in the ring buffer of a record with a key and value of the given sizes.
+ * </p>
+ * @param key_size the size of the key
+ * @param value_size the size of the value
+ * @return the size of the record
+ */
+static size_t record_size(size_t key_size, size_t value_size);
+
+int open_db_write_queue(struct core_object *co, struct db_write_queue *queue, size_t size,
+                        const char *sem_name_prefix, const char *shm_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int  shm_fd;
+    void *shm;
+    char suffix[DB_WRITE_QUEUE_SEM_NAME_SIZE];
+    
+    memset(queue, 0, sizeof(struct db_write_queue));
+    if (size == 0)
+    {
+        return 0;
+    }
+    
+    queue->mutex = open_queue_sem(sem_name_prefix, MUTEX_SEM_SUFFIX, 1);
+    queue->items = open_queue_sem(sem_name_prefix, ITEMS_SEM_SUFFIX, 0);
+    queue->space = open_queue_sem(sem_name_prefix, SPACE_SEM_SUFFIX, 0);
+    if (queue->mutex == SEM_FAILED || queue->items == SEM_FAILED || queue->space == SEM_FAILED)
+    {
+        SET_ERROR(co->err);
+        close_db_write_queue(queue);
+        unlink_db_write_queue(sem_name_prefix);
+        return -1;
+    }
+    FOR_EACH_CHILD_c_IN_CHILD_PIDS
+    {
+        (void) snprintf(suffix, sizeof(suffix), "%s%zu", DONE_SEM_SUFFIX, c);
+        queue->done[c] = open_queue_sem(sem_name_prefix, suffix, 0);
+        if (queue->done[c] == SEM_FAILED)
+        {
+            SET_ERROR(co->err);
+            close_db_write_queue(queue);
+            unlink_db_write_queue(sem_name_prefix);
+            return -1;
+        }
+    }
+    
+    queue->capacity = size / sizeof(struct db_write_record) * sizeof(struct db_write_record);
+    queue->map_size = DB_WRITE_QUEUE_RING_OFFSET + queue->capacity;
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        close_db_write_queue(queue);
+        unlink_db_write_queue(sem_name_prefix);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    
+    // The new object is zero-filled, so the queue starts empty.
+    if (ftruncate(shm_fd, (off_t) queue->map_size) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        close_db_write_queue(queue);
+        unlink_db_write_queue(sem_name_prefix);
+        return -1;
+    }
+    
+    shm = mmap(NULL, queue->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        close_db_write_queue(queue);
+        unlink_db_write_queue(sem_name_prefix);
+        return -1;
+    }
+    queue->shared = (struct db_write_queue_shared *) shm;
+    atomic_init(&queue->shared->upserts, 0);
+    atomic_init(&queue->shared->batches, 0);
+    atomic_init(&queue->shared->largest_batch, 0);
+    atomic_init(&queue->shared->full_waits, 0);
+    
+    return 0;
+}
+
+static sem_t *open_queue_sem(const char *name_prefix, const char *suffix, unsigned int value)
+{
+    char name[DB_WRITE_QUEUE_SEM_NAME_SIZE];
+    
+    if (join_path(name, sizeof(name), name_prefix, suffix) == -1)
+    {
+        return SEM_FAILED;
+    }
+    sem_unlink(name);
+    
+    return sem_open(name, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, value);
+}
+
+void close_db_write_queue(struct db_write_queue *queue)
+{
+    // Closing an unopened semaphore will return -1 and set errno = EINVAL, which can be ignored.
+    if (queue->mutex)
+    {
+        sem_close(queue->mutex);
+    }
+    if (queue->items)
+    {
+        sem_close(queue->items);
+    }
+    if (queue->space)
+    {
+        sem_close(queue->space);
+    }
+    FOR_EACH_CHILD_c_IN_CHILD_PIDS
+    {
+        if (queue->done[c])
+        {
+            sem_close(queue->done[c]);
+        }
+    }
+    if (queue->shared)
+    {
+        munmap(queue->shared, queue->map_size);
+    }
+    memset(queue, 0, sizeof(struct db_write_queue));
+}
+
+void unlink_db_write_queue(const char *sem_name_prefix)
+{
+    char name[DB_WRITE_QUEUE_SEM_NAME_SIZE];
+    
+    (void) snprintf(name, sizeof(name), "%s%s", sem_name_prefix, MUTEX_SEM_SUFFIX);
+    sem_unlink(name);
+    (void) snprintf(name, sizeof(name), "%s%s", sem_name_prefix, ITEMS_SEM_SUFFIX);
+    sem_unlink(name);
+    (void) snprintf(name, sizeof(name), "%s%s", sem_name_prefix, SPACE_SEM_SUFFIX);
+    sem_unlink(name);
+    FOR_EACH_CHILD_c_IN_CHILD_PIDS
+    {
+        (void) snprintf(name, sizeof(name), "%s%s%zu", sem_name_prefix, DONE_SEM_SUFFIX, c);
+        sem_unlink(name);
+    }
+}
+
+int queue_db_upsert(struct core_object *co, struct state_object *so, datum *key, datum *value, bool wait)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_write_queue        *queue;
+    struct db_write_queue_shared *shared;
+    struct db_shard              *shard;
+    struct db_write_record       *record;
+    size_t                       size;
+    size_t                       position;
+    size_t                       padding;
+    bool                         waited;
+    int                          result;
+    
+    queue = &so->db_write_queue;
+    shard = get_db_shard(so, key);
+    size  = record_size((size_t) key->dsize, (size_t) value->dsize);
+    if (!queue->shared || size > queue->capacity)
+    {
+        return db_upsert(co, shard, key, value);
+    }
+    
+    shared = queue->shared;
+    waited = false;
+    if (sem_wait(queue->mutex) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    for (;;)
+    {
+        // A record that would run past the end of the ring buffer starts again at its beginning.
+        position = shared->tail % queue->capacity;
+        padding  = (position + size > queue->capacity) ? queue->capacity - position : 0;
+        if (queue->capacity - (shared->tail - shared->head) >= padding + size)
+        {
+            break;
+        }
+        
+        ++shared->waiting_workers;
+        if (!waited)
+        {
+            atomic_fetch_add_explicit(&shared->full_waits, 1, memory_order_relaxed);
+            waited = true;
+        }
+        sem_post(queue->mutex);
+        if (sem_wait(queue->space) == -1 || sem_wait(queue->mutex) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+    }
+    
+    if (padding)
+    {
+        get_record(queue, shared->tail)->key_size = 0;
+        shared->tail += padding;
+    }
+    record = get_record(queue, shared->tail);
+    record->key_size   = (uint32_t) key->dsize;
+    record->value_size = (uint32_t) value->dsize;
+    record->waiter     = (wait) ? (int32_t) so->child_index : -1;
+    record->shard      = (uint32_t) (shard - so->db_shards);
+    memcpy(record + 1, key->dptr, (size_t) key->dsize);
+    memcpy((uint8_t *) (record + 1) + key->dsize, value->dptr, (size_t) value->dsize);
+    shared->tail += size;
+    sem_post(queue->mutex);
+    sem_post(queue->items);
+    
+    if (!wait)
+    {
+        return DB_UPSERT_QUEUED;
+    }
+    
+    if (sem_wait(queue->done[so->child_index]) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    result = shared->results[so->child_index];
+    if (result == -1)
+    {
+        errno = EIO; // The writer process failed to apply the upsert.
+        SET_ERROR(co->err);
+    }
+    
+    return result;
+}
+
+int apply_db_write_queue(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_write_queue        *queue;
+    struct db_write_queue_shared *shared;
+    struct db_write_record       *record;
+    bool                         interrupted;
+    size_t                       head;
+    size_t                       tail;
+    size_t                       num_records;
+    size_t                       shard_counts[MAX_DB_SHARDS];
+    size_t                       shard_starts[MAX_DB_SHARDS];
+    datum                        *keys;
+    datum                        *values;
+    int                          *results;
+    int32_t                      *waiters;
+    size_t                       i;
+    
+    queue  = &so->db_write_queue;
+    shared = queue->shared;
+    
+    interrupted = false;
+    if (sem_wait(queue->items) == -1)
+    {
+        if (errno != EINTR)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        errno       = 0;
+        interrupted = true; // Signalled to end: apply what is left in the queue.
+    }
+    
+    // Records before the tail are complete, and only this process frees them, so they are read without the mutex.
+    if (sem_wait(queue->mutex) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    head = shared->head;
+    tail = shared->tail;
+    sem_post(queue->mutex);
+    
+    memset(shard_counts, 0, sizeof(shard_counts));
+    num_records = 0;
+    for (size_t offset = head; offset < tail;)
+    {
+        record = get_record(queue, offset);
+        if (record->key_size == 0)
+        {
+            offset += queue->capacity - offset % queue->capacity;
+            continue;
+        }
+        ++shard_counts[record->shard];
+        ++num_records;
+        offset += record_size(record->key_size, record->value_size);
+    }
+    if (num_records == 0)
+    {
+        return 0;
+    }
+    
+    keys    = mm_malloc(num_records * sizeof(datum), co->mm);
+    values  = mm_malloc(num_records * sizeof(datum), co->mm);
+    results = mm_malloc(num_records * sizeof(int), co->mm);
+    waiters = mm_malloc(num_records * sizeof(int32_t), co->mm);
+    if (!(keys && values && results && waiters))
+    {
+        SET_ERROR(co->err);
+        mm_free(co->mm, keys);
+        mm_free(co->mm, values);
+        mm_free(co->mm, results);
+        mm_free(co->mm, waiters);
+        return -1;
+    }
+    
+    // Group the records by shard, keeping their order within each shard so that later upserts of a key win.
+    shard_starts[0] = 0;
+    for (size_t s = 1; s < so->num_db_shards; ++s)
+    {
+        shard_starts[s] = shard_starts[s - 1] + shard_counts[s - 1];
+    }
+    for (size_t offset = head; offset < tail;)
+    {
+        record = get_record(queue, offset);
+        if (record->key_size == 0)
+        {
+            offset += queue->capacity - offset % queue->capacity;
+            continue;
+        }
+        i = shard_starts[record->shard]++;
+        keys[i].dptr    = (char *) (record + 1);
+        keys[i].dsize   = (int) record->key_size;
+        values[i].dptr  = (char *) (record + 1) + record->key_size;
+        values[i].dsize = (int) record->value_size;
+        waiters[i]      = record->waiter;
+        offset += record_size(record->key_size, record->value_size);
+    }
+    
+    i = 0;
+    for (size_t s = 0; s < so->num_db_shards; ++s)
+    {
+        if (shard_counts[s]
+            && db_upsert_batch(co, &so->db_shards[s], shard_counts[s], keys + i, values + i, results + i) == -1)
+        {
+            for (size_t r = i; r < i + shard_counts[s]; ++r)
+            {
+                results[r] = -1;
+            }
+        }
+        i += shard_counts[s];
+    }
+    
+    for (i = 0; i < num_records; ++i)
+    {
+        if (waiters[i] >= 0)
+        {
+            shared->results[waiters[i]] = results[i];
+            sem_post(queue->done[waiters[i]]);
+        } else if (results[i] == -1)
+        {
+            GET_ERROR(co->err); // No worker is waiting to report the failure.
+        }
+    }
+    
+    // The wait took one count of the records; take the rest, so that the next wait is for new records.
+    for (i = (interrupted) ? 0 : 1; i < num_records && sem_trywait(queue->items) == 0; ++i);
+    
+    if (sem_wait(queue->mutex) == -1)
+    {
+        SET_ERROR(co->err);
+        mm_free(co->mm, keys);
+        mm_free(co->mm, values);
+        mm_free(co->mm, results);
+        mm_free(co->mm, waiters);
+        return -1;
+    }
+    shared->head = tail;
+    for (; shared->waiting_workers > 0; --shared->waiting_workers)
+    {
+        sem_post(queue->space);
+    }
+    sem_post(queue->mutex);
+    
+    atomic_fetch_add_explicit(&shared->upserts, num_records, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->batches, 1, memory_order_relaxed);
+    if (num_records > atomic_load_explicit(&shared->largest_batch, memory_order_relaxed))
+    {
+        atomic_store_explicit(&shared->largest_batch, num_records, memory_order_relaxed);
+    }
+    
+    mm_free(co->mm, keys);
+    mm_free(co->mm, values);
+    mm_free(co->mm, results);
+    mm_free(co->mm, waiters);
+    
+    return 0;
+}
+
+void print_db_write_queue_stats(struct db_write_queue *queue)
+{
+    if (!queue->shared)
+    {
+        (void) fprintf(stdout, "database write queue: disabled\n");
+        return;
+    }
+    
+    (void) fprintf(stdout,
+                   "database write queue: %zu bytes: %llu upserts in %llu batches (largest %llu), "
+                   "%llu waited for room\n",
+                   queue->capacity,
+                   (unsigned long long) atomic_load(&queue->shared->upserts),
+                   (unsigned long long) atomic_load(&queue->shared->batches),
+                   (unsigned long long) atomic_load(&queue->shared->largest_batch),
+                   (unsigned long long) atomic_load(&queue->shared->full_waits));
+}
+
+static struct db_write_record *get_record(struct db_write_queue *queue, size_t offset)
+{
+    return (struct db_write_record *) (void *) ((uint8_t *) queue->shared + DB_WRITE_QUEUE_RING_OFFSET
+                                                + offset % queue->capacity);
+}
+
+static size_t record_size(size_t key_size, size_t value_size)
+{
+    size_t size;
+    
+    size = sizeof(struct db_write_record) + key_size + value_size;
+    
+    return (size + sizeof(struct db_write_record) - 1) / sizeof(struct db_write_record)
+           * sizeof(struct db_write_record);
+}
@@ -0,0 +1,1249 @@
+#include "../include/db.h"
+#include "../include/storage.h"
+#include "../include/util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LOG_DIR_SUFFIX ".log"                        /** Suffix of the directory holding the segments of a database. */
+#define LOG_SEGMENT_FORMAT "%s" LOG_DIR_SUFFIX "/%08u.seg" /** Path of a segment: database name, segment number. */
+#define LOG_COMPACT_FORMAT "%s" LOG_DIR_SUFFIX "/compact.tmp" /** Path of a segment being written by compaction. */
+#define LOG_PATH_SIZE 512                            /** Size of the buffers holding segment paths. */
+#define LOG_SEGMENT_MAX_SIZE (64 * 1024 * 1024)      /** Size at which the active segment is sealed and a new one begun. */
+#define LOG_RECORD_PARTS 3                           /** A record is written as its header, key, and value. */
+#define LOG_INITIAL_BUCKETS 1024                     /** Initial number of buckets in the index. */
+#define LOG_COMPACT_DEAD_RATIO 2                     /** Compact once 1 / ratio of the sealed segments is dead records. */
+#define LOG_FNV_OFFSET 2166136261U                   /** FNV-1a offset basis. */
+#define LOG_FNV_PRIME 16777619U                      /** FNV-1a prime. */
+#define LOG_TOMBSTONE UINT32_MAX                     /** Value size of a record removing its key; no value follows. */
+
+/**
+ * The header of a record in a segment. The key and then the value follow the header. The checksum covers the
+ * sizes, the key, and the value, so a record torn by a crash is detected and ignored. A record with a value size of
+ * LOG_TOMBSTONE removes its key.
+ */
+struct log_record_header
+{
+    uint32_t checksum;
+    uint32_t key_size;
+    uint32_t value_size;
+};
+
+/**
+ * An entry of the index, locating the newest record of a key.
+ */
+struct log_index_entry
+{
+    struct log_index_entry *next;
+    uint32_t               hash;
+    uint32_t               segment;
+    size_t                 offset; // Offset of the record header in the segment.
+    uint32_t               key_size;
+    uint32_t               value_size;
+    char                   key[];
+};
+
+/**
+ * A segment mapped into memory for reading.
+ */
+struct log_segment
+{
+    int     fd;
+    uint8_t *data;
+    size_t  size;
+};
+
+/**
+ * The state of a process on a log-structured database: the index, built by replaying the segments, and the mapped
+ * segments. Segments are numbered from first to active; all but the active segment are sealed and never change.
+ */
+struct log_state
+{
+    const char             *name;
+    struct db_shared       *shared;
+    struct log_index_entry **buckets;
+    size_t                 num_buckets;
+    size_t                 num_entries;
+    uint32_t               first;
+    uint32_t               active;
+    size_t                 active_end; // End of the last whole record in the active segment.
+    struct log_segment     *segments;  // Indexed by segment number - first.
+    size_t                 num_segments;
+    uint64_t               version;    // The database version to which the state has been caught up.
+};
+
+/**
+ * log_create
+ * <p>
+ * Create the segment directory and the first segment of a log-structured database if they do not exist.
+ * </p>
+ * @param db_name the name of the database
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int log_create(const char *db_name);
+
+/**
+ * log_fetch
+ * <p>
+ * Fetch the value of a key from a log-structured database. The value is read in place from the mapped segment.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key
+ * @param value the datum to point at the value
+ * @return 0 if found, 1 if not found, -1 and set err on failure
+ */
+static int log_fetch(struct core_object *co, struct db_shard *shard, datum *key, datum *value);
+
+/**
+ * log_upsert
+ * <p>
+ * Append a record for a key to the active segment of a log-structured database, beginning a new segment if the
+ * active segment is full.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key
+ * @param value the value
+ * @return 0 if inserted, 1 if replaced, -1 and set err on failure
+ */
+static int log_upsert(struct core_object *co, struct db_shard *shard, datum *key, datum *value);
+
+/**
+ * log_remove
+ * <p>
+ * Append a tombstone record for a key to the active segment of a log-structured database, and drop the key from
+ * the index. Compaction drops the tombstone with the records it covers.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key
+ * @return 0 if removed, 1 if not found, -1 and set err on failure
+ */
+static int log_remove(struct core_object *co, struct db_shard *shard, datum *key);
+
+/**
+ * log_iterate
+ * <p>
+ * Call visit with every key in the index of a log-structured database and its value, read in place from the mapped
+ * segment.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param visit the function to call with each key and value
+ * @param arg the argument to pass to visit
+ * @return 0 on success, -1 and set err on failure
+ */
+static int log_iterate(struct core_object *co, struct db_shard *shard,
+                       int (*visit)(struct core_object *co, datum *key, datum *value, void *arg), void *arg);
+
+/**
+ * log_close
+ * <p>
+ * Free the index and unmap the segments of this process on a shard.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ */
+static void log_close(struct core_object *co, struct db_shard *shard);
+
+/**
+ * log_maintain
+ * <p>
+ * Compact the sealed segments of a shard once enough of them is dead records.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @return 0 on success, -1 and set err on failure
+ */
+static int log_maintain(struct core_object *co, struct db_shard *shard);
+
+/**
+ * log_compact
+ * <p>
+ * Seal the active segment of a shard, then compact every sealed segment however few of its records are dead.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @return 0 on success, -1 and set err on failure
+ */
+static int log_compact(struct core_object *co, struct db_shard *shard);
+
+/**
+ * compact_segments
+ * <p>
+ * Copy the live records of the sealed segments of a shard to a new segment, which takes their place. The records
+ * are copied without the shard lock held, so requests are served meanwhile; the lock is held for writing only to
+ * swap the new segment in for the sealed segments.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param forced whether to compact even if few of the records are dead
+ * @return 0 on success, -1 and set err on failure
+ */
+static int compact_segments(struct core_object *co, struct db_shard *shard, bool forced);
+
+/**
+ * get_log_state
+ * <p>
+ * Get the state of this process on a shard, caught up with every write to it. The state is rebuilt if it is not
+ * open or was built before the shard was compacted.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @return the state, or NULL and set err on failure
+ */
+static struct log_state *get_log_state(struct core_object *co, struct db_shard *shard);
+
+/**
+ * open_log_state
+ * <p>
+ * Build the state of this process on a shard by replaying its segments.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @return the state, or NULL and set err on failure
+ */
+static struct log_state *open_log_state(struct core_object *co, struct db_shard *shard);
+
+/**
+ * find_segments
+ * <p>
+ * Find the numbers of the first and last segments in the segment directory of a database.
+ * </p>
+ * @param db_name the name of the database
+ * @param first the first segment number
+ * @param last the last segment number
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int find_segments(const char *db_name, uint32_t *first, uint32_t *last);
+
+/**
+ * catch_up
+ * <p>
+ * Replay the records written to the active segment, and any segments begun after it, since the state was last
+ * caught up.
+ * </p>
+ * @param co the core object
+ * @param st the state
+ * @return 0 on success, -1 and set err on failure
+ */
+static int catch_up(struct core_object *co, struct log_state *st);
+
+/**
+ * replay_segment
+ * <p>
+ * Apply the records of a segment from an offset to the index, stopping at the end of the segment or at the first
+ * torn record.
+ * </p>
+ * @param co the core object
+ * @param st the state
+ * @param segment the segment number
+ * @param offset the offset from which to replay
+ * @return the end of the last whole record replayed, or -1 and set err on failure
+ */
+static ssize_t replay_segment(struct core_object *co, struct log_state *st, uint32_t segment, size_t offset);
+
+/**
+ * map_segment
+ * <p>
+ * Get a segment mapped into memory, opening it if it is not open. The active segment is remapped if the mapping
+ * is smaller than min_size and the segment has grown; SIZE_MAX remaps it whenever it has grown.
+ * </p>
+ * @param co the core object
+ * @param st the state
+ * @param segment the segment number
+ * @param min_size the size of the segment needed in the mapping
+ * @return the segment, or NULL and set err on failure
+ */
+static struct log_segment *map_segment(struct core_object *co, struct log_state *st, uint32_t segment,
+                                       size_t min_size);
+
+/**
+ * begin_segment
+ * <p>
+ * Seal the active segment and begin the next.
+ * </p>
+ * @param co the core object
+ * @param st the state
+ * @return 0 on success, -1 and set err on failure
+ */
+static int begin_segment(struct core_object *co, struct log_state *st);
+
+/**
+ * append_record
+ * <p>
+ * Append a record to the active segment, beginning a new segment if the active segment is full, and advance the
+ * state past it. The record is a tombstone if the value is NULL.
+ * </p>
+ * @param co the core object
+ * @param st the state
+ * @param key the key
+ * @param value the value, or NULL for a tombstone
+ * @param offset set to the offset of the record in the active segment
+ * @return 0 on success, -1 and set err on failure
+ */
+static int append_record(struct core_object *co, struct log_state *st, const datum *key, const datum *value,
+                         size_t *offset);
+
+/**
+ * index_find
+ * <p>
+ * Find the index entry of a key.
+ * </p>
+ * @param st the state
+ * @param key the key
+ * @param key_size the size of the key
+ * @param hash the hash of the key
+ * @return the entry, or NULL if the key is not in the index
+ */
+static struct log_index_entry *index_find(const struct log_state *st, const void *key, uint32_t key_size,
+                                          uint32_t hash);
+
+/**
+ * index_put
+ * <p>
+ * Point the index entry of a key at a record, adding the entry if there is none.
+ * </p>
+ * @param co the core object
+ * @param st the state
+ * @param key the key
+ * @param key_size the size of the key
+ * @param segment the segment of the record
+ * @param offset the offset of the record
+ * @param value_size the size of the value of the record
+ * @return 0 on success, -1 and set err on failure
+ */
+static int index_put(struct core_object *co, struct log_state *st, const void *key, uint32_t key_size,
+                     uint32_t segment, size_t offset, uint32_t value_size);
+
+/**
+ * index_remove
+ * <p>
+ * Remove the index entry of a key, if there is one.
+ * </p>
+ * @param st the state
+ * @param key the key
+ * @param key_size the size of the key
+ */
+static void index_remove(struct log_state *st, const void *key, uint32_t key_size);
+
+/**
+ * stored_value_size
+ * <p>
+ * Get the number of value bytes following the key of a record: none for a tombstone.
+ * </p>
+ * @param value_size the value size in the header of the record
+ * @return the number of value bytes
+ */
+static size_t stored_value_size(uint32_t value_size);
+
+/**
+ * hash_key
+ * <p>
+ * Hash a key with FNV-1a.
+ * </p>
+ * @param key the key
+ * @param key_size the size of the key
+ * @return the hash
+ */
+static uint32_t hash_key(const void *key, uint32_t key_size);
+
+/**
+ * record_checksum
+ * <p>
+ * Compute the checksum of a record.
+ * </p>
+ * @param header the header of the record
+ * @param key the key
+ * @param value the value, or NULL for a tombstone
+ * @return the checksum
+ */
+static uint32_t record_checksum(const struct log_record_header *header, const void *key, const void *value);
+
+/**
+ * segment_path
+ * <p>
+ * Write the path of a segment of a database.
+ * </p>
+ * @param path the buffer into which to write the path, of size LOG_PATH_SIZE
+ * @param db_name the name of the database
+ * @param segment the segment number
+ */
+static void segment_path(char *path, const char *db_name, uint32_t segment);
+
+const struct storage_engine log_storage_engine = {
+        .name     = "log",
+        .create   = log_create,
+        .fetch    = log_fetch,
+        .upsert   = log_upsert,
+        .remove   = log_remove,
+        .commit   = NULL,
+        .iterate  = log_iterate,
+        .close    = log_close,
+        .maintain = log_maintain,
+        .compact  = log_compact
+};
+
+static int log_create(const char *db_name)
+{
+    char     path[LOG_PATH_SIZE];
+    uint32_t first;
+    uint32_t last;
+    int      fd;
+    
+    (void) snprintf(path, sizeof(path), "%s" LOG_DIR_SUFFIX, db_name);
+    if (mkdir(path, S_IRWXU) == -1 && errno != EEXIST)
+    {
+        return -1;
+    }
+    
+    if (find_segments(db_name, &first, &last) == -1)
+    {
+        return -1;
+    }
+    if (last == 0)
+    {
+        segment_path(path, db_name, 1);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, DB_FILE_MODE);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        close(fd);
+    }
+    
+    // A compaction interrupted by a crash leaves its unfinished segment behind.
+    (void) snprintf(path, sizeof(path), LOG_COMPACT_FORMAT, db_name);
+    (void) unlink(path);
+    
+    return 0;
+}
+
+static int log_fetch(struct core_object *co, struct db_shard *shard, datum *key, datum *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state       *st;
+    struct log_index_entry *entry;
+    struct log_segment     *seg;
+    
+    st = get_log_state(co, shard);
+    if (!st)
+    {
+        return -1;
+    }
+    
+    entry = index_find(st, key->dptr, (uint32_t) key->dsize, hash_key(key->dptr, (uint32_t) key->dsize));
+    if (!entry)
+    {
+        value->dptr  = NULL;
+        value->dsize = 0;
+        return 1;
+    }
+    
+    seg = map_segment(co, st, entry->segment,
+                      entry->offset + sizeof(struct log_record_header) + entry->key_size + entry->value_size);
+    if (!seg)
+    {
+        return -1;
+    }
+    value->dptr  = seg->data + entry->offset + sizeof(struct log_record_header) + entry->key_size;
+    value->dsize = entry->value_size;
+    
+    return 0;
+}
+
+static int log_upsert(struct core_object *co, struct db_shard *shard, datum *key, datum *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state *st;
+    size_t           offset;
+    int              ret_val;
+    
+    st = get_log_state(co, shard);
+    if (!st)
+    {
+        return -1;
+    }
+    
+    if (append_record(co, st, key, value, &offset) == -1)
+    {
+        return -1;
+    }
+    
+    ret_val = index_find(st, key->dptr, (uint32_t) key->dsize, hash_key(key->dptr, (uint32_t) key->dsize)) ? 1 : 0;
+    if (index_put(co, st, key->dptr, (uint32_t) key->dsize, st->active, offset, (uint32_t) value->dsize) == -1)
+    {
+        return -1;
+    }
+    
+    return ret_val;
+}
+
+static int log_remove(struct core_object *co, struct db_shard *shard, datum *key)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state *st;
+    size_t           offset;
+    
+    st = get_log_state(co, shard);
+    if (!st)
+    {
+        return -1;
+    }
+    
+    if (!index_find(st, key->dptr, (uint32_t) key->dsize, hash_key(key->dptr, (uint32_t) key->dsize)))
+    {
+        return 1;
+    }
+    if (append_record(co, st, key, NULL, &offset) == -1)
+    {
+        return -1;
+    }
+    index_remove(st, key->dptr, (uint32_t) key->dsize);
+    
+    return 0;
+}
+
+static int log_iterate(struct core_object *co, struct db_shard *shard,
+                       int (*visit)(struct core_object *co, datum *key, datum *value, void *arg), void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state       *st;
+    struct log_index_entry *entry;
+    struct log_segment     *seg;
+    datum                  key;
+    datum                  value;
+    int                    ret_val;
+    
+    st = get_log_state(co, shard);
+    if (!st)
+    {
+        return -1;
+    }
+    
+    ret_val = 0;
+    for (size_t b = 0; b < st->num_buckets && ret_val == 0; ++b)
+    {
+        for (entry = st->buckets[b]; entry && ret_val == 0; entry = entry->next)
+        {
+            seg = map_segment(co, st, entry->segment,
+                              entry->offset + sizeof(struct log_record_header) + entry->key_size + entry->value_size);
+            if (!seg)
+            {
+                return -1;
+            }
+            key.dptr    = entry->key;
+            key.dsize   = (int) entry->key_size;
+            value.dptr  = seg->data + entry->offset + sizeof(struct log_record_header) + entry->key_size;
+            value.dsize = (int) entry->value_size;
+            ret_val     = visit(co, &key, &value, arg);
+        }
+    }
+    
+    return (ret_val == -1) ? -1 : 0;
+}
+
+static void log_close(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state       *st;
+    struct log_index_entry *entry;
+    struct log_index_entry *next;
+    
+    st = (struct log_state *) shard->handle.state;
+    if (!st)
+    {
+        return;
+    }
+    
+    for (size_t b = 0; b < st->num_buckets; ++b)
+    {
+        for (entry = st->buckets[b]; entry; entry = next)
+        {
+            next = entry->next;
+            free(entry);
+        }
+    }
+    free(st->buckets);
+    
+    for (size_t s = 0; s < st->num_segments; ++s)
+    {
+        if (st->segments[s].data)
+        {
+            munmap(st->segments[s].data, st->segments[s].size);
+        }
+        if (st->segments[s].fd > 0)
+        {
+            close(st->segments[s].fd);
+        }
+    }
+    free(st->segments);
+    free(st);
+    
+    shard->handle.state = NULL;
+}
+
+static int log_maintain(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    return compact_segments(co, shard, false);
+}
+
+static int log_compact(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state *st;
+    int              ret_val;
+    
+    if (acquire_write_lock(&shard->lock) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    ret_val = 0;
+    st      = get_log_state(co, shard);
+    if (!st)
+    {
+        ret_val = -1;
+    } else if (st->active_end > 0)
+    {
+        // The other processes find the new segment as they catch up with the version.
+        ret_val = begin_segment(co, st);
+        ++shard->shared->version;
+        st->version = shard->shared->version;
+    }
+    release_write_lock(&shard->lock);
+    if (ret_val == -1)
+    {
+        return -1;
+    }
+    
+    return compact_segments(co, shard, true);
+}
+
+static int compact_segments(struct core_object *co, struct db_shard *shard, bool forced)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state       *st;
+    struct log_segment     *seg;
+    struct log_index_entry *entry;
+    char                   path[LOG_PATH_SIZE];
+    char                   compact_path[LOG_PATH_SIZE];
+    uint32_t               last_sealed;
+    size_t                 sealed_size;
+    size_t                 live_size;
+    size_t                 record_size;
+    int                    fd;
+    
+    if (acquire_read_lock(&shard->lock) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    st = get_log_state(co, shard);
+    release_read_lock(&shard->lock);
+    if (!st)
+    {
+        return -1;
+    }
+    
+    // Sealed segments never change and only this process replaces them, so they are read without the lock.
+    if (st->active - st->first < 1)
+    {
+        return 0;
+    }
+    last_sealed = st->active - 1;
+    sealed_size = 0;
+    for (uint32_t s = st->first; s <= last_sealed; ++s)
+    {
+        seg = map_segment(co, st, s, SIZE_MAX);
+        if (!seg)
+        {
+            return -1;
+        }
+        sealed_size += seg->size;
+    }
+    live_size = 0;
+    for (size_t b = 0; b < st->num_buckets; ++b)
+    {
+        for (entry = st->buckets[b]; entry; entry = entry->next)
+        {
+            if (entry->segment <= last_sealed)
+            {
+                live_size += sizeof(struct log_record_header) + entry->key_size + entry->value_size;
+            }
+        }
+    }
+    if (!forced && (sealed_size - live_size) * LOG_COMPACT_DEAD_RATIO < sealed_size)
+    {
+        return 0;
+    }
+    
+    (void) snprintf(compact_path, sizeof(compact_path), LOG_COMPACT_FORMAT, st->name);
+    fd = open(compact_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, DB_FILE_MODE);
+    if (fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    for (size_t b = 0; b < st->num_buckets; ++b)
+    {
+        for (entry = st->buckets[b]; entry; entry = entry->next)
+        {
+            if (entry->segment > last_sealed)
+            {
+                continue;
+            }
+            record_size = sizeof(struct log_record_header) + entry->key_size + entry->value_size;
+            seg         = &st->segments[entry->segment - st->first];
+            if (write_fully(fd, seg->data + entry->offset, record_size) == -1)
+            {
+                SET_ERROR(co->err);
+                close(fd);
+                unlink(compact_path);
+                return -1;
+            }
+        }
+    }
+    if (fsync(fd) == -1)
+    {
+        SET_ERROR(co->err);
+        close(fd);
+        unlink(compact_path);
+        return -1;
+    }
+    close(fd);
+    
+    if (acquire_write_lock(&shard->lock) == -1)
+    {
+        SET_ERROR(co->err);
+        unlink(compact_path);
+        return -1;
+    }
+    // The compacted segment takes the place of the last sealed segment, so replay order is unchanged.
+    segment_path(path, st->name, last_sealed);
+    if (rename(compact_path, path) == -1)
+    {
+        SET_ERROR(co->err);
+        release_write_lock(&shard->lock);
+        unlink(compact_path);
+        return -1;
+    }
+    for (uint32_t s = st->first; s < last_sealed; ++s)
+    {
+        segment_path(path, st->name, s);
+        (void) unlink(path);
+    }
+    invalidate_db_handles(co, shard);
+    release_write_lock(&shard->lock);
+    
+    (void) fprintf(stdout, "Compacted segments %u to %u of %s: %zu bytes to %zu bytes.\n", st->first, last_sealed,
+                   st->name, sealed_size, live_size);
+    
+    return 0;
+}
+
+static struct log_state *get_log_state(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_handle *handle;
+    struct log_state *st;
+    
+    handle = &shard->handle;
+    st     = (struct log_state *) handle->state;
+    if (!st || handle->generation != shard->shared->generation)
+    {
+        log_close(co, shard);
+        st = open_log_state(co, shard);
+        if (!st)
+        {
+            return NULL;
+        }
+        handle->generation = shard->shared->generation;
+    }
+    
+    if (st->version != shard->shared->version && catch_up(co, st) == -1)
+    {
+        return NULL;
+    }
+    
+    return st;
+}
+
+static struct log_state *open_log_state(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_state *st;
+    uint32_t         last;
+    ssize_t          end;
+    
+    st = (struct log_state *) calloc(1, sizeof(struct log_state));
+    if (!st)
+    {
+        SET_ERROR(co->err);
+        return NULL;
+    }
+    st->name        = shard->name;
+    st->shared      = shard->shared;
+    st->num_buckets = LOG_INITIAL_BUCKETS;
+    st->buckets     = (struct log_index_entry **) calloc(st->num_buckets, sizeof(struct log_index_entry *));
+    if (!st->buckets || find_segments(st->name, &st->first, &last) == -1 || last == 0)
+    {
+        SET_ERROR(co->err);
+        free(st->buckets);
+        free(st);
+        return NULL;
+    }
+    shard->handle.state = st; // So that a failure part way through the replay is cleaned up by log_close.
+    
+    st->num_segments = last - st->first + 1;
+    st->segments     = (struct log_segment *) calloc(st->num_segments, sizeof(struct log_segment));
+    if (!st->segments)
+    {
+        SET_ERROR(co->err);
+        log_close(co, shard);
+        return NULL;
+    }
+    for (st->active = st->first; st->active <= last; ++st->active)
+    {
+        end = replay_segment(co, st, st->active, 0);
+        if (end == -1)
+        {
+            log_close(co, shard);
+            return NULL;
+        }
+        st->active_end = (size_t) end;
+    }
+    --st->active;
+    st->version = st->shared->version;
+    
+    return st;
+}
+
+static int find_segments(const char *db_name, uint32_t *first, uint32_t *last)
+{
+    char          path[LOG_PATH_SIZE];
+    DIR           *dir;
+    struct dirent *dirent;
+    unsigned int  segment;
+    char          suffix;
+    
+    *first = UINT32_MAX;
+    *last  = 0;
+    
+    (void) snprintf(path, sizeof(path), "%s" LOG_DIR_SUFFIX, db_name);
+    dir = opendir(path);
+    if (!dir)
+    {
+        return -1;
+    }
+    // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
+    while ((dirent = readdir(dir)))
+    {
+        if (sscanf(dirent->d_name, "%8u.se%c", &segment, &suffix) == 2 && suffix == 'g' && segment > 0)
+        {
+            *first = (segment < *first) ? segment : *first;
+            *last  = (segment > *last) ? segment : *last;
+        }
+    }
+    closedir(dir);
+    
+    if (*last == 0)
+    {
+        *first = 0;
+    }
+    
+    return 0;
+}
+
+static int catch_up(struct core_object *co, struct log_state *st)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char    path[LOG_PATH_SIZE];
+    ssize_t end;
+    
+    for (;;)
+    {
+        end = replay_segment(co, st, st->active, st->active_end);
+        if (end == -1)
+        {
+            return -1;
+        }
+        st->active_end = (size_t) end;
+        
+        // The writer seals a segment only when it begins the next, so the next segment existing means this
+        // segment has been replayed to its end.
+        segment_path(path, st->name, st->active + 1);
+        if (access(path, F_OK) == -1)
+        {
+            break;
+        }
+        if (begin_segment(co, st) == -1)
+        {
+            return -1;
+        }
+    }
+    st->version = st->shared->version;
+    
+    return 0;
+}
+
+static ssize_t replay_segment(struct core_object *co, struct log_state *st, uint32_t segment, size_t offset)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_segment       *seg;
+    struct log_record_header header;
+    const uint8_t            *key;
+    size_t                   record_size;
+    
+    seg = map_segment(co, st, segment, SIZE_MAX);
+    if (!seg)
+    {
+        return -1;
+    }
+    
+    while (offset + sizeof(header) <= seg->size)
+    {
+        memcpy(&header, seg->data + offset, sizeof(header));
+        record_size = sizeof(header) + (size_t) header.key_size + stored_value_size(header.value_size);
+        if (offset + record_size > seg->size)
+        {
+            break;
+        }
+        key = seg->data + offset + sizeof(header);
+        if (record_checksum(&header, key, key + header.key_size) != header.checksum)
+        {
+            break;
+        }
+        if (header.value_size == LOG_TOMBSTONE)
+        {
+            index_remove(st, key, header.key_size);
+        } else if (index_put(co, st, key, header.key_size, segment, offset, header.value_size) == -1)
+        {
+            return -1;
+        }
+        offset += record_size;
+    }
+    
+    return (ssize_t) offset;
+}
+
+static struct log_segment *map_segment(struct core_object *co, struct log_state *st, uint32_t segment,
+                                       size_t min_size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_segment *seg;
+    struct stat        stat_buf;
+    char               path[LOG_PATH_SIZE];
+    void               *data;
+    
+    seg = &st->segments[segment - st->first];
+    if (seg->fd <= 0)
+    {
+        segment_path(path, st->name, segment);
+        seg->fd = open(path, O_RDWR | O_CLOEXEC);
+        if (seg->fd == -1)
+        {
+            SET_ERROR(co->err);
+            seg->fd = 0;
+            return NULL;
+        }
+    }
+    
+    // Sealed segments are mapped once; the active segment is remapped when it has grown.
+    if (seg->data && (segment != st->active || seg->size >= min_size))
+    {
+        return seg;
+    }
+    if (fstat(seg->fd, &stat_buf) == -1)
+    {
+        SET_ERROR(co->err);
+        return NULL;
+    }
+    if (seg->data && (size_t) stat_buf.st_size == seg->size)
+    {
+        return seg;
+    }
+    if (seg->data)
+    {
+        munmap(seg->data, seg->size);
+        seg->data = NULL;
+        seg->size = 0;
+    }
+    if (stat_buf.st_size == 0)
+    {
+        return seg;
+    }
+    data = mmap(NULL, (size_t) stat_buf.st_size, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        return NULL;
+    }
+    seg->data = (uint8_t *) data;
+    seg->size = (size_t) stat_buf.st_size;
+    
+    return seg;
+}
+
+static int begin_segment(struct core_object *co, struct log_state *st)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_segment *segments;
+    char               path[LOG_PATH_SIZE];
+    int                fd;
+    
+    segments = (struct log_segment *) realloc(st->segments, (st->num_segments + 1) * sizeof(struct log_segment));
+    if (!segments)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    memset(&segments[st->num_segments], 0, sizeof(struct log_segment));
+    st->segments = segments;
+    ++st->num_segments;
+    
+    segment_path(path, st->name, st->active + 1);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, DB_FILE_MODE);
+    if (fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    close(fd);
+    
+    // The sealed segment is remapped once at its final size.
+    if (st->segments[st->active - st->first].data)
+    {
+        munmap(st->segments[st->active - st->first].data, st->segments[st->active - st->first].size);
+        st->segments[st->active - st->first].data = NULL;
+    }
+    ++st->active;
+    st->active_end = 0;
+    
+    return 0;
+}
+
+static int append_record(struct core_object *co, struct log_state *st, const datum *key, const datum *value,
+                         size_t *offset)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct log_segment       *seg;
+    struct log_record_header header;
+    struct iovec             iov[LOG_RECORD_PARTS];
+    size_t                   record_size;
+    
+    header.key_size   = (uint32_t) key->dsize;
+    header.value_size = (value) ? (uint32_t) value->dsize : LOG_TOMBSTONE;
+    header.checksum   = record_checksum(&header, key->dptr, (value) ? value->dptr : NULL);
+    record_size       = sizeof(header) + header.key_size + stored_value_size(header.value_size);
+    
+    if (st->active_end > 0 && st->active_end + record_size > LOG_SEGMENT_MAX_SIZE && begin_segment(co, st) == -1)
+    {
+        return -1;
+    }
+    seg = map_segment(co, st, st->active, 0);
+    if (!seg)
+    {
+        return -1;
+    }
+    // Anything past the last whole record was torn by a crash during a write.
+    if (seg->size > st->active_end)
+    {
+        if (ftruncate(seg->fd, (off_t) st->active_end) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        munmap(seg->data, seg->size);
+        seg->data = NULL;
+        seg->size = 0;
+    }
+    
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = key->dptr;
+    iov[1].iov_len  = header.key_size;
+    iov[2].iov_base = (value) ? value->dptr : NULL;
+    iov[2].iov_len  = stored_value_size(header.value_size);
+    if (pwritev(seg->fd, iov, LOG_RECORD_PARTS, (off_t) st->active_end) != (ssize_t) record_size)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    *offset = st->active_end;
+    st->active_end += record_size;
+    // This write is the one bumping the database version, so the state stays caught up.
+    st->version = st->shared->version + 1;
+    
+    return 0;
+}
+
+static struct log_index_entry *index_find(const struct log_state *st, const void *key, uint32_t key_size,
+                                          uint32_t hash)
+{
+    struct log_index_entry *entry;
+    
+    for (entry = st->buckets[hash % st->num_buckets]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->key_size == key_size && memcmp(entry->key, key, key_size) == 0)
+        {
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+static int index_put(struct core_object *co, struct log_state *st, const void *key, uint32_t key_size,
+                     uint32_t segment, size_t offset, uint32_t value_size)
+{
+    struct log_index_entry *entry;
+    struct log_index_entry **buckets;
+    struct log_index_entry *next;
+    size_t                 num_buckets;
+    uint32_t               hash;
+    
+    hash  = hash_key(key, key_size);
+    entry = index_find(st, key, key_size, hash);
+    if (entry)
+    {
+        entry->segment    = segment;
+        entry->offset     = offset;
+        entry->value_size = value_size;
+        return 0;
+    }
+    
+    // Keep the chains short by doubling the buckets when there are as many entries as buckets.
+    if (st->num_entries >= st->num_buckets)
+    {
+        num_buckets = st->num_buckets * 2;
+        buckets     = (struct log_index_entry **) calloc(num_buckets, sizeof(struct log_index_entry *));
+        if (!buckets)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        for (size_t b = 0; b < st->num_buckets; ++b)
+        {
+            for (entry = st->buckets[b]; entry; entry = next)
+            {
+                next                                   = entry->next;
+                entry->next                            = buckets[entry->hash % num_buckets];
+                buckets[entry->hash % num_buckets] = entry;
+            }
+        }
+        free(st->buckets);
+        st->buckets     = buckets;
+        st->num_buckets = num_buckets;
+    }
+    
+    entry = (struct log_index_entry *) malloc(sizeof(struct log_index_entry) + key_size);
+    if (!entry)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    entry->hash       = hash;
+    entry->segment    = segment;
+    entry->offset     = offset;
+    entry->key_size   = key_size;
+    entry->value_size = value_size;
+    memcpy(entry->key, key, key_size);
+    entry->next                          = st->buckets[hash % st->num_buckets];
+    st->buckets[hash % st->num_buckets] = entry;
+    ++st->num_entries;
+    
+    return 0;
+}
+
+static void index_remove(struct log_state *st, const void *key, uint32_t key_size)
+{
+    struct log_index_entry **link;
+    struct log_index_entry *entry;
+    uint32_t               hash;
+    
+    hash = hash_key(key, key_size);
+    link = &st->buckets[hash % st->num_buckets];
+    while (*link)
+    {
+        entry = *link;
+        if (entry->hash == hash && entry->key_size == key_size && memcmp(entry->key, key, key_size) == 0)
+        {
+            *link = entry->next;
+            free(entry);
+            --st->num_entries;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+static size_t stored_value_size(uint32_t value_size)
+{
+    return (value_size == LOG_TOMBSTONE) ? 0 : value_size;
+}
+
+static uint32_t hash_key(const void *key, uint32_t key_size)
+{
+    const uint8_t *bytes;
+    uint32_t      hash;
+    
+    bytes = (const uint8_t *) key;
+    hash  = LOG_FNV_OFFSET;
+    for (uint32_t i = 0; i < key_size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= LOG_FNV_PRIME;
+    }
+    
+    return hash;
+}
+
+static uint32_t record_checksum(const struct log_record_header *header, const void *key, const void *value)
+{
+    uLong checksum;
+    
+    checksum = crc32(0L, Z_NULL, 0);
+    checksum = crc32(checksum, (const Bytef *) &header->key_size, sizeof(header->key_size));
+    checksum = crc32(checksum, (const Bytef *) &header->value_size, sizeof(header->value_size));
+    checksum = crc32(checksum, (const Bytef *) key, header->key_size);
+    // zlib takes a NULL buffer as asking for the initial value, so the empty value of a tombstone is skipped.
+    if (stored_value_size(header->value_size))
+    {
+        checksum = crc32(checksum, (const Bytef *) value, (uInt) stored_value_size(header->value_size));
+    }
+    
+    return (uint32_t) checksum;
+}
+
+static void segment_path(char *path, const char *db_name, uint32_t segment)
+{
+    (void) snprintf(path, LOG_PATH_SIZE, LOG_SEGMENT_FORMAT, db_name, segment);
+}
@@ -1,6 +1,16 @@
+#include "../include/compress.h"
 #include "../include/db.h"
+#include "../include/db_batch.h"
+#include "../include/db_blob.h"
+#include "../include/db_index.h"
+#include "../include/db_record.h"
+#include "../include/db_replica.h"
+#include "../include/db_write_queue.h"
 #include "../include/manager.h"
 #include "../include/methods.h"
+#include "../include/range.h"
+#include "../include/read.h"
+#include "../include/upload.h"
 #include "../include/util.h"
 
 #include <stdlib.h>
@@ -9,7 +19,22 @@
 #include <unistd.h>
 
 // NOLINTNEXTLINE(modernize-macro-to-enum) : Macro is fine.
-#define CONTENT_LENGTH_MAX_DIGITS 32 /** The maximum number of digits acceptable for the content size. */
+#define CONTENT_LENGTH_MAX_DIGITS 32    /** The maximum number of digits acceptable for the content size. */
+#define FS_CACHE_KEY_PREFIX "/fs"       /** Prefix of the compressed variant cache keys of files. */
+#define DB_CACHE_KEY_PREFIX "/db"       /** Prefix of the compressed variant cache keys of database values. */
+#define DB_LIST_PAGE_SIZE 4096          /** Initial size of the buffer holding a page of a database listing. */
+
+/**
+ * A page of a database listing being assembled: the keys listed, one to a line, and the last key listed.
+ */
+struct db_list_page
+{
+    char       *data;
+    size_t     size;
+    size_t     capacity;
+    const char *last;      // In the database ordered key index; NULL if no key was listed.
+    size_t     last_size;
+};
 
 /**
  * http_get
@@ -25,13 +50,117 @@
  * @return 0 on success, -1 and set err on failure
  */
 static int http_get(struct core_object *co, struct state_object *so, struct http_request *request,
-                    size_t *status, struct http_header ***headers, char **entity_body);
+                    size_t *status, struct http_header ***headers, struct http_entity_body *entity_body);
 
 static int fs_get(bool conditional, struct core_object *co, struct state_object *so, struct http_request *request,
-                  size_t *status, struct http_header ***headers, char **entity_body);
+                  size_t *status, struct http_header ***headers, struct http_entity_body *entity_body);
 
 static int db_get(bool conditional, struct core_object *co, struct state_object *so, struct http_request *request,
-                  size_t *status, struct http_header ***headers, char **entity_body);
+                  size_t *status, struct http_header ***headers, struct http_entity_body *entity_body);
+
+/**
+ * db_value_response_innards
+ * <p>
+ * Assemble the response headers for a value fetched from the database and send the value as the entity body,
+ * either from its blob or moved to the front of the buffer into which it was fetched.
+ * </p>
+ * @param co the core object
+ * @param data the buffer into which the record was fetched; freed on failure or if the value is in a blob
+ * @param fd the file descriptor of the blob holding the value, or 0 if the value is in data; closed on failure
+ * @param value the value, in data, if not in a blob
+ * @param value_size the size of the value
+ * @param content_type the content type of the value
+ * @param content_encoding the content coding of the value, or NULL if it is not encoded
+ * @param etag the entity tag of the value, without its quotes
+ * @param vary whether the entity body depends on the Accept-Encoding header of the request
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @param entity_body pointer to the entity body for the response
+ * @return 0 on success, -1 and set err on failure
+ */
+static int db_value_response_innards(struct core_object *co, char *data, int fd, const char *value,
+                                     size_t value_size, const char *content_type, const char *content_encoding,
+                                     const char *etag, bool vary, size_t *status, struct http_header ***headers,
+                                     struct http_entity_body *entity_body);
+
+/**
+ * db_meta_response_innards
+ * <p>
+ * Answer a conditional GET or a HEAD of a database value from its metadata record alone, without reading the
+ * value: with 404 if the value has expired, with 304 if the value has not been modified since the If-Modified-Since
+ * date, or with the headers of the value if the request is a HEAD asking for neither a range nor a compressed
+ * variant. Otherwise, or if the value
+ * has no metadata record, the value must be read to answer the request.
+ * </p>
+ * @param conditional whether the request has an If-Modified-Since header
+ * @param co the core object
+ * @param shard the shard holding the value
+ * @param key the key of the value
+ * @param req the request
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @return 0 if the request was answered, 1 if the value must be read, -1 and set err on failure
+ */
+static int db_meta_response_innards(bool conditional, struct core_object *co, struct db_shard *shard,
+                                    const datum *key, struct http_request *req, size_t *status,
+                                    struct http_header ***headers);
+
+/**
+ * db_list_response_innards
+ * <p>
+ * Answer a GET listing, in order, the database keys that begin with the request URI: a page of up to the Limit
+ * header keys, one to a line, that sort after the Cursor header key. If more keys follow the page, the next-cursor
+ * header holds the key from which to list the next page. Listing takes no database lock.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param req the request
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @param entity_body pointer to the entity body for the response
+ * @return 0 on success, -1 and set err on failure
+ */
+static int db_list_response_innards(struct core_object *co, struct state_object *so, struct http_request *req,
+                                    size_t *status, struct http_header ***headers,
+                                    struct http_entity_body *entity_body);
+
+/**
+ * db_replication_response_innards
+ * <p>
+ * Answer a GET of the replication status: the part this server plays in replication and, for a replica, how far
+ * behind its primary it is, as text.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param status pointer to the status field for the response
+ * @param headers pointer to the header list for the response
+ * @param entity_body pointer to the entity body for the response
+ * @return 0 on success, -1 and set err on failure
+ */
+static int db_replication_response_innards(struct core_object *co, struct state_object *so, size_t *status,
+                                           struct http_header ***headers, struct http_entity_body *entity_body);
+
+/**
+ * append_list_key
+ * <p>
+ * Append a key listed from the database ordered key index to a page of a listing, as a line without the
+ * terminating null byte of the key.
+ * </p>
+ * @param co the core object
+ * @param key the key
+ * @param arg the page
+ * @return 0 on success, -1 and set err on failure
+ */
+static int append_list_key(struct core_object *co, const datum *key, void *arg);
+
+/**
+ * close_blob
+ * <p>
+ * Close the file descriptor of a blob, if one was opened.
+ * </p>
+ * @param fd the file descriptor of the blob, or 0
+ */
+static void close_blob(int fd);
 
 /**
  * http_head
@@ -47,7 +176,7 @@ static int db_get(bool conditional, struct core_object *co, struct state_object
  * @return 0 on success, -1 and set err on failure
  */
 static int http_head(struct core_object *co, struct state_object *so, struct http_request *request,
-                     size_t *status, struct http_header ***headers, char **entity_body);
+                     size_t *status, struct http_header ***headers, struct http_entity_body *entity_body);
 
 /**
  * http_post
@@ -63,35 +192,124 @@ static int http_head(struct core_object *co, struct state_object *so, struct htt
  * @return 0 on success, -1 and set err on failure
  */
 static int http_post(struct core_object *co, struct state_object *so, struct http_request *request,
-                     size_t *status, struct http_header ***headers, char **entity_body);
+                     size_t *status, struct http_header ***headers, struct http_entity_body *entity_body);
+
+/**
+ * parse_db_expiry
+ * <p>
+ * Get the expiry time of a value to be stored in the database from a request: the current time plus the seconds of
+ * a TTL header, or else the date of an Expires header.
+ * </p>
+ * @param request the request
+ * @param expires set to the expiry time, or to 0 if the request gives none
+ * @return 0 on success, -1 if the TTL or the date is malformed
+ */
+static int parse_db_expiry(struct http_request *request, time_t *expires);
 
 /**
  * store_in_db
  * <p>
- * Store a request body in the database with the key as the URI.
+ * Store a request body in the database with the key as the URI. If the database writes are queued for the writer
+ * process, the store is queued, and waited on unless deferred.
  * </p>
  * @param co the core object
  * @param so the server object
  * @param uri the request URI
  * @param entity_body the entity body
  * @param entity_body_size the size of the entity body
- * @return 0 if the object was inserted, 1 if the object was updated, -1 and set err on failure.
+ * @param content_type the content type of the entity body, or NULL if not given
+ * @param content_encoding the content coding of the entity body, or NULL if it is not encoded
+ * @param expires the time after which the entity body has expired, or 0 if it never expires
+ * @param deferred whether to return once the store is queued rather than once it is written
+ * @return 0 if the object was inserted, 1 if the object was updated, DB_UPSERT_QUEUED if the store was queued,
+ * -1 and set err on failure.
  */
 static int store_in_db(struct core_object *co, struct state_object *so, char *uri,
-                       char *entity_body, size_t entity_body_size);
+                       char *entity_body, size_t entity_body_size, const char *content_type,
+                       const char *content_encoding, time_t expires, bool deferred);
+
+/**
+ * store_chunked_in_db
+ * <p>
+ * Decode a chunked entity body from the client connection into a temporary file of the blob store, then store it in
+ * the database under the request URI. A value small enough for a database page is read back and stored as any
+ * other; a larger one is moved into the blob store, and the record holds its digest, so the memory used does not
+ * grow with the body. The entity body of the response is the value.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param request the request, whose entity body is still unread
+ * @param content_type the content type of the value, or NULL if not given
+ * @param content_encoding the content coding of the value, or NULL if it is not encoded
+ * @param expires the time after which the value has expired, or 0 if it never expires
+ * @param deferred whether to return once the write is queued, without waiting for it to be written
+ * @param entity_body the entity body for the response
+ * @return 0 if the value was inserted, 1 if it was replaced, DB_UPSERT_QUEUED if it was queued, -1 and set err on
+ * failure
+ */
+static int store_chunked_in_db(struct core_object *co, struct state_object *so, struct http_request *request,
+                               const char *content_type, const char *content_encoding, time_t expires, bool deferred,
+                               struct http_entity_body *entity_body);
+
+/**
+ * queue_db_value
+ * <p>
+ * Queue an encoded database value to be upserted under a URI, freeing the value.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param uri the URI, which is the key
+ * @param database_buffer the encoded value, allocated with the memory manager
+ * @param database_buffer_size the size of the encoded value
+ * @param deferred whether to return once the write is queued, without waiting for it to be written
+ * @return 0 if the value was inserted, 1 if it was replaced, DB_UPSERT_QUEUED if it was queued, -1 and set err on
+ * failure
+ */
+static int queue_db_value(struct core_object *co, struct state_object *so, char *uri, uint8_t *database_buffer,
+                          size_t database_buffer_size, bool deferred);
 
 /**
  * store_in_fs
  * <p>
- * Store the entity body of a request in the file system at its request line.
+ * Stream the entity body of a request from the client connection into a file in the write directory, under the
+ * request URI. The body is moved to disk in chunks of bounded size and the file is renamed into place whole, so the
+ * memory used does not grow with the body and readers never see part of the file. A client waiting for 100 Continue
+ * is sent it only once the file is open. The entity body of the response is the stored file.
  * </p>
  * @param co the core object
- * @param uri the uri at which to store the entity body
- * @param entity_body the entity body
- * @param entity_body_size the entity body size
+ * @param request the request, whose entity body is still unread
+ * @param entity_body_size the entity body size; ignored if the entity body is chunked
+ * @param entity_body the entity body for the response
+ * @return 0 if the file was created, 1 if it was replaced, -1 and set err on failure
+ */
+static int store_in_fs(struct core_object *co, struct http_request *request, size_t entity_body_size,
+                       struct http_entity_body *entity_body);
+
+/**
+ * receive_chunked_upload
+ * <p>
+ * Decode a chunked entity body from the client connection into an upload a chunk at a time. errno is EMSGSIZE if
+ * the entity body is larger than the maximum, and EBADMSG if its chunks are malformed.
+ * </p>
+ * @param co the core object
+ * @param request the request, whose entity body is still unread
+ * @param upload the upload
  * @return 0 on success, -1 and set err on failure
  */
-static int store_in_fs(struct core_object *co, char *uri, char *entity_body, size_t entity_body_size);
+static int receive_chunked_upload(struct core_object *co, struct http_request *request, struct upload *upload);
+
+/**
+ * entity_body_refused
+ * <p>
+ * Check whether an entity body failed to be accepted because of what the client sent rather than a fault of the
+ * server, as told by errno, and if so set the status of the response: 413 if the entity body was larger than the
+ * maximum, 400 if its chunks were malformed.
+ * </p>
+ * @param status the status of the response
+ * @param headers the headers of the response
+ * @return true if the entity body was refused, false if the server failed
+ */
+static bool entity_body_refused(size_t *status, struct http_header ***headers);
 
 /**
  * post_assemble_response_innards
@@ -106,24 +324,29 @@ static int store_in_fs(struct core_object *co, char *uri, char *entity_body, siz
  * @return 0 on success, -1 on failure
  */
 static int post_assemble_response_innards(struct core_object *co, struct http_request *request,
-                                          struct http_header ***headers, char **entity_body);
+                                          struct http_header ***headers, struct http_entity_body *entity_body);
 
 /**
  * get_assemble_response_innards
  * <p>
  * Assemble the innards of the Response to a GET Request.
  * </p>
+ * @param content_length the size of the entity body
+ * @param content_type the content type of the entity
+ * @param content_encoding the content coding of the entity body, or NULL if it is not encoded
+ * @param etag the entity tag of the entity body, without its quotes, or NULL if it has none
+ * @param vary whether the entity body depends on the Accept-Encoding header of the request
  * @param co the core object
- * @param request the request object
+ * @param status pointer to the status field for the response
  * @param headers pointer to the header list for the response
- * @param entity_body pointer to the entity body for the response
  * @return 0 on success, -1 on failure
  */
-static int get_assemble_response_innards(off_t content_length, struct core_object *co, size_t *status,
-                                         struct http_header ***headers);
+static int get_assemble_response_innards(off_t content_length, const char *content_type,
+                                         const char *content_encoding, const char *etag, bool vary,
+                                         struct core_object *co, size_t *status, struct http_header ***headers);
 
 int perform_method(struct core_object *co, struct state_object *so, struct http_request *request,
-                   size_t *status, struct http_header ***headers, char **entity_body)
+                   size_t *status, struct http_header ***headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
     
@@ -153,14 +376,13 @@ int perform_method(struct core_object *co, struct state_object *so, struct http_
     {
         *status      = NOT_IMPLEMENTED_501;
         *headers     = NULL;
-        *entity_body = NULL;
     }
     
     return 0;
 }
 
 static int http_get(struct core_object *co, struct state_object *so, struct http_request *request,
-                    size_t *status, struct http_header ***headers, char **entity_body)
+                    size_t *status, struct http_header ***headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
     bool               db          = false;
@@ -192,15 +414,25 @@ static int http_get(struct core_object *co, struct state_object *so, struct http
 }
 
 int fs_get(bool conditional, struct core_object *co, struct state_object *so, struct http_request *req,
-           size_t *status, struct http_header ***headers, char **entity_body)
+           size_t *status, struct http_header ***headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
-    char               pathname[BUFSIZ];
-    struct stat        st;
-    struct http_header *h;
-    time_t             f_last_modified;
-    time_t             h_last_modified;
-    int                fd;
+    char                pathname[BUFSIZ];
+    struct stat         st;
+    struct stat         lst;
+    struct http_header  *h;
+    time_t              f_last_modified;
+    time_t              h_last_modified;
+    int                 fd;
+    struct byte_range   ranges[MAX_BYTE_RANGES];
+    int                 num_ranges;
+    const char          *content_type;
+    enum content_coding coding;
+    bool                vary;
+    char                cache_key[BUFSIZ];
+    char                etag[SHA256_HEX_LEN + 1];
+    bool                addressed;
+    int                 res;
     
     memset(pathname, 0, BUFSIZ);
     if (getcwd(pathname, BUFSIZ) == NULL)
@@ -218,10 +450,18 @@ int fs_get(bool conditional, struct core_object *co, struct state_object *so, st
     {
         *status      = NOT_FOUND_404;
         *headers     = NULL;
-        *entity_body = NULL;
         
         return 0;
     }
+    f_last_modified = st.st_mtimespec.tv_sec;
+    
+    // A content-addressed file is a link into the blob store, and an upload of contents already stored leaves the
+    // blob as it was. Each upload makes a new link, so the link is as old as the file.
+    addressed = get_upload_etag(pathname, etag) == 0;
+    if (addressed && lstat(pathname, &lst) == 0)
+    {
+        f_last_modified = lst.st_mtimespec.tv_sec;
+    }
     
     if (conditional)
     {
@@ -231,7 +471,6 @@ int fs_get(bool conditional, struct core_object *co, struct state_object *so, st
             (void) fprintf(stderr, "if-modified-since header not found in request\n");
             return -1;
         }
-        f_last_modified = st.st_mtimespec.tv_sec;
         h_last_modified = http_time_to_time_t(h->value);
         if (h_last_modified == -1)
         {
@@ -241,53 +480,117 @@ int fs_get(bool conditional, struct core_object *co, struct state_object *so, st
         {
             *status      = NOT_MODIFIED_304;
             *headers     = NULL;
-            *entity_body = NULL;
             return 0;
         }
     }
     
+    // A malformed Range header is ignored and the whole file is sent.
+    h          = get_applicable_range(req, f_last_modified);
+    num_ranges = (h) ? parse_range_header(h->value, st.st_size, ranges) : -1;
+    if (num_ranges == 0)
+    {
+        return range_not_satisfiable_response_innards(co, st.st_size, status, headers);
+    }
+    
     printf("OPEN FILE\n");
-    fd = open(pathname, O_RDONLY);
+    fd = open(pathname, O_RDONLY | O_CLOEXEC);
     if (fd == -1)
     {
         SET_ERROR(co->err);
         return -1;
     }
-    *entity_body = mm_calloc(st.st_size + 1, sizeof(char), co->mm);
-    if (!*entity_body)
+    
+    content_type = get_content_type(req->request_line->request_URI);
+    if (num_ranges > 0)
     {
-        SET_ERROR(co->err);
-        return -1;
+        return range_assemble_response_innards(co, ranges, (size_t) num_ranges, st.st_size, content_type, fd,
+                                               NULL, status, headers, entity_body);
     }
-    printf("READ FULLY\n");
-    if (read_fully(fd, *entity_body, st.st_size) == -1)
+    
+    // Ranges are always of the identity entity, so only whole entities are compressed.
+    vary   = is_compressible(content_type, (size_t) st.st_size);
+    coding = (vary) ? negotiate_content_coding(req) : CODING_IDENTITY;
+    if (coding != CODING_IDENTITY)
     {
-        return -1;
+        (void) snprintf(cache_key, BUFSIZ, "%s%s", FS_CACHE_KEY_PREFIX, req->request_line->request_URI);
+        res = get_compressed_variant(co, coding, cache_key, pathname, f_last_modified, fd, NULL,
+                                     (size_t) st.st_size, entity_body);
+        if (res == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        if (res == 0)
+        {
+            close(fd);
+            return get_assemble_response_innards((off_t) entity_body->size, content_type,
+                                                 content_coding_name(coding), NULL, vary, co, status, headers);
+        }
     }
-    (*entity_body)[st.st_size] = '\0';
+    
+    // The entity body is sent straight from the file when the response is sent. A content-addressed file is tagged
+    // with its digest.
+    entity_body->fd     = fd;
+    entity_body->offset = 0;
+    entity_body->size   = (size_t) st.st_size;
     printf("ASSEMBLE HEADERS\n");
-    return get_assemble_response_innards(st.st_size, co, status, headers);
+    return get_assemble_response_innards(st.st_size, content_type, NULL, (addressed) ? etag : NULL, vary, co, status,
+                                         headers);
 }
 
 int db_get(bool conditional, struct core_object *co, struct state_object *so, struct http_request *req,
-           size_t *status, struct http_header ***headers, char **entity_body)
+           size_t *status, struct http_header ***headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
-    int                res;
-    char               *path;
-    char               d_last_modified_str[HTTP_TIME_LEN];
-    time_t             d_last_modified;
-    time_t             h_last_modified;
-    struct http_header *h;
-    char               *data;
-    char               *value;
-    datum              key;
+    int                 res;
+    char                *path;
+    time_t              d_last_modified;
+    time_t              h_last_modified;
+    struct http_header  *h;
+    char                *data;
+    size_t              data_size;
+    struct db_record    record;
+    const char          *value;
+    size_t              value_size;
+    int                 fd;
+    char                digest[SHA256_HEX_LEN + 1];
+    char                etag[DB_RECORD_MAX_ETAG_LEN + 1];
+    datum               key;
+    struct db_shard     *shard;
+    struct byte_range   ranges[MAX_BYTE_RANGES];
+    int                 num_ranges;
+    const char          *content_type;
+    enum content_coding coding;
+    bool                vary;
+    char                cache_key[BUFSIZ];
+    
+    h = get_header("list", req->extension_headers, req->num_extension_headers);
+    if (h && strcmp(to_lower(h->value), "true") == 0)
+    {
+        return db_list_response_innards(co, so, req, status, headers, entity_body);
+    }
+    
+    if (strcmp(req->request_line->request_URI, DB_REPLICATION_PATH) == 0)
+    {
+        return db_replication_response_innards(co, so, status, headers, entity_body);
+    }
     
     path = req->request_line->request_URI;
     key.dptr  = path;
     key.dsize = strlen(path) + 1;
+    shard     = get_db_shard(so, &key);
+    
+    // The metadata record may answer the request without the value being read at all.
+    if (conditional || strcmp(req->request_line->method, M_HEAD) == 0)
+    {
+        res = db_meta_response_innards(conditional, co, shard, &key, req, status, headers);
+        if (res != 1)
+        {
+            return res;
+        }
+    }
     
-    res = safe_dbm_fetch(co, DB_NAME, co->so->db_sem, &key, (uint8_t **) &data);
+    res = safe_dbm_fetch(co, shard, &key, (uint8_t **) &data, &data_size);
     if (res == -1)
     {
         return -1;
@@ -296,12 +599,55 @@ int db_get(bool conditional, struct core_object *co, struct state_object *so, st
     {
         *status      = NOT_FOUND_404;
         *headers     = NULL;
-        *entity_body = NULL;
         
         return 0;
     }
-    strcpy(d_last_modified_str, data);
-    value = data + strlen(data) + 1;
+    if (decode_db_record((uint8_t *) data, data_size, &record) == -1)
+    {
+        (void) fprintf(stderr, "malformed database record for %s\n", path);
+        mm_free(co->mm, data);
+        return -1;
+    }
+    
+    // An expired value is not served, though the sweeper may not have removed it yet.
+    if (is_db_expired(record.expires, time(NULL)))
+    {
+        *status      = NOT_FOUND_404;
+        *headers     = NULL;
+        mm_free(co->mm, data);
+        
+        return 0;
+    }
+    value           = (const char *) record.body;
+    value_size      = record.body_size;
+    fd              = 0;
+    d_last_modified = record.mtime;
+    content_type    = (record.content_type) ? record.content_type : get_content_type(path);
+    get_db_record_etag(&record, etag);
+    
+    // A value in the blob store is sent straight from its file.
+    if (record.flags & DB_RECORD_BLOB)
+    {
+        if (value_size != SHA256_HEX_LEN)
+        {
+            (void) fprintf(stderr, "malformed database blob record for %s\n", path);
+            mm_free(co->mm, data);
+            return -1;
+        }
+        memcpy(digest, value, SHA256_HEX_LEN);
+        digest[SHA256_HEX_LEN] = '\0';
+        res = open_db_blob(co, digest, &fd, &value_size);
+        if (res != 0)
+        {
+            if (res == 1)
+            {
+                (void) fprintf(stderr, "database blob %s for %s not found\n", digest, path);
+            }
+            mm_free(co->mm, data);
+            return -1;
+        }
+        value = NULL;
+    }
     
     if (conditional)
     {
@@ -309,79 +655,518 @@ int db_get(bool conditional, struct core_object *co, struct state_object *so, st
         if (!h)
         {
             (void) fprintf(stderr, "if-modified-since header not found in request\n");
+            close_blob(fd);
+            mm_free(co->mm, data);
             return -1;
         }
-        d_last_modified = http_time_to_time_t(d_last_modified_str);
         h_last_modified = http_time_to_time_t(h->value);
         if (h_last_modified == -1)
         {
+            close_blob(fd);
+            mm_free(co->mm, data);
             return -1;
         }
         if (difftime(d_last_modified, h_last_modified) < 0)
         {
             *status      = NOT_MODIFIED_304;
             *headers     = NULL;
-            *entity_body = NULL;
+            close_blob(fd);
+            mm_free(co->mm, data);
+            return 0;
+        }
+    }
+    
+    // A body stored already encoded is sent as stored, whole.
+    if (record.content_encoding)
+    {
+        return db_value_response_innards(co, data, fd, value, value_size, content_type, record.content_encoding,
+                                         etag, false, status, headers, entity_body);
+    }
+    
+    // A malformed Range header is ignored and the whole value is sent.
+    h          = get_applicable_range(req, d_last_modified);
+    num_ranges = (h) ? parse_range_header(h->value, (off_t) value_size, ranges) : -1;
+    if (num_ranges == 0)
+    {
+        close_blob(fd);
+        mm_free(co->mm, data);
+        return range_not_satisfiable_response_innards(co, (off_t) value_size, status, headers);
+    }
+    if (num_ranges > 0)
+    {
+        res = range_assemble_response_innards(co, ranges, (size_t) num_ranges, (off_t) value_size, content_type,
+                                              fd, value, status, headers, entity_body);
+        mm_free(co->mm, data);
+        return res;
+    }
+    
+    vary   = is_compressible(content_type, value_size);
+    coding = (vary) ? negotiate_content_coding(req) : CODING_IDENTITY;
+    if (coding != CODING_IDENTITY)
+    {
+        (void) snprintf(cache_key, BUFSIZ, "%s%s", DB_CACHE_KEY_PREFIX, path);
+        res = get_compressed_variant(co, coding, cache_key, NULL, d_last_modified, fd, value, value_size,
+                                     entity_body);
+        if (res != 1)
+        {
+            // The content type may be stored in the fetched buffer, so the buffer is freed after the headers are set.
+            if (res == 0)
+            {
+                res = get_assemble_response_innards((off_t) entity_body->size, content_type,
+                                                    content_coding_name(coding), NULL, vary, co, status,
+                                                    headers);
+            }
+            close_blob(fd);
+            mm_free(co->mm, data);
+            return res;
+        }
+    }
+    
+    return db_value_response_innards(co, data, fd, value, value_size, content_type, NULL, etag, vary, status,
+                                     headers, entity_body);
+}
+
+static int db_value_response_innards(struct core_object *co, char *data, int fd, const char *value,
+                                     size_t value_size, const char *content_type, const char *content_encoding,
+                                     const char *etag, bool vary, size_t *status, struct http_header ***headers,
+                                     struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    // The headers are set first, as the content type and coding may be stored ahead of the value in the buffer.
+    if (get_assemble_response_innards((off_t) value_size, content_type, content_encoding, etag, vary, co, status,
+                                      headers) == -1)
+    {
+        close_blob(fd);
+        mm_free(co->mm, data);
+        return -1;
+    }
+    
+    if (fd)
+    {
+        mm_free(co->mm, data);
+        entity_body->fd     = fd;
+        entity_body->offset = 0;
+        entity_body->size   = value_size;
+        
+        return 0;
+    }
+    
+    // Shift the value to the front of the fetched buffer and send the buffer as the entity body.
+    memmove(data, value, value_size);
+    entity_body->data = data;
+    entity_body->size = value_size;
+    
+    return 0;
+}
+
+static int db_meta_response_innards(bool conditional, struct core_object *co, struct db_shard *shard,
+                                    const datum *key, struct http_request *req, size_t *status,
+                                    struct http_header ***headers)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int                 res;
+    uint8_t             *data;
+    size_t              data_size;
+    struct db_meta      meta;
+    struct http_header  *h;
+    time_t              h_last_modified;
+    const char          *content_type;
+    bool                vary;
+    
+    res = db_fetch_meta(co, shard, key, &data, &data_size);
+    if (res != 0)
+    {
+        return res;
+    }
+    if (decode_db_meta(data, data_size, &meta) == -1)
+    {
+        (void) fprintf(stderr, "malformed database metadata record for %s\n", (const char *) key->dptr);
+        mm_free(co->mm, data);
+        return 1;
+    }
+    if (is_db_expired(meta.expires, time(NULL)))
+    {
+        *status  = NOT_FOUND_404;
+        *headers = NULL;
+        mm_free(co->mm, data);
+        return 0;
+    }
+    
+    // An unparseable date is left to the full read to report.
+    if (conditional)
+    {
+        h               = get_header(H_IF_MODIFIED_SINCE, req->request_headers, req->num_request_headers);
+        h_last_modified = (h) ? http_time_to_time_t(h->value) : -1;
+        if (h_last_modified != -1 && difftime(meta.mtime, h_last_modified) < 0)
+        {
+            *status  = NOT_MODIFIED_304;
+            *headers = NULL;
+            mm_free(co->mm, data);
+            return 0;
+        }
+    }
+    
+    // A HEAD is answered with the headers a GET would get, so only if the GET would send the value unchanged.
+    res = 1;
+    if (strcmp(req->request_line->method, M_HEAD) == 0 && !get_applicable_range(req, meta.mtime))
+    {
+        content_type = (meta.content_type) ? meta.content_type : get_content_type((const char *) key->dptr);
+        vary         = !meta.content_encoding && is_compressible(content_type, meta.value_size);
+        if (!vary || negotiate_content_coding(req) == CODING_IDENTITY)
+        {
+            res = get_assemble_response_innards((off_t) meta.value_size, content_type, meta.content_encoding,
+                                                meta.etag, vary, co, status, headers);
+        }
+    }
+    mm_free(co->mm, data);
+    
+    return res;
+}
+
+static int db_list_response_innards(struct core_object *co, struct state_object *so, struct http_request *req,
+                                    size_t *status, struct http_header ***headers,
+                                    struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct http_header  *cursor_header;
+    struct http_header  *limit_header;
+    const char          *prefix;
+    const char          *cursor;
+    unsigned long long  limit;
+    char                *end;
+    struct db_list_page page;
+    char                *next_cursor;
+    size_t              h;
+    int                 res;
+    
+    // Without every key in the index, a listing could silently leave keys out.
+    if (!db_index_complete(&so->db_index))
+    {
+        *status  = SERVICE_UNAVAILABLE_503;
+        *headers = NULL;
+        return 0;
+    }
+    
+    cursor_header = get_header("cursor", req->extension_headers, req->num_extension_headers);
+    limit_header  = get_header("limit", req->extension_headers, req->num_extension_headers);
+    limit         = DEFAULT_DB_LIST_LIMIT;
+    if (limit_header)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+        limit = strtoull(limit_header->value, &end, 10);
+        if (*end != '\0' || limit == 0 || limit > MAX_DB_LIST_LIMIT)
+        {
+            *status  = BAD_REQUEST_400;
+            *headers = NULL;
             return 0;
         }
     }
     
-    *entity_body = mm_calloc(strlen(value) + 1, sizeof(char), co->mm);
-    if (!*entity_body)
+    memset(&page, 0, sizeof(page));
+    page.capacity = DB_LIST_PAGE_SIZE;
+    page.data     = mm_malloc(page.capacity, co->mm);
+    if (!page.data)
     {
         SET_ERROR(co->err);
         return -1;
     }
-    strcpy(*entity_body, value);
     
-    return get_assemble_response_innards((off_t) strlen(value), co, status, headers);
+    // The keys are the request URIs with their terminating null byte, which the prefix leaves off and the cursor keeps.
+    prefix = req->request_line->request_URI;
+    cursor = (cursor_header) ? cursor_header->value : NULL;
+    res    = db_index_list(co, &so->db_index, prefix, strlen(prefix), cursor, (cursor) ? strlen(cursor) + 1 : 0,
+                           (size_t) limit, append_list_key, &page);
+    if (res == -1)
+    {
+        mm_free(co->mm, page.data);
+        return -1;
+    }
+    
+    if (get_assemble_response_innards((off_t) page.size, TEXT_PLAIN_CONTENT_TYPE, NULL, NULL, false, co, status,
+                                      headers) == -1)
+    {
+        mm_free(co->mm, page.data);
+        return -1;
+    }
+    entity_body->data = page.data;
+    entity_body->size = page.size;
+    
+    // The next page is listed from the last key of this one, which is copied out in case it lacks a null byte.
+    if (res == 1 && page.last)
+    {
+        next_cursor = mm_malloc(page.last_size + 1, co->mm);
+        if (!next_cursor)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        memcpy(next_cursor, page.last, page.last_size);
+        next_cursor[page.last_size] = '\0';
+        
+        h = 0;
+        while ((*headers)[h])
+        {
+            ++h;
+        }
+        (*headers)[h] = set_header(co, "next-cursor", next_cursor);
+        mm_free(co->mm, next_cursor);
+        if (!(*headers)[h])
+        {
+            return -1;
+        }
+    }
+    
+    return 0;
 }
 
-static int http_head(struct core_object *co, struct state_object *so, struct http_request *req,
-                     size_t *status, struct http_header ***headers, char **entity_body)
+static int db_replication_response_innards(struct core_object *co, struct state_object *so, size_t *status,
+                                           struct http_header ***headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
-    if (http_get(co, so, req, status, headers, entity_body) == -1)
+    
+    char   *text;
+    size_t text_size;
+    
+    text = mm_malloc(DB_REPLICATION_STATUS_SIZE, co->mm);
+    if (!text)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (format_db_replication_status(so, text, &text_size) == -1)
     {
+        SET_ERROR(co->err);
+        mm_free(co->mm, text);
         return -1;
     }
-    if (*entity_body) {
-        if (mm_free(co->mm, *entity_body) == -1)
+    
+    if (get_assemble_response_innards((off_t) text_size, TEXT_PLAIN_CONTENT_TYPE, NULL, NULL, false, co, status,
+                                      headers) == -1)
+    {
+        mm_free(co->mm, text);
+        return -1;
+    }
+    entity_body->data = text;
+    entity_body->size = text_size;
+    
+    return 0;
+}
+
+static int append_list_key(struct core_object *co, const datum *key, void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_list_page *page;
+    size_t              key_size;
+    char                *data;
+    
+    page     = (struct db_list_page *) arg;
+    key_size = (size_t) key->dsize;
+    if (key_size > 0 && ((const char *) key->dptr)[key_size - 1] == '\0')
+    {
+        --key_size;
+    }
+    
+    if (page->size + key_size + 1 > page->capacity)
+    {
+        while (page->size + key_size + 1 > page->capacity)
+        {
+            page->capacity *= 2;
+        }
+        data = mm_realloc(page->data, page->capacity, co->mm);
+        if (!data)
         {
             SET_ERROR(co->err);
             return -1;
         }
-        *entity_body = NULL;
+        page->data = data;
     }
+    
+    memcpy(page->data + page->size, key->dptr, key_size);
+    page->size += key_size;
+    page->data[page->size++] = LF;
+    page->last      = (const char *) key->dptr;
+    page->last_size = key_size;
+    
+    return 0;
+}
+
+static void close_blob(int fd)
+{
+    if (fd)
+    {
+        close(fd);
+    }
+}
+
+static int http_head(struct core_object *co, struct state_object *so, struct http_request *req,
+                     size_t *status, struct http_header ***headers, struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    if (http_get(co, so, req, status, headers, entity_body) == -1)
+    {
+        return -1;
+    }
+    free_entity_body(co, entity_body);
     return 0;
 }
 
 static int http_post(struct core_object *co, struct state_object *so, struct http_request *request,
-                     size_t *status, struct http_header ***headers, char **entity_body)
+                     size_t *status, struct http_header ***headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
     
     int                overwrite_status;
     struct http_header *database_header;
+    struct http_header *durability_header;
+    struct http_header *expect_header;
+    struct http_header *transfer_encoding_header;
     struct http_header *content_length_header;
+    struct http_header *content_type_header;
+    struct http_header *content_encoding_header;
     size_t             entity_body_size;
+    bool               in_database;
+    bool               multi_get;
+    bool               batch;
+    bool               streamed;
+    bool               deferred;
+    time_t             expires;
     
     // Read headers to determine if database or file system
     database_header       = get_header("database", request->extension_headers, request->num_extension_headers);
+    durability_header     = get_header("durability", request->extension_headers, request->num_extension_headers);
+    expect_header         = get_header(H_EXPECT, request->extension_headers, request->num_extension_headers);
     content_length_header = get_header(H_CONTENT_LENGTH, request->entity_headers, request->num_entity_headers);
+    in_database           = database_header && strcmp(to_lower(database_header->value), "true") == 0;
+    multi_get             = in_database && strcmp(request->request_line->request_URI, DB_MULTI_GET_PATH) == 0;
+    batch                 = in_database && strcmp(request->request_line->request_URI, DB_BATCH_UPSERT_PATH) == 0;
+    
+    // Only chunked entity bodies are decoded; the reader leaves any other transfer coding for the method to refuse.
+    transfer_encoding_header = get_header(H_TRANSFER_ENCODING, request->extension_headers,
+                                          request->num_extension_headers);
+    
+    // The content type and coding of the body are kept with it in the database.
+    content_type_header     = get_header(H_CONTENT_TYPE, request->entity_headers, request->num_entity_headers);
+    content_encoding_header = get_header(H_CONTENT_ENCODING, request->entity_headers, request->num_entity_headers);
+    
+    // "Durability: async" accepts a queued database write without waiting for it to be written.
+    deferred = durability_header && strcmp(to_lower(durability_header->value), "async") == 0;
+    
+    // The request is validated before its entity body is accepted, so that a rejected body is never sent or read.
+    if (expect_header && strcmp(to_lower(expect_header->value), EXPECT_CONTINUE) != 0)
+    {
+        *status  = EXPECTATION_FAILED_417;
+        *headers = NULL;
+        return 0;
+    }
     
-    *entity_body = mm_strdup(request->entity_body, co->mm);
+    if (transfer_encoding_header && !request->entity_body_chunked)
+    {
+        *status  = NOT_IMPLEMENTED_501;
+        *headers = NULL;
+        return 0;
+    }
+    
+    // A chunked entity body needs no length; its size is checked against the maximum as its chunks arrive.
+    if (!content_length_header && !request->entity_body_chunked)
+    {
+        *status  = LENGTH_REQUIRED_411;
+        *headers = NULL;
+        return 0;
+    }
     
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
-    entity_body_size = strtol(content_length_header->value, NULL, 10);
+    entity_body_size = (request->entity_body_chunked) ? 0 : strtol(content_length_header->value, NULL, 10);
+    if (co->max_entity_body_size && entity_body_size > co->max_entity_body_size)
+    {
+        *status  = REQUEST_ENTITY_TOO_LARGE_413;
+        *headers = NULL;
+        return 0;
+    }
+    
+    // A replica takes its writes from its primary alone, so that it never holds a value the primary does not.
+    if (in_database && !multi_get && so->db_replica.shared)
+    {
+        *status  = FORBIDDEN_403;
+        *headers = NULL;
+        return 0;
+    }
+    
+    // A database value may be given a lifetime, after which it is no longer served and is swept away.
+    expires = 0;
+    if (in_database && !multi_get && parse_db_expiry(request, &expires) == -1)
+    {
+        *status  = BAD_REQUEST_400;
+        *headers = NULL;
+        return 0;
+    }
+    
+    // A file system POST, or a chunked database value, streams its entity body into a file, and accepts it once the
+    // file is open, so that the client is not asked for a body that cannot be stored. A batch upsert parses its
+    // records from the connection as they arrive.
+    streamed = !in_database || batch || (request->entity_body_chunked && !multi_get);
+    if (!streamed)
+    {
+        if (accept_entity_body(request, false, co) == -1)
+        {
+            if (entity_body_refused(status, headers))
+            {
+                return 0;
+            }
+            SET_ERROR(co->err);
+            return -1;
+        }
+        entity_body_size = request->entity_body_size;
+    }
+    
+    // A database POST to the multi-get path reads the keys listed in its body rather than storing the body.
+    if (multi_get)
+    {
+        return db_multi_get_response_innards(co, so, request->entity_body, entity_body_size, status, headers,
+                                             entity_body);
+    }
+    
+    // A database POST to the batch upsert path upserts the records in its body.
+    if (batch)
+    {
+        if (accept_entity_body(request, true, co) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        return db_batch_upsert_response_innards(co, so, request, entity_body_size, expires, status, headers,
+                                                entity_body);
+    }
     
     // Store with key as URI
-    if (database_header && strcmp(to_lower(database_header->value), "true") == 0)
+    if (in_database && streamed)
     {
-        overwrite_status = store_in_db(co, so, request->request_line->request_URI, *entity_body, entity_body_size);
+        overwrite_status = store_chunked_in_db(co, so, request,
+                                               (content_type_header) ? content_type_header->value : NULL,
+                                               (content_encoding_header) ? content_encoding_header->value : NULL,
+                                               expires, deferred, entity_body);
+    } else if (in_database)
+    {
+        entity_body->data = mm_malloc(entity_body_size + 1, co->mm);
+        if (!entity_body->data)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        memcpy(entity_body->data, request->entity_body, entity_body_size + 1);
+        entity_body->size = entity_body_size;
+        
+        overwrite_status = store_in_db(co, so, request->request_line->request_URI, entity_body->data,
+                                       entity_body_size,
+                                       (content_type_header) ? content_type_header->value : NULL,
+                                       (content_encoding_header) ? content_encoding_header->value : NULL,
+                                       expires, deferred);
     } else
     {
-        overwrite_status = store_in_fs(co, request->request_line->request_URI, *entity_body, entity_body_size);
+        overwrite_status = store_in_fs(co, request, entity_body_size, entity_body);
     }
     
     switch (overwrite_status)
@@ -396,8 +1181,17 @@ static int http_post(struct core_object *co, struct state_object *so, struct htt
             *status = OK_200;
             break;
         }
+        case DB_UPSERT_QUEUED: // queued for the writer process
+        {
+            *status = ACCEPTED_202;
+            break;
+        }
         case -1: // error
         {
+            if (entity_body_refused(status, headers))
+            {
+                return 0;
+            }
             return -1;
         }
         default:;
@@ -411,78 +1205,239 @@ static int http_post(struct core_object *co, struct state_object *so, struct htt
     return 0;
 }
 
+static int parse_db_expiry(struct http_request *request, time_t *expires)
+{
+    struct http_header *ttl_header;
+    struct http_header *expires_header;
+    unsigned long long ttl;
+    char               *end;
+    
+    *expires       = 0;
+    ttl_header     = get_header("ttl", request->extension_headers, request->num_extension_headers);
+    expires_header = get_header(H_EXPIRES, request->entity_headers, request->num_entity_headers);
+    if (ttl_header)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+        ttl = strtoull(ttl_header->value, &end, 10);
+        if (end == ttl_header->value || *end != '\0' || ttl == 0 || ttl > MAX_DB_TTL)
+        {
+            return -1;
+        }
+        *expires = time(NULL) + (time_t) ttl;
+    } else if (expires_header)
+    {
+        *expires = http_time_to_time_t(expires_header->value);
+        if (*expires == -1)
+        {
+            *expires = 0;
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
 static int store_in_db(struct core_object *co, struct state_object *so, char *uri,
-                       char *entity_body, size_t entity_body_size)
+                       char *entity_body, size_t entity_body_size, const char *content_type,
+                       const char *content_encoding, time_t expires, bool deferred)
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    int     overwrite_status;
-    char    timestamp[HTTP_TIME_LEN];
-    size_t  timestamp_size;
     uint8_t *database_buffer;
     size_t  database_buffer_size;
     datum   key;
-    datum   value;
     
-    // Get the timestamp.
-    if (http_time_now(timestamp) == -1)
+    key.dptr  = uri;
+    key.dsize = strlen(uri) + 1;
+    
+    // Put the entity body into a database record, or into the blob store with the record holding its digest.
+    if (encode_db_value(co, &key, (const uint8_t *) entity_body, entity_body_size, content_type, content_encoding,
+                        expires, &database_buffer, &database_buffer_size) == -1)
     {
-        SET_ERROR(co->err);
         return -1;
     }
-    timestamp_size = strlen(timestamp) + 1;
     
-    // Create a buffer for the database value.
-    database_buffer_size = timestamp_size + entity_body_size + 1;
-    database_buffer      = mm_malloc(database_buffer_size, co->mm);
-    if (!database_buffer)
+    return queue_db_value(co, so, uri, database_buffer, database_buffer_size, deferred);
+}
+
+static int store_chunked_in_db(struct core_object *co, struct state_object *so, struct http_request *request,
+                               const char *content_type, const char *content_encoding, time_t expires, bool deferred,
+                               struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct upload upload;
+    int           overwrite_status;
+    int           saved_errno;
+    uint8_t       *database_buffer;
+    size_t        database_buffer_size;
+    
+    if (open_db_value_upload(co, &upload) == -1 || accept_entity_body(request, true, co) == -1
+        || receive_chunked_upload(co, request, &upload) == -1)
     {
-        SET_ERROR(co->err);
+        saved_errno = errno;
+        close_upload(&upload);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    // A value that may fit a database page is read back, and stored inline if it does.
+    if (upload.size <= DB_MAX_INLINE_ITEM_SIZE)
+    {
+        entity_body->data = mm_malloc(upload.size + 1, co->mm);
+        if (!entity_body->data || lseek(upload.fd, 0, SEEK_SET) == -1
+            || read_fully(upload.fd, entity_body->data, upload.size) == -1)
+        {
+            SET_ERROR(co->err);
+            close_upload(&upload);
+            return -1;
+        }
+        entity_body->data[upload.size] = '\0';
+        entity_body->size              = upload.size;
+        close_upload(&upload);
+        
+        return store_in_db(co, so, request->request_line->request_URI, entity_body->data, entity_body->size,
+                           content_type, content_encoding, expires, deferred);
+    }
+    
+    if (publish_db_value_upload(co, &upload) == -1
+        || encode_db_blob_value(co, upload.digest, content_type, content_encoding, expires, &database_buffer,
+                                &database_buffer_size) == -1)
+    {
+        close_upload(&upload);
+        return -1;
+    }
+    overwrite_status = queue_db_value(co, so, request->request_line->request_URI, database_buffer,
+                                      database_buffer_size, deferred);
+    if (overwrite_status == -1)
+    {
+        close_upload(&upload);
         return -1;
     }
     
-    // Put the timestamp\0entitybody\0 into the buffer.
-    memcpy(database_buffer, timestamp, timestamp_size);
-    memcpy(database_buffer + timestamp_size, entity_body, entity_body_size);
-    *(database_buffer + database_buffer_size - 1) = '\0'; // Place /0 at end.
+    // The file moved into the blob store is still open, and is sent back as it is.
+    entity_body->fd     = upload.fd;
+    entity_body->offset = 0;
+    entity_body->size   = upload.size;
+    upload.fd           = -1;
+    close_upload(&upload);
+    
+    return overwrite_status;
+}
+
+static int queue_db_value(struct core_object *co, struct state_object *so, char *uri, uint8_t *database_buffer,
+                          size_t database_buffer_size, bool deferred)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int   overwrite_status;
+    datum key;
+    datum value;
     
     key.dptr    = uri;
     key.dsize   = strlen(uri) + 1;
     value.dptr  = database_buffer;
     value.dsize = database_buffer_size;
     
-    overwrite_status = db_upsert(co, DB_NAME, so->db_sem, &key, &value);
+    overwrite_status = queue_db_upsert(co, so, &key, &value, !deferred);
     
     mm_free(co->mm, database_buffer);
     
     return overwrite_status;
 }
 
-static int store_in_fs(struct core_object *co, char *uri, char *entity_body, size_t entity_body_size)
+static int store_in_fs(struct core_object *co, struct http_request *request, size_t entity_body_size,
+                       struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    char pathname[BUFSIZ];
-    int  overwrite_status;
+    struct upload upload;
+    int           overwrite_status;
+    int           saved_errno;
     
-    memset(pathname, 0, BUFSIZ);
-    if (getcwd(pathname, BUFSIZ) == NULL)
+    if (open_upload(co, &upload, request->request_line->request_URI) == -1
+        || accept_entity_body(request, true, co) == -1
+        || ((request->entity_body_chunked) ? receive_chunked_upload(co, request, &upload)
+                                           : receive_upload(co, &upload, request->client_fd, entity_body_size)) == -1)
     {
-        SET_ERROR(co->err);
+        saved_errno = errno;
+        close_upload(&upload);
+        errno = saved_errno;
         return -1;
     }
     
-    *(pathname + strlen(pathname)) = '/';
-    strlcat(pathname, WRITE_DIR, BUFSIZ);
+    overwrite_status = publish_upload(co, &upload);
+    if (overwrite_status == -1)
+    {
+        close_upload(&upload);
+        return -1;
+    }
     
-    overwrite_status = write_to_dir(co, pathname, uri,
-                                    entity_body, entity_body_size);
+    // The file renamed into place is still open, and is sent back as it is.
+    entity_body->fd     = upload.fd;
+    entity_body->offset = 0;
+    entity_body->size   = upload.size;
+    upload.fd           = -1;
+    close_upload(&upload);
     
     return overwrite_status;
 }
 
+static int receive_chunked_upload(struct core_object *co, struct http_request *request, struct upload *upload)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    size_t chunk_size;
+    
+    for (bool first = true;; first = false)
+    {
+        if (read_chunk_header(request->client_fd, first, &chunk_size) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        if (chunk_size == 0)
+        {
+            return 0;
+        }
+        if (co->max_entity_body_size && chunk_size > co->max_entity_body_size - upload->size)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (receive_upload(co, upload, request->client_fd, chunk_size) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+static bool entity_body_refused(size_t *status, struct http_header ***headers)
+{
+    switch (errno)
+    {
+        case EMSGSIZE:
+        {
+            *status = REQUEST_ENTITY_TOO_LARGE_413;
+            break;
+        }
+        case EBADMSG:
+        {
+            *status = BAD_REQUEST_400;
+            break;
+        }
+        default:
+        {
+            return false;
+        }
+    }
+    *headers = NULL;
+    
+    return true;
+}
+
 static int post_assemble_response_innards(struct core_object *co, struct http_request *request,
-                                          struct http_header ***headers, char **entity_body)
+                                          struct http_header ***headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
     
@@ -502,7 +1457,7 @@ static int post_assemble_response_innards(struct core_object *co, struct http_re
     }
     
     memset(entity_body_size, 0, CONTENT_LENGTH_MAX_DIGITS);
-    if (sprintf(entity_body_size, "%lu", strlen(*entity_body)) == -1)
+    if (sprintf(entity_body_size, "%lu", entity_body->size) == -1)
     {
         mm_free(co->mm, content_type);
         mm_free(co->mm, content_length);
@@ -522,46 +1477,67 @@ static int post_assemble_response_innards(struct core_object *co, struct http_re
     return 0;
 }
 
-static int get_assemble_response_innards(off_t content_length, struct core_object *co, size_t *status,
-                                         struct http_header ***headers)
+static int get_assemble_response_innards(off_t content_length, const char *content_type,
+                                         const char *content_encoding, const char *etag, bool vary,
+                                         struct core_object *co, size_t *status, struct http_header ***headers)
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    const int          num_headers = 2;
-    struct http_header *h_content_type;
-    struct http_header *h_content_length;
-    char               content_length_str[H_CONTENT_LENGTH_LENGTH];
+    const int num_headers = 6;
+    char      content_length_str[H_CONTENT_LENGTH_LENGTH];
+    char      etag_str[DB_RECORD_MAX_ETAG_LEN + 3];
+    size_t    offset;
     
-    h_content_type = set_header(co, H_CONTENT_TYPE, TEXT_HTML_CONTENT_TYPE);
-    if (!h_content_type)
+    if (sprintf(content_length_str, "%lld", (long long) content_length) < 0)
     {
+        SET_ERROR(co->err);
         return -1;
     }
-    
-    if (sprintf(content_length_str, "%lld", content_length) < 0)
-    {
-        destroy_http_header(h_content_type, co);
-        return -1;
-    }
-    h_content_length = set_header(co, H_CONTENT_LENGTH, content_length_str);
-    if (!h_content_length)
+    if (etag && *etag)
     {
-        destroy_http_header(h_content_type, co);
-        return -1;
+        (void) snprintf(etag_str, sizeof(etag_str), "\"%s\"", etag);
     }
     
-    *headers = mm_calloc(num_headers + 1, sizeof(struct http_header), co->mm);
+    *headers = mm_calloc(num_headers + 1, sizeof(struct http_header *), co->mm);
     if (!*headers)
     {
-        destroy_http_header(h_content_type, co);
-        destroy_http_header(h_content_type, co);
         SET_ERROR(co->err);
         return -1;
     }
     
-    (*headers)[0] = h_content_length;
-    (*headers)[1] = h_content_type;
-    (*headers)[2] = NULL;
+    offset = 0;
+    (*headers)[offset++] = set_header(co, H_CONTENT_LENGTH, content_length_str);
+    (*headers)[offset++] = set_header(co, H_CONTENT_TYPE, content_type);
+    (*headers)[offset++] = set_header(co, H_ACCEPT_RANGES, BYTES_RANGE_UNIT);
+    if (content_encoding)
+    {
+        (*headers)[offset++] = set_header(co, H_CONTENT_ENCODING, content_encoding);
+    }
+    if (etag && *etag)
+    {
+        (*headers)[offset++] = set_header(co, H_ETAG, etag_str);
+    }
+    if (vary) // The entity body depends on the Accept-Encoding header of the request.
+    {
+        (*headers)[offset++] = set_header(co, H_VARY, H_ACCEPT_ENCODING);
+    }
+    
+    for (size_t h = 0; h < offset; ++h)
+    {
+        if (!(*headers)[h])
+        {
+            for (h = 0; h < offset; ++h)
+            {
+                if ((*headers)[h])
+                {
+                    destroy_http_header((*headers)[h], co);
+                }
+            }
+            mm_free(co->mm, *headers);
+            *headers = NULL;
+            return -1;
+        }
+    }
     
     *status = OK_200;
     
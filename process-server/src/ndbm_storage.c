@@ -0,0 +1,579 @@
+#include "../include/db.h"
+#include "../include/storage.h"
+#include "../include/util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NDBM_COMPACT_SUFFIX ".compact"    /** Suffix of the name of the database into which a shard is rebuilt. */
+#define NDBM_PATH_SIZE 128                /** Size of the buffers holding the paths of the files of a database. */
+#define NDBM_COMPACT_SLICE_KEYS 256       /** Records copied by compaction under each acquisition of the read lock. */
+#define NDBM_COMPACT_ATTEMPTS 4           /** Copies of a shard tried before its compaction is put off. */
+
+/**
+ * The suffixes of the files an NDBM database may be made of: .pag and .dir for ndbm and gdbm, .db for Berkeley DB.
+ */
+static const char *const ndbm_file_suffixes[] = {".pag", ".dir", ".db", NULL};
+
+/**
+ * ndbm_create
+ * <p>
+ * Create an NDBM database if it does not exist.
+ * </p>
+ * @param db_name the name of the database
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int ndbm_create(const char *db_name);
+
+/**
+ * ndbm_fetch
+ * <p>
+ * Fetch the value of a key from an NDBM database.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key
+ * @param value the datum to point at the value
+ * @return 0 if found, 1 if not found, -1 and set err on failure
+ */
+static int ndbm_fetch(struct core_object *co, struct db_shard *shard, datum *key, datum *value);
+
+/**
+ * ndbm_upsert
+ * <p>
+ * Insert or replace the value of a key in an NDBM database. The key is first stored with DBM_INSERT, which is a
+ * single probe for a new key; only if the key exists is it stored again with DBM_REPLACE.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key
+ * @param value the value
+ * @return 0 if inserted, 1 if replaced, -1 and set err on failure
+ */
+static int ndbm_upsert(struct core_object *co, struct db_shard *shard, datum *key, datum *value);
+
+/**
+ * ndbm_remove
+ * <p>
+ * Remove a key and its value from an NDBM database. NDBM reports a missing key as a failure, so the key is looked
+ * up first.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param key the key
+ * @return 0 if removed, 1 if not found, -1 and set err on failure
+ */
+static int ndbm_remove(struct core_object *co, struct db_shard *shard, datum *key);
+
+/**
+ * ndbm_commit
+ * <p>
+ * Flush the upserts of this process on an NDBM database by closing its handle, since NDBM has no sync, and
+ * invalidate the handles of all processes so that none serves pages buffered before the upserts. Doing this once
+ * per batch rather than once per upsert is what makes batches cheap.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ */
+static void ndbm_commit(struct core_object *co, struct db_shard *shard);
+
+/**
+ * ndbm_iterate
+ * <p>
+ * Call visit with every key in an NDBM database and its value.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param visit the function to call with each key and value
+ * @param arg the argument to pass to visit
+ * @return 0 on success, -1 and set err on failure
+ */
+static int ndbm_iterate(struct core_object *co, struct db_shard *shard,
+                        int (*visit)(struct core_object *co, datum *key, datum *value, void *arg), void *arg);
+
+/**
+ * ndbm_close
+ * <p>
+ * Close the NDBM handle of this process on a shard if it is open.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ */
+static void ndbm_close(struct core_object *co, struct db_shard *shard);
+
+/**
+ * ndbm_compact
+ * <p>
+ * Rebuild an NDBM database from its live records into a fresh database, then rename the files of the fresh
+ * database over those of the shard and bump the shard generation, so that every process reopens its handle. The
+ * records are copied in slices, each under its own acquisition of the read lock, so neither readers nor writers wait
+ * behind the copy for long. A write between slices spoils the copy, which is started over.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @return 0 if compacted, 1 if the shard was written during every attempt, -1 and set err on failure
+ */
+static int ndbm_compact(struct core_object *co, struct db_shard *shard);
+
+/**
+ * copy_live_records
+ * <p>
+ * Copy every record of a shard into a fresh database, a slice of records at a time.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @param compact_name the name of the fresh database
+ * @param version set to the version of the shard the copy holds
+ * @param num_records set to the number of records copied
+ * @return 0 on success, 1 if the shard was written between slices, -1 and set err on failure
+ */
+static int copy_live_records(struct core_object *co, struct db_shard *shard, char *compact_name,
+                             uint64_t *version, size_t *num_records);
+
+/**
+ * rename_ndbm_files
+ * <p>
+ * Rename the files of an NDBM database to those of another, replacing them.
+ * </p>
+ * @param co the core object
+ * @param from_name the name of the database to rename
+ * @param to_name the name of the database to replace
+ * @return 0 on success, -1 and set err on failure
+ */
+static int rename_ndbm_files(struct core_object *co, const char *from_name, const char *to_name);
+
+/**
+ * remove_ndbm_files
+ * <p>
+ * Remove the files of an NDBM database, if they exist.
+ * </p>
+ * @param db_name the name of the database
+ */
+static void remove_ndbm_files(const char *db_name);
+
+/**
+ * get_ndbm_files_size
+ * <p>
+ * Get the total size of the files of an NDBM database.
+ * </p>
+ * @param db_name the name of the database
+ * @return the size in bytes
+ */
+static off_t get_ndbm_files_size(const char *db_name);
+
+/**
+ * get_ndbm_handle
+ * <p>
+ * Get the open NDBM handle of this process on a shard. The database is opened if the handle is not open or was
+ * opened before the database was last written by another handle, in which case the pages buffered by the handle
+ * are stale.
+ * </p>
+ * @param co the core object
+ * @param shard the shard
+ * @return the handle, or NULL and set err on failure
+ */
+static DBM *get_ndbm_handle(struct core_object *co, struct db_shard *shard);
+
+const struct storage_engine ndbm_storage_engine = {
+        .name     = "ndbm",
+        .create   = ndbm_create,
+        .fetch    = ndbm_fetch,
+        .upsert   = ndbm_upsert,
+        .remove   = ndbm_remove,
+        .commit   = ndbm_commit,
+        .iterate  = ndbm_iterate,
+        .close    = ndbm_close,
+        .maintain = NULL,
+        .compact  = ndbm_compact
+};
+
+static int ndbm_create(const char *db_name)
+{
+    DBM  *db;
+    char name[NDBM_PATH_SIZE];
+    char compact_name[NDBM_PATH_SIZE];
+    
+    // dbm_open takes a non-const name.
+    if (strlcpy(name, db_name, sizeof(name)) >= sizeof(name))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (join_path(compact_name, sizeof(compact_name), db_name, NDBM_COMPACT_SUFFIX) == -1)
+    {
+        return -1;
+    }
+    
+    // A compaction interrupted by a crash leaves its unfinished database behind.
+    remove_ndbm_files(compact_name);
+    
+    db = dbm_open(name, DB_FLAGS, DB_FILE_MODE); // NOLINT(concurrency-mt-unsafe) : No threads here
+    if (db == (DBM *) 0)
+    {
+        return -1;
+    }
+    dbm_close(db); // NOLINT(concurrency-mt-unsafe) : No threads here
+    
+    return 0;
+}
+
+static int ndbm_fetch(struct core_object *co, struct db_shard *shard, datum *key, datum *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    DBM *db;
+    
+    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
+    db = get_ndbm_handle(co, shard);
+    if (!db)
+    {
+        return -1;
+    }
+    *value = dbm_fetch(db, *key);
+    if (!value->dptr && dbm_error(db))
+    {
+        print_db_error(db);
+    }
+    // NOLINTEND(concurrency-mt-unsafe) : Protected
+    
+    return (value->dptr) ? 0 : 1;
+}
+
+static int ndbm_upsert(struct core_object *co, struct db_shard *shard, datum *key, datum *value)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int ret_val;
+    int status;
+    DBM *db;
+    
+    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
+    db = get_ndbm_handle(co, shard);
+    if (!db)
+    {
+        return -1;
+    }
+    status  = dbm_store(db, *key, *value, DBM_INSERT);
+    ret_val = status; // 0 if inserted, 1 if the key exists, -1 on error.
+    if (status == 1)
+    {
+        status = dbm_store(db, *key, *value, DBM_REPLACE);
+    }
+    if (status == -1)
+    {
+        print_db_error(db);
+        ret_val = -1;
+    }
+    // NOLINTEND(concurrency-mt-unsafe) : Protected
+    
+    return ret_val;
+}
+
+static int ndbm_remove(struct core_object *co, struct db_shard *shard, datum *key)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int   ret_val;
+    DBM   *db;
+    datum existing;
+    
+    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
+    db = get_ndbm_handle(co, shard);
+    if (!db)
+    {
+        return -1;
+    }
+    existing = dbm_fetch(db, *key);
+    if (!existing.dptr)
+    {
+        return 1;
+    }
+    ret_val = 0;
+    if (dbm_delete(db, *key) != 0)
+    {
+        print_db_error(db);
+        ret_val = -1;
+    }
+    // NOLINTEND(concurrency-mt-unsafe) : Protected
+    
+    return ret_val;
+}
+
+static void ndbm_commit(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    // Closing the handle flushes the writes so that the handles of the other processes can see them.
+    ndbm_close(co, shard);
+    invalidate_db_handles(co, shard);
+}
+
+static int ndbm_iterate(struct core_object *co, struct db_shard *shard,
+                        int (*visit)(struct core_object *co, datum *key, datum *value, void *arg), void *arg)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    DBM   *db;
+    datum key;
+    datum value;
+    int   ret_val;
+    
+    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
+    db = get_ndbm_handle(co, shard);
+    if (!db)
+    {
+        return -1;
+    }
+    ret_val = 0;
+    for (key = dbm_firstkey(db); key.dptr && ret_val == 0; key = dbm_nextkey(db))
+    {
+        value = dbm_fetch(db, key);
+        if (value.dptr)
+        {
+            ret_val = visit(co, &key, &value, arg);
+        }
+    }
+    // NOLINTEND(concurrency-mt-unsafe) : Protected
+    
+    return (ret_val == -1) ? -1 : 0;
+}
+
+static void ndbm_close(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_handle *handle;
+    
+    handle = &shard->handle;
+    if (handle->state)
+    {
+        dbm_close((DBM *) handle->state); // NOLINT(concurrency-mt-unsafe) : No threads here
+        handle->state = NULL;
+    }
+}
+
+static int ndbm_compact(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char     compact_name[NDBM_PATH_SIZE];
+    uint64_t version;
+    size_t   num_records;
+    off_t    old_size;
+    off_t    new_size;
+    int      res;
+    
+    if (join_path(compact_name, sizeof(compact_name), shard->name, NDBM_COMPACT_SUFFIX) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    for (int attempt = 0; attempt < NDBM_COMPACT_ATTEMPTS; ++attempt)
+    {
+        res = copy_live_records(co, shard, compact_name, &version, &num_records);
+        if (res == -1)
+        {
+            remove_ndbm_files(compact_name);
+            return -1;
+        }
+        if (res == 1)
+        {
+            continue;
+        }
+        
+        if (acquire_write_lock(&shard->lock) == -1)
+        {
+            SET_ERROR(co->err);
+            remove_ndbm_files(compact_name);
+            return -1;
+        }
+        // A write made after the last slice was copied would be lost by the switch.
+        if (shard->shared->version != version)
+        {
+            release_write_lock(&shard->lock);
+            continue;
+        }
+        old_size = get_ndbm_files_size(shard->name);
+        new_size = get_ndbm_files_size(compact_name);
+        res      = rename_ndbm_files(co, compact_name, shard->name);
+        if (res == 0)
+        {
+            invalidate_db_handles(co, shard);
+        }
+        release_write_lock(&shard->lock);
+        if (res == -1)
+        {
+            remove_ndbm_files(compact_name);
+            return -1;
+        }
+        
+        (void) fprintf(stdout, "Compacted %s: %zu records, %lld bytes to %lld bytes.\n", shard->name, num_records,
+                       (long long) old_size, (long long) new_size);
+        return 0;
+    }
+    remove_ndbm_files(compact_name);
+    
+    return 1;
+}
+
+static int copy_live_records(struct core_object *co, struct db_shard *shard, char *compact_name,
+                             uint64_t *version, size_t *num_records)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    DBM      *db;
+    DBM      *compact_db;
+    datum    key;
+    datum    value;
+    uint64_t generation;
+    bool     first;
+    bool     done;
+    int      ret_val;
+    
+    // NOLINTBEGIN(concurrency-mt-unsafe) : Protected
+    compact_db = dbm_open(compact_name, DB_FLAGS | O_TRUNC, DB_FILE_MODE);
+    if (compact_db == (DBM *) 0)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    *num_records = 0;
+    generation   = 0;
+    first        = true;
+    done         = false;
+    ret_val      = 0;
+    while (!done && ret_val == 0)
+    {
+        if (acquire_read_lock(&shard->lock) == -1)
+        {
+            SET_ERROR(co->err);
+            ret_val = -1;
+            break;
+        }
+        
+        // The handle goes on from the key where the last slice stopped only if nothing was written since.
+        if (first)
+        {
+            *version   = shard->shared->version;
+            generation = shard->shared->generation;
+        } else if (shard->shared->version != *version || shard->shared->generation != generation)
+        {
+            release_read_lock(&shard->lock);
+            ret_val = 1;
+            break;
+        }
+        db = get_ndbm_handle(co, shard);
+        if (!db)
+        {
+            ret_val = -1;
+        }
+        for (size_t n = 0; db && n < NDBM_COMPACT_SLICE_KEYS && ret_val == 0; ++n)
+        {
+            key   = (first) ? dbm_firstkey(db) : dbm_nextkey(db);
+            first = false;
+            if (!key.dptr)
+            {
+                done = true;
+                break;
+            }
+            value = dbm_fetch(db, key);
+            if (!value.dptr)
+            {
+                continue;
+            }
+            if (dbm_store(compact_db, key, value, DBM_REPLACE) == -1)
+            {
+                print_db_error(compact_db);
+                ret_val = -1;
+            }
+            ++*num_records;
+        }
+        release_read_lock(&shard->lock);
+    }
+    
+    dbm_close(compact_db);
+    // NOLINTEND(concurrency-mt-unsafe) : Protected
+    
+    return ret_val;
+}
+
+static int rename_ndbm_files(struct core_object *co, const char *from_name, const char *to_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char from_path[NDBM_PATH_SIZE];
+    char to_path[NDBM_PATH_SIZE];
+    
+    for (const char *const *suffix = ndbm_file_suffixes; *suffix; ++suffix)
+    {
+        if (join_path(from_path, sizeof(from_path), from_name, *suffix) == -1
+            || join_path(to_path, sizeof(to_path), to_name, *suffix) == -1
+            || (rename(from_path, to_path) == -1 && errno != ENOENT))
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static void remove_ndbm_files(const char *db_name)
+{
+    char path[NDBM_PATH_SIZE];
+    
+    for (const char *const *suffix = ndbm_file_suffixes; *suffix; ++suffix)
+    {
+        if (join_path(path, sizeof(path), db_name, *suffix) == 0)
+        {
+            (void) unlink(path);
+        }
+    }
+}
+
+static off_t get_ndbm_files_size(const char *db_name)
+{
+    char        path[NDBM_PATH_SIZE];
+    struct stat st;
+    off_t       size;
+    
+    size = 0;
+    for (const char *const *suffix = ndbm_file_suffixes; *suffix; ++suffix)
+    {
+        if (join_path(path, sizeof(path), db_name, *suffix) == 0 && stat(path, &st) == 0)
+        {
+            size += st.st_size;
+        }
+    }
+    
+    return size;
+}
+
+static DBM *get_ndbm_handle(struct core_object *co, struct db_shard *shard)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_handle *handle;
+    DBM              *db;
+    
+    handle = &shard->handle;
+    if (handle->state && handle->generation == shard->shared->generation)
+    {
+        return (DBM *) handle->state;
+    }
+    
+    ndbm_close(co, shard);
+    db = dbm_open(shard->name, DB_FLAGS, DB_FILE_MODE); // NOLINT(concurrency-mt-unsafe) : Protected
+    if (db == (DBM *) 0)
+    {
+        SET_ERROR(co->err);
+        return NULL;
+    }
+    handle->state      = db;
+    handle->generation = shard->shared->generation;
+    
+    return db;
+}
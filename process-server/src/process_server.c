@@ -1,6 +1,14 @@
+#include "../include/db.h"
+#include "../include/db_changelog.h"
+#include "../include/db_expiry.h"
+#include "../include/db_replica.h"
+#include "../include/db_snapshot.h"
+#include "../include/db_write_queue.h"
 #include "../include/methods.h"
 #include "../include/process_server.h"
 #include "../include/process_server_util.h"
+#include "../include/storage.h"
+#include "../include/upload.h"
 
 #include <read.h>
 #include <request.h>
@@ -19,11 +27,24 @@
 #include <time.h>
 #include <unistd.h>
 
+#define NS_PER_MS 1000000L /** Nanoseconds in a millisecond. */
+
 // NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables): must be non-const
 /**
  * Whether the loop at the heart of the program should be running.
  */
 volatile int GOGO_PROCESS = 1;
+
+/**
+ * Whether the storage maintenance process has been asked to compact the database.
+ */
+volatile sig_atomic_t COMPACT_DB = 0;
+
+/**
+ * The pid of the storage maintenance process, to which the parent forwards requests to compact the database; 0 if
+ * there is none.
+ */
+volatile pid_t MAINTENANCE_PID = 0;
 // NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
 
 /**
@@ -47,9 +68,10 @@ static int p_run_poll_loop(struct core_object *co, struct state_object *so, stru
  * </p>
  * @param sa sigaction struct to fill
  * @param signal the signal for which to listen
+ * @param handler the function to call when the signal is received
  * @return 0 on success, -1 and set errno on failure
  */
-static int setup_signal_handler(struct sigaction *sa, int signal);
+static int setup_signal_handler(struct sigaction *sa, int signal, void (*handler)(int));
 
 /**
  * end_gogo_handler
@@ -60,6 +82,24 @@ static int setup_signal_handler(struct sigaction *sa, int signal);
  */
 static void end_gogo_handler(int signal);
 
+/**
+ * p_forward_compact_handler
+ * <p>
+ * Handler for SIGUSR1 in the parent. Forward the request to compact the database to the storage maintenance process.
+ * </p>
+ * @param signal the signal received
+ */
+static void p_forward_compact_handler(int signal);
+
+/**
+ * a_compact_handler
+ * <p>
+ * Handler for SIGUSR1 in the storage maintenance process. Set the request to compact the database.
+ * </p>
+ * @param signal the signal received
+ */
+static void a_compact_handler(int signal);
+
 /**
  * p_accept_new_connection
  * <p>
@@ -134,6 +174,98 @@ static int p_send_to_child(struct core_object *co, struct state_object *so, stru
 static void p_remove_connection(struct core_object *co, struct parent_struct *parent,
                                 struct pollfd *pollfd, size_t conn_index, struct pollfd *listen_pollfd);
 
+/**
+ * a_run_aux_process
+ * <p>
+ * Run an auxiliary process: run its task, then sleep for its interval, until signalled to end.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @param aux the auxiliary process
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int a_run_aux_process(struct core_object *co, struct state_object *so, struct aux_process *aux);
+
+/**
+ * a_maintain_storage
+ * <p>
+ * Run the maintenance of the storage engine on each database shard, and compact the shards if asked to. A shard
+ * written too often to be compacted is tried again at the next run.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int a_maintain_storage(struct core_object *co, struct state_object *so);
+
+/**
+ * a_apply_db_writes
+ * <p>
+ * Wait for database writes to be queued by the workers, then apply them in batches.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int a_apply_db_writes(struct core_object *co, struct state_object *so);
+
+/**
+ * a_publish_db_snapshot
+ * <p>
+ * Publish a new database snapshot if one is due.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int a_publish_db_snapshot(struct core_object *co, struct state_object *so);
+
+/**
+ * a_sweep_db_expired
+ * <p>
+ * Make a pass over the database keys, removing those that have expired. The pass is made in slices bounded in
+ * keys and time, with a pause between them, so that the shard locks are never held for long.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int a_sweep_db_expired(struct core_object *co, struct state_object *so);
+
+/**
+ * a_serve_db_changelog
+ * <p>
+ * Serve the database change log to the replicas that connect on its socket, until the process is told to end.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int a_serve_db_changelog(struct core_object *co, struct state_object *so);
+
+/**
+ * a_replicate_db
+ * <p>
+ * Connect to the change log server of the primary and apply the changes it sends, until the connection is lost or
+ * the process is told to end. A primary that cannot be reached is tried again at the next run.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int a_replicate_db(struct core_object *co, struct state_object *so);
+
+/**
+ * a_flush_uploads
+ * <p>
+ * Wait for uploads to be published by the workers, then sync them in groups.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int a_flush_uploads(struct core_object *co, struct state_object *so);
+
 /**
  * c_run_child_process
  * <p>
@@ -211,14 +343,61 @@ int setup_process_server(struct core_object *co, struct state_object *so)
     
     co->so = so;
     
+    // The directories are created first, as the upload flusher keeps the write directory open.
+    if (create_dir(WRITE_DIR) == -1 || create_dir(CACHE_DIR) == -1 || create_dir(BLOB_DIR) == -1
+        || create_dir(SNAPSHOT_DIR) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
     if (open_pipe_semaphores_domain_sockets_database(co, so) == -1)
     {
         return -1;
     }
     
-    if (create_dir(WRITE_DIR) == -1)
+    // The maintenance process also compacts the database when the server is sent SIGUSR1.
+    if ((co->storage->maintain || co->storage->compact) &&
+        register_aux_process(co, so, "Storage maintenance", a_maintain_storage, STORAGE_MAINTENANCE_INTERVAL) == -1)
+    {
+        return -1;
+    }
+    
+    // The writer waits on the queue rather than sleeping between runs.
+    if (so->db_write_queue.shared && register_aux_process(co, so, "Database writer", a_apply_db_writes, 0) == -1)
+    {
+        return -1;
+    }
+    
+    if (so->db_snapshot.shared &&
+        register_aux_process(co, so, "Snapshot publisher", a_publish_db_snapshot, DB_SNAPSHOT_INTERVAL) == -1)
+    {
+        return -1;
+    }
+    
+    // The sweeper finds keys through the ordered key index; without it, expired values are only hidden from reads.
+    if (so->db_index.shared &&
+        register_aux_process(co, so, "Expiry sweeper", a_sweep_db_expired, DB_EXPIRY_INTERVAL) == -1)
+    {
+        return -1;
+    }
+    
+    // The server polls the change log for new changes rather than sleeping between runs.
+    if (so->db_changelog.shared &&
+        register_aux_process(co, so, "Change log server", a_serve_db_changelog, 0) == -1)
+    {
+        return -1;
+    }
+    
+    if (so->db_replica.shared &&
+        register_aux_process(co, so, "Replicator", a_replicate_db, DB_REPLICA_RETRY_INTERVAL) == -1)
+    {
+        return -1;
+    }
+    
+    // The flusher waits on the uploads published rather than sleeping between runs.
+    if (so->upload_flusher.shared && register_aux_process(co, so, "Upload flusher", a_flush_uploads, 0) == -1)
     {
-        SET_ERROR(co->err);
         return -1;
     }
     
@@ -249,6 +428,12 @@ int run_process_server(struct core_object *co, struct state_object *so)
         {
             return -1;
         }
+    } else if (so->aux)
+    {
+        if (a_run_aux_process(co, so, so->aux) == -1)
+        {
+            return -1;
+        }
     }
     
     return 0;
@@ -262,12 +447,24 @@ static int p_run_poll_loop(struct core_object *co, struct state_object *so, stru
     struct pollfd    *pollfds;
     nfds_t           nfds;
     
-    if (setup_signal_handler(&sigint, SIGINT) == -1)
+    if (setup_signal_handler(&sigint, SIGINT, end_gogo_handler) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (setup_signal_handler(&sigint, SIGTERM, end_gogo_handler) == -1)
     {
         SET_ERROR(co->err);
         return -1;
     }
-    if (setup_signal_handler(&sigint, SIGTERM) == -1)
+    for (size_t a = 0; a < so->num_aux_processes; ++a)
+    {
+        if (so->aux_processes[a].run_once == a_maintain_storage)
+        {
+            MAINTENANCE_PID = so->aux_processes[a].pid;
+        }
+    }
+    if (setup_signal_handler(&sigint, SIGUSR1, p_forward_compact_handler) == -1)
     {
         SET_ERROR(co->err);
         return -1;
@@ -281,6 +478,10 @@ static int p_run_poll_loop(struct core_object *co, struct state_object *so, stru
         poll_status = poll(pollfds, nfds, -1);
         if (poll_status == -1)
         {
+            if (errno == EINTR && GOGO_PROCESS)
+            {
+                continue; // Interrupted by a request to compact the database.
+            }
             SET_ERROR(co->err);
             return (errno == EINTR) ? 0 : -1;
         }
@@ -309,11 +510,11 @@ static int p_run_poll_loop(struct core_object *co, struct state_object *so, stru
     return 0;
 }
 
-static int setup_signal_handler(struct sigaction *sa, int signal)
+static int setup_signal_handler(struct sigaction *sa, int signal, void (*handler)(int))
 {
     sigemptyset(&sa->sa_mask);
     sa->sa_flags   = 0;
-    sa->sa_handler = end_gogo_handler;
+    sa->sa_handler = handler;
     if (sigaction(signal, sa, 0) == -1)
     {
         return -1;
@@ -329,8 +530,26 @@ static void end_gogo_handler(int signal)
     GOGO_PROCESS = 0;
 }
 
+static void a_compact_handler(int signal)
+{
+    COMPACT_DB = 1;
+}
+
 #pragma GCC diagnostic pop
 
+static void p_forward_compact_handler(int signal)
+{
+    int saved_errno;
+    
+    // The poll loop checks errno once the handler returns.
+    saved_errno = errno;
+    if (MAINTENANCE_PID > 0)
+    {
+        (void) kill(MAINTENANCE_PID, signal);
+    }
+    errno = saved_errno;
+}
+
 static int p_accept_new_connection(struct core_object *co, struct parent_struct *parent, struct pollfd *pollfds)
 {
     PRINT_STACK_TRACE(co->tracer);
@@ -511,6 +730,200 @@ static void p_remove_connection(struct core_object *co, struct parent_struct *pa
     }
 }
 
+static int a_run_aux_process(struct core_object *co, struct state_object *so, struct aux_process *aux)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    pid_t            pid;
+    struct sigaction sigint;
+    
+    pid = getpid();
+    
+    (void) fprintf(stdout, "%s process with pid %d started.\n", aux->name, pid);
+    
+    if (setup_signal_handler(&sigint, SIGINT, end_gogo_handler) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (setup_signal_handler(&sigint, SIGTERM, end_gogo_handler) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (aux->run_once == a_maintain_storage && setup_signal_handler(&sigint, SIGUSR1, a_compact_handler) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    while (GOGO_PROCESS)
+    {
+        if (aux->run_once(co, so) == -1)
+        {
+            return -1;
+        }
+        sleep(aux->interval); // Interrupted by the signal to end, or by a request to compact the database.
+    }
+    
+    (void) fprintf(stdout, "%s process with pid %d winding down.\n", aux->name, pid);
+    
+    return 0;
+}
+
+static int a_maintain_storage(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_shard *shard;
+    int             res;
+    
+    if (COMPACT_DB)
+    {
+        COMPACT_DB = 0;
+        for (size_t s = 0; s < so->num_db_shards; ++s)
+        {
+            so->db_shards[s].compact_pending = true;
+        }
+    }
+    
+    for (size_t s = 0; s < so->num_db_shards; ++s)
+    {
+        shard = &so->db_shards[s];
+        if (shard->compact_pending)
+        {
+            res = db_compact(co, shard);
+            if (res == -1)
+            {
+                return -1;
+            }
+            shard->compact_pending = (res == 1);
+        }
+        if (db_maintain(co, shard) == -1)
+        {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int a_apply_db_writes(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    return apply_db_write_queue(co, so);
+}
+
+static int a_publish_db_snapshot(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (!db_snapshot_due(&so->db_snapshot, co->db_snapshot_writes))
+    {
+        return 0;
+    }
+    
+    return publish_db_snapshot(co, so);
+}
+
+static int a_sweep_db_expired(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    // The sweeper runs its passes in one process for its whole life, so the last collection is kept across them.
+    static time_t          last_collected;
+    struct db_expiry_sweep sweep;
+    struct timespec        pause;
+    int                    res;
+    
+    if (open_db_expiry_sweep(co, &sweep) == -1)
+    {
+        return -1;
+    }
+    sweep.collect_blobs = difftime(sweep.started, last_collected) >= DB_BLOB_COLLECT_INTERVAL;
+    
+    pause.tv_sec  = 0;
+    pause.tv_nsec = DB_EXPIRY_PAUSE_MS * NS_PER_MS;
+    res           = 1;
+    while (GOGO_PROCESS && res == 1)
+    {
+        res = sweep_db_expiry_slice(co, so, &sweep);
+        if (res == 1)
+        {
+            nanosleep(&pause, NULL); // Interrupted by the signal to end.
+        }
+    }
+    if (sweep.removed > 0)
+    {
+        (void) fprintf(stdout, "Removed %zu expired of %zu database keys.\n", sweep.removed, sweep.checked);
+    }
+    
+    // Only a pass over every key knows all the blobs that are referred to.
+    if (GOGO_PROCESS && res == 0 && sweep.collect_blobs)
+    {
+        res            = collect_db_expiry_blobs(co, &sweep);
+        last_collected = sweep.started;
+        if (sweep.collected > 0)
+        {
+            (void) fprintf(stdout, "Collected %zu unreferenced database blobs.\n", sweep.collected);
+        }
+    }
+    close_db_expiry_sweep(co, &sweep);
+    
+    return (res == -1) ? -1 : 0;
+}
+
+static int a_serve_db_changelog(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_changelog_server server;
+    int                        res;
+    
+    if (open_db_changelog_server(co, &server, co->db_changelog_socket) == -1)
+    {
+        return -1;
+    }
+    
+    res = 0;
+    while (GOGO_PROCESS && res == 0)
+    {
+        res = serve_db_changelog(co, &so->db_changelog, &server);
+    }
+    close_db_changelog_server(co, &so->db_changelog, &server);
+    
+    return res;
+}
+
+static int a_replicate_db(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct db_replica_stream stream;
+    int                      res;
+    
+    res = open_db_replica_stream(co, &so->db_replica, &stream);
+    if (res != 0)
+    {
+        return (res == -1) ? -1 : 0;
+    }
+    
+    while (GOGO_PROCESS && res == 0)
+    {
+        res = apply_db_replica_frame(co, so, &stream);
+    }
+    close_db_replica_stream(co, &so->db_replica, &stream);
+    
+    return (res == -1) ? -1 : 0;
+}
+
+static int a_flush_uploads(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    return flush_uploads(co, so);
+}
+
 static int c_run_child_process(struct core_object *co, struct state_object *so)
 {
     PRINT_STACK_TRACE(co->tracer);
@@ -521,12 +934,12 @@ static int c_run_child_process(struct core_object *co, struct state_object *so)
     
     (void) fprintf(stdout, "Child process with pid %d started.\n", pid);
     
-    if (setup_signal_handler(&sigint, SIGINT) == -1)
+    if (setup_signal_handler(&sigint, SIGINT, end_gogo_handler) == -1)
     {
         SET_ERROR(co->err);
         return -1;
     }
-    if (setup_signal_handler(&sigint, SIGTERM) == -1)
+    if (setup_signal_handler(&sigint, SIGTERM, end_gogo_handler) == -1)
     {
         SET_ERROR(co->err);
         return -1;
@@ -549,7 +962,8 @@ static int c_receive_and_handle_messages(struct core_object *co, struct state_ob
     // Child processes will loop here.
     while (GOGO_PROCESS)
     {
-        // Clean the child struct.
+        // Clean the child struct. It holds only the state of one connection; the database handles of the worker
+        // are kept in the state object, so that they stay open between requests until the worker exits.
         memset(child, 0, sizeof(struct child_struct));
         
         if (c_get_file_description_from_domain_socket(co, so, child) == -1)
@@ -582,10 +996,12 @@ static int c_handle_http_request_response(struct core_object *co, struct state_o
 {
     PRINT_STACK_TRACE(co->tracer);
     
-    size_t              status;
-    struct http_header  **headers;
-    char                *entity_body;
-    struct http_request *request;
+    size_t                  status;
+    struct http_header      **headers;
+    struct http_entity_body entity_body;
+    struct http_request     *request;
+    
+    memset(&entity_body, 0, sizeof(struct http_entity_body));
     
     request = init_http_request(co);
     if (!request)
@@ -597,7 +1013,6 @@ static int c_handle_http_request_response(struct core_object *co, struct state_o
     if (result == -1)
     {
         status      = INTERNAL_SERVER_ERROR_500;
-        entity_body = NULL;
         headers     = NULL;
         // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
         GET_ERROR(co->err);
@@ -608,19 +1023,20 @@ static int c_handle_http_request_response(struct core_object *co, struct state_o
     {
         // if there is an error, set status to 500
         status      = INTERNAL_SERVER_ERROR_500;
-        entity_body = NULL;
         headers     = NULL;
+        free_entity_body(co, &entity_body);
         // NOLINTNEXTLINE(concurrency-mt-unsafe) : No threads here
         GET_ERROR(co->err);
     }
 
     // NOLINTNEXTLINE(clang-analyzer-core.CallAndMessage): Status will be initialized; result is either -1 or 0
-    if (assemble_send_response(co, child->client_fd_local, status, headers, entity_body) == -1)
+    if (assemble_send_response(co, child->client_fd_local, status, headers, &entity_body) == -1)
     {
+        free_entity_body(co, &entity_body);
         return -1;
     }
     
-    free_http_data(co, headers, entity_body);
+    free_http_data(co, headers, &entity_body);
     destroy_http_request(&request, co);
     
     return 0;
@@ -715,5 +1131,8 @@ void destroy_process_state(struct core_object *co, struct state_object *so)
     } else if (so->child)
     {
         c_destroy_child_state(co, so, so->child);
+    } else if (so->aux)
+    {
+        a_destroy_aux_state(co, so);
     }
 }
@@ -1,10 +1,20 @@
 #include "../include/db.h"
+#include "../include/db_bloom.h"
+#include "../include/db_cache.h"
+#include "../include/db_changelog.h"
+#include "../include/db_index.h"
+#include "../include/db_replica.h"
+#include "../include/db_snapshot.h"
+#include "../include/db_write_queue.h"
 #include "../include/manager.h"
 #include "../include/process_server_util.h"
+#include "../include/storage.h"
+#include "../include/upload.h"
 
 #include <request.h>
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <semaphore.h>
 #include <signal.h>
@@ -62,6 +72,27 @@ static int p_open_process_server_for_listen(struct core_object *co, struct paren
  */
 static int c_setup_child(struct core_object *co, struct state_object *so);
 
+/**
+ * fork_aux_processes
+ * <p>
+ * Fork the registered auxiliary processes. Save their pids. Setup the auxiliary process in the auxiliary processes.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int fork_aux_processes(struct core_object *co, struct state_object *so);
+
+/**
+ * a_setup_aux
+ * <p>
+ * Set up an auxiliary process. It takes no part in handling connections, so the pipe and domain socket are closed.
+ * </p>
+ * @param so the state object
+ * @param aux the auxiliary process
+ */
+static void a_setup_aux(struct state_object *so, struct aux_process *aux);
+
 struct state_object *setup_process_state(struct memory_manager *mm)
 {
     struct state_object *so;
@@ -97,6 +128,58 @@ int open_pipe_semaphores_domain_sockets_database(struct core_object *co, struct
         return -1;
     }
     
+    if (open_db_shards(co, so, DB_NAME, co->num_db_shards, DB_LOCK_NAME_PREFIX, DB_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    
+    if (open_db_cache(co, &so->db_cache, co->db_cache_size, co->db_cache_entry_size, co->db_cache_policy,
+                      DB_CACHE_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    
+    if (open_db_bloom(co, &so->db_bloom, co->db_bloom_size, DB_BLOOM_SHM_NAME) == -1
+        || fill_db_bloom(co, so) == -1)
+    {
+        return -1;
+    }
+    
+    if (open_db_index(co, &so->db_index, co->db_index_size, DB_INDEX_SHM_NAME, DB_INDEX_SEM_NAME) == -1
+        || fill_db_index(co, so) == -1)
+    {
+        return -1;
+    }
+    
+    if (open_db_snapshot(co, &so->db_snapshot, co->db_snapshot_writes, DB_SNAPSHOT_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    
+    if (open_db_write_queue(co, &so->db_write_queue, co->db_write_queue_size, DB_WRITE_QUEUE_SEM_PREFIX,
+                            DB_WRITE_QUEUE_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    
+    // Changes are logged only to be served to replicas.
+    if (open_db_changelog(co, &so->db_changelog, CHANGELOG_NAME, DB_CHANGELOG_SHM_NAME,
+                          co->db_changelog_socket != NULL) == -1)
+    {
+        return -1;
+    }
+    
+    if (open_db_replica(co, &so->db_replica, co->db_primary_socket, REPLICA_OFFSET_NAME, DB_REPLICA_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    
+    if (open_upload_flusher(co, &so->upload_flusher, co->upload_durability == UPLOAD_DURABILITY_GROUP,
+                            UPLOAD_FLUSHER_SEM_PREFIX, UPLOAD_FLUSHER_SHM_NAME) == -1)
+    {
+        return -1;
+    }
+    
     return 0;
 }
 
@@ -107,13 +190,16 @@ static int open_semaphores(struct core_object *co, struct state_object *so)
     sem_t *pipe_write_sem;
     sem_t *domain_read_sem;
     sem_t *domain_write_sem;
-    sem_t *db_write_sem;
+    
+    // Semaphores left under the names by another server, such as the primary of a replica, would be shared with it.
+    sem_unlink(PIPE_WRITE_SEM_NAME);
+    sem_unlink(DOMAIN_READ_SEM_NAME);
+    sem_unlink(DOMAIN_WRITE_SEM_NAME);
     
     // Value 0 will block; value 1 will allow first process to enter, then behave as if value was 0.
-    pipe_write_sem   = sem_open(PIPE_WRITE_SEM_NAME, O_CREAT, S_IRUSR | S_IWUSR, 1);
-    domain_read_sem  = sem_open(DOMAIN_READ_SEM_NAME, O_CREAT, S_IRUSR | S_IWUSR, 0);
-    domain_write_sem = sem_open(DOMAIN_WRITE_SEM_NAME, O_CREAT, S_IRUSR | S_IWUSR, 1);
-    db_write_sem     = sem_open(DB_WRITE_SEM_NAME, O_CREAT, S_IRUSR | S_IWUSR, 1);
+    pipe_write_sem   = sem_open(PIPE_WRITE_SEM_NAME, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, 1);
+    domain_read_sem  = sem_open(DOMAIN_READ_SEM_NAME, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, 0);
+    domain_write_sem = sem_open(DOMAIN_WRITE_SEM_NAME, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, 1);
     if (pipe_write_sem == SEM_FAILED || domain_read_sem == SEM_FAILED || domain_write_sem == SEM_FAILED)
     {
         SET_ERROR(co->err);
@@ -121,19 +207,16 @@ static int open_semaphores(struct core_object *co, struct state_object *so)
         sem_close(pipe_write_sem);
         sem_close(domain_read_sem);
         sem_close(domain_write_sem);
-        sem_close(db_write_sem);
         // Unlinking an unopened semaphore will return -1 and set errno = ENOENT, which can be ignored.
         sem_unlink(PIPE_WRITE_SEM_NAME);
         sem_unlink(DOMAIN_READ_SEM_NAME);
         sem_unlink(DOMAIN_WRITE_SEM_NAME);
-        sem_unlink(DB_WRITE_SEM_NAME);
         return -1;
     }
     
     so->c_to_p_pipe_sem_write = pipe_write_sem;
     so->domain_sems[READ]  = domain_read_sem;
     so->domain_sems[WRITE] = domain_write_sem;
-    so->db_sem = db_write_sem;
     
     return 0;
 }
@@ -154,6 +237,7 @@ int fork_child_processes(struct core_object *co, struct state_object *so)
         so->child_pids[c] = pid;
         if (pid == 0)
         {
+            so->child_index = c;
             if (c_setup_child(co, so) == -1)
             {
                 return -1;
@@ -164,6 +248,14 @@ int fork_child_processes(struct core_object *co, struct state_object *so)
     }
     if (pid > 0)
     {
+        if (fork_aux_processes(co, so) == -1)
+        {
+            return -1;
+        }
+        if (so->aux)
+        {
+            return 0;
+        }
         if (p_setup_parent(co, so) == -1)
         {
             return -1;
@@ -173,6 +265,65 @@ int fork_child_processes(struct core_object *co, struct state_object *so)
     return 0;
 }
 
+int register_aux_process(struct core_object *co, struct state_object *so, const char *name,
+                         int (*run_once)(struct core_object *, struct state_object *), unsigned int interval)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct aux_process *aux;
+    
+    if (so->num_aux_processes >= MAX_AUX_PROCESSES)
+    {
+        errno = ENOSPC;
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    aux = &so->aux_processes[so->num_aux_processes++];
+    aux->name     = name;
+    aux->run_once = run_once;
+    aux->interval = interval;
+    aux->pid      = 0;
+    
+    return 0;
+}
+
+static int fork_aux_processes(struct core_object *co, struct state_object *so)
+{
+    pid_t pid;
+    
+    for (size_t a = 0; a < so->num_aux_processes; ++a)
+    {
+        pid = fork();
+        if (pid == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        so->aux_processes[a].pid = pid;
+        if (pid == 0)
+        {
+            a_setup_aux(so, &so->aux_processes[a]);
+            break; // Do not fork bomb.
+        }
+    }
+    
+    return 0;
+}
+
+static void a_setup_aux(struct state_object *so, struct aux_process *aux)
+{
+    so->aux = aux;
+    
+    close_fd_report_undefined_error(so->c_to_p_pipe_fds[READ], "state of parent pipe read is undefined.");
+    close_fd_report_undefined_error(so->c_to_p_pipe_fds[WRITE], "state of child pipe write is undefined.");
+    close_fd_report_undefined_error(so->domain_fds[READ], "state of child domain socket is undefined.");
+    close_fd_report_undefined_error(so->domain_fds[WRITE], "state of parent domain socket is undefined.");
+    
+    memset(so->c_to_p_pipe_fds, 0, sizeof(so->c_to_p_pipe_fds));
+    memset(so->domain_fds, 0, sizeof(so->domain_fds));
+}
+
 static int c_setup_child(struct core_object *co, struct state_object *so)
 {
     so->parent = NULL; // Here for clarity; will already be null.
@@ -259,16 +410,25 @@ static int p_open_process_server_for_listen(struct core_object *co, struct paren
 void p_destroy_parent_state(struct core_object *co, struct state_object *so, struct parent_struct *parent)
 {
     PRINT_STACK_TRACE(co->tracer);
-    int status;
+    int    status;
+    size_t num_db_shards;
     
     FOR_EACH_CHILD_c_IN_CHILD_PIDS // Send signals to child processes real quick.
     {
         kill(so->child_pids[c], SIGINT);
     }
+    for (size_t a = 0; a < so->num_aux_processes; ++a)
+    {
+        kill(so->aux_processes[a].pid, SIGINT);
+    }
     FOR_EACH_CHILD_c_IN_CHILD_PIDS // Wait for child processes to wrap up.
     {
         waitpid(so->child_pids[c], &status, 0);
     }
+    for (size_t a = 0; a < so->num_aux_processes; ++a)
+    {
+        waitpid(so->aux_processes[a].pid, &status, 0);
+    }
     
     close_fd_report_undefined_error(so->c_to_p_pipe_fds[READ], "state of pipe read is undefined.");
     close_fd_report_undefined_error(so->domain_fds[WRITE], "state of parent domain socket is undefined.");
@@ -283,11 +443,48 @@ void p_destroy_parent_state(struct core_object *co, struct state_object *so, str
     sem_close(so->c_to_p_pipe_sem_write);
     sem_close(so->domain_sems[READ]);
     sem_close(so->domain_sems[WRITE]);
-    sem_close(so->db_sem);
     sem_unlink(PIPE_WRITE_SEM_NAME);
     sem_unlink(DOMAIN_READ_SEM_NAME);
     sem_unlink(DOMAIN_WRITE_SEM_NAME);
-    sem_unlink(DB_WRITE_SEM_NAME);
+    
+    num_db_shards = so->num_db_shards;
+    for (size_t s = 0; s < num_db_shards; ++s)
+    {
+        print_rw_lock_stats(so->db_shards[s].name, &so->db_shards[s].lock);
+    }
+    close_db_shards(co, so);
+    unlink_db_shards(DB_LOCK_NAME_PREFIX, num_db_shards);
+    
+    print_db_cache_stats(&so->db_cache);
+    close_db_cache(&so->db_cache);
+    
+    print_db_bloom_stats(&so->db_bloom);
+    close_db_bloom(&so->db_bloom);
+    
+    print_db_index_stats(&so->db_index);
+    close_db_index(&so->db_index);
+    
+    print_db_snapshot_stats(&so->db_snapshot);
+    unlink_db_snapshot(&so->db_snapshot);
+    close_db_snapshot(&so->db_snapshot);
+    
+    if (so->db_write_queue.shared)
+    {
+        print_db_write_queue_stats(&so->db_write_queue);
+        close_db_write_queue(&so->db_write_queue);
+        unlink_db_write_queue(DB_WRITE_QUEUE_SEM_PREFIX);
+    }
+    
+    print_db_changelog_stats(&so->db_changelog);
+    close_db_changelog(&so->db_changelog);
+    close_db_replica(&so->db_replica);
+    
+    if (so->upload_flusher.shared)
+    {
+        print_upload_flusher_stats(&so->upload_flusher);
+        close_upload_flusher(&so->upload_flusher);
+        unlink_upload_flusher(UPLOAD_FLUSHER_SEM_PREFIX);
+    }
 }
 
 void c_destroy_child_state(struct core_object *co, struct state_object *so, struct child_struct *child)
@@ -296,9 +493,34 @@ void c_destroy_child_state(struct core_object *co, struct state_object *so, stru
     close_fd_report_undefined_error(so->c_to_p_pipe_fds[WRITE], "state of pipe write is undefined.");
     close_fd_report_undefined_error(so->domain_fds[READ], "state of child domain socket is undefined.");
     
+    close_db_shards(co, so);
+    close_db_cache(&so->db_cache);
+    close_db_bloom(&so->db_bloom);
+    close_db_index(&so->db_index);
+    close_db_snapshot(&so->db_snapshot);
+    close_db_write_queue(&so->db_write_queue);
+    close_db_changelog(&so->db_changelog);
+    close_db_replica(&so->db_replica);
+    close_upload_flusher(&so->upload_flusher);
+    
     mm_free(co->mm, child);
 }
 
+void a_destroy_aux_state(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    close_db_shards(co, so);
+    close_db_cache(&so->db_cache);
+    close_db_bloom(&so->db_bloom);
+    close_db_index(&so->db_index);
+    close_db_snapshot(&so->db_snapshot);
+    close_db_write_queue(&so->db_write_queue);
+    close_db_changelog(&so->db_changelog);
+    close_db_replica(&so->db_replica);
+    close_upload_flusher(&so->upload_flusher);
+}
+
 void close_fd_report_undefined_error(int fd, const char *err_msg)
 {
     if (close(fd) == -1)
@@ -0,0 +1,460 @@
+#include "../include/manager.h"
+#include "../include/range.h"
+#include "../include/util.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+// NOLINTNEXTLINE(modernize-macro-to-enum) : Macro is fine.
+#define RANGE_FIELD_MAX_LEN 96 /** The maximum length of a Content-Range or Content-Length value. */
+
+/** Prefix of a byte range set in a Range header. */
+#define BYTES_RANGE_PREFIX BYTES_RANGE_UNIT "="
+
+/** Format of a Content-Range value for a satisfiable range: first-last/size. */
+#define CONTENT_RANGE_FORMAT BYTES_RANGE_UNIT " %lld-%lld/%lld"
+
+/** Format of a Content-Range value for an unsatisfiable range: size. */
+#define CONTENT_RANGE_UNSATISFIED_FORMAT BYTES_RANGE_UNIT " */%lld"
+
+/** Format of the header of one part of a multipart/byteranges body. */
+#define BYTERANGES_PART_FORMAT \
+    "--" BYTERANGES_BOUNDARY CRLF_STR H_CONTENT_TYPE COLON_SP_STR "%s" CRLF_STR \
+    H_CONTENT_RANGE COLON_SP_STR CONTENT_RANGE_FORMAT CRLF_STR CRLF_STR
+
+/** Closing delimiter of a multipart/byteranges body. */
+#define BYTERANGES_END "--" BYTERANGES_BOUNDARY "--" CRLF_STR
+
+/**
+ * skip_range_whitespace
+ * <p>
+ * Skip over the whitespace in a Range header.
+ * </p>
+ * @param str the position in the header
+ * @return the first non-whitespace position
+ */
+static const char *skip_range_whitespace(const char *str);
+
+/**
+ * coalesce_ranges
+ * <p>
+ * Sort satisfiable ranges by their first byte and merge those that overlap or touch, so that no byte of the entity
+ * is sent twice, whatever ranges the client repeats.
+ * </p>
+ * @param ranges the ranges, sorted and merged in place
+ * @param num_ranges the number of ranges
+ * @return the number of ranges left
+ */
+static int coalesce_ranges(struct byte_range *ranges, int num_ranges);
+
+/**
+ * assemble_byteranges_body
+ * <p>
+ * Assemble a multipart/byteranges entity body from the ranges of an entity.
+ * </p>
+ * @param co the core object
+ * @param ranges the ranges
+ * @param num_ranges the number of ranges
+ * @param entity_size the size of the whole entity
+ * @param entity_type the content type of the entity
+ * @param fd the file holding the entity, or 0
+ * @param data the entity if not in a file
+ * @param entity_body the entity body to fill
+ * @return 0 on success, -1 and set err on failure
+ */
+static int assemble_byteranges_body(struct core_object *co, const struct byte_range *ranges, size_t num_ranges,
+                                    off_t entity_size, const char *entity_type, int fd, const char *data,
+                                    struct http_entity_body *entity_body);
+
+/**
+ * copy_range
+ * <p>
+ * Copy a range of an entity into a buffer.
+ * </p>
+ * @param dst the buffer
+ * @param range the range to copy
+ * @param fd the file holding the entity, or 0
+ * @param data the entity if not in a file
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int copy_range(char *dst, const struct byte_range *range, int fd, const char *data);
+
+/**
+ * set_range_headers
+ * <p>
+ * Allocate a header list and fill it with the Content-Type, Content-Length and, if not NULL, Content-Range
+ * headers of a range response.
+ * </p>
+ * @param co the core object
+ * @param headers pointer to the header list for the response
+ * @param content_type the content type
+ * @param content_length the content length
+ * @param content_range the content range, or NULL
+ * @return 0 on success, -1 and set err on failure
+ */
+static int set_range_headers(struct core_object *co, struct http_header ***headers, const char *content_type,
+                             size_t content_length, const char *content_range);
+
+struct http_header *get_applicable_range(struct http_request *req, time_t last_modified)
+{
+    struct http_header *range;
+    struct http_header *if_range;
+    time_t             if_range_time;
+    
+    range = get_header(H_RANGE, req->extension_headers, req->num_extension_headers);
+    if (!range)
+    {
+        return NULL;
+    }
+    
+    if_range = get_header(H_IF_RANGE, req->extension_headers, req->num_extension_headers);
+    if (!if_range)
+    {
+        return range;
+    }
+    
+    // Entity tags are not supported; an If-Range that is not a date never matches.
+    if_range_time = http_time_to_time_t(if_range->value);
+    if (if_range_time == -1 || difftime(last_modified, if_range_time) > 0)
+    {
+        return NULL;
+    }
+    
+    return range;
+}
+
+int parse_range_header(const char *value, off_t entity_size, struct byte_range ranges[MAX_BYTE_RANGES])
+{
+    const char *spec;
+    const char *next;
+    char       *end;
+    int        num_specs;
+    int        num_ranges;
+    long long  first;
+    long long  last;
+    
+    if (strncasecmp(value, BYTES_RANGE_PREFIX, strlen(BYTES_RANGE_PREFIX)) != 0)
+    {
+        return -1;
+    }
+    
+    num_specs  = 0;
+    num_ranges = 0;
+    spec       = value + strlen(BYTES_RANGE_PREFIX);
+    
+    // Format: byte-range-spec *( "," byte-range-spec ); empty list elements are allowed.
+    while (*(spec = skip_range_whitespace(spec)))
+    {
+        if (*spec == ',')
+        {
+            ++spec;
+            continue;
+        }
+        
+        if (++num_specs > MAX_BYTE_RANGES)
+        {
+            return -1;
+        }
+        
+        errno = 0;
+        if (*spec == '-') // Suffix range: the last N bytes.
+        {
+            if (!isdigit((unsigned char) *(spec + 1)))
+            {
+                return -1;
+            }
+            // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+            last  = strtoll(spec + 1, &end, 10);
+            next  = end;
+            first = (last >= entity_size) ? 0 : entity_size - last;
+            last  = (last == 0) ? -1 : entity_size - 1; // A zero-length suffix is unsatisfiable.
+        } else
+        {
+            if (!isdigit((unsigned char) *spec))
+            {
+                return -1;
+            }
+            // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+            first = strtoll(spec, &end, 10);
+            if (*end != '-')
+            {
+                return -1;
+            }
+            spec = end + 1;
+            if (isdigit((unsigned char) *spec))
+            {
+                // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Will never change
+                last = strtoll(spec, &end, 10);
+                next = end;
+                if (last < first)
+                {
+                    return -1;
+                }
+            } else
+            {
+                last = entity_size - 1; // Open-ended range: to the end of the entity.
+                next = spec;
+            }
+            if (last >= entity_size)
+            {
+                last = entity_size - 1;
+            }
+        }
+        if (errno == ERANGE)
+        {
+            return -1;
+        }
+        
+        spec = skip_range_whitespace(next);
+        if (*spec && *spec != ',')
+        {
+            return -1;
+        }
+        
+        if (first < entity_size && first <= last) // Unsatisfiable ranges are dropped.
+        {
+            ranges[num_ranges].first = (off_t) first;
+            ranges[num_ranges].last  = (off_t) last;
+            ++num_ranges;
+        }
+    }
+    
+    return (num_specs) ? coalesce_ranges(ranges, num_ranges) : -1;
+}
+
+static int coalesce_ranges(struct byte_range *ranges, int num_ranges)
+{
+    struct byte_range range;
+    int               num_merged;
+    int               j;
+    
+    // There are at most MAX_BYTE_RANGES ranges, so an insertion sort does.
+    for (int i = 1; i < num_ranges; ++i)
+    {
+        range = ranges[i];
+        for (j = i; j > 0 && ranges[j - 1].first > range.first; --j)
+        {
+            ranges[j] = ranges[j - 1];
+        }
+        ranges[j] = range;
+    }
+    
+    num_merged = (num_ranges > 0) ? 1 : 0;
+    for (int i = 1; i < num_ranges; ++i)
+    {
+        if (ranges[i].first <= ranges[num_merged - 1].last + 1)
+        {
+            if (ranges[i].last > ranges[num_merged - 1].last)
+            {
+                ranges[num_merged - 1].last = ranges[i].last;
+            }
+        } else
+        {
+            ranges[num_merged++] = ranges[i];
+        }
+    }
+    
+    return num_merged;
+}
+
+static const char *skip_range_whitespace(const char *str)
+{
+    while (*str == SP || *str == '\t')
+    {
+        ++str;
+    }
+    
+    return str;
+}
+
+int range_assemble_response_innards(struct core_object *co, const struct byte_range *ranges, size_t num_ranges,
+                                    off_t entity_size, const char *entity_type, int fd, const char *data,
+                                    size_t *status, struct http_header ***headers,
+                                    struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char content_range[RANGE_FIELD_MAX_LEN];
+    char content_type[RANGE_FIELD_MAX_LEN];
+    int  ret_val;
+    
+    if (num_ranges > 1)
+    {
+        ret_val = assemble_byteranges_body(co, ranges, num_ranges, entity_size, entity_type, fd, data,
+                                           entity_body);
+        if (fd)
+        {
+            close(fd); // The parts have been copied out of the file.
+        }
+        if (ret_val == -1)
+        {
+            return -1;
+        }
+        (void) snprintf(content_type, RANGE_FIELD_MAX_LEN, "%s%s", MULTIPART_BYTERANGES_CONTENT_TYPE,
+                        BYTERANGES_BOUNDARY);
+        
+        *status = PARTIAL_CONTENT_206;
+        return set_range_headers(co, headers, content_type, entity_body->size, NULL);
+    }
+    
+    entity_body->size = (size_t) (ranges->last - ranges->first + 1);
+    if (fd) // Send the range straight from the file.
+    {
+        entity_body->fd     = fd;
+        entity_body->offset = ranges->first;
+    } else
+    {
+        entity_body->data = mm_malloc(entity_body->size, co->mm);
+        if (!entity_body->data)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        memcpy(entity_body->data, data + ranges->first, entity_body->size);
+    }
+    
+    (void) snprintf(content_range, RANGE_FIELD_MAX_LEN, CONTENT_RANGE_FORMAT, (long long) ranges->first,
+                    (long long) ranges->last, (long long) entity_size);
+    
+    *status = PARTIAL_CONTENT_206;
+    return set_range_headers(co, headers, entity_type, entity_body->size, content_range);
+}
+
+int range_not_satisfiable_response_innards(struct core_object *co, off_t entity_size, size_t *status,
+                                           struct http_header ***headers)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char content_range[RANGE_FIELD_MAX_LEN];
+    
+    (void) snprintf(content_range, RANGE_FIELD_MAX_LEN, CONTENT_RANGE_UNSATISFIED_FORMAT, (long long) entity_size);
+    
+    *status = REQUESTED_RANGE_NOT_SATISFIABLE_416;
+    return set_range_headers(co, headers, TEXT_HTML_CONTENT_TYPE, 0, content_range);
+}
+
+static int assemble_byteranges_body(struct core_object *co, const struct byte_range *ranges, size_t num_ranges,
+                                    off_t entity_size, const char *entity_type, int fd, const char *data,
+                                    struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    size_t body_size;
+    size_t offset;
+    int    part_header_size;
+    
+    // Size the body first so that it is allocated once.
+    body_size = strlen(BYTERANGES_END);
+    for (size_t r = 0; r < num_ranges; ++r)
+    {
+        part_header_size = snprintf(NULL, 0, BYTERANGES_PART_FORMAT, entity_type,
+                                    (long long) ranges[r].first, (long long) ranges[r].last,
+                                    (long long) entity_size);
+        body_size += (size_t) part_header_size + (size_t) (ranges[r].last - ranges[r].first + 1) + CRLF_SIZE;
+    }
+    
+    // +1 for the null byte written by snprintf.
+    entity_body->data = mm_malloc(body_size + 1, co->mm);
+    if (!entity_body->data)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    offset = 0;
+    for (size_t r = 0; r < num_ranges; ++r)
+    {
+        part_header_size = snprintf(entity_body->data + offset, body_size + 1 - offset, BYTERANGES_PART_FORMAT,
+                                    entity_type, (long long) ranges[r].first, (long long) ranges[r].last,
+                                    (long long) entity_size);
+        offset += (size_t) part_header_size;
+        
+        if (copy_range(entity_body->data + offset, ranges + r, fd, data) == -1)
+        {
+            SET_ERROR(co->err);
+            mm_free(co->mm, entity_body->data);
+            entity_body->data = NULL;
+            return -1;
+        }
+        offset += (size_t) (ranges[r].last - ranges[r].first + 1);
+        
+        memcpy(entity_body->data + offset, CRLF_STR, CRLF_SIZE);
+        offset += CRLF_SIZE;
+    }
+    memcpy(entity_body->data + offset, BYTERANGES_END, strlen(BYTERANGES_END));
+    
+    entity_body->size = body_size;
+    
+    return 0;
+}
+
+static int copy_range(char *dst, const struct byte_range *range, int fd, const char *data)
+{
+    size_t  size;
+    size_t  nread;
+    ssize_t result;
+    
+    size = (size_t) (range->last - range->first + 1);
+    
+    if (!fd)
+    {
+        memcpy(dst, data + range->first, size);
+        return 0;
+    }
+    
+    for (nread = 0; nread < size; nread += (size_t) result)
+    {
+        result = pread(fd, dst + nread, size - nread, range->first + (off_t) nread);
+        if (result == -1)
+        {
+            return -1;
+        }
+        if (result == 0)
+        {
+            errno = EIO; // The file was truncated while being read.
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int set_range_headers(struct core_object *co, struct http_header ***headers, const char *content_type,
+                             size_t content_length, const char *content_range)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    const int num_headers = 3;
+    char      content_length_str[RANGE_FIELD_MAX_LEN];
+    size_t    offset;
+    
+    (void) snprintf(content_length_str, RANGE_FIELD_MAX_LEN, "%zu", content_length);
+    
+    *headers = mm_calloc(num_headers + 1, sizeof(struct http_header *), co->mm);
+    if (!*headers)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    offset = 0;
+    (*headers)[offset++] = set_header(co, H_CONTENT_TYPE, content_type);
+    (*headers)[offset++] = set_header(co, H_CONTENT_LENGTH, content_length_str);
+    if (content_range)
+    {
+        (*headers)[offset++] = set_header(co, H_CONTENT_RANGE, content_range);
+    }
+    (*headers)[offset] = NULL;
+    
+    for (size_t h = 0; h < offset; ++h)
+    {
+        if (!(*headers)[h])
+        {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
@@ -3,11 +3,26 @@
 #include <request.h>
 #include <util.h>
 
+#include <ctype.h>
+#include <stdlib.h>
+
 /**
  * Read states
  */
 enum states{SUCCESS = 0, FAILURE = -1};
 
+/**
+ * The interim response asking a client for its entity body. Only an HTTP/1.1 client waits for it, and it names the
+ * version the client speaks rather than HTTP_VERSION.
+ */
+#define CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n"
+
+/**
+ * The longest size line or trailer line of a chunked entity body, with its CRLF. Chunk extensions and trailers are
+ * ignored, so a line longer than any real one is refused rather than held.
+ */
+#define CHUNK_LINE_MAX 1024
+
 /**
  * HTTP 1.0 general headers
  */
@@ -69,6 +84,52 @@ static int add_header(struct http_header * header, struct http_header *** header
  */
 static int read_entity_body(int fd, struct http_request * req, struct core_object * co);
 
+/**
+ * read_chunked_entity_body
+ * <p>
+ * Reads a chunked Entity-Body from a client connection, decoding its chunks into one buffer. errno is EMSGSIZE if
+ * the entity body is larger than the maximum, and EBADMSG if its chunks are malformed.
+ * </p>
+ * @param fd the client connection.
+ * @param req the request to read to.
+ * @param co the core object.
+ * @return 0 on success, -1 on failure.
+ */
+static int read_chunked_entity_body(int fd, struct http_request * req, struct core_object * co);
+
+/**
+ * is_chunked
+ * <p>
+ * Checks whether the entity body of a request is sent in chunks. Any other transfer coding is left to the method to
+ * refuse.
+ * </p>
+ * @param req the request.
+ * @return true if the entity body is chunked, false if not.
+ */
+static bool is_chunked(struct http_request * req);
+
+/**
+ * is_post
+ * <p>
+ * Checks whether a request is a POST, whose entity body the method accepts once it has validated the request,
+ * either read into memory or streamed to disk by the method.
+ * </p>
+ * @param req the request.
+ * @return true if the request is a POST, false if not.
+ */
+static bool is_post(struct http_request * req);
+
+/**
+ * expects_continue
+ * <p>
+ * Checks whether the client waits for 100 Continue before sending the entity body. The expectation of an HTTP/1.0
+ * client is ignored, as HTTP/1.0 has no interim responses.
+ * </p>
+ * @param req the request.
+ * @return true if the client waits to be asked for the entity body, false if not.
+ */
+static bool expects_continue(struct http_request * req);
+
 /**
  * read_until
  * <p>
@@ -80,11 +141,34 @@ static int read_entity_body(int fd, struct http_request * req, struct core_objec
  */
 static char * read_until(int fd, char * until, struct core_object * co);
 
+/**
+ * read_chunk_line
+ * <p>
+ * Reads a line of a chunked entity body, a character at a time, into a buffer of fixed size. errno is EBADMSG if the
+ * line does not fit.
+ * </p>
+ * @param fd the file descriptor to read from.
+ * @param line the buffer to read the line into, without its CRLF.
+ * @param size the size of the buffer.
+ * @return 0 on success, -1 on failure.
+ */
+static int read_chunk_line(int fd, char * line, size_t size);
+
 int read_request(int fd, struct http_request * req, struct core_object * co) {
+    req->client_fd = fd;
+    
     if (read_headers(fd, req, co) == FAILURE) {
         return -1;
     }
 
+    // The entity body of a POST, of a request whose client waits to be asked for it, or in chunks, whose size is not
+    // known until it is read, is left for the method to accept.
+    req->entity_body_chunked = is_chunked(req);
+    if (is_post(req) || expects_continue(req) || req->entity_body_chunked) {
+        req->entity_body_unread = true;
+        return 0;
+    }
+    
     if (read_entity_body(fd, req, co) == FAILURE) {
         return -1;
     }
@@ -92,6 +176,67 @@ int read_request(int fd, struct http_request * req, struct core_object * co) {
     return 0;
 }
 
+int accept_entity_body(struct http_request * req, bool streamed, struct core_object * co) {
+    if (!req->entity_body_unread) {
+        return SUCCESS;
+    }
+
+    if (expects_continue(req) && write_fully(req->client_fd, CONTINUE_RESPONSE, strlen(CONTINUE_RESPONSE)) == -1) {
+        return FAILURE;
+    }
+
+    req->entity_body_unread = false;
+    if (streamed) {
+        return SUCCESS;
+    }
+
+    if (req->entity_body_chunked) {
+        return read_chunked_entity_body(req->client_fd, req, co);
+    }
+    return read_entity_body(req->client_fd, req, co);
+}
+
+int read_chunk_header(int fd, bool first, size_t * size) {
+    char crlf[3] = {TERM, TERM, TERM};
+    char line[CHUNK_LINE_MAX];
+    char * end;
+    unsigned long long chunk_size;
+
+    // The data of each chunk but the last is followed by a CRLF.
+    if (!first) {
+        if (read_fully(fd, crlf, 2) == -1) {
+            return FAILURE;
+        }
+        if (crlf[0] != CR || crlf[1] != LF) {
+            errno = EBADMSG;
+            return FAILURE;
+        }
+    }
+
+    // Format: chunk-size [ chunk-extension ] CRLF, the size in hexadecimal.
+    if (read_chunk_line(fd, line, sizeof(line)) == FAILURE) {
+        return FAILURE;
+    }
+    errno = 0;
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): Hexadecimal
+    chunk_size = strtoull(line, &end, 16);
+    if (!isxdigit((unsigned char) *line) || errno == ERANGE || (*end && *end != ';' && *end != SP && *end != '\t')) {
+        errno = EBADMSG;
+        return FAILURE;
+    }
+    *size = (size_t) chunk_size;
+
+    // The last chunk is followed by a trailer of headers, which is ignored, and an empty line.
+    while (chunk_size == 0) {
+        if (read_chunk_line(fd, line, sizeof(line)) == FAILURE) {
+            return FAILURE;
+        }
+        chunk_size = (*line == TERM) ? 1 : 0;
+    }
+
+    return SUCCESS;
+}
+
 static int read_headers(int fd, struct http_request * req, struct core_object * co) {
     bool request_line = true;
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers): size static
@@ -201,10 +346,69 @@ static int read_entity_body(int fd, struct http_request * req, struct core_objec
             return FAILURE;
         }
         *(req->entity_body + length) = '\0';
+        req->entity_body_size = length;
+    }
+    return SUCCESS;
+}
+
+static int read_chunked_entity_body(int fd, struct http_request * req, struct core_object * co) {
+    size_t chunk_size;
+    size_t length = 0;
+    char * body;
+
+    req->entity_body = mm_malloc(1, co->mm);
+    if (!req->entity_body) {
+        SET_ERROR(co->err);
+        return FAILURE;
+    }
+
+    for (bool first = true;; first = false) {
+        if (read_chunk_header(fd, first, &chunk_size) == FAILURE) {
+            return FAILURE;
+        }
+        if (chunk_size == 0) {
+            break;
+        }
+        if (co->max_entity_body_size && chunk_size > co->max_entity_body_size - length) {
+            errno = EMSGSIZE;
+            return FAILURE;
+        }
+
+        body = mm_realloc(req->entity_body, length + chunk_size + 1, co->mm);
+        if (!body) {
+            SET_ERROR(co->err);
+            return FAILURE;
+        }
+        req->entity_body = body;
+        if (read_fully(fd, req->entity_body + length, chunk_size) == -1) {
+            SET_ERROR(co->err);
+            return FAILURE;
+        }
+        length += chunk_size;
     }
+    *(req->entity_body + length) = '\0';
+    req->entity_body_size = length;
+
     return SUCCESS;
 }
 
+static bool is_chunked(struct http_request * req) {
+    struct http_header * coding = get_header(H_TRANSFER_ENCODING, req->extension_headers, req->num_extension_headers);
+    return coding && strcmp(to_lower(coding->value), CHUNKED) == 0;
+}
+
+static bool is_post(struct http_request * req) {
+    return strcmp(req->request_line->method, M_POST) == 0;
+}
+
+static bool expects_continue(struct http_request * req) {
+    struct http_header * expect = get_header(H_EXPECT, req->extension_headers, req->num_extension_headers);
+    if (!expect || strcmp(req->request_line->http_version, HTTP_VERSION) == 0) {
+        return false;
+    }
+    return strcmp(to_lower(expect->value), EXPECT_CONTINUE) == 0;
+}
+
 static char * read_until(int fd, char * until, struct core_object * co) {
     char c;
     size_t line_size = 2; // initial line size
@@ -240,3 +444,24 @@ static char * read_until(int fd, char * until, struct core_object * co) {
 
     return line;
 }
+
+static int read_chunk_line(int fd, char * line, size_t size) {
+    size_t line_size = 0;
+    char c;
+
+    for (;;) {
+        if (read_fully(fd, &c, sizeof(char)) == -1) {
+            return FAILURE;
+        }
+        if (c == LF && line_size > 0 && line[line_size - 1] == CR) {
+            line[line_size - 1] = TERM;
+            return SUCCESS;
+        }
+        if (line_size == size - 1) {
+            errno = EBADMSG;
+            return FAILURE;
+        }
+        line[line_size++] = c;
+        line[line_size] = TERM;
+    }
+}
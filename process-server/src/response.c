@@ -1,5 +1,6 @@
 #include "../include/response.h"
 #include "../include/manager.h"
+#include "../include/util.h"
 
 /** HTTP 1.0 Status Codes and Reason Phrases */
 #define STATUS_CODE_OK                      "200"
@@ -10,6 +11,8 @@
 #define REASON_PHRASE_ACCEPTED              "Accepted"
 #define STATUS_CODE_NO_CONTENT              "204"
 #define REASON_PHRASE_NO_CONTENT            "No Content"
+#define STATUS_CODE_PARTIAL_CONTENT         "206"
+#define REASON_PHRASE_PARTIAL_CONTENT       "Partial Content"
 #define STATUS_CODE_MOVED_PERMANENTLY       "301"
 #define REASON_PHRASE_MOVED_PERMANENTLY     "Moved Permanently"
 #define STATUS_CODE_MOVED_TEMPORARILY       "302"
@@ -24,6 +27,14 @@
 #define REASON_PHRASE_FORBIDDEN             "Forbidden"
 #define STATUS_CODE_NOT_FOUND               "404"
 #define REASON_PHRASE_NOT_FOUND             "Not Found"
+#define STATUS_CODE_LENGTH_REQUIRED         "411"
+#define REASON_PHRASE_LENGTH_REQUIRED       "Length Required"
+#define STATUS_CODE_ENTITY_TOO_LARGE        "413"
+#define REASON_PHRASE_ENTITY_TOO_LARGE      "Request Entity Too Large"
+#define STATUS_CODE_RANGE_NOT_SATISFIABLE   "416"
+#define REASON_PHRASE_RANGE_NOT_SATISFIABLE "Requested Range Not Satisfiable"
+#define STATUS_CODE_EXPECTATION_FAILED      "417"
+#define REASON_PHRASE_EXPECTATION_FAILED    "Expectation Failed"
 #define STATUS_CODE_INTERNAL_SERVER_ERROR   "500"
 #define REASON_PHRASE_INTERNAL_SERVER_ERROR "Internal Server Error"
 #define STATUS_CODE_NOT_IMPLEMENTED         "501"
@@ -61,12 +72,11 @@ void print_response(struct core_object *co, struct http_response *response);
 /**
  * serialize_http_response
  * <p>
- * Serialize an HTTP Response object into a byte sequence.
+ * Serialize an HTTP Response object into a byte sequence. An entity body held in a file is not serialized.
  * </p>
  * @param co the core object
  * @param dst_buffer the destination byte buffer
  * @param response the response to be serialized
- * @param entity_body_size the size of the entity body in the response
  * @return size of serial buffer on success, 0 and set error on failure.
  */
 static size_t serialize_http_response(struct core_object *co, char **dst_buffer, struct http_response *response);
@@ -82,15 +92,13 @@ static size_t serialize_http_response(struct core_object *co, char **dst_buffer,
 static size_t get_header_size_bytes(struct http_header **headers, TRACER_FUNCTION_AS(tracer));
 
 int assemble_send_response(struct core_object *co, int socket_fd,
-                           size_t status, struct http_header **headers, const char *entity_body)
+                           size_t status, struct http_header **headers, const struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
     
     struct http_response response;
     size_t               serial_response_size;
     char                 *serial_response;
-    ssize_t              bytes_sent;
-    size_t               bytes_sent_total;
     
     // Assemble the status line, headers, and body of the response
     assemble_status_line(co, &response, status);
@@ -108,14 +116,17 @@ int assemble_send_response(struct core_object *co, int socket_fd,
     }
     
     // Send the response
-    bytes_sent       = 0;
-    bytes_sent_total = 0;
-    while (bytes_sent != -1 && bytes_sent_total <= serial_response_size)
+    if (write_fully(socket_fd, serial_response, serial_response_size) == -1)
     {
-        bytes_sent = send(socket_fd, serial_response, serial_response_size, 0);
-        bytes_sent_total += bytes_sent;
+        SET_ERROR(co->err);
+        mm_free(co->mm, serial_response);
+        return -1;
     }
-    if (bytes_sent == -1)
+    mm_free(co->mm, serial_response);
+    
+    // Send an entity body held in a file straight from the file.
+    if (entity_body && entity_body->fd
+        && sendfile_fully(socket_fd, entity_body->fd, entity_body->offset, entity_body->size) == -1)
     {
         SET_ERROR(co->err);
         return -1;
@@ -156,6 +167,12 @@ static void assemble_status_line(struct core_object *co, struct http_response *r
             response->status_line.reason_phrase = REASON_PHRASE_NO_CONTENT;
             break;
         }
+        case PARTIAL_CONTENT_206:
+        {
+            response->status_line.status_code   = STATUS_CODE_PARTIAL_CONTENT;
+            response->status_line.reason_phrase = REASON_PHRASE_PARTIAL_CONTENT;
+            break;
+        }
         case MOVED_PERMANENTLY_301:
         {
             response->status_line.status_code   = STATUS_CODE_MOVED_PERMANENTLY;
@@ -197,6 +214,30 @@ static void assemble_status_line(struct core_object *co, struct http_response *r
             response->status_line.status_code   = STATUS_CODE_NOT_FOUND;
             response->status_line.reason_phrase = REASON_PHRASE_NOT_FOUND;
             break;
+        }
+        case LENGTH_REQUIRED_411:
+        {
+            response->status_line.status_code   = STATUS_CODE_LENGTH_REQUIRED;
+            response->status_line.reason_phrase = REASON_PHRASE_LENGTH_REQUIRED;
+            break;
+        }
+        case REQUEST_ENTITY_TOO_LARGE_413:
+        {
+            response->status_line.status_code   = STATUS_CODE_ENTITY_TOO_LARGE;
+            response->status_line.reason_phrase = REASON_PHRASE_ENTITY_TOO_LARGE;
+            break;
+        }
+        case REQUESTED_RANGE_NOT_SATISFIABLE_416:
+        {
+            response->status_line.status_code   = STATUS_CODE_RANGE_NOT_SATISFIABLE;
+            response->status_line.reason_phrase = REASON_PHRASE_RANGE_NOT_SATISFIABLE;
+            break;
+        }
+        case EXPECTATION_FAILED_417:
+        {
+            response->status_line.status_code   = STATUS_CODE_EXPECTATION_FAILED;
+            response->status_line.reason_phrase = REASON_PHRASE_EXPECTATION_FAILED;
+            break;
         }
             // 500 is default, located at bottom of switch tree.
         case NOT_IMPLEMENTED_501:
@@ -238,9 +279,10 @@ static size_t serialize_http_response(struct core_object *co, char **dst_buffer,
     serial_response_size = STATUS_LINE_SIZE(response->status_line) + CRLF_SIZE
                            + headers_size_bytes // Includes CRLF_SIZE
                            + CRLF_SIZE
-                           + ((response->entity_body) ? strlen(response->entity_body) : 0);
+                           + ((response->entity_body && response->entity_body->data) ? response->entity_body->size : 0);
     
-    *dst_buffer = mm_malloc(serial_response_size, co->mm);
+    // +1 for the null byte written by the last strlcpy.
+    *dst_buffer = mm_malloc(serial_response_size + 1, co->mm);
     if (!*dst_buffer)
     {
         SET_ERROR(co->err);
@@ -297,10 +339,10 @@ static size_t serialize_http_response(struct core_object *co, char **dst_buffer,
     strlcpy((*dst_buffer + byte_offset), CRLF_STR, CRLF_SIZE + 1);
     byte_offset += CRLF_SIZE;
     
-    if (response->entity_body)
+    // memcpy rather than strlcpy; the entity body may not be text.
+    if (response->entity_body && response->entity_body->data)
     {
-        strlcpy((*dst_buffer + byte_offset), response->entity_body,
-                strlen(response->entity_body) + 1);
+        memcpy((*dst_buffer + byte_offset), response->entity_body->data, response->entity_body->size);
     }
     
     return serial_response_size;
@@ -321,7 +363,13 @@ void print_response(struct core_object *co, struct http_response *response)
             printf("%s: %s\r\n", (*headers)->key, (*headers)->value);
         }
     }
-    printf("\r\n%s\n", (response->entity_body) ? response->entity_body : "");
+    if (response->entity_body && response->entity_body->data)
+    {
+        printf("\r\n%.*s\n", (int) response->entity_body->size, response->entity_body->data);
+    } else
+    {
+        printf("\r\n\n");
+    }
 }
 
 static size_t get_header_size_bytes(struct http_header **headers, TRACER_FUNCTION_AS(tracer))
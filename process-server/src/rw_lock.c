@@ -0,0 +1,239 @@
+#include "../include/rw_lock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define RW_LOCK_NAME_MAX_LEN 32        /** The maximum length of a semaphore name, including the null byte. */
+#define READ_TRY_SEM_SUFFIX "_rt"      /** Suffix of the read try semaphore name. */
+#define RESOURCE_SEM_SUFFIX "_rs"      /** Suffix of the resource semaphore name. */
+#define READERS_MUTEX_SEM_SUFFIX "_rm" /** Suffix of the readers mutex semaphore name. */
+#define WRITERS_MUTEX_SEM_SUFFIX "_wm" /** Suffix of the writers mutex semaphore name. */
+
+/**
+ * open_rw_lock_sem
+ * <p>
+ * Open one named semaphore of a reader/writer lock with a value of 1.
+ * </p>
+ * @param name_prefix the prefix of the semaphore name
+ * @param suffix the suffix of the semaphore name
+ * @return the semaphore, or SEM_FAILED and set errno on failure
+ */
+static sem_t *open_rw_lock_sem(const char *name_prefix, const char *suffix);
+
+/**
+ * wait_counted
+ * <p>
+ * Wait on a semaphore, noting whether the wait blocked.
+ * </p>
+ * @param sem the semaphore
+ * @param waited set to true if the wait blocked, otherwise left as is
+ * @return 0 on success, -1 and set errno on failure
+ */
+static int wait_counted(sem_t *sem, bool *waited);
+
+/**
+ * leave_writers
+ * <p>
+ * Remove a writer from the count of writers holding or waiting for a reader/writer lock, letting readers in if
+ * it was the last.
+ * </p>
+ * @param lock the lock
+ */
+static void leave_writers(struct rw_lock *lock);
+
+int open_rw_lock(struct rw_lock *lock, const char *name_prefix, struct rw_lock_state *state)
+{
+    // Semaphores left by a server that did not shut down cleanly may hold any value.
+    unlink_rw_lock(name_prefix);
+    
+    lock->read_try      = open_rw_lock_sem(name_prefix, READ_TRY_SEM_SUFFIX);
+    lock->resource      = open_rw_lock_sem(name_prefix, RESOURCE_SEM_SUFFIX);
+    lock->readers_mutex = open_rw_lock_sem(name_prefix, READERS_MUTEX_SEM_SUFFIX);
+    lock->writers_mutex = open_rw_lock_sem(name_prefix, WRITERS_MUTEX_SEM_SUFFIX);
+    if (lock->read_try == SEM_FAILED || lock->resource == SEM_FAILED || lock->readers_mutex == SEM_FAILED
+        || lock->writers_mutex == SEM_FAILED)
+    {
+        // Closing an unopened semaphore will return -1 and set errno = EINVAL, which can be ignored.
+        close_rw_lock(lock);
+        unlink_rw_lock(name_prefix);
+        return -1;
+    }
+    
+    lock->state    = state;
+    state->readers = 0;
+    state->writers = 0;
+    atomic_init(&state->read_acquisitions, 0);
+    atomic_init(&state->read_contentions, 0);
+    atomic_init(&state->write_acquisitions, 0);
+    atomic_init(&state->write_contentions, 0);
+    
+    return 0;
+}
+
+static sem_t *open_rw_lock_sem(const char *name_prefix, const char *suffix)
+{
+    char name[RW_LOCK_NAME_MAX_LEN];
+    
+    (void) snprintf(name, RW_LOCK_NAME_MAX_LEN, "%s%s", name_prefix, suffix);
+    
+    return sem_open(name, O_CREAT, S_IRUSR | S_IWUSR, 1);
+}
+
+void close_rw_lock(struct rw_lock *lock)
+{
+    sem_close(lock->read_try);
+    sem_close(lock->resource);
+    sem_close(lock->readers_mutex);
+    sem_close(lock->writers_mutex);
+}
+
+void unlink_rw_lock(const char *name_prefix)
+{
+    const char *suffixes[] = {READ_TRY_SEM_SUFFIX, RESOURCE_SEM_SUFFIX, READERS_MUTEX_SEM_SUFFIX,
+                              WRITERS_MUTEX_SEM_SUFFIX};
+    char       name[RW_LOCK_NAME_MAX_LEN];
+    
+    for (size_t s = 0; s < sizeof(suffixes) / sizeof(*suffixes); ++s)
+    {
+        (void) snprintf(name, RW_LOCK_NAME_MAX_LEN, "%s%s", name_prefix, suffixes[s]);
+        // Unlinking an unopened semaphore will return -1 and set errno = ENOENT, which can be ignored.
+        sem_unlink(name);
+    }
+}
+
+int acquire_read_lock(struct rw_lock *lock)
+{
+    bool waited = false;
+    
+    // A waiting writer holds read_try, so new readers queue behind it.
+    if (wait_counted(lock->read_try, &waited) == -1)
+    {
+        return -1;
+    }
+    if (wait_counted(lock->readers_mutex, &waited) == -1)
+    {
+        sem_post(lock->read_try);
+        return -1;
+    }
+    if (++lock->state->readers == 1) // The first reader locks writers out for the group.
+    {
+        if (wait_counted(lock->resource, &waited) == -1)
+        {
+            --lock->state->readers;
+            sem_post(lock->readers_mutex);
+            sem_post(lock->read_try);
+            return -1;
+        }
+    }
+    sem_post(lock->readers_mutex);
+    sem_post(lock->read_try);
+    
+    atomic_fetch_add(&lock->state->read_acquisitions, 1);
+    if (waited)
+    {
+        atomic_fetch_add(&lock->state->read_contentions, 1);
+    }
+    
+    return 0;
+}
+
+void release_read_lock(struct rw_lock *lock)
+{
+    int saved_errno;
+    
+    saved_errno = errno;
+    // Retry on interruption; a reader that cannot leave would lock writers out forever.
+    while (sem_wait(lock->readers_mutex) == -1 && errno == EINTR)
+    {
+    }
+    if (--lock->state->readers == 0) // The last reader lets writers in.
+    {
+        sem_post(lock->resource);
+    }
+    sem_post(lock->readers_mutex);
+    errno = saved_errno;
+}
+
+int acquire_write_lock(struct rw_lock *lock)
+{
+    bool waited = false;
+    
+    if (wait_counted(lock->writers_mutex, &waited) == -1)
+    {
+        return -1;
+    }
+    if (++lock->state->writers == 1) // The first writer keeps new readers out until the last writer is done.
+    {
+        if (wait_counted(lock->read_try, &waited) == -1)
+        {
+            --lock->state->writers;
+            sem_post(lock->writers_mutex);
+            return -1;
+        }
+    }
+    sem_post(lock->writers_mutex);
+    
+    if (wait_counted(lock->resource, &waited) == -1)
+    {
+        leave_writers(lock);
+        return -1;
+    }
+    
+    atomic_fetch_add(&lock->state->write_acquisitions, 1);
+    if (waited)
+    {
+        atomic_fetch_add(&lock->state->write_contentions, 1);
+    }
+    
+    return 0;
+}
+
+void release_write_lock(struct rw_lock *lock)
+{
+    int saved_errno;
+    
+    saved_errno = errno;
+    sem_post(lock->resource);
+    leave_writers(lock);
+    errno = saved_errno;
+}
+
+static void leave_writers(struct rw_lock *lock)
+{
+    // Retry on interruption; a writer that cannot leave would lock readers out forever.
+    while (sem_wait(lock->writers_mutex) == -1 && errno == EINTR)
+    {
+    }
+    if (--lock->state->writers == 0) // The last writer lets readers in.
+    {
+        sem_post(lock->read_try);
+    }
+    sem_post(lock->writers_mutex);
+}
+
+static int wait_counted(sem_t *sem, bool *waited)
+{
+    if (sem_trywait(sem) == 0)
+    {
+        return 0;
+    }
+    if (errno != EAGAIN)
+    {
+        return -1;
+    }
+    
+    *waited = true;
+    return sem_wait(sem);
+}
+
+void print_rw_lock_stats(const char *name, struct rw_lock *lock)
+{
+    (void) fprintf(stdout, "%s lock: %llu reads (%llu waited), %llu writes (%llu waited)\n", name,
+                   (unsigned long long) atomic_load(&lock->state->read_acquisitions),
+                   (unsigned long long) atomic_load(&lock->state->read_contentions),
+                   (unsigned long long) atomic_load(&lock->state->write_acquisitions),
+                   (unsigned long long) atomic_load(&lock->state->write_contentions));
+}
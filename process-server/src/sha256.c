@@ -0,0 +1,163 @@
+#include "../include/sha256.h"
+
+#include <string.h>
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers) : The constants of FIPS 180-4.
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n)))) /** Rotate a 32-bit word right by n bits. */
+
+/**
+ * The SHA-256 round constants.
+ */
+static const uint32_t round_constants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * sha256_transform
+ * <p>
+ * Hash one block into the state of a SHA-256 hash.
+ * </p>
+ * @param state the hash state
+ * @param block the block
+ */
+static void sha256_transform(uint32_t state[8], const uint8_t block[SHA256_BLOCK_SIZE]);
+
+void sha256_init(struct sha256_context *ctx)
+{
+    static const uint32_t initial_state[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    
+    memcpy(ctx->state, initial_state, sizeof(initial_state));
+    ctx->length     = 0;
+    ctx->block_size = 0;
+}
+
+void sha256_update(struct sha256_context *ctx, const void *data, size_t size)
+{
+    const uint8_t *bytes;
+    size_t        n;
+    
+    bytes = data;
+    ctx->length += size;
+    
+    // Fill a partial block first, then hash whole blocks straight from the data.
+    if (ctx->block_size)
+    {
+        n = SHA256_BLOCK_SIZE - ctx->block_size;
+        n = (size < n) ? size : n;
+        memcpy(ctx->block + ctx->block_size, bytes, n);
+        ctx->block_size += n;
+        bytes += n;
+        size -= n;
+        if (ctx->block_size < SHA256_BLOCK_SIZE)
+        {
+            return;
+        }
+        sha256_transform(ctx->state, ctx->block);
+        ctx->block_size = 0;
+    }
+    for (; size >= SHA256_BLOCK_SIZE; bytes += SHA256_BLOCK_SIZE, size -= SHA256_BLOCK_SIZE)
+    {
+        sha256_transform(ctx->state, bytes);
+    }
+    memcpy(ctx->block, bytes, size);
+    ctx->block_size = size;
+}
+
+void sha256_final_hex(struct sha256_context *ctx, char hex[SHA256_HEX_LEN + 1])
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    uint64_t          bit_length;
+    
+    bit_length = ctx->length * 8;
+    
+    // Pad with a 1 bit and zeros up to the length, which fills the last 8 bytes of the last block.
+    ctx->block[ctx->block_size++] = 0x80;
+    if (ctx->block_size > SHA256_BLOCK_SIZE - 8)
+    {
+        memset(ctx->block + ctx->block_size, 0, SHA256_BLOCK_SIZE - ctx->block_size);
+        sha256_transform(ctx->state, ctx->block);
+        ctx->block_size = 0;
+    }
+    memset(ctx->block + ctx->block_size, 0, SHA256_BLOCK_SIZE - 8 - ctx->block_size);
+    for (size_t i = 0; i < 8; ++i)
+    {
+        ctx->block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t) (bit_length >> (8 * i));
+    }
+    sha256_transform(ctx->state, ctx->block);
+    
+    for (size_t i = 0; i < SHA256_DIGEST_SIZE; ++i)
+    {
+        uint8_t byte = (uint8_t) (ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+        
+        hex[2 * i]     = hex_digits[byte >> 4];
+        hex[2 * i + 1] = hex_digits[byte & 0xf];
+    }
+    hex[SHA256_HEX_LEN] = '\0';
+}
+
+static void sha256_transform(uint32_t state[8], const uint8_t block[SHA256_BLOCK_SIZE])
+{
+    uint32_t w[64];
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t e;
+    uint32_t f;
+    uint32_t g;
+    uint32_t h;
+    uint32_t t1;
+    uint32_t t2;
+    
+    for (size_t i = 0; i < 16; ++i)
+    {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8
+               | (uint32_t) block[4 * i + 3];
+    }
+    for (size_t i = 16; i < 64; ++i)
+    {
+        w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7]
+               + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+    
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+    for (size_t i = 0; i < 64; ++i)
+    {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + round_constants[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h  = g;
+        g  = f;
+        f  = e;
+        e  = d + t1;
+        d  = c;
+        c  = b;
+        b  = a;
+        a  = t1 + t2;
+    }
+    
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+// NOLINTEND(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
@@ -0,0 +1,30 @@
+#include "../include/storage.h"
+
+#include <string.h>
+
+/**
+ * The storage engines, terminated by NULL. The first is the default.
+ */
+static const struct storage_engine *const storage_engines[] = {
+        &ndbm_storage_engine,
+        &log_storage_engine,
+        NULL
+};
+
+const struct storage_engine *get_storage_engine(const char *name)
+{
+    for (const struct storage_engine *const *engine = storage_engines; *engine; ++engine)
+    {
+        if (strcmp((*engine)->name, name) == 0)
+        {
+            return *engine;
+        }
+    }
+    
+    return NULL;
+}
+
+const struct storage_engine *const *get_storage_engines(void)
+{
+    return storage_engines;
+}
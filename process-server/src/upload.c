@@ -0,0 +1,753 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // syncfs
+#endif
+
+#include "../include/db_blob.h"
+#include "../include/manager.h"
+#include "../include/upload.h"
+#include "../include/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DB_VALUE_TEMP_NAME "/value"       /** Name in the blob store of a database value being uploaded. */
+#define UPLOAD_FLUSHER_SEM_NAME_SIZE 32   /** Size of the buffer holding the name of a flusher semaphore. */
+#define MUTEX_SEM_SUFFIX "_m"             /** Suffix of the flusher mutex semaphore name. */
+#define PENDING_SEM_SUFFIX "_p"           /** Suffix of the uploads waiting semaphore name. */
+#define DONE_SEM_SUFFIX "_d"              /** Suffix, followed by the worker index, of a worker's synced semaphore name. */
+#define NS_PER_MS 1000000L                /** Nanoseconds in a millisecond. */
+#define NS_PER_S 1000000000L              /** Nanoseconds in a second. */
+#define MS_PER_S 1000                     /** Milliseconds in a second. */
+#define HASH_CHUNK_SIZE 65536             /** The most bytes of a content-addressed upload read and hashed at a time. */
+
+/**
+ * The state of the upload flusher shared by all processes.
+ */
+struct upload_flusher_shared
+{
+    bool             waiting[NUM_CHILD_PROCESSES]; // Whether each worker waits on its upload; protected by mutex.
+    int              results[NUM_CHILD_PROCESSES]; // The result of the last sync waited on by each worker.
+    _Atomic size_t   num_waiting;                   // Written with mutex held; read without it.
+    _Atomic uint64_t uploads;
+    _Atomic uint64_t syncs;
+    _Atomic uint64_t largest_group;
+};
+
+/**
+ * receive_hashed
+ * <p>
+ * Copy part of the body of a content-addressed upload from the client connection into the temporary file through
+ * a buffer of HASH_CHUNK_SIZE bytes, adding it to the hash of the upload.
+ * </p>
+ * @param co the core object
+ * @param upload the upload
+ * @param socket_fd the client connection
+ * @param size the number of bytes to receive
+ * @return 0 on success, -1 and set err on failure
+ */
+static int receive_hashed(struct core_object *co, struct upload *upload, int socket_fd, size_t size);
+
+/**
+ * link_to_blob
+ * <p>
+ * Move the temporary file of a content-addressed upload into the blob store, then put a symbolic link to the blob
+ * where the temporary file was, ready to be renamed into place.
+ * </p>
+ * @param co the core object
+ * @param upload the upload
+ * @return 0 on success, -1 and set err on failure
+ */
+static int link_to_blob(struct core_object *co, struct upload *upload);
+
+/**
+ * sync_dir
+ * <p>
+ * Sync the directory holding a file, so that a rename into it is durable.
+ * </p>
+ * @param co the core object
+ * @param path the path of the file
+ * @return 0 on success, -1 and set err on failure
+ */
+static int sync_dir(struct core_object *co, const char *path);
+
+/**
+ * sync_upload
+ * <p>
+ * Make a published upload durable according to the durability of uploads: sync it and its directory in this
+ * process, or wait for the upload flusher to sync its group.
+ * </p>
+ * @param co the core object
+ * @param upload the upload, already renamed into place
+ * @return 0 on success, -1 and set err on failure
+ */
+static int sync_upload(struct core_object *co, struct upload *upload);
+
+/**
+ * wait_for_upload_flusher
+ * <p>
+ * Join the group of uploads waiting to be synced by the upload flusher, and wait until it has synced them.
+ * </p>
+ * @param co the core object
+ * @param so the state object
+ * @return 0 on success, -1 and set err on failure
+ */
+static int wait_for_upload_flusher(struct core_object *co, struct state_object *so);
+
+/**
+ * open_flusher_sem
+ * <p>
+ * Open one named semaphore of the upload flusher with an initial value. A semaphore left by a server that did not
+ * shut down cleanly is replaced.
+ * </p>
+ * @param name_prefix the prefix of the semaphore name
+ * @param suffix the suffix of the semaphore name
+ * @param value the initial value
+ * @return the semaphore, or SEM_FAILED and set errno on failure
+ */
+static sem_t *open_flusher_sem(const char *name_prefix, const char *suffix, unsigned int value);
+
+/**
+ * past_deadline
+ * <p>
+ * Check whether the monotonic clock has passed a deadline.
+ * </p>
+ * @param deadline the deadline
+ * @return true if the deadline has passed or the clock cannot be read, false otherwise
+ */
+static bool past_deadline(const struct timespec *deadline);
+
+int open_upload(struct core_object *co, struct upload *upload, const char *uri)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char   *last_slash;
+    mode_t mask;
+    
+    memset(upload, 0, sizeof(struct upload));
+    upload->fd     = -1;
+    upload->hashed = co->upload_addressed;
+    
+    sha256_init(&upload->sha);
+    
+    if (getcwd(upload->path, BUFSIZ) == NULL)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (strlcat(upload->path, "/", BUFSIZ) >= BUFSIZ || strlcat(upload->path, WRITE_DIR, BUFSIZ) >= BUFSIZ ||
+        strlcat(upload->path, uri, BUFSIZ) >= BUFSIZ)
+    {
+        errno = ENAMETOOLONG;
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    strlcpy(upload->temp_path, upload->path, BUFSIZ);
+    last_slash = strrchr(upload->temp_path, '/');
+    *last_slash = '\0';
+    if (create_dir(upload->temp_path) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if (join_path(upload->temp_path, BUFSIZ, upload->path, TEMP_SUFFIX) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    upload->fd = mkstemp(upload->temp_path);
+    if (upload->fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    // mkstemp makes the file private; a published file gets the mode files of the write directory always had.
+    mask = umask(0);
+    umask(mask);
+    if (fchmod(upload->fd, WR_DIR_FLAGS & ~mask) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int open_db_value_upload(struct core_object *co, struct upload *upload)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    memset(upload, 0, sizeof(struct upload));
+    upload->fd     = -1;
+    upload->hashed = true;
+    
+    sha256_init(&upload->sha);
+    
+    // The file is written beside the blobs, so that it is moved into the store without being copied.
+    strlcpy(upload->temp_path, BLOB_DIR DB_VALUE_TEMP_NAME TEMP_SUFFIX, BUFSIZ);
+    upload->fd = mkstemp(upload->temp_path);
+    if (upload->fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int receive_upload(struct core_object *co, struct upload *upload, int socket_fd, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (upload->hashed)
+    {
+        return receive_hashed(co, upload, socket_fd, size);
+    }
+    
+    if (splice_fully(socket_fd, upload->fd, size) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    upload->size += size;
+    
+    return 0;
+}
+
+int write_upload(struct core_object *co, struct upload *upload, const void *data, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (upload->hashed)
+    {
+        sha256_update(&upload->sha, data, size);
+    }
+    if (write_fully(upload->fd, data, size) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    upload->size += size;
+    
+    return 0;
+}
+
+static int receive_hashed(struct core_object *co, struct upload *upload, int socket_fd, size_t size)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    uint8_t buffer[HASH_CHUNK_SIZE];
+    size_t  chunk;
+    ssize_t len;
+    size_t  nreceived = 0;
+    
+    while (nreceived < size)
+    {
+        chunk = (size - nreceived < HASH_CHUNK_SIZE) ? size - nreceived : HASH_CHUNK_SIZE;
+        len   = read(socket_fd, buffer, chunk);
+        if (len == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            errno = (len == 0) ? ECONNRESET : errno; // The client hung up before sending the whole body.
+            SET_ERROR(co->err);
+            return -1;
+        }
+        sha256_update(&upload->sha, buffer, (size_t) len);
+        if (write_fully(upload->fd, buffer, (size_t) len) == -1)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        nreceived += (size_t) len;
+    }
+    upload->size += size;
+    
+    return 0;
+}
+
+int publish_upload(struct core_object *co, struct upload *upload)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int ret_val;
+    
+    // The contents are synced before the rename, so that a crash never leaves the file in place but empty.
+    if (co->upload_durability == UPLOAD_DURABILITY_REQUEST && fsync(upload->fd) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    if (co->upload_addressed && link_to_blob(co, upload) == -1)
+    {
+        return -1;
+    }
+    
+    ret_val = (access(upload->path, F_OK) == 0) ? 1 : 0;
+    if (rename(upload->temp_path, upload->path) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    upload->published = true;
+    
+    if (sync_upload(co, upload) == -1)
+    {
+        return -1;
+    }
+    
+    return ret_val;
+}
+
+int publish_db_value_upload(struct core_object *co, struct upload *upload)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    sha256_final_hex(&upload->sha, upload->digest);
+    if (store_db_blob_file(co, upload->temp_path, upload->digest) == -1)
+    {
+        return -1;
+    }
+    upload->published = true;
+    
+    return 0;
+}
+
+static int link_to_blob(struct core_object *co, struct upload *upload)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char blob_path[BUFSIZ];
+    char target[BUFSIZ];
+    
+    sha256_final_hex(&upload->sha, upload->digest);
+    if (store_db_blob_file(co, upload->temp_path, upload->digest) == -1)
+    {
+        return -1;
+    }
+    
+    // The link is absolute, as the depth of the URI says nothing of how far the file is from the blob store.
+    get_db_blob_path(upload->digest, blob_path);
+    if (getcwd(target, BUFSIZ) == NULL)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    strlcat(target, "/", BUFSIZ);
+    strlcat(target, blob_path, BUFSIZ);
+    if (symlink(target, upload->temp_path) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int get_upload_etag(const char *path, char etag[SHA256_HEX_LEN + 1])
+{
+    char    target[BUFSIZ];
+    ssize_t len;
+    char    *digest;
+    
+    // Only a link into the blob store names the digest of the file.
+    len = readlink(path, target, BUFSIZ - 1);
+    if (len == -1)
+    {
+        return 1;
+    }
+    target[len] = '\0';
+    digest = strrchr(target, '/');
+    if (!digest || !strstr(target, "/" BLOB_DIR "/") || strlen(digest + 1) != SHA256_HEX_LEN)
+    {
+        return 1;
+    }
+    strlcpy(etag, digest + 1, SHA256_HEX_LEN + 1);
+    
+    return 0;
+}
+
+static int sync_dir(struct core_object *co, const char *path)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char dir_path[BUFSIZ];
+    int  dir_fd;
+    int  result;
+    
+    strlcpy(dir_path, path, BUFSIZ);
+    *strrchr(dir_path, '/') = '\0';
+    dir_fd = open(dir_path, O_RDONLY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    result = fsync(dir_fd);
+    close(dir_fd);
+    if (result == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int sync_upload(struct core_object *co, struct upload *upload)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    char blob_path[BUFSIZ];
+    
+    switch (co->upload_durability)
+    {
+        case UPLOAD_DURABILITY_REQUEST:
+        {
+            // The renames are durable once the directories they were made in are synced.
+            if (co->upload_addressed)
+            {
+                get_db_blob_path(upload->digest, blob_path);
+                if (sync_dir(co, blob_path) == -1)
+                {
+                    return -1;
+                }
+            }
+            return sync_dir(co, upload->path);
+        }
+        case UPLOAD_DURABILITY_GROUP:
+        {
+            return wait_for_upload_flusher(co, co->so);
+        }
+        case UPLOAD_DURABILITY_NONE:
+        default:
+        {
+            return 0;
+        }
+    }
+}
+
+void close_upload(struct upload *upload)
+{
+    if (upload->fd != -1)
+    {
+        close(upload->fd);
+        upload->fd = -1;
+    }
+    if (!upload->published && *upload->temp_path)
+    {
+        unlink(upload->temp_path);
+    }
+}
+
+int open_upload_flusher(struct core_object *co, struct upload_flusher *flusher, bool enabled,
+                        const char *sem_name_prefix, const char *shm_name)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    int  shm_fd;
+    void *shm;
+    char suffix[UPLOAD_FLUSHER_SEM_NAME_SIZE];
+    
+    memset(flusher, 0, sizeof(struct upload_flusher));
+    flusher->dir_fd = -1;
+    if (!enabled)
+    {
+        return 0;
+    }
+    
+    flusher->dir_fd = open(WRITE_DIR, O_RDONLY | O_CLOEXEC);
+    if (flusher->dir_fd == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    flusher->mutex   = open_flusher_sem(sem_name_prefix, MUTEX_SEM_SUFFIX, 1);
+    flusher->pending = open_flusher_sem(sem_name_prefix, PENDING_SEM_SUFFIX, 0);
+    if (flusher->mutex == SEM_FAILED || flusher->pending == SEM_FAILED)
+    {
+        SET_ERROR(co->err);
+        close_upload_flusher(flusher);
+        unlink_upload_flusher(sem_name_prefix);
+        return -1;
+    }
+    FOR_EACH_CHILD_c_IN_CHILD_PIDS
+    {
+        (void) snprintf(suffix, sizeof(suffix), "%s%zu", DONE_SEM_SUFFIX, c);
+        flusher->done[c] = open_flusher_sem(sem_name_prefix, suffix, 0);
+        if (flusher->done[c] == SEM_FAILED)
+        {
+            SET_ERROR(co->err);
+            close_upload_flusher(flusher);
+            unlink_upload_flusher(sem_name_prefix);
+            return -1;
+        }
+    }
+    
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1)
+    {
+        SET_ERROR(co->err);
+        close_upload_flusher(flusher);
+        unlink_upload_flusher(sem_name_prefix);
+        return -1;
+    }
+    shm_unlink(shm_name);
+    
+    // The new object is zero-filled, so no worker starts out waiting.
+    if (ftruncate(shm_fd, (off_t) sizeof(struct upload_flusher_shared)) == -1)
+    {
+        SET_ERROR(co->err);
+        close(shm_fd);
+        close_upload_flusher(flusher);
+        unlink_upload_flusher(sem_name_prefix);
+        return -1;
+    }
+    
+    shm = mmap(NULL, sizeof(struct upload_flusher_shared), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED)
+    {
+        SET_ERROR(co->err);
+        close_upload_flusher(flusher);
+        unlink_upload_flusher(sem_name_prefix);
+        return -1;
+    }
+    flusher->shared = (struct upload_flusher_shared *) shm;
+    atomic_init(&flusher->shared->num_waiting, 0);
+    atomic_init(&flusher->shared->uploads, 0);
+    atomic_init(&flusher->shared->syncs, 0);
+    atomic_init(&flusher->shared->largest_group, 0);
+    
+    return 0;
+}
+
+static sem_t *open_flusher_sem(const char *name_prefix, const char *suffix, unsigned int value)
+{
+    char name[UPLOAD_FLUSHER_SEM_NAME_SIZE];
+    
+    if (join_path(name, sizeof(name), name_prefix, suffix) == -1)
+    {
+        return SEM_FAILED;
+    }
+    sem_unlink(name);
+    
+    return sem_open(name, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, value);
+}
+
+void close_upload_flusher(struct upload_flusher *flusher)
+{
+    // Closing an unopened semaphore will return -1 and set errno = EINVAL, which can be ignored.
+    if (flusher->mutex)
+    {
+        sem_close(flusher->mutex);
+    }
+    if (flusher->pending)
+    {
+        sem_close(flusher->pending);
+    }
+    FOR_EACH_CHILD_c_IN_CHILD_PIDS
+    {
+        if (flusher->done[c])
+        {
+            sem_close(flusher->done[c]);
+        }
+    }
+    if (flusher->shared)
+    {
+        munmap(flusher->shared, sizeof(struct upload_flusher_shared));
+    }
+    if (flusher->dir_fd != -1)
+    {
+        close(flusher->dir_fd);
+    }
+    memset(flusher, 0, sizeof(struct upload_flusher));
+    flusher->dir_fd = -1;
+}
+
+void unlink_upload_flusher(const char *sem_name_prefix)
+{
+    char name[UPLOAD_FLUSHER_SEM_NAME_SIZE];
+    
+    (void) snprintf(name, sizeof(name), "%s%s", sem_name_prefix, MUTEX_SEM_SUFFIX);
+    sem_unlink(name);
+    (void) snprintf(name, sizeof(name), "%s%s", sem_name_prefix, PENDING_SEM_SUFFIX);
+    sem_unlink(name);
+    FOR_EACH_CHILD_c_IN_CHILD_PIDS
+    {
+        (void) snprintf(name, sizeof(name), "%s%s%zu", sem_name_prefix, DONE_SEM_SUFFIX, c);
+        sem_unlink(name);
+    }
+}
+
+static int wait_for_upload_flusher(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct upload_flusher *flusher;
+    
+    flusher = &so->upload_flusher;
+    if (sem_wait(flusher->mutex) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    flusher->shared->waiting[so->child_index] = true;
+    atomic_fetch_add_explicit(&flusher->shared->num_waiting, 1, memory_order_relaxed);
+    
+    // Posted with the mutex held, so that the flusher takes exactly one count for each upload it syncs.
+    sem_post(flusher->pending);
+    sem_post(flusher->mutex);
+    
+    if (sem_wait(flusher->done[so->child_index]) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    if (flusher->shared->results[so->child_index] == -1)
+    {
+        errno = EIO; // The flusher failed to sync the group.
+        SET_ERROR(co->err);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int flush_uploads(struct core_object *co, struct state_object *so)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    struct upload_flusher        *flusher;
+    struct upload_flusher_shared *shared;
+    bool                         interrupted;
+    bool                         waiting[NUM_CHILD_PROCESSES];
+    size_t                       num_waiting;
+    struct timespec              deadline;
+    struct timespec              pause;
+    int                          result;
+    
+    flusher = &so->upload_flusher;
+    shared  = flusher->shared;
+    
+    interrupted = false;
+    if (sem_wait(flusher->pending) == -1)
+    {
+        if (errno != EINTR)
+        {
+            SET_ERROR(co->err);
+            return -1;
+        }
+        errno       = 0;
+        interrupted = true; // Signalled to end: sync whatever uploads are waiting.
+    }
+    
+    // Let the group fill until it holds upload_group_writes uploads, or its first upload has waited upload_group_ms.
+    if (!interrupted && clock_gettime(CLOCK_MONOTONIC, &deadline) == 0)
+    {
+        deadline.tv_sec  += (time_t) (co->upload_group_ms / MS_PER_S);
+        deadline.tv_nsec += (long) (co->upload_group_ms % MS_PER_S) * NS_PER_MS;
+        if (deadline.tv_nsec >= NS_PER_S)
+        {
+            deadline.tv_nsec -= NS_PER_S;
+            ++deadline.tv_sec;
+        }
+        pause.tv_sec  = 0;
+        pause.tv_nsec = UPLOAD_GROUP_POLL_MS * NS_PER_MS;
+        while (atomic_load_explicit(&shared->num_waiting, memory_order_relaxed) < co->upload_group_writes
+               && !past_deadline(&deadline))
+        {
+            if (nanosleep(&pause, NULL) == -1)
+            {
+                break; // Interrupted by the signal to end.
+            }
+        }
+    }
+    
+    if (sem_wait(flusher->mutex) == -1)
+    {
+        SET_ERROR(co->err);
+        return -1;
+    }
+    memcpy(waiting, shared->waiting, sizeof(waiting));
+    memset(shared->waiting, 0, sizeof(shared->waiting));
+    num_waiting = atomic_exchange_explicit(&shared->num_waiting, 0, memory_order_relaxed);
+    sem_post(flusher->mutex);
+    if (num_waiting == 0)
+    {
+        return 0;
+    }
+    
+    // One sync of the file system makes every upload of the group durable, contents and renames alike.
+#if defined(__linux__)
+    result = syncfs(flusher->dir_fd);
+#else
+    sync();
+    result = 0;
+#endif
+    if (result == -1)
+    {
+        SET_ERROR(co->err);
+        GET_ERROR(co->err); // Each worker waiting reports the failure as well.
+    }
+    
+    FOR_EACH_CHILD_c_IN_CHILD_PIDS
+    {
+        if (waiting[c])
+        {
+            shared->results[c] = result;
+            sem_post(flusher->done[c]);
+        }
+    }
+    
+    // The wait took one count of the uploads; take the rest, so that the next wait is for new uploads.
+    for (size_t i = (interrupted) ? 0 : 1; i < num_waiting && sem_trywait(flusher->pending) == 0; ++i);
+    
+    atomic_fetch_add_explicit(&shared->uploads, num_waiting, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->syncs, 1, memory_order_relaxed);
+    if (num_waiting > atomic_load_explicit(&shared->largest_group, memory_order_relaxed))
+    {
+        atomic_store_explicit(&shared->largest_group, num_waiting, memory_order_relaxed);
+    }
+    
+    return 0;
+}
+
+static bool past_deadline(const struct timespec *deadline)
+{
+    struct timespec now;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    {
+        return true;
+    }
+    
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+void print_upload_flusher_stats(struct upload_flusher *flusher)
+{
+    if (!flusher->shared)
+    {
+        (void) fprintf(stdout, "upload flusher: disabled\n");
+        return;
+    }
+    
+    (void) fprintf(stdout, "upload flusher: %llu uploads synced in %llu groups (largest %llu)\n",
+                   (unsigned long long) atomic_load(&flusher->shared->uploads),
+                   (unsigned long long) atomic_load(&flusher->shared->syncs),
+                   (unsigned long long) atomic_load(&flusher->shared->largest_group));
+}
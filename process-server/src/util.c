@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // splice
+#endif
+
 #include "../include/manager.h"
 #include "../include/util.h"
 
@@ -5,23 +9,68 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#else
+#include <sys/sendfile.h>
+#endif
+
 // NOLINTNEXTLINE(modernize-macro-to-enum) : Macro is fine.
 #define BASE_10 10
+#define MOVE_CHUNK_SIZE 65536 /** The most bytes moved from a socket to a file at a time, the default pipe capacity. */
 #define HTTP_TIME_FORMAT "%a, %d %b %Y %H:%M:%S %Z"
 
-int write_fully(int fd, void *data, size_t size)
+/**
+ * Content types by URI extension.
+ */
+static const char *const content_types[][2] = {
+        {".html", TEXT_HTML_CONTENT_TYPE},
+        {".htm",  TEXT_HTML_CONTENT_TYPE},
+        {".txt",  "text/plain"},
+        {".css",  "text/css"},
+        {".csv",  "text/csv"},
+        {".js",   "application/javascript"},
+        {".json", "application/json"},
+        {".xml",  "application/xml"},
+        {".svg",  "image/svg+xml"},
+        {".png",  "image/png"},
+        {".jpg",  "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif",  "image/gif"},
+        {".webp", "image/webp"},
+        {".mp3",  "audio/mpeg"},
+        {".mp4",  "video/mp4"},
+        {".woff", "font/woff"},
+        {".woff2", "font/woff2"},
+        {".pdf",  "application/pdf"},
+        {".zip",  "application/zip"},
+        {".gz",   "application/gzip"},
+        {".bin",  "application/octet-stream"}
+};
+
+int write_fully(int fd, const void *data, size_t size)
 {
     ssize_t result;
     ssize_t nwrote = 0;
     
     while (nwrote < (ssize_t) size)
     {
-        result = send(fd, ((char *) data) + nwrote, size - nwrote, MSG_NOSIGNAL);
+        result = send(fd, ((const char *) data) + nwrote, size - nwrote, MSG_NOSIGNAL);
+        if (result == -1 && errno == ENOTSOCK)
+        {
+            result = write(fd, ((const char *) data) + nwrote, size - nwrote); // A file rather than a socket.
+        }
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
         if (result == -1)
         {
             perror("writing fully");
@@ -33,6 +82,17 @@ int write_fully(int fd, void *data, size_t size)
     return 0;
 }
 
+int join_path(char *path, size_t size, const char *head, const char *tail)
+{
+    if (strlcpy(path, head, size) >= size || strlcat(path, tail, size) >= size)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    return 0;
+}
+
 int read_fully(int fd, void *data, size_t size)
 {
     ssize_t result;
@@ -46,12 +106,169 @@ int read_fully(int fd, void *data, size_t size)
             perror("reading fully");
             return -1;
         }
+        if (result == 0)
+        {
+            errno = ECONNRESET; // The peer hung up before sending everything.
+            return -1;
+        }
         nread += result;
     }
     
     return 0;
 }
 
+int sendfile_fully(int socket_fd, int file_fd, off_t offset, size_t size)
+{
+    size_t nsent = 0;
+    
+    while (nsent < size)
+    {
+#if defined(__APPLE__)
+        off_t len = (off_t) (size - nsent);
+        
+        // On macOS, len is set to the number of bytes sent even when interrupted.
+        if (sendfile(file_fd, socket_fd, offset, &len, NULL, 0) == -1 && errno != EINTR && errno != EAGAIN)
+        {
+            perror("sending file fully");
+            return -1;
+        }
+#else
+        off_t   file_offset = offset; // Linux advances the offset passed; advance it below for both platforms.
+        ssize_t len;
+        
+        len = sendfile(socket_fd, file_fd, &file_offset, size - nsent);
+        if (len == -1)
+        {
+            perror("sending file fully");
+            return -1;
+        }
+#endif
+        if (len == 0)
+        {
+            break; // The file was truncated; nothing more to send.
+        }
+        nsent += (size_t) len;
+        offset += len;
+    }
+    
+    return 0;
+}
+
+/**
+ * copy_fully
+ * <p>
+ * Copies data fully from a socket to a file through a buffer of MOVE_CHUNK_SIZE bytes.
+ * </p>
+ * @param socket_fd the socket to read from.
+ * @param file_fd the file to write to.
+ * @param size the number of bytes to copy.
+ * @return 0 on success. On failure -1 and set errno.
+ */
+static int copy_fully(int socket_fd, int file_fd, size_t size);
+
+int splice_fully(int socket_fd, int file_fd, size_t size)
+{
+#if defined(__linux__)
+    int     pipe_fds[2];
+    size_t  chunk;
+    ssize_t len = 0;
+    ssize_t nmoved;
+    size_t  nspliced = 0;
+    int     saved_errno;
+    
+    if (pipe(pipe_fds) == -1)
+    {
+        return -1;
+    }
+    
+    while (nspliced < size)
+    {
+        chunk = (size - nspliced < MOVE_CHUNK_SIZE) ? size - nspliced : MOVE_CHUNK_SIZE;
+        len   = splice(socket_fd, NULL, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (len == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len == -1 && errno == EINVAL && nspliced == 0)
+        {
+            // The socket or the file cannot be spliced; copy it instead.
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            return copy_fully(socket_fd, file_fd, size);
+        }
+        if (len <= 0)
+        {
+            break;
+        }
+        
+        // Drain the pipe into the file, so that at most one chunk is ever held in the pipe.
+        while (len > 0)
+        {
+            nmoved = splice(pipe_fds[0], NULL, file_fd, NULL, (size_t) len, SPLICE_F_MOVE);
+            if (nmoved == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (nmoved <= 0)
+            {
+                break;
+            }
+            len -= nmoved;
+            nspliced += (size_t) nmoved;
+        }
+        if (len > 0)
+        {
+            break;
+        }
+    }
+    
+    saved_errno = (len == 0) ? ECONNRESET : errno; // The client hung up before sending the whole body.
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (nspliced < size)
+    {
+        perror("splicing fully");
+        errno = saved_errno;
+        return -1;
+    }
+    
+    return 0;
+#else
+    return copy_fully(socket_fd, file_fd, size);
+#endif
+}
+
+static int copy_fully(int socket_fd, int file_fd, size_t size)
+{
+    char    buffer[MOVE_CHUNK_SIZE];
+    size_t  chunk;
+    ssize_t len;
+    size_t  ncopied = 0;
+    
+    while (ncopied < size)
+    {
+        chunk = (size - ncopied < MOVE_CHUNK_SIZE) ? size - ncopied : MOVE_CHUNK_SIZE;
+        len   = read(socket_fd, buffer, chunk);
+        if (len == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            errno = (len == 0) ? ECONNRESET : errno; // The client hung up before sending the whole body.
+            perror("copying fully");
+            return -1;
+        }
+        if (write_fully(file_fd, buffer, (size_t) len) == -1)
+        {
+            return -1;
+        }
+        ncopied += (size_t) len;
+    }
+    
+    return 0;
+}
+
 char *litlittok(char *str, char *sep)
 {
     // shameless copy of https://stackoverflow.com/questions/59770865/strtok-c-multiple-chars-as-one-delimiter
@@ -148,6 +365,27 @@ char * to_lower(char *s)
     return s;
 }
 
+const char *get_content_type(const char *uri)
+{
+    const char *extension;
+    
+    extension = strrchr(uri, '.');
+    if (!extension || strchr(extension, '/'))
+    {
+        return TEXT_HTML_CONTENT_TYPE;
+    }
+    
+    for (size_t t = 0; t < sizeof(content_types) / sizeof(content_types[0]); ++t)
+    {
+        if (strcasecmp(extension, content_types[t][0]) == 0)
+        {
+            return content_types[t][1];
+        }
+    }
+    
+    return TEXT_HTML_CONTENT_TYPE;
+}
+
 struct http_header *get_header(const char *key, struct http_header **headers, const size_t num_headers)
 {
     if (!headers)
@@ -213,7 +451,22 @@ void free_all_headers(struct core_object *co, struct http_header **headers)
     mm_free(co->mm, headers);
 }
 
-void free_http_data(struct core_object *co, struct http_header **headers, char *entity_body)
+void free_entity_body(struct core_object *co, struct http_entity_body *entity_body)
+{
+    PRINT_STACK_TRACE(co->tracer);
+    
+    if (entity_body->data)
+    {
+        mm_free(co->mm, entity_body->data);
+    }
+    if (entity_body->fd)
+    {
+        close(entity_body->fd);
+    }
+    memset(entity_body, 0, sizeof(struct http_entity_body));
+}
+
+void free_http_data(struct core_object *co, struct http_header **headers, struct http_entity_body *entity_body)
 {
     PRINT_STACK_TRACE(co->tracer);
     
@@ -223,7 +476,7 @@ void free_http_data(struct core_object *co, struct http_header **headers, char *
     }
     if (entity_body)
     {
-        mm_free(co->mm, entity_body);
+        free_entity_body(co, entity_body);
     }
 }
 